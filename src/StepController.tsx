@@ -22,11 +22,13 @@ import ReplayIcon from '@mui/icons-material/Replay';
 import ArrowForwardIcon from '@mui/icons-material/ArrowForward';
 import PlayArrowIcon from '@mui/icons-material/PlayArrow';
 import PauseIcon from '@mui/icons-material/Pause';
+import FastForwardIcon from '@mui/icons-material/FastForward';
 
 interface StepControllerProps {
     onReset(): void;
     onStep(): void;
     onPlay(): void;
+    onRun(): void;
     running: boolean;
     terminated: boolean;
     error: string | null;
@@ -55,6 +57,12 @@ const StepController: FC<StepControllerProps> = (props) => {
                 startIcon={playIcon}
                 onClick={props.onPlay}
                 disabled={playingDisabled}
+            >{props.running ? "Pause" : "Play"}</Button>
+            <Button
+                variant="outlined"
+                startIcon={<FastForwardIcon />}
+                onClick={props.onRun}
+                disabled={playingDisabled}
             >Run</Button>
         </Box>
     );
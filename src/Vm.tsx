@@ -137,32 +137,6 @@ const Vm: FC<VmProps> = (props) => {
 
     const { vmState, printkLines, setPrintkLines } = props;
 
-    useInterval(() => {
-        if (vmState === null) {
-            return;
-        }
-        const rc = vmState.step();
-        const newHotAddress: HotAddressInfo = {
-            address: Number(vmState.cpu.hotAddress[0]),
-            size: Number(vmState.cpu.hotAddressSize[0]),
-        };
-        if (newHotAddress.address !== hotAddress.address ||
-            newHotAddress.size !== hotAddress.size) {
-            setHotAddress(newHotAddress);
-        }
-        if (rc < 0) {
-            setVmError(`Error from VM: ${rc}`);
-            setTerminated(true);
-            setRunning(false);
-        } else if (rc === 0) {
-            setVmError(`Program Terminated`);
-            setTerminated(true);
-            setRunning(false);
-        }
-        setTimeStep(timeStep + 1);
-    }, running ? 400 : null);
-
-
     // The inner vm is not a react component.  This manages updating
     // the program state and commanding the vm to load it.
     const loadNewProgram = useCallback((newProgram: AssembledProgram) => {
@@ -205,10 +179,9 @@ const Vm: FC<VmProps> = (props) => {
         setTerminated(false);
         setTimeStep(timeStep + 1);
     };
-    const onStep = () => {
-        if (terminated) { return; }
-        setRunning(false);
-        const rc = vmState.step();
+    // Shows the VM's state after it steps or runs, given the rc it
+    // returned.
+    const onExecuted = (rc: number) => {
         const newHotAddress: HotAddressInfo = {
             address: Number(vmState.cpu.hotAddress[0]),
             size: Number(vmState.cpu.hotAddressSize[0]),
@@ -220,16 +193,35 @@ const Vm: FC<VmProps> = (props) => {
         if (rc < 0) {
             setVmError(`Error from VM: ${rc}`);
             setTerminated(true);
+            setRunning(false);
         } else if (rc === 0) {
             setVmError(`Program Terminated`);
             setTerminated(true);
+            setRunning(false);
         }
         setTimeStep(timeStep + 1);
     };
+    // Steps every 400ms while playing, so the program can be watched.
+    useInterval(() => {
+        onExecuted(vmState.step());
+    }, running ? 400 : null);
+
+    const onStep = () => {
+        if (terminated) { return; }
+        setRunning(false);
+        onExecuted(vmState.step());
+    };
     const onPlay = () => {
         if (terminated) { return; }
         setRunning(!running);
-    }
+    };
+    // Runs to the exit at full speed, using the compiled program if the
+    // program hasn't started yet.
+    const onRun = () => {
+        if (terminated) { return; }
+        setRunning(false);
+        onExecuted(vmState.run());
+    };
 
     const onSetStackValue = (offset: number, value: number) => {
         vmState.memory.stack[offset] = value;
@@ -293,6 +285,7 @@ const Vm: FC<VmProps> = (props) => {
                 onReset={onReset}
                 onStep={onStep}
                 onPlay={onPlay}
+                onRun={onRun}
                 running={running}
                 terminated={terminated}
                 error={vmError}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import { render, screen, fireEvent } from '@testing-library/react';
+import StepController from '../StepController';
+
+const renderController = (running: boolean, terminated: boolean) => {
+    const handlers = {
+        onReset: jest.fn(),
+        onStep: jest.fn(),
+        onPlay: jest.fn(),
+        onRun: jest.fn(),
+    };
+    render(
+        <StepController
+            {...handlers}
+            running={running}
+            terminated={terminated}
+            error={null}
+        />
+    );
+    return handlers;
+};
+
+it("plays step by step and runs at full speed from separate buttons", () => {
+    const handlers = renderController(false, false);
+    fireEvent.click(screen.getByRole('button', { name: 'Play' }));
+    expect(handlers.onPlay).toHaveBeenCalledTimes(1);
+    expect(handlers.onRun).not.toHaveBeenCalled();
+
+    fireEvent.click(screen.getByRole('button', { name: 'Run' }));
+    expect(handlers.onRun).toHaveBeenCalledTimes(1);
+    expect(handlers.onPlay).toHaveBeenCalledTimes(1);
+});
+
+it("pauses while playing", () => {
+    const handlers = renderController(true, false);
+    expect(screen.queryByRole('button', { name: 'Play' })).toBeNull();
+    fireEvent.click(screen.getByRole('button', { name: 'Pause' }));
+    expect(handlers.onPlay).toHaveBeenCalledTimes(1);
+    expect(screen.getByRole('button', { name: 'Run' })).toBeEnabled();
+});
+
+it("only resets once terminated", () => {
+    renderController(false, true);
+    expect(screen.getByRole('button', { name: 'Step' })).toBeDisabled();
+    expect(screen.getByRole('button', { name: 'Play' })).toBeDisabled();
+    expect(screen.getByRole('button', { name: 'Run' })).toBeDisabled();
+    expect(screen.getByRole('button', { name: 'Reset' })).toBeEnabled();
+});
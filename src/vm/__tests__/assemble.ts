@@ -13,7 +13,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-import { assemble } from '../program';
+import { assemble, Program } from '../program';
 import { HELLOWORLD_HEXBYTECODE, HELLOWORLD_SOURCE } from '../consts';
 
 it("assembles", () => {
@@ -189,6 +189,30 @@ it("assembles be64", assemblesSingle(
     ]),
 ));
 
+it("assembles lock add", assemblesSingle(
+    "lock add [r1+8], r2",
+    new Uint8Array([
+        0xdb, 0x21, 0x08, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+    ]),
+));
+
+it("assembles lock fetch xor32", assemblesSingle(
+    "lock fetch xor32 [r10-4], r3",
+    new Uint8Array([
+        0xc3, 0x3a, 0xfc, 0xff,
+        0xa1, 0x00, 0x00, 0x00,
+    ]),
+));
+
+it("assembles lock cmpxchg", assemblesSingle(
+    "lock cmpxchg [r1], r2",
+    new Uint8Array([
+        0xdb, 0x21, 0x00, 0x00,
+        0xf1, 0x00, 0x00, 0x00,
+    ]),
+));
+
 it("assembles ja", assemblesSingle(
     "ja +32",
     new Uint8Array([
@@ -197,6 +221,50 @@ it("assembles ja", assemblesSingle(
     ]),
 ));
 
+it("assembles jumps to labels", () => {
+    const p = assemble(
+        [
+            "mov r1, 0",
+            "loop: lddw r2, 7",
+            "add r1, 1",
+            "jlt r1, 10, loop",
+            "jeq r1, 10, done",
+            "mov r0, 1",
+            "done: exit",
+        ],
+        {},
+    );
+
+    expect(p.instructions[3].machineCode).toEqual(new Uint8Array([
+        0xa5, 0x01, 0xfc, 0xff,
+        0x0a, 0x00, 0x00, 0x00,
+    ]));
+    expect(p.instructions[4].machineCode).toEqual(new Uint8Array([
+        0x15, 0x01, 0x01, 0x00,
+        0x0a, 0x00, 0x00, 0x00,
+    ]));
+});
+
+it("rejects a jump to itself", () => {
+    expect(() => {
+        assemble(["spin: ja spin", "exit"], {});
+    }).toThrow();
+});
+
+it("rejects a jump to an undefined label", () => {
+    expect(() => {
+        assemble(["ja nowhere", "exit"], {});
+    }).toThrow();
+});
+
+it("assembles ja backwards", assemblesSingle(
+    "ja -4",
+    new Uint8Array([
+        0x05, 0x00, 0xfc, 0xff,
+        0x00, 0x00, 0x00, 0x00,
+    ]),
+));
+
 it("assembles jeq reg-reg", assemblesSingle(
     "jeq r1, r7, +40",
     new Uint8Array([
@@ -286,6 +354,25 @@ it("assembles with comments and blank lines", () => {
     });
 });
 
+it("assembles into one buffer", () => {
+    const p = assemble(["mov r1, 40", "lddw r2, 0x100000002", "exit"], {});
+    expect(p.code).toEqual(new Uint8Array([
+        0xb7, 0x01, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00,
+        0x18, 0x02, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+        0x95, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    ]));
+    expect(p.instructions[1].machineCode.buffer).toBe(p.code.buffer);
+    expect(p.instructions[1].machineCode.byteOffset).toEqual(8);
+    expect(p.instructions[2].machineCode.byteOffset).toEqual(24);
+
+    // Loading reuses the buffer; without one it is built once.
+    expect(new Program(p.instructions, p.code).getInstructions()).toBe(p.code);
+    const rebuilt = new Program(p.instructions);
+    expect(rebuilt.getInstructions()).toEqual(p.code);
+    expect(rebuilt.getInstructions()).toBe(rebuilt.getInstructions());
+});
+
 it("assembles with trailing and blank lines", () => {
     // a comment line, a blank line, and an instruction
     const source = "mov r1, 40\n// foo\n\n";
@@ -93,6 +93,43 @@ it('disassembles jeq', () => {
     expect(disassemble(instBytecode)).toEqual(["jeq r0, 0, +4"]);
 });
 
+it('disassembles backward jumps', () => {
+    const instBytecode = new Uint8Array([
+       0xa5, 0x01, 0xfd, 0xff, 0x0a, 0x00, 0x00, 0x00,
+       0x05, 0x00, 0xfc, 0xff, 0x00, 0x00, 0x00, 0x00,
+    ]);
+    expect(disassemble(instBytecode)).toEqual([
+        "jlt r1, 10, -3",
+        "ja -4",
+    ]);
+});
+
+it('disassembles atomics', () => {
+    const instBytecode = new Uint8Array([
+       0xdb, 0x21, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00,
+       0xc3, 0x3a, 0xfc, 0xff, 0xa1, 0x00, 0x00, 0x00,
+       0xdb, 0x21, 0x00, 0x00, 0xe1, 0x00, 0x00, 0x00,
+       0xc3, 0x21, 0x00, 0x00, 0xf1, 0x00, 0x00, 0x00,
+    ]);
+    expect(disassemble(instBytecode)).toEqual([
+        "lock add [r1+8], r2",
+        "lock fetch xor32 [r10-4], r3",
+        "lock xchg [r1], r2",
+        "lock cmpxchg32 [r1], r2",
+    ]);
+});
+
+it('disassembles calls to named and unnamed helpers', () => {
+    const instBytecode = new Uint8Array([
+       0x85, 0x00, 0x00, 0x00, 0x7d, 0x00, 0x00, 0x00,
+       0x85, 0x00, 0x00, 0x00, 0x64, 0x00, 0x00, 0x00,
+    ]);
+    expect(disassemble(instBytecode)).toEqual([
+        "call memcpy",
+        "call 100",
+    ]);
+});
+
 it('disassembles forktop', () => {
   const forktop_bytecode = Uint8Array.from(
       Buffer.from(FORKTOP_BYTECODE_HEX.split('\n').join('').trim(), 'hex'));
@@ -157,6 +157,25 @@ const storeBaseEmitter = (size: c.InstructionOpSize, cls: c.InstructionClass) =>
 const storeEmitter = (size: c.InstructionOpSize) => storeBaseEmitter(size, c.InstructionClass.EBPF_CLS_ST);
 const storexEmitter = (size: c.InstructionOpSize) => storeBaseEmitter(size, c.InstructionClass.EBPF_CLS_STX);
 
+// "lock add [r1+8], r2", "lock fetch or32 [r1], r2", "lock cmpxchg [r1], r2"
+const atomicEmitter = (op: c.InstructionAtomicOp, fetch: boolean) => {
+    const emitter: Emitter = (i) => {
+        assertImmediateZero(i);
+        const size = i.opname.endsWith("32") ? c.InstructionOpSize.EBPF_SIZE_W : c.InstructionOpSize.EBPF_SIZE_DW;
+        const unpacked: c.UnpackedInstruction = {
+            opcode: c.InstructionClass.EBPF_CLS_STX | size | c.InstructionOpMode.EBPF_MODE_ATOMIC,
+            dst: encodeRegister(i.dest),
+            src: encodeRegister(i.source),
+            offset: i.offset,
+            imm: op | (fetch ? c.EBPF_ATOMIC_FETCH : 0),
+        };
+        return unpacked;
+    };
+    return emitter;
+};
+const atomic = (op: c.InstructionAtomicOp) => packer(atomicEmitter(op, false));
+const atomicFetch = (op: c.InstructionAtomicOp) => packer(atomicEmitter(op, true));
+
 // Typescript needs some convincing that we can convert a string into an enum key
 const opnameToInstructionOp = (opname: string) => {
     let aluOpcodeLookup = "EBPF_" + opname.toUpperCase();
@@ -291,6 +310,26 @@ export const encoder: Encoder = {
     stxh: packer(storexEmitter(c.InstructionOpSize.EBPF_SIZE_H)),
     stxw: packer(storexEmitter(c.InstructionOpSize.EBPF_SIZE_W)),
     stxdw: packer(storexEmitter(c.InstructionOpSize.EBPF_SIZE_DW)),
+    "lock add": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_ADD),
+    "lock or": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_OR),
+    "lock and": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_AND),
+    "lock xor": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_XOR),
+    "lock fetch add": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_ADD),
+    "lock fetch or": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_OR),
+    "lock fetch and": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_AND),
+    "lock fetch xor": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_XOR),
+    "lock xchg": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_XCHG),
+    "lock cmpxchg": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_CMPXCHG),
+    "lock add32": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_ADD),
+    "lock or32": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_OR),
+    "lock and32": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_AND),
+    "lock xor32": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_XOR),
+    "lock fetch add32": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_ADD),
+    "lock fetch or32": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_OR),
+    "lock fetch and32": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_AND),
+    "lock fetch xor32": atomicFetch(c.InstructionAtomicOp.EBPF_ATOMIC_XOR),
+    "lock xchg32": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_XCHG),
+    "lock cmpxchg32": atomic(c.InstructionAtomicOp.EBPF_ATOMIC_CMPXCHG),
     add: alu64,
     sub: alu64,
     mul: alu64,
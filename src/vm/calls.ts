@@ -14,37 +14,22 @@
  * limitations under the License.
  */
 
-import { BIG_NEGATIVE_ONE, BIG_ZERO } from "./consts";
 import { Vm } from "./vm";
 
-const probe_read = (vm: Vm, to: BigInt, n: BigInt, from: BigInt) => {
-    const smallTo = Number(to);
-    const smallN = Number(n);
-    const smallFrom = Number(from);
-
-    // FIXME: There are currently no access or bounds controls.
-
-    for (let i = 0; i < smallN; i++) {
-        vm.memory.all[smallTo + i] = vm.memory.all[smallFrom + i]
-    }
-    return BigInt(0);
-};
-
-const map_lookup_elem = (vm: Vm, bigMapId: BigInt, bigKeyPtr: BigInt) => {
-    const [mapId, keyPtr] = [Number(bigMapId), Number(bigKeyPtr)];
+const map_lookup_elem = (vm: Vm, mapId: number, keyPtr: number) => {
     const bigKey = vm.memory.all64[keyPtr / 8];
     const key = Number(bigKey);
 
     const map = vm.maps.get(mapId);
     if (map === undefined) {
-        return BigInt(0);
+        return 0;
     }
 
     const val = map[key];
     if (val === undefined) {
-        return BigInt(0);
+        return 0;
     }
-    return BigInt(val);
+    return val;
 };
 
 enum MapUpdateFlags {
@@ -54,12 +39,11 @@ enum MapUpdateFlags {
     BPF_F_LOCK = 4,
 }
 
-const map_update_elem = (vm: Vm, bigMapId: BigInt, bigKeyPtr: BigInt, bigValuePtr: BigInt, bigFlags: BigInt) => {
-    const [mapId, keyPtr, valuePtr, flags] = [bigMapId, bigKeyPtr, bigValuePtr, bigFlags].map(Number);
+const map_update_elem = (vm: Vm, mapId: number, keyPtr: number, valuePtr: number, flags: number) => {
     const map = vm.maps.get(mapId);
     if (map === undefined) {
         console.warn(`map_update_elem called for non-existent map ${mapId}`);
-        return BIG_NEGATIVE_ONE;
+        return -1;
     }
     
     const bigKey = vm.memory.all64[keyPtr / 8];
@@ -69,20 +53,20 @@ const map_update_elem = (vm: Vm, bigMapId: BigInt, bigKeyPtr: BigInt, bigValuePt
 
     if ((flags & MapUpdateFlags.BPF_EXIST) && map[key] === undefined) {
         console.warn(`map_update_elem called with BPF_EXIST for non-existent key ${key}`);
-        return BIG_NEGATIVE_ONE;
+        return -1;
     }
     if ((flags & MapUpdateFlags.BPF_NOEXIST) && map[key] !== undefined) {
         console.warn(`map_update_elem called with BPF_NOEXIST for existent key ${key}`);
-        return BIG_NEGATIVE_ONE;
+        return -1;
     }
     map[key] = value;
-    return BIG_ZERO;
+    return 0;
 };
 
 const callbacks = new Array(64);
 callbacks[1] = map_lookup_elem;
 callbacks[2] = map_update_elem;
-callbacks[4] = probe_read;
-// callbacks[6] is trace_printk and handled specially (see vm.ts)
+// callbacks[6] is trace_printk and handled specially (see vm.ts); probe_read
+// and the packet and memory helpers are native (see ebpfvm_emscripten.c)
 
 export default callbacks;
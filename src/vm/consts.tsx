@@ -111,10 +111,23 @@ export enum InstructionOpMode {
     EBPF_MODE_ABS = 0x20,
     EBPF_MODE_IND = 0x40,
     EBPF_MODE_MEM = 0x60,
-    // EBPF_MODE_XADD = 0xc0,  // Unsupported
+    EBPF_MODE_ATOMIC = 0xc0,
 }
 export const EBPF_MODE = (x: InstructionOpMode) => (x & 0xe0);
 
+// Atomic (EBPF_MODE_ATOMIC) instructions keep the operation in imm: an
+// ALU op for add/or/and/xor, optionally with EBPF_ATOMIC_FETCH to load the
+// old value into the source register.
+export enum InstructionAtomicOp {
+    EBPF_ATOMIC_ADD = 0x00,
+    EBPF_ATOMIC_OR = 0x40,
+    EBPF_ATOMIC_AND = 0x50,
+    EBPF_ATOMIC_XOR = 0xa0,
+    EBPF_ATOMIC_XCHG = 0xe1,
+    EBPF_ATOMIC_CMPXCHG = 0xf1,
+}
+export const EBPF_ATOMIC_FETCH = 0x01;
+
 // ALU ops use this bit to indicate the source operand,
 // except for endianness ALU ops, that use it to indicate
 // big/little.
@@ -260,6 +273,12 @@ export const EBPF_HELPER_FUNC_NAMES = [
     'msg_pop_data',
     'rc_pointer_rel',
 ];
+
+// uBPF's own bulk memory helpers (UBPF_HELPER_MEMCPY etc. in ubpf.h), at the
+// top of the helper table.
+EBPF_HELPER_FUNC_NAMES[125] = 'memcpy';
+EBPF_HELPER_FUNC_NAMES[126] = 'memset';
+EBPF_HELPER_FUNC_NAMES[127] = 'memcmp';
 export interface UnpackedInstruction {
     opcode: number,
     dst: number,
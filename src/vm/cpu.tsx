@@ -14,12 +14,12 @@
  * limitations under the License.
  */
 export class Cpu {
-    programCounter: Uint16Array;
+    programCounter: Uint32Array;
     registers: BigUint64Array;
     hotAddress: BigUint64Array;
     hotAddressSize: BigUint64Array;
 
-    constructor(programCounter: Uint16Array, registers: BigUint64Array, hotAddress: BigUint64Array, hotAddressSize: BigUint64Array) {
+    constructor(programCounter: Uint32Array, registers: BigUint64Array, hotAddress: BigUint64Array, hotAddressSize: BigUint64Array) {
         this.programCounter = programCounter;
         this.registers = registers;
         this.hotAddress = hotAddress;
@@ -34,6 +34,10 @@ const stringifyRelative = (base: string, offset: number) => {
     }
 }
 
+const toJumpOffset = (offset: number) => {
+    return (offset < 0) ? `${offset}` : `+${offset}`;
+};
+
 const toImm = (n: number) => {
     // UBPF's disassembler emits "%#12345" but the assembler only
     // accepts "12345".  We'll match the assembler.
@@ -76,17 +80,17 @@ export const disassembleInstruction = (code: Uint8Array, offset: number) => {
         if (op === c.InstructionJumps.EBPF_EXIT) {
             return opName;
         } else if (op === c.InstructionJumps.EBPF_CALL) {
-            if (imm < c.EBPF_HELPER_FUNC_NAMES.length) {
+            if (c.EBPF_HELPER_FUNC_NAMES[imm] !== undefined) {
                 return `${opName} ${c.EBPF_HELPER_FUNC_NAMES[imm]}`;
             } else {
                 return `${opName} ${toImm(imm)}`;
             }
         } else if (op === c.InstructionJumps.EBPF_JA) {
-            return `${opName} +${off}`;
+            return `${opName} ${toJumpOffset(off)}`;
         } else if (source === 0) {
-            return `${opName} r${dst_reg}, ${toImm(imm)}, +${off}`;
+            return `${opName} r${dst_reg}, ${toImm(imm)}, ${toJumpOffset(off)}`;
         } else {
-            return `${opName} r${dst_reg}, r${src_reg}, +${off}`;
+            return `${opName} r${dst_reg}, r${src_reg}, ${toJumpOffset(off)}`;
         }
     } else if (instClass === c.InstructionClass.EBPF_CLS_JMP32) {
         throw new Error("EBPF_CLS_JMP32 Unimplemented");
@@ -117,6 +121,24 @@ export const disassembleInstruction = (code: Uint8Array, offset: number) => {
         } else if (instClass === c.InstructionClass.EBPF_CLS_ST) {
             const arg1 = stringifyRelative(`r${dst_reg}`, off);
             return `${mnem} ${arg1}, ${toImm(imm)}`;
+        } else if (instClass === c.InstructionClass.EBPF_CLS_STX &&
+            c.EBPF_MODE(code[offset]) === c.InstructionOpMode.EBPF_MODE_ATOMIC) {
+            const arg1 = stringifyRelative(`r${dst_reg}`, off);
+            // xchg and cmpxchg always fetch; the others only with the flag.
+            let fullOpName = c.InstructionAtomicOp[imm];
+            let prefix = "";
+            if (fullOpName === undefined && (imm & c.EBPF_ATOMIC_FETCH)) {
+                fullOpName = c.InstructionAtomicOp[imm & ~c.EBPF_ATOMIC_FETCH];
+                prefix = "fetch ";
+            }
+            if (fullOpName === undefined) {
+                throw new Error(`Unknown atomic operation ${imm}`);
+            }
+            let opName = prefix + fullOpName.replace(/^EBPF_ATOMIC_/, '').toLowerCase();
+            if (size === c.InstructionOpSize.EBPF_SIZE_W) {
+                opName += "32";
+            }
+            return `lock ${opName} ${arg1}, r${src_reg}`;
         } else if (instClass === c.InstructionClass.EBPF_CLS_STX) {
             const arg1 = stringifyRelative(`r${dst_reg}`, off);
             return `${mnem} ${arg1}, r${src_reg}`;
@@ -15,6 +15,7 @@
  */
 
 import binconsts from '../generated/vm/consts';
+import { Packet, XDP_MD_SIZE, XDP_PACKET_HEADROOM } from './packet';
 
 type Apply =
     (freeMemory: Uint8Array, registers: BigUint64Array) => void;
@@ -56,3 +57,31 @@ export const CreateSchedCloneEntrypoint =
 export const SchedCloneEntrypoint = {
   memory: binconsts.task_struct,
 };
+
+// Runs the program XDP-style: r1 points at an xdp_md whose data/data_end
+// bracket the packet, which sits after it and some headroom in VM memory.
+export const CreateXdpEntrypoint =
+    (packet: Packet) => {
+      const apply: Apply = (freeMemory, registers) => {
+        const contextRelAddr = freeMemory.byteOffset;
+        freeMemory = assignMemory(freeMemory, new Uint8Array(XDP_MD_SIZE));
+        const hardStartRelAddr = freeMemory.byteOffset;
+        freeMemory = assignMemory(freeMemory, new Uint8Array(XDP_PACKET_HEADROOM));
+        const dataRelAddr = freeMemory.byteOffset;
+        freeMemory = assignMemory(freeMemory, packet.data);
+
+        const context = new DataView(freeMemory.buffer, contextRelAddr, XDP_MD_SIZE);
+        context.setBigUint64(0, BigInt(dataRelAddr), true);
+        context.setBigUint64(8, BigInt(dataRelAddr + packet.length), true);
+        context.setBigUint64(16, BigInt(dataRelAddr), true);
+        context.setUint32(24, packet.ingressIfindex, true);
+        context.setUint32(28, packet.rxQueueIndex, true);
+        context.setBigUint64(32, BigInt(hardStartRelAddr), true);
+        context.setBigUint64(40, BigInt(dataRelAddr + packet.length), true);
+
+        registers[1] = BigInt(contextRelAddr);
+        registers[2] = BigInt(XDP_MD_SIZE);
+      };
+
+      return {apply};
+    };
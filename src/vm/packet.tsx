@@ -13,6 +13,35 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+// Verdicts an XDP program returns, numbered as in Linux.
+export enum XdpAction {
+    XDP_ABORTED = 0,
+    XDP_DROP = 1,
+    XDP_PASS = 2,
+    XDP_TX = 3,
+    XDP_REDIRECT = 4,
+}
+
+// struct ubpf_xdp_md: data, data_end and data_meta as 64-bit pointers,
+// 32-bit ingress_ifindex and rx_queue_index, then data_hard_start and
+// data_hard_end bracketing the buffer the packet is in.
+export const XDP_MD_SIZE = 48;
+
+// Room left before the packet for xdp_adjust_head() to push headers, as in Linux.
+export const XDP_PACKET_HEADROOM = 256;
+
 export class Packet {
+    data: Uint8Array;
+    ingressIfindex: number;
+    rxQueueIndex: number;
+
+    constructor(data: Uint8Array = new Uint8Array(0), ingressIfindex = 0, rxQueueIndex = 0) {
+        this.data = data;
+        this.ingressIfindex = ingressIfindex;
+        this.rxQueueIndex = rxQueueIndex;
+    }
 
+    get length() {
+        return this.data.byteLength;
+    }
 }
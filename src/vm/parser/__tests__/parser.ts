@@ -96,6 +96,39 @@ it("parses with percent-labeled registers", () => expectSingleInstruction(
     },
 ));
 
+it("parses lock add", () => expectSingleInstruction(
+    "lock add [r1+8], r2\n",
+    {
+        opname: "lock add",
+        source: "r2",
+        dest: "r1",
+        offset: 8,
+        imm: BigInt(0),
+    },
+));
+
+it("parses lock fetch and32", () => expectSingleInstruction(
+    "lock fetch and32 [r10-4], r3\n",
+    {
+        opname: "lock fetch and32",
+        source: "r3",
+        dest: "r10",
+        offset: -4,
+        imm: BigInt(0),
+    },
+));
+
+it("parses lock xchg", () => expectSingleInstruction(
+    "lock xchg [r0], r5\n",
+    {
+        opname: "lock xchg",
+        source: "r5",
+        dest: "r0",
+        offset: 0,
+        imm: BigInt(0),
+    },
+));
+
 it("parses stdw", () => expectSingleInstruction(
     "stdw [r3-16], 0xab\n",
     {
@@ -24,6 +24,7 @@ export interface ParsedInstruction {
     offset: number;
     imm: bigint;
     label?: string;
+    target?: string;
     extension?: string;
 }
 
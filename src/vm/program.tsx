@@ -23,6 +23,7 @@ export interface Instruction {
     // 'fooLabel:   jeq #ETHERTYPE_IP, L1, L2',
     asmSource: string;
 
+    // Programs from assemble() share one buffer; this is a view of it.
     machineCode: Uint8Array;
 }
 
@@ -31,8 +32,11 @@ export type Symbols = {[symbol: string]: number};
 export class Program {
     instructions: Instruction[];
     byteLength: number;
+    private code: Uint8Array | null;
 
-    constructor(instructions: Instruction[]) {
+    // code, if given, is the machine code of all the instructions back to
+    // back (as assemble() returns it).
+    constructor(instructions: Instruction[], code?: Uint8Array) {
         this.instructions = instructions;
 
         // lddw is 16 bytes (2 encoded instructions)
@@ -41,19 +45,16 @@ export class Program {
             numBytes += this.instructions[i].machineCode.byteLength;
         }
         this.byteLength = numBytes;
+        this.code = code && code.byteLength === numBytes ? code : null;
     }
 
+    // The machine code of the whole program.  Don't modify it; it is shared
+    // with the instructions.
     getInstructions() {
-        // FIXME: We should cache this.
-        const instArray = new Uint8Array(this.byteLength);
-        let byteOffset = 0;
-        for (let i = 0; i < this.instructions.length; i++) {
-            for (let j = 0; j < this.instructions[i].machineCode.byteLength; j++) {
-                instArray[byteOffset + j] = this.instructions[i].machineCode[j];
-            }
-            byteOffset += this.instructions[i].machineCode.byteLength;
+        if (this.code === null) {
+            this.code = concatMachineCode(this.instructions, this.byteLength);
         }
-        return instArray;
+        return this.code;
     }
 
     getInstructionAtProgramCounter(pc: number) {
@@ -71,8 +72,21 @@ export class Program {
 export interface AssembledProgram {
     labels: Symbols;
     instructions: Instruction[];
+    // The machine code of all the instructions, which are views into it.
+    code: Uint8Array;
 }
 
+// Copy the instructions' machine code into one buffer.
+const concatMachineCode = (instructions: Instruction[], byteLength: number) => {
+    const code = new Uint8Array(byteLength);
+    let byteOffset = 0;
+    for (let i = 0; i < instructions.length; i++) {
+        code.set(instructions[i].machineCode, byteOffset);
+        byteOffset += instructions[i].machineCode.byteLength;
+    }
+    return code;
+};
+
 export interface AssemblerOptions {
     symbols?: Symbols,
     helpers?: string[],
@@ -116,8 +130,23 @@ export const assemble = (
         lastLineNumber = inst.lineNumber;
     }
 
+    // Gather the machine code into one buffer, which the VM loads in one
+    // copy, and leave each instruction a view of its part.
+    let byteLength = 0;
+    for (let i = 0; i < instructions.length; i++) {
+        byteLength += instructions[i].machineCode.byteLength;
+    }
+    const code = concatMachineCode(instructions, byteLength);
+    let byteOffset = 0;
+    for (let i = 0; i < instructions.length; i++) {
+        const length = instructions[i].machineCode.byteLength;
+        instructions[i].machineCode = code.subarray(byteOffset, byteOffset + length);
+        byteOffset += length;
+    }
+
     return {
         instructions,
         labels: parsed.labels,
+        code,
     };
 };
@@ -26,12 +26,29 @@ export interface ResolvedInstruction {
     extension?: number;
 }
 
-export const resolveJumpOffset = (instIndex: number, absTarget: number) => {
-    if (instIndex >= absTarget) {
-        throw new Error(`only forward jumps allowed`);
+// Jumps may go backwards, to make loops; the VM's verifier checks that
+// every loop is bounded when the program is loaded.
+export const resolveJumpOffset = (instIndex: number, absTarget: number, lineNumber: number) => {
+    if (instIndex === absTarget) {
+        throw new Error(`jump to itself is an infinite loop (line ${lineNumber})`);
     }
-    // subtract 1: you are always jumping at least one instruction
-    return absTarget - instIndex - 1;
+    // subtract 1: the offset is relative to the next instruction
+    const offset = absTarget - instIndex - 1;
+    if (offset < -32768 || offset > 32767) {
+        throw new Error(`jump offset ${offset} out of range (line ${lineNumber})`);
+    }
+    return offset;
+};
+
+// Jump offsets count instruction slots, and lddw takes two.
+const slotIndexes = (instructions: ParsedInstruction[]) => {
+    const slots: number[] = [];
+    let slot = 0;
+    for (const inst of instructions) {
+        slots.push(slot);
+        slot += (inst.opname === "lddw") ? 2 : 1;
+    }
+    return slots;
 };
 
 export const resolve = (
@@ -41,6 +58,7 @@ export const resolve = (
     helpers: string[],
 ) => {
     const resolvedInstructions: ResolvedInstruction[] = [];
+    const slots = slotIndexes(instructions);
 
     for (let i = 0; i < instructions.length; i++) {
         const inst = instructions[i];
@@ -69,6 +87,16 @@ export const resolve = (
             resolvedInst.imm = BigInt(id);
         }
 
+        if (inst.target !== undefined) {
+            const target = labels[inst.target];
+            if (target === undefined) {
+                throw new Error(
+                    `jump to undefined label "${inst.target}" (line ${inst.lineNumber})`
+                );
+            }
+            resolvedInst.offset = resolveJumpOffset(slots[i], slots[target], inst.lineNumber);
+        }
+
         // FIXME: Recalculate imm and offset here based on symbols.
         if (inst.extension !== undefined) {
             const absSymbol: number = symbols[inst.extension];
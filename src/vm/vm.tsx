@@ -18,16 +18,14 @@ import { Memory } from './memory';
 import { Program, AssembledProgram } from './program';
 import { Packet } from './packet';
 import { Maps } from './maps';
-import { BIG_MAX_32, BIG_NEGATIVE_ONE } from './consts';
 
 const Ubpf = require('../generated/ubpf.js');
 
-const MAX_PROGRAM_SIZE = 16*512;  // bytes
-
 interface UbpfModule extends EmscriptenModule {
     // These are all the EMSCRIPTEN_KEEPALIVE functions in
     // ubpf/ebpfvm_emscripten.c
     _ebpfvm_create_vm(logCallback: number, trampolineCallback: number): number;
+    _ebpfvm_get_call_block(): number;
     _ebpfvm_get_programcounter_address(): number;
     _ebpfvm_get_registers(): number;
     _ebpfvm_get_hot_address(): number;
@@ -40,14 +38,31 @@ interface UbpfModule extends EmscriptenModule {
     _ebpfvm_get_instructions(): number;
     _ebpfvm_validate_instructions(numInstructions: number): number;
     _ebpfvm_exec_step(): number;
+    _ebpfvm_compile_wasm(): number;
+    _ebpfvm_get_wasm_code(): number;
 
     // These are controlled by '-s EXPORT_RUNTIME_FUNCTIONS' in the emcc step
     addFunction(f: (...args: any[])=>any, signature: string): number
     UTF8ToString(wasmAddress: number): string;
+
+    // The instance exports; a compiled program imports ubpf's memory
+    // and function table from here.
+    asm: {
+        memory: WebAssembly.Memory;
+        __indirect_function_table: WebAssembly.Table;
+    };
 }
 
+// The "run" export of a program compiled by ebpfvm_compile_wasm().
+type CompiledProgram = (r1: bigint, r2: bigint, r10: bigint) => bigint;
+
+// Helpers implemented in JavaScript get r1-r5 as numbers, which are exact up
+// to 2^53 (enough for pointers, ids and sizes), and may return a negative
+// number for an error.
 type EbpfvmCallback =
-    (vm: Vm, r1: BigInt, r2: BigInt, r3: BigInt, r4: BigInt, r5: BigInt) => BigInt;
+    (vm: Vm, r1: number, r2: number, r3: number, r4: number, r5: number) => number;
+
+const TWO_32 = 4294967296;
 
 export class Vm {
     cpu: Cpu;
@@ -56,22 +71,41 @@ export class Vm {
     packet: Packet;
     maps: Maps;
     ubpfModule: UbpfModule;
-    maxProgramSize: number;
+    compiled: CompiledProgram | null;
 
-    constructor(cpu: Cpu, memory: Memory, program: Program, packet: Packet, ubpfModule: UbpfModule, maxProgramSize: number) {
+    constructor(cpu: Cpu, memory: Memory, program: Program, packet: Packet, ubpfModule: UbpfModule) {
         this.cpu = cpu;
         this.memory = memory;
         this.program = program;
         this.packet = packet;
         this.maps = new Maps();
         this.ubpfModule = ubpfModule;
-        this.maxProgramSize = maxProgramSize;
+        this.compiled = null;
     }
 
     step() {
         return this.ubpfModule._ebpfvm_exec_step();
     }
 
+    // Run from the current instruction until the program exits.  Returns
+    // like step(): 0 when the program exits, negative on error.  If the
+    // program hasn't started and has been compiled, this runs the compiled
+    // version instead of interpreting; like the interpreter's exit, it leaves
+    // the program counter past the exit and r0 holding the return value.
+    run() {
+        if (this.compiled !== null && this.cpu.programCounter[0] === 0) {
+            const registers = this.cpu.registers;
+            const stackTop = BigInt(this.memory.stack.byteOffset + this.memory.stack.byteLength);
+            registers[0] = this.compiled(registers[1], registers[2], stackTop);
+            return 0;
+        }
+        let rc = this.step();
+        while (rc > 0) {
+            rc = this.step();
+        }
+        return rc;
+    }
+
     reset() {
         this.cpu.programCounter[0] = 0;
 
@@ -84,24 +118,52 @@ export class Vm {
     }
 
     setProgram(program: AssembledProgram) {
-        this.program = new Program(program.instructions);
-
-        if (this.program.byteLength > this.maxProgramSize) {
-            throw new Error(`New program too big (${this.program.byteLength} > ${this.maxProgramSize})`);
-        }
+        const newProgram = new Program(program.instructions, program.code);
 
-        const instructionBytes = this.program.getInstructions();
-        const instsOffset = this.ubpfModule._ebpfvm_get_instructions();
-        const vmInstructions = new Uint8Array(this.ubpfModule.HEAP8.buffer, instsOffset, instructionBytes.byteLength);
-        for (let i = 0; i < instructionBytes.byteLength; i++) {
-            vmInstructions[i] = instructionBytes[i];
+        // The VM stages each program in a buffer sized to fit it.
+        const instructionBytes = newProgram.getInstructions();
+        const numInstructions = instructionBytes.byteLength / 8;
+        if (this.ubpfModule._ebpfvm_allocate_instructions(numInstructions) !== numInstructions) {
+            throw new Error(`Failed to allocate for ${numInstructions} VM instructions`);
         }
-        const isValid = this.ubpfModule._ebpfvm_validate_instructions(instructionBytes.byteLength / 8);
+        this.ubpfModule.HEAPU8.set(instructionBytes, this.ubpfModule._ebpfvm_get_instructions());
+        // The VM only switches once the new program validates; until then
+        // (or if it doesn't) the old one stays loaded.
+        const isValid = this.ubpfModule._ebpfvm_validate_instructions(numInstructions);
         if (isValid !== 0) {
-            // FIXME: Maybe we should store the old program first, in case this one
-            // fails to validate?  Now we're just busted...
             throw new Error("Failed to validate program");
         }
+        this.program = newProgram;
+        this.compileProgram();
+    }
+
+    // Translate the program to a WebAssembly module and let the browser
+    // compile it in the background; until that finishes (or if the
+    // program can't be translated), run() interprets.
+    private compileProgram() {
+        this.compiled = null;
+
+        const size = this.ubpfModule._ebpfvm_compile_wasm();
+        if (size <= 0) {
+            return;
+        }
+        const codeOffset = this.ubpfModule._ebpfvm_get_wasm_code();
+        const code = this.ubpfModule.HEAPU8.slice(codeOffset, codeOffset + size);
+        const program = this.program;
+        const imports = {
+            env: {
+                memory: this.ubpfModule.asm.memory,
+                table: this.ubpfModule.asm.__indirect_function_table,
+            },
+        };
+        WebAssembly.instantiate(code, imports).then(({ instance }) => {
+            // Another program may have been loaded while this one compiled.
+            if (this.program === program) {
+                this.compiled = instance.exports.run as CompiledProgram;
+            }
+        }).catch((e) => {
+            console.warn("Failed to compile program to WebAssembly: %s", e);
+        });
     }
 }
 
@@ -113,8 +175,6 @@ export interface NewVmOptions {
     printkCallback?: (s: string) => void;
 }
 
-type EbpfvmCallbackTrampoline = (internalVm: number, call: BigInt, r1: BigInt, r2: BigInt, r3: BigInt, r4: BigInt, r5: BigInt) => BigInt;
-
 export const newVm = (options: NewVmOptions) => {
     return Ubpf({
         locateFile: (path: string, scriptDirectory: string) => {
@@ -127,24 +187,26 @@ export const newVm = (options: NewVmOptions) => {
         const logJsString = (wasmS: number) => printkCallback(mod.UTF8ToString(wasmS));
         const myLogWasmSlot: number = mod.addFunction(logJsString, 'vi');
 
-        const myCallTrampoline: EbpfvmCallbackTrampoline = (internalVm: number, call: BigInt, r1: BigInt, r2: BigInt, r3: BigInt, r4: BigInt, r5: BigInt) => {
-            // internalVm is a pointer to "struct ubpf_vm" (in C); don't use.
-
-            if (call > BIG_MAX_32) {
-                printkCallback(`Unhandled large callback ${call}`);
-                return BIG_NEGATIVE_ONE;
-            }
-            const smallCall = Number(call);
-
-            if (!options.callbacks || !options.callbacks[smallCall]) {
-                printkCallback(`Unhandled callback ${call}`);
-                return BIG_NEGATIVE_ONE;
+        // The C trampoline leaves the call id, r1-r5 and room for the return
+        // value in this block as 64-bit little-endian words (see call_block
+        // in ebpfvm_emscripten.c), so no BigInts are made per call.
+        const callBlock = new Uint32Array(mod.HEAP8.buffer, mod._ebpfvm_get_call_block(), 14);
+        const word = (i: number) => callBlock[2 * i] + callBlock[2 * i + 1] * TWO_32;
+        const setReturn = (ret: number) => {
+            callBlock[12] = ret >>> 0;
+            callBlock[13] = Math.floor(ret / TWO_32) >>> 0;
+        };
+        const myCallTrampoline = () => {
+            const call = callBlock[0];
+            const cb = callBlock[1] === 0 && options.callbacks ? options.callbacks[call] : undefined;
+            if (!cb) {
+                printkCallback(`Unhandled callback ${word(0)}`);
+                setReturn(-1);
+                return;
             }
-
-            const cb = options.callbacks[smallCall];
-            return cb(vm, r1, r2, r3, r4, r5);
+            setReturn(cb(vm, word(1), word(2), word(3), word(4), word(5)));
         };
-        const myCallTrampolineSlot: number = mod.addFunction(myCallTrampoline, 'jijjjjjj');
+        const myCallTrampolineSlot: number = mod.addFunction(myCallTrampoline, 'v');
 
         const vmCreateOk = mod._ebpfvm_create_vm(myLogWasmSlot, myCallTrampolineSlot);
         if (vmCreateOk !== 0) {
@@ -152,7 +214,7 @@ export const newVm = (options: NewVmOptions) => {
         }
 
         const vmProgramCounterOffset = mod._ebpfvm_get_programcounter_address();
-        const vmProgramCounter = new Uint16Array(mod.HEAP8.buffer, vmProgramCounterOffset, 1);
+        const vmProgramCounter = new Uint32Array(mod.HEAP8.buffer, vmProgramCounterOffset, 1);
         const vmRegistersOffset = mod._ebpfvm_get_registers();
         const vmRegisters = new BigUint64Array(mod.HEAP8.buffer, vmRegistersOffset, 11);
         const vmHotAddressOffset = mod._ebpfvm_get_hot_address();
@@ -179,15 +241,10 @@ export const newVm = (options: NewVmOptions) => {
             stackSize: vmStackSize,
         });
 
-        const toAllocForInstructions = MAX_PROGRAM_SIZE;
-        const allocInsts = mod._ebpfvm_allocate_instructions(toAllocForInstructions / 8);
-        if (allocInsts <= 0) {
-            throw new Error("Failed to allocate for VM instructions");
-        }
         const program = new Program([]);
 
         const packet = new Packet();
-        const vm = new Vm(cpu, memory, program, packet, mod, toAllocForInstructions);
+        const vm = new Vm(cpu, memory, program, packet, mod);
         return vm;
     });
 };
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Shared by the native tests (make test-native).  Each test is a program of
+ * its own that exits non-zero on the first failed CHECK.
+ */
+
+#ifndef UBPF_TEST_H
+#define UBPF_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                          \
+        }                                                                     \
+    } while (0)
+
+#define INST(op, d, s, off, i) ((struct ebpf_inst){.opcode = (op), .dst = (d), .src = (s), .offset = (off), .imm = (i)})
+#define NUM_INSTS(insts) (sizeof(insts) / sizeof((insts)[0]))
+
+/* A VM with the program loaded, or NULL with *errmsg set if it was refused */
+static inline struct ubpf_vm*
+try_load(const struct ebpf_inst* insts, size_t num_insts, bool verify, char** errmsg)
+{
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    ubpf_toggle_verifier(vm, verify);
+    *errmsg = NULL;
+    if (ubpf_load(vm, insts, num_insts * sizeof(insts[0]), errmsg) != 0) {
+        ubpf_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+static inline struct ubpf_vm*
+load(const struct ebpf_inst* insts, size_t num_insts)
+{
+    char* errmsg;
+    struct ubpf_vm* vm = try_load(insts, num_insts, true, &errmsg);
+    if (vm == NULL) {
+        fprintf(stderr, "load: %s\n", errmsg);
+        exit(1);
+    }
+    return vm;
+}
+
+/*
+ * Run the program on mem in the interpreter; returns ubpf_exec()'s rc.  With
+ * bounds checks on, mem must be the VM's own (vm->mem).
+ */
+static inline int
+interpret(struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* result)
+{
+    vm->regs[1] = (uintptr_t)mem;
+    vm->regs[2] = mem_len;
+    int rc = ubpf_exec(vm);
+    *result = vm->return_value;
+    return rc;
+}
+
+/* Run the program on mem in the interpreter and in the JIT, which must agree */
+static inline uint64_t
+run_both(struct ubpf_vm* vm, void* mem, size_t mem_len)
+{
+    char* errmsg = NULL;
+    uint64_t interpreted;
+    CHECK(interpret(vm, mem, mem_len, &interpreted) == 0);
+    ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+    if (fn == NULL) {
+        fprintf(stderr, "compile: %s\n", errmsg);
+        exit(1);
+    }
+    CHECK(fn(mem, mem_len) == interpreted);
+    return interpreted;
+}
+
+#endif
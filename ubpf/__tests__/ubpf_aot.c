@@ -0,0 +1,116 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include "test.h"
+
+#define FOLD(r) INST(EBPF_OP_MUL64_IMM, 0, 0, 0, 31), INST(EBPF_OP_ADD64_REG, 0, r, 0, 0)
+
+/* Folds r2 = mem[0] and r3 = mem[1] through a helper and the trickier operations into r0 */
+static const struct ebpf_inst insts[] = {
+    INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+    INST(EBPF_OP_LDXDW, 3, 1, 8, 0),
+    INST(EBPF_OP_MOV64_REG, 6, 2, 0, 0),
+    INST(EBPF_OP_MOV64_REG, 7, 3, 0, 0),
+    INST(EBPF_OP_MOV64_REG, 1, 2, 0, 0),
+    INST(EBPF_OP_MOV64_REG, 2, 3, 0, 0),
+    INST(EBPF_OP_CALL, 0, 0, 0, 1),
+    INST(EBPF_OP_MOV64_REG, 4, 6, 0, 0),
+    INST(EBPF_OP_MOV_REG, 4, 7, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 6, 0, 0),
+    INST(EBPF_OP_MOD_IMM, 4, 0, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 6, 0, 0),
+    INST(EBPF_OP_LSH_REG, 4, 7, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 6, 0, 0),
+    INST(EBPF_OP_ARSH64_REG, 4, 7, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_JEQ32_REG, 6, 7, 1, 0),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+    INST(EBPF_OP_JLE_IMM, 6, 0, 1, -3),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 2),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+static const uint64_t inputs[][2] = {
+    {0xfffffffffffffff1, 0x2a064e0},
+    {0xffffffff00000005, 0x100000005},
+    {0x100000000, 0xffffffffffffffed},
+    {0xfffffffffffffffe, 0x21},
+    {7, 0},
+};
+
+static uint64_t
+mix(struct ubpf_vm* vm, uint64_t call, uint64_t a, uint64_t b, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return a * 0x9e3779b97f4a7c15 ^ b;
+}
+
+/* The shared object computes what the interpreter and the JIT do */
+static void
+test_aot(void)
+{
+    char dir[] = "/tmp/ubpf_aot.XXXXXX";
+    char so_path[sizeof(dir) + 16];
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg = NULL;
+    uint64_t ctx[2];
+
+    CHECK(vm != NULL && mkdtemp(dir) != NULL);
+    snprintf(so_path, sizeof(so_path), "%s/prog.so", dir);
+    CHECK(ubpf_register(vm, 1, "mix", mix) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    if (ubpf_aot_compile(vm, so_path, &errmsg) != 0) {
+        fprintf(stderr, "aot_compile: %s\n", errmsg);
+        exit(1);
+    }
+    ubpf_jit_fn fn = ubpf_aot_load(vm, so_path, &errmsg);
+    if (fn == NULL) {
+        fprintf(stderr, "aot_load: %s\n", errmsg);
+        exit(1);
+    }
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        uint64_t interpreted;
+        memcpy(vm->mem, inputs[i], sizeof(inputs[i]));
+        CHECK(interpret(vm, vm->mem, sizeof(inputs[i]), &interpreted) == 0);
+        memcpy(ctx, inputs[i], sizeof(ctx));
+        CHECK(fn(ctx, sizeof(ctx)) == interpreted);
+    }
+    ubpf_destroy(vm);
+
+    /* Compiled, the same program gives the same results */
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        vm = ubpf_create();
+        CHECK(vm != NULL);
+        CHECK(ubpf_register(vm, 1, "mix", mix) == 0);
+        CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+        memcpy(vm->mem, inputs[i], sizeof(inputs[i]));
+        run_both(vm, vm->mem, sizeof(inputs[i]));
+        ubpf_destroy(vm);
+    }
+    unlink(so_path);
+    rmdir(dir);
+}
+
+int
+main(void)
+{
+    test_aot();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdatomic.h>
+#include "test.h"
+
+#define NUM_INPUTS 10000
+#define BROKEN 5
+
+struct input
+{
+    uint64_t a;
+    uint32_t b;
+};
+
+/* r0 = a * 3 + b */
+static const struct ebpf_inst insts[] = {
+    INST(EBPF_OP_LDXDW, 0, 1, 0, 0),
+    INST(EBPF_OP_LDXW, 2, 1, 8, 0),
+    INST(EBPF_OP_MUL64_IMM, 0, 0, 0, 3),
+    INST(EBPF_OP_ADD64_REG, 0, 2, 0, 0),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+/* Point one input's r1 outside memory, so only it fails; counts the calls */
+static void
+apply(void* mem, size_t mem_len, uint64_t* regs, size_t index, void* arg)
+{
+    if (index == BROKEN) {
+        regs[1] += 1 << 30;
+    }
+    atomic_fetch_add((atomic_size_t*)arg, 1);
+}
+
+/* Every input gets its own result, in order, interpreted and compiled */
+static void
+test_batch(void)
+{
+    static struct input data[NUM_INPUTS];
+    static struct ubpf_batch_input inputs[NUM_INPUTS];
+    static struct ubpf_batch_result results[NUM_INPUTS];
+    struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+    char* errmsg;
+
+    for (size_t i = 0; i < NUM_INPUTS; i++) {
+        data[i].a = i * 7;
+        data[i].b = i ^ 0x55;
+        inputs[i].data = &data[i];
+        inputs[i].len = 12;
+    }
+    for (int compiled = 0; compiled < 2; compiled++) {
+        if (compiled) {
+            CHECK(ubpf_compile(vm, &errmsg) != NULL);
+        }
+        for (unsigned int threads = 1; threads <= 4; threads *= 2) {
+            atomic_size_t calls = 0;
+            memset(results, 0xff, sizeof(results));
+            CHECK(ubpf_exec_batch(vm, inputs, results, NUM_INPUTS, threads, compiled ? NULL : apply, &calls) == 0);
+            for (size_t i = 0; i < NUM_INPUTS; i++) {
+                if (!compiled && i == BROKEN) {
+                    CHECK(results[i].rc == -1);
+                    continue;
+                }
+                CHECK(results[i].rc == 0);
+                CHECK(results[i].return_value == i * 21 + (i ^ 0x55));
+            }
+            CHECK(compiled || calls == NUM_INPUTS);
+        }
+    }
+    ubpf_destroy(vm);
+}
+
+int
+main(void)
+{
+    test_batch();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test.h"
+
+/* tcpdump -ddd 'ip and tcp dst port 80' */
+static const char tcp_port_80[] = "11\n"
+                                  "40 0 0 12\n"
+                                  "21 0 8 2048\n"
+                                  "48 0 0 23\n"
+                                  "21 0 6 6\n"
+                                  "40 0 0 20\n"
+                                  "69 4 0 8191\n"
+                                  "177 0 0 14\n"
+                                  "72 0 0 16\n"
+                                  "21 0 1 80\n"
+                                  "6 0 0 262144\n"
+                                  "6 0 0 0\n";
+
+struct packet
+{
+    uint8_t protocol;
+    uint16_t fragment;
+    uint16_t port;
+    uint32_t len;
+    enum ubpf_xdp_action action;
+};
+
+/* Ethernet, a 20-byte IPv4 header and the start of a TCP or UDP header */
+static void
+build(uint8_t* frame, const struct packet* p)
+{
+    memset(frame, 0, 64);
+    frame[12] = 0x08;
+    frame[14] = 0x45;
+    frame[20] = p->fragment >> 8;
+    frame[21] = p->fragment & 0xff;
+    frame[23] = p->protocol;
+    frame[36] = p->port >> 8;
+    frame[37] = p->port & 0xff;
+}
+
+/* The filter's verdicts come out as XDP's, interpreted and compiled */
+static void
+test_filter(void)
+{
+    static const struct packet packets[] = {
+        {6, 0, 80, 54, UBPF_XDP_PASS},
+        {6, 0, 81, 54, UBPF_XDP_DROP},
+        {17, 0, 80, 42, UBPF_XDP_DROP},
+        /* A later fragment has no TCP header to look at */
+        {6, 0x00b9, 80, 54, UBPF_XDP_DROP},
+        /* Loads past the end of the packet reject it */
+        {6, 0, 80, 36, UBPF_XDP_DROP},
+        {6, 0, 80, 20, UBPF_XDP_DROP},
+    };
+    struct ubpf_cbpf_insn* insns;
+    size_t count;
+    char* errmsg;
+    uint8_t frame[64];
+
+    CHECK(ubpf_parse_cbpf(tcp_port_80, &insns, &count, &errmsg) == 0 && count == 11);
+    for (int compiled = 0; compiled < 2; compiled++) {
+        struct ubpf_vm* vm = ubpf_create();
+        CHECK(vm != NULL);
+        CHECK(ubpf_load_cbpf(vm, insns, count, &errmsg) == 0);
+        CHECK(!compiled || ubpf_compile(vm, &errmsg) != NULL);
+        for (size_t i = 0; i < NUM_INSTS(packets); i++) {
+            struct ubpf_xdp_md md = {
+                .data = (uintptr_t)frame,
+                .data_end = (uintptr_t)frame + packets[i].len,
+                .data_meta = (uintptr_t)frame,
+            };
+            uint64_t action;
+            build(frame, &packets[i]);
+            CHECK(ubpf_exec_xdp(vm, &md, &action) == 0);
+            CHECK(action == packets[i].action);
+        }
+        ubpf_destroy(vm);
+    }
+    free(insns);
+}
+
+/* A is 32 bits wide, and division by a zero X rejects the packet */
+static void
+test_arithmetic(void)
+{
+    /* A = 0xffffffff; A += 2; X = A; A = 7 / X; ret A */
+    const struct ubpf_cbpf_insn insns[] = {
+        {0x00, 0, 0, 0xffffffff},
+        {0x04, 0, 0, 2},
+        {0x07, 0, 0, 0},
+        {0x00, 0, 0, 7},
+        {0x3c, 0, 0, 0},
+        {0x16, 0, 0, 0},
+    };
+    struct ubpf_cbpf_insn by_zero[NUM_INSTS(insns)];
+    struct ubpf_xdp_md md = {0};
+    uint64_t action;
+    char* errmsg;
+
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_load_cbpf(vm, insns, NUM_INSTS(insns), &errmsg) == 0);
+    CHECK(ubpf_exec_xdp(vm, &md, &action) == 0 && action == UBPF_XDP_PASS);
+    ubpf_destroy(vm);
+
+    memcpy(by_zero, insns, sizeof(insns));
+    by_zero[1].k = 1;
+    vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_load_cbpf(vm, by_zero, NUM_INSTS(by_zero), &errmsg) == 0);
+    CHECK(ubpf_exec_xdp(vm, &md, &action) == 0 && action == UBPF_XDP_DROP);
+    ubpf_destroy(vm);
+}
+
+/* Malformed text and filters are refused */
+static void
+test_invalid(void)
+{
+    static const char* texts[] = {"", "2\n6 0 0 1\n", "1\n6 0 zero 1\n"};
+    /* A jump past the end, and no return at the end */
+    const struct ubpf_cbpf_insn jump_out[] = {{0x15, 5, 0, 1}, {0x06, 0, 0, 1}};
+    const struct ubpf_cbpf_insn no_return[] = {{0x00, 0, 0, 1}};
+    struct ubpf_cbpf_insn* insns;
+    size_t count;
+    void* code;
+    size_t code_len;
+    char* errmsg;
+
+    for (size_t i = 0; i < NUM_INSTS(texts); i++) {
+        errmsg = NULL;
+        CHECK(ubpf_parse_cbpf(texts[i], &insns, &count, &errmsg) == -1 && errmsg != NULL);
+        free(errmsg);
+    }
+    errmsg = NULL;
+    CHECK(ubpf_translate_cbpf(jump_out, NUM_INSTS(jump_out), &code, &code_len, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    errmsg = NULL;
+    CHECK(ubpf_translate_cbpf(no_return, NUM_INSTS(no_return), &code, &code_len, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+}
+
+int
+main(void)
+{
+    test_filter();
+    test_arithmetic();
+    test_invalid();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "test.h"
+
+/* r0 = base; r0 += 1, n times; also stores at r10 - depth */
+#define COUNTER(base, n, depth)                                                                        \
+    {                                                                                                  \
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, base), INST(EBPF_OP_MOV64_IMM, 2, 0, 0, n),                   \
+            INST(EBPF_OP_STDW, 10, 0, -(depth), 5), INST(EBPF_OP_JEQ_IMM, 2, 0, 3, 0),                 \
+            INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1), INST(EBPF_OP_SUB64_IMM, 2, 0, 0, 1),                  \
+            INST(EBPF_OP_JA, 0, 0, -4, 0), INST(EBPF_OP_EXIT, 0, 0, 0, 0),                             \
+    }
+
+static const struct ebpf_inst prog_a[] = COUNTER(1000, 100, 8);
+static const struct ebpf_inst prog_b[] = COUNTER(2000, 200, 256);
+
+static struct ubpf_vm*
+create(void)
+{
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    ubpf_toggle_loop_check(vm, false);
+    return vm;
+}
+
+static void
+swap(struct ubpf_vm* vm, const struct ebpf_inst* insts, size_t size)
+{
+    char* errmsg = NULL;
+    if (ubpf_swap_code(vm, insts, size, &errmsg) != 0) {
+        fprintf(stderr, "swap: %s\n", errmsg);
+        exit(1);
+    }
+}
+
+/* A swap replaces the program, or leaves it alone if the new one is refused */
+static void
+test_swap(void)
+{
+    struct ebpf_inst bad[] = {INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0)};
+    struct ubpf_vm* vm = create();
+    char* errmsg = NULL;
+
+    swap(vm, prog_a, sizeof(prog_a));
+    CHECK(ubpf_exec(vm) == 0 && vm->return_value == 1100);
+    CHECK(ubpf_swap_code(vm, bad, sizeof(bad), &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    CHECK(ubpf_exec(vm) == 0 && vm->return_value == 1100);
+
+    swap(vm, prog_b, sizeof(prog_b));
+    CHECK(vm->stack_usage == 256);
+    CHECK(ubpf_exec(vm) == 0 && vm->return_value == 2200);
+
+    /* Not in the middle of the VM's own run */
+    CHECK(ubpf_exec_budget(vm, 5) == 1);
+    errmsg = NULL;
+    CHECK(ubpf_swap_code(vm, prog_a, sizeof(prog_a), &errmsg) == -1);
+    free(errmsg);
+    while (ubpf_exec_budget(vm, 5) == 1) {
+    }
+    CHECK(vm->return_value == 2200);
+
+    /* A compiled VM gets the new program compiled */
+    ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+    CHECK(fn != NULL && fn(NULL, 0) == 2200);
+    swap(vm, prog_a, sizeof(prog_a));
+    CHECK(vm->jitted != NULL && vm->jitted(NULL, 0) == 1100);
+    CHECK(ubpf_exec(vm) == 0 && vm->return_value == 1100);
+
+    /* Loading the usual way still works after a swap */
+    ubpf_unload_code(vm);
+    CHECK(ubpf_load(vm, prog_b, sizeof(prog_b), &errmsg) == 0);
+    CHECK(ubpf_exec(vm) == 0 && vm->return_value == 2200);
+    ubpf_destroy(vm);
+}
+
+static struct ubpf_map* progs;
+static atomic_bool stop;
+
+/* tail_call(ctx, 0, 0); return 7 */
+static struct ubpf_vm*
+caller(void)
+{
+    struct ebpf_inst insts[] = {
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 3, 0, 0, 0),
+        INST(EBPF_OP_CALL, 0, 0, 0, 12),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 7),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    char* errmsg;
+    struct ubpf_vm* vm = create();
+    CHECK(ubpf_register_map(vm, 0, progs) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    return vm;
+}
+
+/* Tail calls into the swapped program, interpreted or through XDP's compiled path */
+static void*
+runner(void* arg)
+{
+    bool compiled = arg != NULL;
+    struct ubpf_vm* vm = caller();
+    char* errmsg;
+    long runs = 0;
+
+    if (compiled) {
+        CHECK(ubpf_compile(vm, &errmsg) != NULL);
+    }
+    while (!atomic_load(&stop) || runs == 0) {
+        uint64_t result;
+        if (compiled) {
+            struct ubpf_xdp_md md = {0};
+            CHECK(ubpf_exec_xdp(vm, &md, &result) == 0);
+        } else {
+            CHECK(ubpf_exec(vm) == 0);
+            result = vm->return_value;
+        }
+        CHECK(result == 1100 || result == 2200);
+        runs++;
+    }
+    ubpf_destroy(vm);
+    return NULL;
+}
+
+/* The old program isn't freed while other threads still run it */
+static void
+test_swap_while_running(void)
+{
+    progs = ubpf_map_create(UBPF_MAP_TYPE_PROG_ARRAY, 4, sizeof(struct ubpf_vm*), 1);
+    struct ubpf_vm* target = create();
+    char* errmsg;
+    uint32_t key = 0;
+    pthread_t threads[4];
+
+    CHECK(progs != NULL);
+    CHECK(ubpf_load(target, prog_a, sizeof(prog_a), &errmsg) == 0);
+    CHECK(ubpf_compile(target, &errmsg) != NULL);
+    CHECK(ubpf_map_update_elem(progs, &key, &target, 0) == 0);
+    for (size_t i = 0; i < NUM_INSTS(threads); i++) {
+        CHECK(pthread_create(&threads[i], NULL, runner, (i & 1) ? &threads[i] : NULL) == 0);
+    }
+    for (int i = 0; i < 200; i++) {
+        if (i & 1) {
+            swap(target, prog_a, sizeof(prog_a));
+        } else {
+            swap(target, prog_b, sizeof(prog_b));
+        }
+    }
+    atomic_store(&stop, true);
+    for (size_t i = 0; i < NUM_INSTS(threads); i++) {
+        CHECK(pthread_join(threads[i], NULL) == 0);
+    }
+    CHECK(ubpf_map_delete_elem(progs, &key) == 0);
+    ubpf_destroy(target);
+    ubpf_map_destroy(progs);
+}
+
+int
+main(void)
+{
+    test_swap();
+    test_swap_while_running();
+    printf("ok\n");
+    return 0;
+}
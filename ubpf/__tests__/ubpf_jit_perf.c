@@ -0,0 +1,124 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include "test.h"
+
+/* r0 = (1 << 32 | 5) + 3 */
+static const struct ebpf_inst insts[] = {
+    INST(EBPF_OP_LDDW, 0, 0, 0, 5),
+    INST(0, 0, 0, 0, 1),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 3),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+static ubpf_jit_fn
+compile(const char* name, unsigned int flags)
+{
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+    CHECK(vm != NULL);
+    CHECK(ubpf_set_jit_profiling(vm, flags, name) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+    CHECK(fn != NULL);
+    CHECK(fn(NULL, 0) == (1ull << 32 | 5) + 3);
+    /* The symbols stay in the files after the code is gone */
+    ubpf_destroy(vm);
+    return fn;
+}
+
+/* Finds "<start> <size> <symbol>" in the perf map */
+static bool
+find_symbol(const char* path, const char* symbol, uintptr_t* start, size_t* size)
+{
+    FILE* f = fopen(path, "r");
+    char name[128];
+    bool found = false;
+
+    CHECK(f != NULL);
+    while (!found && fscanf(f, "%" SCNxPTR " %zx %127s", start, size, name) == 3) {
+        found = strcmp(name, symbol) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+/* Each compiled program gets a symbol, or one per instruction that has code */
+static void
+test_perf_map(void)
+{
+    char path[64];
+    uintptr_t start, pc0;
+    size_t size, prologue;
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    unlink(path);
+
+    ubpf_jit_fn whole = compile("whole", UBPF_JIT_PERF_MAP);
+    CHECK(find_symbol(path, "ubpf_prog_whole", &start, &size));
+    CHECK(start == (uintptr_t)whole && size > 0);
+    CHECK(!find_symbol(path, "ubpf_prog_whole+pc0", &start, &size));
+
+    ubpf_jit_fn split = compile("split", UBPF_JIT_PERF_MAP_INSTS);
+    CHECK(find_symbol(path, "ubpf_prog_split_prologue", &start, &prologue));
+    CHECK(start == (uintptr_t)split);
+    CHECK(find_symbol(path, "ubpf_prog_split+pc0", &pc0, &size));
+    CHECK(pc0 == start + prologue);
+    /* The second half of lddw has no code of its own */
+    CHECK(!find_symbol(path, "ubpf_prog_split+pc1", &start, &size));
+    CHECK(find_symbol(path, "ubpf_prog_split+pc2", &start, &size) && start > pc0);
+    CHECK(find_symbol(path, "ubpf_prog_split_epilogue", &start, &size));
+    unlink(path);
+}
+
+/* The jitdump starts with its header, and the listing has a line per instruction */
+static void
+test_jitdump(void)
+{
+    char path[64], listing[64], line[128];
+    uint32_t magic = 0;
+    int lines = 0;
+    FILE* f;
+
+    compile("dump", UBPF_JIT_JITDUMP);
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+    f = fopen(path, "r");
+    CHECK(f != NULL && fread(&magic, sizeof(magic), 1, f) == 1);
+    fclose(f);
+    CHECK(magic == 0x4A695444);
+
+    snprintf(listing, sizeof(listing), "/tmp/ubpf-%d-0.bpf", getpid());
+    f = fopen(listing, "r");
+    CHECK(f != NULL);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lines++;
+    }
+    fclose(f);
+    CHECK(lines == NUM_INSTS(insts));
+    unlink(listing);
+    unlink(path);
+}
+
+int
+main(void)
+{
+    test_perf_map();
+    test_jitdump();
+    printf("ok\n");
+    return 0;
+}
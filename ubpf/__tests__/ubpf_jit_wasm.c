@@ -0,0 +1,145 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The modules only run inside a WebAssembly host that shares the VM's
+ * memory, so natively the tests check their shape and what is refused.
+ */
+
+#include "test.h"
+
+static uint64_t
+add(struct ubpf_vm* vm, uint64_t call, uint64_t a, uint64_t b, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return a + b;
+}
+
+static uint32_t
+read_uleb(const uint8_t* buf, size_t len, size_t* pos)
+{
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        CHECK(*pos < len);
+        uint8_t byte = buf[(*pos)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    CHECK(false);
+    return 0;
+}
+
+/* The module is well formed: a header, then the sections in order, each as long as it says */
+static void
+test_module(void)
+{
+    /* r0 = add(mem[0], 3) unless mem[0] is 0, swapped to big endian in the low 16 bits */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDXDW, 6, 1, 0, 0),
+        INST(EBPF_OP_LDDW, 0, 0, 0, 7),
+        INST(0, 0, 0, 0, 1),
+        INST(EBPF_OP_JEQ_IMM, 6, 0, 4, 0),
+        INST(EBPF_OP_MOV64_REG, 1, 6, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 3),
+        INST(EBPF_OP_CALL, 0, 0, 0, 0),
+        INST(EBPF_OP_BE, 0, 0, 0, 16),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static const uint8_t header[] = {0x00, 'a', 's', 'm', 0x01, 0x00, 0x00, 0x00};
+    static const uint8_t section_ids[] = {1, 2, 3, 7, 10};
+    static uint8_t buffer[65536];
+    struct ubpf_vm* vm = ubpf_create();
+    size_t size = sizeof(buffer), pos = sizeof(header);
+    char* errmsg;
+
+    CHECK(vm != NULL);
+    CHECK(ubpf_register(vm, 0, "add", add) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    CHECK(ubpf_translate_wasm(vm, buffer, &size, &errmsg) == 0);
+    CHECK(size > sizeof(header) && size < sizeof(buffer));
+    CHECK(memcmp(buffer, header, sizeof(header)) == 0);
+
+    for (size_t i = 0; i < NUM_INSTS(section_ids); i++) {
+        CHECK(pos < size && buffer[pos++] == section_ids[i]);
+        uint32_t len = read_uleb(buffer, size, &pos);
+        size_t end = pos + len;
+        CHECK(end <= size);
+        if (section_ids[i] == 7) {
+            /* One export, the function run */
+            CHECK(read_uleb(buffer, end, &pos) == 1);
+            CHECK(read_uleb(buffer, end, &pos) == 3 && memcmp(buffer + pos, "run", 3) == 0);
+        } else if (section_ids[i] == 10) {
+            /* run and the two byte swaps, each as long as it says */
+            CHECK(read_uleb(buffer, end, &pos) == 3);
+            for (int f = 0; f < 3; f++) {
+                pos += read_uleb(buffer, end, &pos);
+                CHECK(pos <= end && buffer[pos - 1] == 0x0b);
+            }
+            CHECK(pos == end);
+        }
+        pos = end;
+    }
+    CHECK(pos == size);
+
+    /* The same program makes the same module */
+    static uint8_t again[sizeof(buffer)];
+    size_t again_size = sizeof(again);
+    CHECK(ubpf_translate_wasm(vm, again, &again_size, &errmsg) == 0);
+    CHECK(again_size == size && memcmp(again, buffer, size) == 0);
+
+    /* Or nothing, if it doesn't fit */
+    again_size = size - 1;
+    CHECK(ubpf_translate_wasm(vm, again, &again_size, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    ubpf_destroy(vm);
+}
+
+/* Loops are left to the interpreter, and there has to be a program */
+static void
+test_rejected(void)
+{
+    static const struct ebpf_inst loop[] = {
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_JLT_IMM, 0, 0, -2, 10),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static uint8_t buffer[65536];
+    size_t size = sizeof(buffer);
+    struct ubpf_vm* vm = load(loop, NUM_INSTS(loop));
+    char* errmsg;
+
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 10);
+    CHECK(ubpf_translate_wasm(vm, buffer, &size, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    ubpf_destroy(vm);
+
+    vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_translate_wasm(vm, buffer, &size, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    ubpf_destroy(vm);
+}
+
+int
+main(void)
+{
+    test_module();
+    test_rejected();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test.h"
+
+#define MAX_CASES 40
+
+/* Unsorted, with duplicates, negatives, and values equal in their low 32 bits */
+static const int32_t values[MAX_CASES] = {
+    17, -1, 3, 0x7fffffff, -100, 3, 42, INT32_MIN, 9, 8, 7, 6, 5, 4, 2, 1, 0, -2, -3, 99,
+    1000, 1001, 1002, -1000, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70,
+};
+
+/*
+ * r2 = mem[0]; a ladder of jeq r2, values[i] to "r0 = i; exit", falling
+ * through to "r0 = 999; exit".  The ladder starts at skip, so a jump into its
+ * middle is a target too.
+ */
+static size_t
+ladder(struct ebpf_inst* insts, uint8_t opcode, int num_cases, int skip)
+{
+    size_t n = 0;
+    insts[n++] = INST(EBPF_OP_LDXDW, 2, 1, 0, 0);
+    insts[n++] = INST(EBPF_OP_JA, 0, 0, skip, 0);
+    size_t first = n;
+    for (int i = 0; i < num_cases; i++) {
+        insts[n++] = INST(opcode, 2, 0, 0, values[i]);
+    }
+    insts[n++] = INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 999);
+    insts[n++] = INST(EBPF_OP_EXIT, 0, 0, 0, 0);
+    for (int i = 0; i < num_cases; i++) {
+        insts[first + i].offset = n + 2 * i - (first + i) - 1;
+    }
+    for (int i = 0; i < num_cases; i++) {
+        insts[n++] = INST(EBPF_OP_MOV64_IMM, 0, 0, 0, i);
+        insts[n++] = INST(EBPF_OP_EXIT, 0, 0, 0, 0);
+    }
+    return n;
+}
+
+/* What the ladder should return for x */
+static uint64_t
+expected(uint8_t opcode, int num_cases, int skip, uint64_t x)
+{
+    for (int i = skip; i < num_cases; i++) {
+        bool equal = opcode == EBPF_OP_JEQ_IMM ? x == (uint64_t)(int64_t)values[i] : (uint32_t)x == (uint32_t)values[i];
+        if (equal) {
+            return i;
+        }
+    }
+    return 999;
+}
+
+/* Ladders compiled to a search pick the first matching case, as written */
+static void
+test_jeq_ladders(void)
+{
+    static const uint8_t opcodes[] = {EBPF_OP_JEQ_IMM, EBPF_OP_JEQ32_IMM};
+    static const int sizes[] = {1, 3, 8, MAX_CASES};
+
+    for (size_t o = 0; o < NUM_INSTS(opcodes); o++) {
+        for (size_t s = 0; s < NUM_INSTS(sizes); s++) {
+            for (int skip = 0; skip <= sizes[s] / 2; skip += sizes[s] / 2 + 1) {
+                struct ebpf_inst insts[3 * MAX_CASES + 4];
+                size_t n = ladder(insts, opcodes[o], sizes[s], skip);
+                struct ubpf_vm* vm = load(insts, n);
+
+                for (int i = 0; i < MAX_CASES; i++) {
+                    uint64_t probes[] = {
+                        (uint64_t)(int64_t)values[i],
+                        (uint32_t)values[i],
+                        (uint32_t)values[i] | 0x500000000ull,
+                        (uint64_t)(int64_t)values[i] + 1,
+                    };
+                    for (size_t p = 0; p < NUM_INSTS(probes); p++) {
+                        memcpy(vm->mem, &probes[p], 8);
+                        CHECK(run_both(vm, vm->mem, 8) == expected(opcodes[o], sizes[s], skip, probes[p]));
+                    }
+                }
+                ubpf_destroy(vm);
+            }
+        }
+    }
+}
+
+/* Code laid out by a branch profile computes what the interpreter does, on every path */
+static void
+test_branch_profile(void)
+{
+    /* x = mem[0]; r0 = x <= 100 ? (x & 1 ? 1 : 3) : 0; x == 7 ? 99 : r0 + 4 */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_JGT_IMM, 2, 0, 3, 100),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_JSET_IMM, 2, 0, 1, 1),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 2),
+        INST(EBPF_OP_JEQ_IMM, 2, 0, 2, 7),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 4),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 99),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static const uint64_t probes[] = {0, 1, 2, 7, 8, 100, 101, 102, 1000, UINT64_MAX};
+    struct ubpf_vm* plain = load(insts, NUM_INSTS(insts));
+    struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+    uint64_t x = 7, result;
+    char* errmsg;
+
+    CHECK(!ubpf_toggle_branch_profile(vm, true));
+    /* Only x == 7 runs, so the 99 path is the hot one */
+    memcpy(vm->mem, &x, 8);
+    for (int i = 0; i < 10; i++) {
+        CHECK(interpret(vm, vm->mem, 8, &result) == 0 && result == 99);
+    }
+    CHECK(vm->branch_counts[2].taken == 0 && vm->branch_counts[2].not_taken == 10);
+    CHECK(vm->branch_counts[4].taken == 10 && vm->branch_counts[6].taken == 10);
+    CHECK(vm->branch_counts[3].taken == 0 && vm->branch_counts[3].not_taken == 0);
+
+    ubpf_jit_fn profiled = ubpf_compile(vm, &errmsg);
+    ubpf_jit_fn unprofiled = ubpf_compile(plain, &errmsg);
+    CHECK(profiled != NULL && unprofiled != NULL);
+    CHECK(vm->jitted_size != plain->jitted_size || memcmp(vm->jitted, plain->jitted, vm->jitted_size) != 0);
+    for (size_t i = 0; i < NUM_INSTS(probes); i++) {
+        memcpy(vm->mem, &probes[i], 8);
+        memcpy(plain->mem, &probes[i], 8);
+        CHECK(run_both(vm, vm->mem, 8) == run_both(plain, plain->mem, 8));
+    }
+
+    /* Turning the profile off discards the counts */
+    CHECK(ubpf_toggle_branch_profile(vm, false));
+    CHECK(vm->branch_counts == NULL);
+    ubpf_destroy(vm);
+    ubpf_destroy(plain);
+}
+
+int
+main(void)
+{
+    test_jeq_ladders();
+    test_branch_profile();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test.h"
+
+/* r0 = 0; r6 = 0; loop: r0 += r6; r6 += 1; jlt r6, bound, loop; exit */
+static size_t
+counted(struct ebpf_inst* insts, int32_t bound)
+{
+    insts[0] = INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0);
+    insts[1] = INST(EBPF_OP_MOV64_IMM, 6, 0, 0, 0);
+    insts[2] = INST(EBPF_OP_ADD64_REG, 0, 6, 0, 0);
+    insts[3] = INST(EBPF_OP_ADD64_IMM, 6, 0, 0, 1);
+    insts[4] = INST(EBPF_OP_JLT_IMM, 6, 0, -3, bound);
+    insts[5] = INST(EBPF_OP_EXIT, 0, 0, 0, 0);
+    return 6;
+}
+
+/* Counted loops, bottom- or top-tested and nested, run to completion */
+static void
+test_counted(void)
+{
+    struct ebpf_inst insts[6];
+    struct ubpf_vm* vm = load(insts, counted(insts, 16));
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 120);
+    ubpf_destroy(vm);
+
+    /* Right up to the limit */
+    vm = load(insts, counted(insts, UBPF_MAX_LOOP_ITERATIONS));
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == (uint64_t)UBPF_MAX_LOOP_ITERATIONS * (UBPF_MAX_LOOP_ITERATIONS - 1) / 2);
+    ubpf_destroy(vm);
+
+    /* r6 = 10; loop: jeq r6, 0, done; r0 += 3; r6 -= 1; ja loop; done: exit */
+    static const struct ebpf_inst top_tested[] = {
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 6, 0, 0, 10),
+        INST(EBPF_OP_JEQ_IMM, 6, 0, 3, 0),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 3),
+        INST(EBPF_OP_SUB64_IMM, 6, 0, 0, 1),
+        INST(EBPF_OP_JA, 0, 0, -4, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    vm = load(top_tested, NUM_INSTS(top_tested));
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 30);
+    ubpf_destroy(vm);
+
+    /* 8 x 8 with 32-bit counters */
+    static const struct ebpf_inst nested[] = {
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV_IMM, 6, 0, 0, 0),
+        INST(EBPF_OP_MOV_IMM, 7, 0, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_ADD_IMM, 7, 0, 0, 1),
+        INST(EBPF_OP_JLT32_IMM, 7, 0, -3, 8),
+        INST(EBPF_OP_ADD_IMM, 6, 0, 0, 1),
+        INST(EBPF_OP_JLT32_IMM, 6, 0, -6, 8),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    vm = load(nested, NUM_INSTS(nested));
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 64);
+    ubpf_destroy(vm);
+}
+
+/* Loops that may not end are refused, unless the loop check is off */
+static void
+test_unbounded(void)
+{
+    struct ebpf_inst too_long[6];
+    counted(too_long, UBPF_MAX_LOOP_ITERATIONS + 1);
+    /* The counter comes from memory */
+    static const struct ebpf_inst from_memory[] = {
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_LDXDW, 6, 1, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_ADD64_IMM, 6, 0, 0, 1),
+        INST(EBPF_OP_JLT_IMM, 6, 0, -3, 100),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    /* Counting by two never hits 7 */
+    static const struct ebpf_inst never_equal[] = {
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 6, 0, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 6, 0, 0, 2),
+        INST(EBPF_OP_JNE_IMM, 6, 0, -2, 7),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    const struct
+    {
+        const struct ebpf_inst* insts;
+        size_t num_insts;
+    } programs[] = {
+        {too_long, NUM_INSTS(too_long)},
+        {from_memory, NUM_INSTS(from_memory)},
+        {never_equal, NUM_INSTS(never_equal)},
+    };
+    char* errmsg;
+
+    for (size_t i = 0; i < NUM_INSTS(programs); i++) {
+        CHECK(try_load(programs[i].insts, programs[i].num_insts, true, &errmsg) == NULL && errmsg != NULL);
+        free(errmsg);
+
+        struct ubpf_vm* vm = ubpf_create();
+        CHECK(vm != NULL);
+        ubpf_toggle_loop_check(vm, false);
+        CHECK(ubpf_load(vm, programs[i].insts, programs[i].num_insts * sizeof(struct ebpf_inst), &errmsg) == 0);
+        ubpf_destroy(vm);
+    }
+
+    /* Unchecked, a loop still runs: 100 - 95 iterations from memory */
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    ubpf_toggle_loop_check(vm, false);
+    CHECK(ubpf_load(vm, from_memory, sizeof(from_memory), &errmsg) == 0);
+    *(uint64_t*)vm->mem = 95;
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 5);
+    ubpf_destroy(vm);
+}
+
+int
+main(void)
+{
+    test_counted();
+    test_unbounded();
+    printf("ok\n");
+    return 0;
+}
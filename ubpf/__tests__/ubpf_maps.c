@@ -0,0 +1,280 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include "test.h"
+
+/* Host memory the programs below have no business reading */
+static uint64_t secret[2] = {0x5ec2e7, 0x5ec2e7};
+
+/* r0 = helper(map 0, key, value, 0) */
+static int
+call_helper(int helper, uint64_t key, uint64_t value, struct ubpf_map* map, uint64_t* result)
+{
+    struct ebpf_inst insts[] = {
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_LDDW, 2, 0, 0, (uint32_t)key),
+        INST(0, 0, 0, 0, key >> 32),
+        INST(EBPF_OP_LDDW, 3, 0, 0, (uint32_t)value),
+        INST(0, 0, 0, 0, value >> 32),
+        INST(EBPF_OP_MOV64_IMM, 4, 0, 0, 0),
+        INST(EBPF_OP_CALL, 0, 0, 0, helper),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    char* errmsg;
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_register_map(vm, 0, map) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    int rc = interpret(vm, vm->mem, vm->mem_len, result);
+    ubpf_destroy(vm);
+    return rc;
+}
+
+/* With bounds checks on, the helpers only take keys and values the program may read */
+static void
+test_helper_pointers(void)
+{
+    struct ubpf_map* map = ubpf_map_create(UBPF_MAP_TYPE_HASH, 8, 16, 4);
+    uint64_t bad = 0x10, host = (uintptr_t)secret, result, value[2];
+    CHECK(map != NULL);
+
+    CHECK(call_helper(2, bad, host, map, &result) == 0 && result == (uint64_t)-EFAULT);
+    CHECK(call_helper(2, host, host, map, &result) == 0 && result == (uint64_t)-EFAULT);
+    CHECK(ubpf_map_read(map, secret, value) != 0);
+    CHECK(call_helper(1, bad, 0, map, &result) == 0 && result == 0);
+    CHECK(call_helper(3, bad, 0, map, &result) == 0 && result == (uint64_t)-EFAULT);
+    ubpf_map_destroy(map);
+}
+
+/* Update and look up through the stack, interpreted and compiled */
+static void
+test_update_lookup(void)
+{
+    struct ebpf_inst insts[] = {
+        /* key = 3; value = {r1[0], 0} */
+        INST(EBPF_OP_STDW, 10, 0, -8, 3),
+        INST(EBPF_OP_LDXDW, 6, 1, 0, 0),
+        INST(EBPF_OP_STXDW, 10, 6, -24, 0),
+        INST(EBPF_OP_STDW, 10, 0, -16, 0),
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 2, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, -8),
+        INST(EBPF_OP_MOV64_REG, 3, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 3, 0, 0, -24),
+        INST(EBPF_OP_MOV64_IMM, 4, 0, 0, 0),
+        INST(EBPF_OP_CALL, 0, 0, 0, 2),
+        /* return lookup(key)[0] + 1, or 0 if it's missing */
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 2, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, -8),
+        INST(EBPF_OP_CALL, 0, 0, 0, 1),
+        INST(EBPF_OP_JEQ_IMM, 0, 0, 2, 0),
+        INST(EBPF_OP_LDXDW, 0, 0, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    struct ubpf_map* map = ubpf_map_create(UBPF_MAP_TYPE_HASH, 8, 16, 4);
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+    uint64_t key = 3, value[2];
+
+    CHECK(map != NULL && vm != NULL);
+    CHECK(ubpf_register_map(vm, 0, map) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    *(uint64_t*)vm->mem = 41;
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 42);
+    CHECK(ubpf_map_read(map, &key, value) == 0 && value[0] == 41 && value[1] == 0);
+    ubpf_destroy(vm);
+    ubpf_map_destroy(map);
+}
+
+/* stage k: ctx[0] = ctx[0] * 10 + k; tail_call(ctx, 0, k + 1); return r0 + 100 + k */
+static struct ubpf_vm*
+stage(struct ubpf_map* progs, int k)
+{
+    struct ebpf_inst insts[] = {
+        INST(EBPF_OP_MOV64_REG, 6, 1, 0, 0),
+        INST(EBPF_OP_LDXDW, 2, 6, 0, 0),
+        INST(EBPF_OP_MUL64_IMM, 2, 0, 0, 10),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, k),
+        INST(EBPF_OP_STXDW, 6, 2, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 1, 6, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 3, 0, 0, k + 1),
+        INST(EBPF_OP_CALL, 0, 0, 0, 12),
+        INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 100 + k),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    char* errmsg;
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_register_map(vm, 0, progs) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    return vm;
+}
+
+/* Tail calls follow the program array, interpreted and compiled, and stop at the limit */
+static void
+test_tail_calls(void)
+{
+    struct ubpf_map* progs = ubpf_map_create(UBPF_MAP_TYPE_PROG_ARRAY, 4, sizeof(struct ubpf_vm*), 8);
+    struct ubpf_vm* stages[4];
+    char* errmsg;
+    uint64_t ctx[1];
+    CHECK(progs != NULL);
+
+    for (int k = 0; k < 4; k++) {
+        stages[k] = stage(progs, k);
+        if (k > 0) {
+            uint32_t key = k;
+            CHECK(ubpf_map_update_elem(progs, &key, &stages[k], 0) == 0);
+        }
+    }
+
+    /* 0 -> 1 -> 2 -> 3 -> the empty slot 4, which returns -1 */
+    uint64_t* mem = stages[0]->mem;
+    mem[0] = 0;
+    CHECK(ubpf_exec(stages[0]) == 0);
+    CHECK(mem[0] == 123 && stages[0]->return_value == 102);
+
+    /* Compiled code only tail calls into programs that are compiled too */
+    ubpf_jit_fn fn = ubpf_compile(stages[0], &errmsg);
+    CHECK(fn != NULL);
+    ctx[0] = 0;
+    CHECK(fn(ctx, sizeof(ctx)) == 99 && ctx[0] == 0);
+    for (int k = 1; k < 4; k++) {
+        CHECK(ubpf_compile(stages[k], &errmsg) != NULL);
+    }
+    ctx[0] = 0;
+    CHECK(fn(ctx, sizeof(ctx)) == 102 && ctx[0] == 123);
+
+    /* Clearing a slot ends the chain there */
+    uint32_t key = 2;
+    CHECK(ubpf_map_delete_elem(progs, &key) == 0);
+    mem[0] = 0;
+    CHECK(ubpf_exec(stages[0]) == 0);
+    CHECK(mem[0] == 1 && stages[0]->return_value == 100);
+    ctx[0] = 0;
+    CHECK(fn(ctx, sizeof(ctx)) == 100 && ctx[0] == 1);
+
+    /* A program that tail calls itself runs 1 + UBPF_MAX_TAIL_CALLS times */
+    struct ebpf_inst self[] = {
+        INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, 1),
+        INST(EBPF_OP_STXDW, 1, 2, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 3, 0, 0, 5),
+        INST(EBPF_OP_CALL, 0, 0, 0, 12),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_register_map(vm, 0, progs) == 0);
+    CHECK(ubpf_load(vm, self, sizeof(self), &errmsg) == 0);
+    key = 5;
+    CHECK(ubpf_map_update_elem(progs, &key, &vm, 0) == 0);
+    mem = vm->mem;
+    mem[0] = 0;
+    CHECK(ubpf_exec(vm) == 0);
+    CHECK(mem[0] == UBPF_MAX_TAIL_CALLS + 1 && vm->return_value == (uint64_t)-1);
+    fn = ubpf_compile(vm, &errmsg);
+    CHECK(fn != NULL);
+    ctx[0] = 0;
+    CHECK(fn(ctx, sizeof(ctx)) == (uint64_t)-1 && ctx[0] == UBPF_MAX_TAIL_CALLS + 1);
+
+    CHECK(ubpf_map_delete_elem(progs, &key) == 0);
+    ubpf_destroy(vm);
+    for (int k = 0; k < 4; k++) {
+        ubpf_destroy(stages[k]);
+    }
+    ubpf_map_destroy(progs);
+}
+
+/* Per-CPU counters bumped without atomics from many threads add up */
+static void
+test_percpu(void)
+{
+    /* (*lookup(map 0, 0))++, or return 1 if it's missing */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_STDW, 10, 0, -8, 0),
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 2, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, -8),
+        INST(EBPF_OP_CALL, 0, 0, 0, 1),
+        INST(EBPF_OP_JEQ_IMM, 0, 0, 5, 0),
+        INST(EBPF_OP_LDXDW, 1, 0, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 1, 0, 0, 1),
+        INST(EBPF_OP_STXDW, 0, 1, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static const enum ubpf_map_type types[] = {UBPF_MAP_TYPE_PERCPU_ARRAY, UBPF_MAP_TYPE_PERCPU_HASH};
+    static struct ubpf_batch_input inputs[20000];
+    static struct ubpf_batch_result results[NUM_INSTS(inputs)];
+    uint64_t key = 0, zero = 0, total, copies[UBPF_MAX_CPUS];
+    char* errmsg;
+
+    for (size_t t = 0; t < NUM_INSTS(types); t++) {
+        for (int compiled = 0; compiled < 2; compiled++) {
+            uint32_t key_size = types[t] == UBPF_MAP_TYPE_PERCPU_HASH ? 8 : 4;
+            struct ubpf_map* map = ubpf_map_create(types[t], key_size, 8, 4);
+            struct ubpf_vm* vm = ubpf_create();
+            uint64_t sum = 0;
+            int used = 0;
+
+            CHECK(map != NULL && vm != NULL);
+            CHECK(ubpf_map_update_elem(map, &key, &zero, UBPF_ANY) == 0);
+            CHECK(ubpf_register_map(vm, 0, map) == 0);
+            CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+            CHECK(!compiled || ubpf_compile(vm, &errmsg) != NULL);
+            CHECK(ubpf_exec_batch(vm, inputs, results, NUM_INSTS(inputs), 4, NULL, NULL) == 0);
+            for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+                CHECK(results[i].rc == 0 && results[i].return_value == 0);
+            }
+
+            /* The sum of the copies, and the copies one by one */
+            CHECK(ubpf_map_read(map, &key, &total) == 0 && total == NUM_INSTS(inputs));
+            CHECK(ubpf_map_read_percpu(map, &key, copies) == 0);
+            for (int cpu = 0; cpu < UBPF_MAX_CPUS; cpu++) {
+                sum += copies[cpu];
+                used += copies[cpu] != 0;
+            }
+            CHECK(sum == NUM_INSTS(inputs) && used >= 1 && used <= 4);
+            ubpf_destroy(vm);
+            ubpf_map_destroy(map);
+        }
+    }
+
+    /* Only per-CPU maps have copies to read */
+    struct ubpf_map* map = ubpf_map_create(UBPF_MAP_TYPE_ARRAY, 4, 8, 4);
+    CHECK(map != NULL);
+    CHECK(ubpf_map_read_percpu(map, &key, copies) == -1);
+    ubpf_map_destroy(map);
+}
+
+int
+main(void)
+{
+    test_helper_pointers();
+    test_update_lookup();
+    test_tail_calls();
+    test_percpu();
+    printf("ok\n");
+    return 0;
+}
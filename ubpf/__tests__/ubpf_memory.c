@@ -0,0 +1,157 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include "test.h"
+
+/* Host memory the programs below have no business touching */
+static char secret[16] = "secret";
+
+/* r0 = helper(r1 = mem + a, r2 = b, r3 = c), with a, b and c from mem[0..2] */
+static const struct ebpf_inst call_insts[] = {
+    INST(EBPF_OP_LDXDW, 6, 1, 0, 0),
+    INST(EBPF_OP_LDXDW, 2, 1, 8, 0),
+    INST(EBPF_OP_LDXDW, 3, 1, 16, 0),
+    INST(EBPF_OP_ADD64_REG, 1, 6, 0, 0),
+    INST(EBPF_OP_CALL, 0, 0, 0, 0),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+static struct ubpf_vm*
+load_call(int32_t helper)
+{
+    struct ebpf_inst insts[NUM_INSTS(call_insts)];
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+
+    memcpy(insts, call_insts, sizeof(insts));
+    insts[4].imm = helper;
+    CHECK(vm != NULL);
+    CHECK(ubpf_register_memory_helpers(vm) == 0);
+    /* The arguments are computed at run time, so only the interpreter checks them */
+    ubpf_toggle_verifier(vm, false);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    return vm;
+}
+
+/* Calls helper on vm->mem laid out as {a, b, c, bytes...}; returns r0 */
+static uint64_t
+call(struct ubpf_vm* vm, uint64_t a, uint64_t b, uint64_t c, const char* bytes, bool compiled)
+{
+    uint64_t* args = vm->mem;
+    uint64_t result;
+    char* errmsg;
+
+    args[0] = a;
+    args[1] = b;
+    args[2] = c;
+    memset((char*)vm->mem + 24, 0, 64);
+    memcpy((char*)vm->mem + 24, bytes, strlen(bytes));
+    if (compiled) {
+        ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+        CHECK(fn != NULL);
+        return fn(vm->mem, vm->mem_len);
+    }
+    CHECK(interpret(vm, vm->mem, vm->mem_len, &result) == 0);
+    return result;
+}
+
+static const char*
+bytes(struct ubpf_vm* vm)
+{
+    return (const char*)vm->mem + 24;
+}
+
+/* memcpy, memset and memcmp do what libc's do, overlapping or not */
+static void
+test_bulk(void)
+{
+    for (int compiled = 0; compiled < 2; compiled++) {
+        uintptr_t mem;
+        struct ubpf_vm* cpy = load_call(UBPF_HELPER_MEMCPY);
+        struct ubpf_vm* set = load_call(UBPF_HELPER_MEMSET);
+        struct ubpf_vm* cmp = load_call(UBPF_HELPER_MEMCMP);
+
+        /* The second argument is an address, not an offset into memory */
+        mem = (uintptr_t)cpy->mem;
+        CHECK(call(cpy, 26, mem + 24, 6, "abcdefgh", compiled) == 0);
+        CHECK(strcmp(bytes(cpy), "ababcdef") == 0);
+        CHECK(call(cpy, 24, mem + 26, 6, "abcdefgh", compiled) == 0);
+        CHECK(strcmp(bytes(cpy), "cdefghgh") == 0);
+
+        CHECK(call(set, 25, 'x', 3, "abcdefgh", compiled) == 0);
+        CHECK(strcmp(bytes(set), "axxxefgh") == 0);
+
+        mem = (uintptr_t)cmp->mem;
+        CHECK(call(cmp, 24, mem + 28, 3, "abcdabcd", compiled) == 0);
+        CHECK(call(cmp, 24, mem + 28, 4, "abcdabce", compiled) == (uint64_t)-1);
+        CHECK(call(cmp, 28, mem + 24, 4, "abcdabce", compiled) == 1);
+
+        ubpf_destroy(cpy);
+        ubpf_destroy(set);
+        ubpf_destroy(cmp);
+    }
+}
+
+/* probe_read_str() copies up to the terminator and says how much it copied */
+static void
+test_probe_read_str(void)
+{
+    for (int compiled = 0; compiled < 2; compiled++) {
+        struct ubpf_vm* vm = load_call(45);
+        uintptr_t mem = (uintptr_t)vm->mem;
+
+        CHECK(call(vm, 40, 16, mem + 24, "hello", compiled) == 6);
+        CHECK(strcmp(bytes(vm) + 16, "hello") == 0);
+        /* Truncated to fit, and still terminated */
+        CHECK(call(vm, 40, 4, mem + 24, "hello", compiled) == 4);
+        CHECK(strcmp(bytes(vm) + 16, "hel") == 0);
+        ubpf_destroy(vm);
+    }
+}
+
+/* With bounds checks, buffers outside the program's memory fail with -EFAULT */
+static void
+test_bounds(void)
+{
+    static const int32_t helpers[] = {UBPF_HELPER_MEMCPY, UBPF_HELPER_MEMCMP, 4};
+    uintptr_t host = (uintptr_t)secret;
+
+    for (size_t i = 0; i < NUM_INSTS(helpers); i++) {
+        struct ubpf_vm* vm = load_call(helpers[i]);
+        /* probe_read takes (dst, size, src) rather than (dst, src, size) */
+        bool sized_second = helpers[i] == 4;
+        CHECK(call(vm, 24, sized_second ? 6 : host, sized_second ? host : 6, "", false) == (uint64_t)-EFAULT);
+        ubpf_destroy(vm);
+    }
+
+    /* Or as the destination, and past the end of memory */
+    struct ubpf_vm* vm = load_call(UBPF_HELPER_MEMSET);
+    CHECK(call(vm, host - (uintptr_t)vm->mem, 'x', 6, "", false) == (uint64_t)-EFAULT);
+    CHECK(call(vm, vm->mem_len - 4, 'x', 6, "", false) == (uint64_t)-EFAULT);
+    ubpf_destroy(vm);
+    CHECK(strcmp(secret, "secret") == 0);
+}
+
+int
+main(void)
+{
+    test_bulk();
+    test_probe_read_str();
+    test_bounds();
+    printf("ok\n");
+    return 0;
+}
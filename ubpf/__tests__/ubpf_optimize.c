@@ -0,0 +1,174 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test.h"
+
+static uint64_t
+store_seven(struct ubpf_vm* vm, uint64_t call, uint64_t p, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    *(uint64_t*)p = 7;
+    return 0;
+}
+
+static struct ubpf_vm*
+load_optimized(const struct ebpf_inst* insts, size_t num_insts)
+{
+    struct ubpf_vm* vm = load(insts, num_insts);
+    char* errmsg;
+    if (ubpf_optimize(vm, &errmsg) != 0) {
+        fprintf(stderr, "optimize: %s\n", errmsg);
+        exit(1);
+    }
+    return vm;
+}
+
+/* Constants spilled to the stack fold, and the dead ends they leave go away */
+static void
+test_fold(void)
+{
+    /* r0 = mem[0] + 5, the long way round */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_MOV64_IMM, 6, 0, 0, 5),
+        INST(EBPF_OP_STXDW, 10, 6, -8, 0),
+        INST(EBPF_OP_MOV64_IMM, 8, 0, 0, 123),
+        INST(EBPF_OP_LDXDW, 7, 10, -8, 0),
+        INST(EBPF_OP_LDXDW, 0, 1, 0, 0),
+        INST(EBPF_OP_JGT_IMM, 7, 0, 2, 10),
+        INST(EBPF_OP_ADD64_REG, 0, 7, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 999),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static const uint64_t inputs[] = {0, 37, UINT64_MAX};
+    struct ubpf_vm* plain = load(insts, NUM_INSTS(insts));
+    struct ubpf_vm* vm = load_optimized(insts, NUM_INSTS(insts));
+    char* errmsg;
+
+    CHECK(vm->num_insts <= 3);
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        memcpy(plain->mem, &inputs[i], 8);
+        memcpy(vm->mem, &inputs[i], 8);
+        CHECK(run_both(vm, vm->mem, 8) == inputs[i] + 5);
+        CHECK(run_both(plain, plain->mem, 8) == inputs[i] + 5);
+    }
+
+    /* Only between loading and compiling */
+    CHECK(ubpf_optimize(vm, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    ubpf_destroy(vm);
+    ubpf_destroy(plain);
+
+    vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_optimize(vm, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    ubpf_destroy(vm);
+}
+
+/* A stack slot a helper may write through isn't treated as a constant */
+static void
+test_escaped_stack(void)
+{
+    /* *(r10 - 8) = 1; store_seven(r10 - 8); return *(r10 - 8) */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_STDW, 10, 0, -8, 1),
+        INST(EBPF_OP_MOV64_REG, 1, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 1, 0, 0, -8),
+        INST(EBPF_OP_CALL, 0, 0, 0, 0),
+        INST(EBPF_OP_LDXDW, 0, 10, -8, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+
+    CHECK(vm != NULL);
+    CHECK(ubpf_register(vm, 0, "store_seven", store_seven) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    CHECK(ubpf_optimize(vm, &errmsg) == 0);
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 7);
+    ubpf_destroy(vm);
+}
+
+/* Known context fields and read-only map values fold in, until the map changes */
+static void
+test_specialize(void)
+{
+    /* If ctx->mode (a u32 at 4) is 1, return the value at key 0 of map 0, else 77 */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDXW, 2, 1, 4, 0),
+        INST(EBPF_OP_JNE_IMM, 2, 0, 9, 1),
+        INST(EBPF_OP_STW, 10, 0, -4, 0),
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 2, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, -4),
+        INST(EBPF_OP_CALL, 0, 0, 0, 1),
+        INST(EBPF_OP_JEQ_IMM, 0, 0, 2, 0),
+        INST(EBPF_OP_LDXDW, 0, 0, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 77),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    struct ubpf_map* map = ubpf_map_create(UBPF_MAP_TYPE_ARRAY, 4, 8, 1);
+    struct ubpf_ctx_field mode = {4, 4, 1};
+    uint32_t key = 0;
+    uint64_t value = 40;
+    char* errmsg;
+
+    CHECK(map != NULL);
+    CHECK(ubpf_map_update_elem(map, &key, &value, 0) == 0);
+    ubpf_map_set_readonly(map, true);
+
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(vm != NULL);
+    CHECK(ubpf_register_map(vm, 0, map) == 0);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    ((uint32_t*)vm->mem)[1] = 1;
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 40);
+
+    /* Also recompiles what was compiled */
+    CHECK(ubpf_specialize(vm, &mode, 1, &errmsg) == 0);
+    CHECK(vm->num_insts <= 3);
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 40);
+
+    /* The host changing the map specializes the program again */
+    value = 41;
+    CHECK(ubpf_map_update_elem(map, &key, &value, 0) == 0);
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 41);
+
+    /* Specializing again starts over from the program as loaded */
+    mode.value = 0;
+    ((uint32_t*)vm->mem)[1] = 0;
+    CHECK(ubpf_specialize(vm, &mode, 1, &errmsg) == 0);
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 77);
+
+    mode.size = 3;
+    CHECK(ubpf_specialize(vm, &mode, 1, &errmsg) == -1 && errmsg != NULL);
+    free(errmsg);
+    CHECK(run_both(vm, vm->mem, vm->mem_len) == 77);
+    ubpf_destroy(vm);
+    ubpf_map_destroy(map);
+}
+
+int
+main(void)
+{
+    test_fold();
+    test_escaped_stack();
+    test_specialize();
+    printf("ok\n");
+    return 0;
+}
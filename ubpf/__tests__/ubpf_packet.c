@@ -0,0 +1,239 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include "test.h"
+
+/* Run with the packet helpers over md, interpreted or compiled */
+static uint64_t
+run_xdp(const struct ebpf_inst* insts, size_t num_insts, bool compiled, struct ubpf_xdp_md* md)
+{
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+    uint64_t action;
+
+    CHECK(vm != NULL);
+    CHECK(ubpf_register_packet_helpers(vm) == 0);
+    if (ubpf_load(vm, insts, num_insts * sizeof(insts[0]), &errmsg) != 0) {
+        fprintf(stderr, "load: %s\n", errmsg);
+        exit(1);
+    }
+    CHECK(!compiled || ubpf_compile(vm, &errmsg) != NULL);
+    CHECK(ubpf_exec_xdp(vm, md, &action) == 0);
+    ubpf_destroy(vm);
+    return action;
+}
+
+static struct ubpf_xdp_md
+packet(uint8_t* buf, size_t len)
+{
+    return (struct ubpf_xdp_md){
+        .data = (uintptr_t)buf,
+        .data_end = (uintptr_t)buf + len,
+        .data_meta = (uintptr_t)buf,
+    };
+}
+
+static uint16_t
+fold16(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+/* csum_diff() over the whole packet, for every length the vector loops split differently */
+static void
+test_csum_diff(void)
+{
+    /* return csum_diff(NULL, 0, data, data_end - data, 0) */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDXDW, 3, 1, 0, 0),
+        INST(EBPF_OP_LDXDW, 4, 1, 8, 0),
+        INST(EBPF_OP_SUB64_REG, 4, 3, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 5, 0, 0, 0),
+        INST(EBPF_OP_CALL, 0, 0, 0, 28),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static const size_t lengths[] = {4, 60, 64, 100, 256, 1500};
+    uint8_t buf[1500];
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 131 + (i >> 3);
+    }
+    for (size_t l = 0; l < NUM_INSTS(lengths); l++) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < lengths[l]; i += 4) {
+            uint32_t word;
+            memcpy(&word, buf + i, sizeof(word));
+            sum += word;
+        }
+        for (int compiled = 0; compiled < 2; compiled++) {
+            struct ubpf_xdp_md md = packet(buf, lengths[l]);
+            CHECK(fold16(run_xdp(insts, NUM_INSTS(insts), compiled, &md)) == fold16(sum));
+        }
+    }
+
+    /* Only whole words */
+    struct ubpf_xdp_md md = packet(buf, 6);
+    CHECK(run_xdp(insts, NUM_INSTS(insts), false, &md) == (uint64_t)-EINVAL);
+}
+
+/* Rewriting the TTL keeps the IPv4 header checksum valid */
+static void
+test_l3_csum_replace(void)
+{
+    /* ip->ttl ^= 0x5a, with l3_csum_replace(ctx, 24, old, new, 2) */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_MOV64_REG, 6, 1, 0, 0),
+        INST(EBPF_OP_LDXDW, 2, 6, 0, 0),
+        INST(EBPF_OP_LDXH, 3, 2, 22, 0),
+        INST(EBPF_OP_MOV64_REG, 4, 3, 0, 0),
+        INST(EBPF_OP_XOR64_IMM, 4, 0, 0, 0x5a),
+        INST(EBPF_OP_STXH, 2, 4, 22, 0),
+        INST(EBPF_OP_MOV64_REG, 1, 6, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 24),
+        INST(EBPF_OP_MOV64_IMM, 5, 0, 0, 2),
+        INST(EBPF_OP_CALL, 0, 0, 0, 10),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static const uint8_t ip[20] = {
+        0x45, 0x00, 0x00, 0x54, 0x1c, 0x46, 0x40, 0x00, 0x40, 0x06,
+        0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+    };
+
+    for (int compiled = 0; compiled < 2; compiled++) {
+        uint8_t frame[34] = {0};
+        uint64_t sum = 0;
+        uint16_t check;
+
+        memcpy(frame + 14, ip, sizeof(ip));
+        for (size_t i = 0; i < sizeof(ip); i += 2) {
+            sum += frame[14 + i] << 8 | frame[15 + i];
+        }
+        check = ~fold16(sum);
+        frame[24] = check >> 8;
+        frame[25] = check & 0xff;
+
+        struct ubpf_xdp_md md = packet(frame, sizeof(frame));
+        CHECK(run_xdp(insts, NUM_INSTS(insts), compiled, &md) == 0);
+        CHECK(frame[22] == (0x40 ^ 0x5a));
+        sum = 0;
+        for (size_t i = 0; i < sizeof(ip); i += 2) {
+            sum += frame[14 + i] << 8 | frame[15 + i];
+        }
+        CHECK(fold16(sum) == 0xffff);
+    }
+}
+
+/* Growing and shrinking the packet stays inside its buffer */
+static void
+test_adjust(void)
+{
+    static const struct
+    {
+        int32_t head, tail;
+        uint64_t result;
+        size_t data;
+    } cases[] = {
+        {-14, 100, 174, 50},
+        {14, -20, 26, 78},
+        /* Past the buffer, or shorter than an Ethernet header */
+        {-65, 0, -EINVAL, 64},
+        {0, 133, -EINVAL, 64},
+        {50, 0, -EINVAL, 64},
+    };
+
+    for (size_t i = 0; i < NUM_INSTS(cases); i++) {
+        /* adjust_head(ctx, head); adjust_tail(ctx, tail); return data_end - data */
+        struct ebpf_inst insts[] = {
+            INST(EBPF_OP_MOV64_REG, 6, 1, 0, 0),
+            INST(EBPF_OP_MOV64_IMM, 2, 0, 0, cases[i].head),
+            INST(EBPF_OP_CALL, 0, 0, 0, 44),
+            INST(EBPF_OP_JNE_IMM, 0, 0, 7, 0),
+            INST(EBPF_OP_MOV64_REG, 1, 6, 0, 0),
+            INST(EBPF_OP_MOV64_IMM, 2, 0, 0, cases[i].tail),
+            INST(EBPF_OP_CALL, 0, 0, 0, 65),
+            INST(EBPF_OP_JNE_IMM, 0, 0, 3, 0),
+            INST(EBPF_OP_LDXDW, 2, 6, 0, 0),
+            INST(EBPF_OP_LDXDW, 0, 6, 8, 0),
+            INST(EBPF_OP_SUB64_REG, 0, 2, 0, 0),
+            INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        };
+        for (int compiled = 0; compiled < 2; compiled++) {
+            uint8_t buf[256];
+            struct ubpf_xdp_md md = packet(buf + 64, 60);
+            md.data_hard_start = (uintptr_t)buf;
+            md.data_hard_end = (uintptr_t)buf + sizeof(buf);
+            memset(buf, 0xab, sizeof(buf));
+
+            CHECK(run_xdp(insts, NUM_INSTS(insts), compiled, &md) == cases[i].result);
+            CHECK(md.data == (uintptr_t)buf + cases[i].data && md.data_meta == md.data);
+            if (cases[i].tail > 0 && cases[i].result == 174) {
+                /* A grown tail is zeroed */
+                CHECK(buf[64 + 60] == 0 && buf[64 + 60 + 99] == 0 && buf[64 + 60 + 100] == 0xab);
+            }
+        }
+    }
+}
+
+/* skb_load_bytes() copies out of the packet, and only out of the packet */
+static void
+test_load_bytes(void)
+{
+    static const int32_t offsets[] = {6, 52, 53};
+    uint8_t frame[60];
+
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = i;
+    }
+    for (size_t i = 0; i < NUM_INSTS(offsets); i++) {
+        /* skb_load_bytes(ctx, offset, r10 - 8, 8); return r0 ? r0 : *(r10 - 8) */
+        struct ebpf_inst insts[] = {
+            INST(EBPF_OP_STDW, 10, 0, -8, 0),
+            INST(EBPF_OP_MOV64_IMM, 2, 0, 0, offsets[i]),
+            INST(EBPF_OP_MOV64_REG, 3, 10, 0, 0),
+            INST(EBPF_OP_ADD64_IMM, 3, 0, 0, -8),
+            INST(EBPF_OP_MOV64_IMM, 4, 0, 0, 8),
+            INST(EBPF_OP_CALL, 0, 0, 0, 26),
+            INST(EBPF_OP_JNE_IMM, 0, 0, 1, 0),
+            INST(EBPF_OP_LDXDW, 0, 10, -8, 0),
+            INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        };
+        uint64_t expected = (uint64_t)-EFAULT;
+        if (offsets[i] + 8 <= (int32_t)sizeof(frame)) {
+            memcpy(&expected, frame + offsets[i], sizeof(expected));
+        }
+        for (int compiled = 0; compiled < 2; compiled++) {
+            struct ubpf_xdp_md md = packet(frame, sizeof(frame));
+            CHECK(run_xdp(insts, NUM_INSTS(insts), compiled, &md) == expected);
+        }
+    }
+}
+
+int
+main(void)
+{
+    test_csum_diff();
+    test_l3_csum_replace();
+    test_adjust();
+    test_load_bytes();
+    printf("ok\n");
+    return 0;
+}
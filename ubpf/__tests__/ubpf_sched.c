@@ -0,0 +1,129 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdatomic.h>
+#include "test.h"
+
+#define NUM_JOBS 5000
+#define LONG_LOOPS 5000000
+
+/* r0 = ctx[0]; r0 += 3, ctx[1] times */
+static const struct ebpf_inst insts[] = {
+    INST(EBPF_OP_LDXDW, 0, 1, 0, 0),
+    INST(EBPF_OP_LDXDW, 2, 1, 8, 0),
+    INST(EBPF_OP_JEQ_IMM, 2, 0, 3, 0),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 3),
+    INST(EBPF_OP_ADD64_IMM, 2, 0, 0, -1),
+    INST(EBPF_OP_JA, 0, 0, -4, 0),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+static struct ubpf_vm*
+create(void)
+{
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+    CHECK(vm != NULL);
+    ubpf_toggle_loop_check(vm, false);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    return vm;
+}
+
+/* A run paused by its budget picks up where it stopped */
+static void
+test_budget(void)
+{
+    struct ubpf_vm* vm = create();
+    uint64_t* ctx = vm->mem;
+    int rc, slices = 0;
+
+    ctx[0] = 5;
+    ctx[1] = 1000;
+    vm->regs[1] = (uintptr_t)ctx;
+    vm->regs[2] = 16;
+    while ((rc = ubpf_exec_budget(vm, 100)) == 1) {
+        slices++;
+    }
+    CHECK(rc == 0 && vm->return_value == 3005 && slices >= 39 && vm->pc == 0);
+
+    /* ubpf_exec() finishes a paused run */
+    CHECK(ubpf_exec_budget(vm, 100) == 1);
+    CHECK(ubpf_exec(vm) == 0 && vm->return_value == 3005);
+    ubpf_destroy(vm);
+}
+
+struct job
+{
+    uint64_t ctx[2];
+    int rc;
+    uint64_t return_value;
+    int finished;
+};
+
+static atomic_int num_finished;
+
+static void
+done(int rc, uint64_t return_value, void* arg)
+{
+    struct job* job = arg;
+    job->rc = rc;
+    job->return_value = return_value;
+    job->finished = atomic_fetch_add(&num_finished, 1);
+}
+
+/* Short jobs queued behind a long one still finish first */
+static void
+test_sched(void)
+{
+    static struct job jobs[NUM_JOBS];
+    struct ubpf_sched* sched = ubpf_sched_create(2, 1000);
+    struct ubpf_vm* vm = create();
+    uint64_t too_short[1] = {0};
+    struct job broken;
+    CHECK(sched != NULL);
+
+    jobs[0].ctx[0] = 1;
+    jobs[0].ctx[1] = LONG_LOOPS;
+    for (size_t i = 1; i < NUM_JOBS; i++) {
+        jobs[i].ctx[0] = i;
+        jobs[i].ctx[1] = i % 50;
+    }
+    for (size_t i = 0; i < NUM_JOBS; i++) {
+        CHECK(ubpf_sched_submit(sched, vm, jobs[i].ctx, sizeof(jobs[i].ctx), done, &jobs[i]) == 0);
+    }
+    /* The context is the only memory a job may read */
+    CHECK(ubpf_sched_submit(sched, vm, too_short, sizeof(too_short), done, &broken) == 0);
+    ubpf_sched_wait(sched);
+
+    CHECK(jobs[0].rc == 0 && jobs[0].return_value == 1 + 3ull * LONG_LOOPS);
+    for (size_t i = 1; i < NUM_JOBS; i++) {
+        CHECK(jobs[i].rc == 0 && jobs[i].return_value == i + 3 * (i % 50));
+    }
+    CHECK(broken.rc == -1);
+    CHECK(jobs[0].finished == NUM_JOBS);
+
+    ubpf_sched_destroy(sched);
+    ubpf_destroy(vm);
+}
+
+int
+main(void)
+{
+    test_budget();
+    test_sched();
+    printf("ok\n");
+    return 0;
+}
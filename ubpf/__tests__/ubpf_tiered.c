@@ -0,0 +1,133 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include "test.h"
+
+#define FOLD(r) INST(EBPF_OP_MUL64_IMM, 0, 0, 0, 31), INST(EBPF_OP_ADD64_REG, 0, r, 0, 0)
+
+/*
+ * Folds the results of operations the tiers once disagreed on, applied to
+ * r2 = mem[0] and r3 = mem[1], into r0.
+ */
+static const struct ebpf_inst mixed[] = {
+    INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+    INST(EBPF_OP_LDXDW, 3, 1, 8, 0),
+    INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0),
+    /* 32-bit moves clear the upper half */
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_MOV_REG, 4, 3, 0, 0),
+    FOLD(4),
+    /* so does a 32-bit modulo by zero */
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_MOD_IMM, 4, 0, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_MOV64_IMM, 5, 0, 0, 0),
+    INST(EBPF_OP_MOD_REG, 4, 5, 0, 0),
+    FOLD(4),
+    /* shift counts are taken mod the operand width */
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_LSH_IMM, 4, 0, 0, 33),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_LSH_REG, 4, 3, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_ARSH_REG, 4, 3, 0, 0),
+    FOLD(4),
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_RSH64_REG, 4, 3, 0, 0),
+    FOLD(4),
+    /* 32-bit compares ignore both upper halves */
+    INST(EBPF_OP_JEQ32_REG, 2, 3, 1, 0),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1),
+    /* 64-bit compares sign-extend the immediate */
+    INST(EBPF_OP_JLE_IMM, 2, 0, 1, -3),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 2),
+    INST(EBPF_OP_JGT_IMM, 2, 0, 1, -3),
+    INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 4),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+static const uint64_t inputs[][2] = {
+    {0xfffffffffffffff1, 0x2a064e0},
+    {0xffffffff00000005, 0x100000005},
+    {0x100000000, 0xffffffffffffffed},
+    {0xfffffffffffffffe, 0x21},
+    {7, 0},
+};
+
+static uint64_t
+run_tiered(struct ubpf_vm* vm, const uint64_t* input)
+{
+    memcpy(vm->mem, input, 16);
+    vm->regs[1] = (uintptr_t)vm->mem;
+    vm->regs[2] = 16;
+    CHECK(ubpf_exec_tiered(vm) == 0);
+    return vm->return_value;
+}
+
+/* A program gives the same results before and after it is promoted */
+static void
+test_promotion(void)
+{
+    struct ubpf_vm* vm = ubpf_create();
+    struct ubpf_tier_stats stats;
+    char* errmsg;
+    uint64_t interpreted[NUM_INSTS(inputs)];
+
+    CHECK(vm != NULL);
+    CHECK(ubpf_set_jit_threshold(vm, NUM_INSTS(inputs), 0) == 0);
+    CHECK(ubpf_load(vm, mixed, sizeof(mixed), &errmsg) == 0);
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        interpreted[i] = run_tiered(vm, inputs[i]);
+    }
+    for (int tries = 0; tries < 100000; tries++) {
+        ubpf_get_tier_stats(vm, &stats);
+        if (stats.jitted) {
+            break;
+        }
+        run_tiered(vm, inputs[0]);
+        sched_yield();
+    }
+    CHECK(stats.jitted);
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        CHECK(run_tiered(vm, inputs[i]) == interpreted[i]);
+    }
+    ubpf_destroy(vm);
+}
+
+/* The same, one input at a time through the interpreter and the JIT directly */
+static void
+test_tiers_agree(void)
+{
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        struct ubpf_vm* vm = load(mixed, NUM_INSTS(mixed));
+        memcpy(vm->mem, inputs[i], 16);
+        run_both(vm, vm->mem, 16);
+        ubpf_destroy(vm);
+    }
+}
+
+int
+main(void)
+{
+    test_tiers_agree();
+    test_promotion();
+    printf("ok\n");
+    return 0;
+}
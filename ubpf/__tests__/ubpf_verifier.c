@@ -0,0 +1,188 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test.h"
+
+/* r6 = 1 << 32; if r6 <op> imm, return 2, else return fallen */
+static struct ubpf_vm*
+compare_program(uint8_t opcode, int32_t imm, bool bad_taken, bool bad_fallen, char** errmsg)
+{
+    struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDDW, 6, 0, 0, 0),
+        INST(0, 0, 0, 0, 1),
+        INST(opcode, 6, 0, 2, imm),
+        /* r7 is never set: reading it is only allowed where it can't run */
+        bad_fallen ? INST(EBPF_OP_MOV64_REG, 0, 7, 0, 0) : INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 1),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        bad_taken ? INST(EBPF_OP_MOV64_REG, 0, 7, 0, 0) : INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 2),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    return try_load(insts, NUM_INSTS(insts), true, errmsg);
+}
+
+/* 64-bit unsigned compares sign-extend the immediate, everywhere */
+static void
+test_negative_immediates(void)
+{
+    static const struct
+    {
+        uint8_t opcode;
+        bool taken;
+    } cases[] = {
+        {EBPF_OP_JLE_IMM, true},
+        {EBPF_OP_JLT_IMM, true},
+        {EBPF_OP_JGT_IMM, false},
+        {EBPF_OP_JGE_IMM, false},
+    };
+    char* errmsg;
+
+    for (size_t i = 0; i < NUM_INSTS(cases); i++) {
+        struct ubpf_vm* vm = compare_program(cases[i].opcode, -3, false, false, &errmsg);
+        CHECK(vm != NULL);
+        CHECK(run_both(vm, NULL, 0) == (cases[i].taken ? 2 : 1));
+        ubpf_destroy(vm);
+
+        /* The verifier prunes exactly the side that can't run */
+        vm = compare_program(cases[i].opcode, -3, !cases[i].taken, cases[i].taken, &errmsg);
+        CHECK(vm != NULL);
+        CHECK(run_both(vm, NULL, 0) == (cases[i].taken ? 2 : 1));
+        ubpf_destroy(vm);
+
+        vm = compare_program(cases[i].opcode, -3, cases[i].taken, !cases[i].taken, &errmsg);
+        CHECK(vm == NULL && errmsg != NULL);
+        free(errmsg);
+    }
+}
+
+static uint64_t
+not_a_lookup(struct ubpf_vm* vm, uint64_t call, uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return 0;
+}
+
+/* Dereference what helper returns for key 0 in map 0, without testing it for NULL */
+static bool
+verifies_unchecked_lookup(struct ubpf_vm* vm, int32_t helper)
+{
+    struct ebpf_inst insts[] = {
+        INST(EBPF_OP_STDW, 10, 0, -8, 0),
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 2, 10, 0, 0),
+        INST(EBPF_OP_ADD64_IMM, 2, 0, 0, -8),
+        INST(EBPF_OP_CALL, 0, 0, 0, helper),
+        INST(EBPF_OP_LDXDW, 0, 0, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    char* errmsg = NULL;
+    int rc = ubpf_load(vm, insts, sizeof(insts), &errmsg);
+    free(errmsg);
+    ubpf_unload_code(vm);
+    return rc == 0;
+}
+
+/* Lookups are known by the helper registered, whatever it is called */
+static void
+test_lookup_helper(void)
+{
+    struct ubpf_map* map = ubpf_map_create(UBPF_MAP_TYPE_ARRAY, 4, 8, 1);
+    struct ubpf_vm* vm = ubpf_create();
+    CHECK(map != NULL && vm != NULL);
+    CHECK(ubpf_register_map(vm, 0, map) == 0);
+    CHECK(ubpf_register(vm, 5, "map_lookup_elem", not_a_lookup) == 0);
+
+    CHECK(!verifies_unchecked_lookup(vm, 1));
+    CHECK(verifies_unchecked_lookup(vm, 5));
+    vm->ext_func_names[1] = "lookup";
+    CHECK(!verifies_unchecked_lookup(vm, 1));
+
+    ubpf_destroy(vm);
+    ubpf_map_destroy(map);
+}
+
+#define NUM_DIAMONDS 40
+
+/*
+ * r2 = mem[0]; r0 = mem[1]; r8 = 0; then NUM_DIAMONDS branches on bits of r2
+ * that each add or xor r2 into r0, and return r0 + r8.  If bad_at is a
+ * diamond, r8 is only set on one side of it instead, the taken side if
+ * bad_taken.
+ */
+static size_t
+diamonds(struct ebpf_inst* insts, int bad_at, bool bad_taken)
+{
+    struct ebpf_inst set_r8 = INST(EBPF_OP_MOV64_IMM, 8, 0, 0, 0);
+    size_t n = 0;
+    insts[n++] = INST(EBPF_OP_LDXDW, 2, 1, 0, 0);
+    insts[n++] = INST(EBPF_OP_LDXDW, 0, 1, 8, 0);
+    if (bad_at < 0) {
+        insts[n++] = INST(EBPF_OP_MOV64_IMM, 8, 0, 0, 0);
+    }
+    for (int i = 0; i < NUM_DIAMONDS; i++) {
+        insts[n++] = INST(EBPF_OP_JSET_IMM, 2, 0, 2, 1 << (i % 31));
+        insts[n++] = i == bad_at && !bad_taken ? set_r8 : INST(EBPF_OP_ADD64_REG, 0, 2, 0, 0);
+        insts[n++] = INST(EBPF_OP_JA, 0, 0, 1, 0);
+        insts[n++] = i == bad_at && bad_taken ? set_r8 : INST(EBPF_OP_XOR64_REG, 0, 2, 0, 0);
+    }
+    insts[n++] = INST(EBPF_OP_ADD64_REG, 0, 8, 0, 0);
+    insts[n++] = INST(EBPF_OP_EXIT, 0, 0, 0, 0);
+    return n;
+}
+
+/* Paths through the diamonds that meet again are pruned, but never past a difference that matters */
+static void
+test_pruning(void)
+{
+    static const uint64_t inputs[][2] = {{0, 0}, {0x5a5a5a5a, 7}, {UINT64_MAX, 1}, {0x12345, UINT64_MAX}};
+    struct ebpf_inst insts[4 * NUM_DIAMONDS + 5];
+    struct ubpf_verifier_stats stats;
+    size_t n = diamonds(insts, -1, false);
+    struct ubpf_vm* vm = load(insts, n);
+    char* errmsg;
+
+    /* Without pruning there would be 2^NUM_DIAMONDS paths */
+    ubpf_get_verifier_stats(vm, &stats);
+    CHECK(stats.states_pruned > 0);
+    CHECK(stats.insns_processed < 10 * n);
+    for (size_t i = 0; i < NUM_INSTS(inputs); i++) {
+        uint64_t x = inputs[i][0], expected = inputs[i][1];
+        for (int d = 0; d < NUM_DIAMONDS; d++) {
+            expected = x & (1u << (d % 31)) ? expected ^ x : expected + x;
+        }
+        memcpy(vm->mem, inputs[i], sizeof(inputs[i]));
+        CHECK(run_both(vm, vm->mem, sizeof(inputs[i])) == expected);
+    }
+    ubpf_destroy(vm);
+
+    /* A path that leaves r8 unset is told apart from those that set it, wherever it is */
+    static const int bad_at[] = {0, NUM_DIAMONDS / 2, NUM_DIAMONDS - 1};
+    for (size_t i = 0; i < NUM_INSTS(bad_at); i++) {
+        for (int bad_taken = 0; bad_taken < 2; bad_taken++) {
+            n = diamonds(insts, bad_at[i], bad_taken);
+            CHECK(try_load(insts, n, true, &errmsg) == NULL && errmsg != NULL);
+            free(errmsg);
+        }
+    }
+}
+
+int
+main(void)
+{
+    test_negative_immediates();
+    test_lookup_helper();
+    test_pruning();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test.h"
+
+#define NUM_INCREMENTS 100000
+
+/* A store the verifier prunes as unreachable still gets stack */
+static void
+test_stack_sizing(void)
+{
+    struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDDW, 6, 0, 0, 0),
+        INST(0, 0, 0, 0, 1),
+        INST(EBPF_OP_JLE_IMM, 6, 0, 1, -3),
+        INST(EBPF_OP_STDW, 10, 0, -64, 1),
+        INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 7),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    struct ubpf_verifier_stats stats;
+    struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+
+    ubpf_get_verifier_stats(vm, &stats);
+    CHECK(stats.stack_depth < 64);
+    CHECK(vm->stack_usage == 64);
+    CHECK(run_both(vm, NULL, 0) == 7);
+    ubpf_destroy(vm);
+
+    /* The same store on the path that runs */
+    insts[2] = INST(EBPF_OP_JGT_IMM, 6, 0, 1, -3);
+    vm = load(insts, NUM_INSTS(insts));
+    ubpf_get_verifier_stats(vm, &stats);
+    CHECK(stats.stack_depth == 64);
+    CHECK(vm->stack_usage == 64);
+    CHECK(run_both(vm, NULL, 0) == 7);
+    ubpf_destroy(vm);
+}
+
+/* The value an atomic op leaves in memory, and in the fetch register and r0 */
+static void
+atomic_expected(int32_t op, bool is64, uint64_t* mem, uint64_t* src, uint64_t* r0)
+{
+    uint64_t mask = is64 ? UINT64_MAX : UINT32_MAX;
+    uint64_t old = *mem & mask, value;
+
+    switch (op & ~EBPF_ATOMIC_OP_FETCH) {
+    case EBPF_ALU_OP_ADD:
+        value = old + *src;
+        break;
+    case EBPF_ALU_OP_OR:
+        value = old | *src;
+        break;
+    case EBPF_ALU_OP_AND:
+        value = old & *src;
+        break;
+    case EBPF_ALU_OP_XOR:
+        value = old ^ *src;
+        break;
+    case EBPF_ATOMIC_OP_XCHG & ~EBPF_ATOMIC_OP_FETCH:
+        value = *src;
+        break;
+    default:
+        value = old == (*r0 & mask) ? *src : old;
+        *r0 = old;
+        break;
+    }
+    *mem = (*mem & ~mask) | (value & mask);
+    if ((op & EBPF_ATOMIC_OP_FETCH) && op != EBPF_ATOMIC_OP_CMPXCHG) {
+        *src = old;
+    }
+}
+
+/* Each atomic op, 32 and 64 bits wide, interpreted and compiled */
+static void
+test_atomics(void)
+{
+    static const int32_t ops[] = {
+        EBPF_ALU_OP_ADD,
+        EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH,
+        EBPF_ALU_OP_OR,
+        EBPF_ALU_OP_OR | EBPF_ATOMIC_OP_FETCH,
+        EBPF_ALU_OP_AND,
+        EBPF_ALU_OP_AND | EBPF_ATOMIC_OP_FETCH,
+        EBPF_ALU_OP_XOR,
+        EBPF_ALU_OP_XOR | EBPF_ATOMIC_OP_FETCH,
+        EBPF_ATOMIC_OP_XCHG,
+        EBPF_ATOMIC_OP_CMPXCHG,
+    };
+    /* mem[0] is the target, mem[1] the source and mem[2] r0 */
+    static const uint64_t inputs[][3] = {
+        {0xfedcba9876543210, 0x0f0f0f0ff0f0f0f0, 0},
+        {0xfedcba9876543210, 0x1111111111111111, 0xfedcba9876543210},
+        {0xfedcba9876543210, 0x2222222222222222, 0x0123456776543210},
+    };
+
+    for (size_t i = 0; i < NUM_INSTS(ops) * 2; i++) {
+        bool is64 = i & 1;
+        int32_t op = ops[i / 2];
+        /* return mem[0] * 31 * 31 + src * 31 + r0 */
+        struct ebpf_inst insts[] = {
+            INST(EBPF_OP_LDXDW, 3, 1, 8, 0),
+            INST(EBPF_OP_LDXDW, 0, 1, 16, 0),
+            INST(is64 ? EBPF_OP_ATOMIC_STORE : EBPF_OP_ATOMIC32_STORE, 1, 3, 0, op),
+            INST(EBPF_OP_LDXDW, 4, 1, 0, 0),
+            INST(EBPF_OP_MUL64_IMM, 4, 0, 0, 31),
+            INST(EBPF_OP_ADD64_REG, 4, 3, 0, 0),
+            INST(EBPF_OP_MUL64_IMM, 4, 0, 0, 31),
+            INST(EBPF_OP_ADD64_REG, 0, 4, 0, 0),
+            INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+        };
+        struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+        char* errmsg;
+        ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+        CHECK(fn != NULL);
+
+        for (size_t j = 0; j < NUM_INSTS(inputs); j++) {
+            uint64_t mem = inputs[j][0], src = inputs[j][1], r0 = inputs[j][2], result;
+            atomic_expected(op, is64, &mem, &src, &r0);
+
+            memcpy(vm->mem, inputs[j], sizeof(inputs[j]));
+            CHECK(interpret(vm, vm->mem, sizeof(inputs[j]), &result) == 0);
+            CHECK(result == mem * 31 * 31 + src * 31 + r0 && *(uint64_t*)vm->mem == mem);
+
+            memcpy(vm->mem, inputs[j], sizeof(inputs[j]));
+            CHECK(fn(vm->mem, sizeof(inputs[j])) == result && *(uint64_t*)vm->mem == mem);
+        }
+        ubpf_destroy(vm);
+    }
+}
+
+/* Increments from many threads at once all land */
+static void
+test_atomic_counter(void)
+{
+    /* r2 = ctx[0]; r3 = fetch_add(r2[0], 1); add32(r2[8], r3); return r3 */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 3, 0, 0, 1),
+        INST(EBPF_OP_ATOMIC_STORE, 2, 3, 0, EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH),
+        INST(EBPF_OP_ATOMIC32_STORE, 2, 3, 8, EBPF_ALU_OP_ADD),
+        INST(EBPF_OP_MOV64_REG, 0, 3, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    static struct ubpf_batch_input inputs[NUM_INCREMENTS];
+    static struct ubpf_batch_result results[NUM_INCREMENTS];
+    uint64_t counters[2];
+    uint64_t* ptr = counters;
+    uint64_t expected = (uint64_t)NUM_INCREMENTS * (NUM_INCREMENTS - 1) / 2;
+    char* errmsg;
+
+    for (size_t i = 0; i < NUM_INCREMENTS; i++) {
+        inputs[i].data = &ptr;
+        inputs[i].len = sizeof(ptr);
+    }
+    for (int compiled = 0; compiled < 2; compiled++) {
+        struct ubpf_vm* vm = ubpf_create();
+        uint64_t sum = 0;
+        CHECK(vm != NULL);
+        /* The counters are outside the VM's memory */
+        ubpf_toggle_bounds_check(vm, false);
+        CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+        CHECK(!compiled || ubpf_compile(vm, &errmsg) != NULL);
+        counters[0] = counters[1] = 0;
+        CHECK(ubpf_exec_batch(vm, inputs, results, NUM_INCREMENTS, 4, NULL, NULL) == 0);
+        for (size_t i = 0; i < NUM_INCREMENTS; i++) {
+            CHECK(results[i].rc == 0);
+            sum += results[i].return_value;
+        }
+        CHECK(counters[0] == NUM_INCREMENTS && sum == expected);
+        CHECK(counters[1] == (uint32_t)expected);
+        ubpf_destroy(vm);
+    }
+}
+
+/* How often the helpers below ran */
+static int helper_calls;
+
+static uint64_t
+weigh(struct ubpf_vm* vm, uint64_t call, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+    helper_calls++;
+    return a + 2 * b + 3 * c + 4 * d + 5 * e;
+}
+
+static uint64_t
+multiply(struct ubpf_vm* vm, uint64_t call, uint64_t a, uint64_t b, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    helper_calls++;
+    return a * b;
+}
+
+/* Helpers described as taking fewer arguments, or as pure, still get called with the right ones */
+static void
+test_describe_helper(void)
+{
+    /* r1-r5 = mem[0..4]; return helper 0 (r1-r5) + helper 1 (r1, r2) */
+    static const struct ebpf_inst insts[] = {
+        INST(EBPF_OP_LDXDW, 2, 1, 8, 0),
+        INST(EBPF_OP_LDXDW, 3, 1, 16, 0),
+        INST(EBPF_OP_LDXDW, 4, 1, 24, 0),
+        INST(EBPF_OP_LDXDW, 5, 1, 32, 0),
+        INST(EBPF_OP_LDXDW, 1, 1, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 6, 1, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 7, 2, 0, 0),
+        INST(EBPF_OP_CALL, 0, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 8, 0, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 1, 6, 0, 0),
+        INST(EBPF_OP_MOV64_REG, 2, 7, 0, 0),
+        INST(EBPF_OP_CALL, 0, 0, 0, 1),
+        INST(EBPF_OP_ADD64_REG, 0, 8, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    uint64_t args[5] = {3, 5, 7, 11, 13};
+    uint64_t expected = 3 + 2 * 5 + 3 * 7 + 4 * 11 + 5 * 13 + 3 * 5;
+    struct ubpf_vm* vm = ubpf_create();
+    char* errmsg;
+
+    CHECK(vm != NULL);
+    CHECK(ubpf_register(vm, 0, "weigh", weigh) == 0);
+    CHECK(ubpf_register(vm, 1, "multiply", multiply) == 0);
+    CHECK(ubpf_describe_helper(vm, 0, 5, 0) == 0);
+    CHECK(ubpf_describe_helper(vm, 1, 2, UBPF_HELPER_PURE) == 0);
+    /* Nothing registered, too many arguments, unknown flags */
+    CHECK(ubpf_describe_helper(vm, 2, 1, 0) == -1);
+    CHECK(ubpf_describe_helper(vm, 0, 6, 0) == -1);
+    CHECK(ubpf_describe_helper(vm, 0, 5, 0x2) == -1);
+    CHECK(ubpf_load(vm, insts, sizeof(insts), &errmsg) == 0);
+    memcpy(vm->mem, args, sizeof(args));
+    CHECK(run_both(vm, vm->mem, sizeof(args)) == expected);
+    ubpf_destroy(vm);
+
+    /* With constant arguments, the optimizer calls a pure helper instead of the program */
+    static const struct ebpf_inst constant[] = {
+        INST(EBPF_OP_LDXDW, 6, 1, 0, 0),
+        INST(EBPF_OP_MOV64_IMM, 1, 0, 0, 12),
+        INST(EBPF_OP_MOV64_IMM, 2, 0, 0, 12),
+        INST(EBPF_OP_CALL, 0, 0, 0, 1),
+        INST(EBPF_OP_ADD64_REG, 0, 6, 0, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    for (int pure = 0; pure < 2; pure++) {
+        vm = ubpf_create();
+        CHECK(vm != NULL);
+        CHECK(ubpf_register(vm, 1, "multiply", multiply) == 0);
+        CHECK(ubpf_describe_helper(vm, 1, 2, UBPF_HELPER_PURE) == 0);
+        if (!pure) {
+            /* Registering again forgets the description */
+            CHECK(ubpf_register(vm, 1, "multiply", multiply) == 0);
+        }
+        CHECK(ubpf_load(vm, constant, sizeof(constant), &errmsg) == 0);
+        helper_calls = 0;
+        CHECK(ubpf_optimize(vm, &errmsg) == 0);
+        CHECK((helper_calls > 0) == pure);
+        helper_calls = 0;
+        memcpy(vm->mem, args, 8);
+        CHECK(run_both(vm, vm->mem, 8) == 144 + 3);
+        CHECK(helper_calls == (pure ? 0 : 2));
+        ubpf_destroy(vm);
+    }
+}
+
+/* The longest program the VM takes loads and runs, interpreted and compiled */
+static void
+test_long_program(void)
+{
+    static struct ebpf_inst insts[UBPF_MAX_INSTS];
+    size_t longest = UBPF_MAX_INSTS - 1;
+    struct ubpf_vm* vm;
+    char* errmsg;
+
+    /* r0 = 0; r0 += 1, over and over; exit */
+    insts[0] = INST(EBPF_OP_MOV64_IMM, 0, 0, 0, 0);
+    for (size_t pc = 1; pc < longest - 1; pc++) {
+        insts[pc] = INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1);
+    }
+    insts[longest - 1] = INST(EBPF_OP_EXIT, 0, 0, 0, 0);
+    vm = load(insts, longest);
+    CHECK(vm->num_insts == longest);
+    CHECK(run_both(vm, NULL, 0) == longest - 2);
+    ubpf_destroy(vm);
+
+    /* One more is too many */
+    insts[longest - 1] = INST(EBPF_OP_ADD64_IMM, 0, 0, 0, 1);
+    insts[longest] = INST(EBPF_OP_EXIT, 0, 0, 0, 0);
+    CHECK(try_load(insts, longest + 1, true, &errmsg) == NULL && errmsg != NULL);
+    free(errmsg);
+}
+
+int
+main(void)
+{
+    test_stack_sizing();
+    test_atomics();
+    test_atomic_counter();
+    test_describe_helper();
+    test_long_program();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include "test.h"
+
+/*
+ * Passes IPv4, drops IPv6, sends anything else back out (TX), and aborts
+ * frames too short for an Ethernet header.  Marks the first byte of the
+ * frames it looks at.
+ */
+static const struct ebpf_inst insts[] = {
+    INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+    INST(EBPF_OP_LDXDW, 3, 1, 8, 0),
+    INST(EBPF_OP_MOV64_REG, 4, 2, 0, 0),
+    INST(EBPF_OP_ADD64_IMM, 4, 0, 0, 14),
+    INST(EBPF_OP_JGT_REG, 4, 3, 9, 0),
+    INST(EBPF_OP_LDXH, 5, 2, 12, 0),
+    INST(EBPF_OP_BE, 5, 0, 0, 16),
+    INST(EBPF_OP_STB, 2, 0, 0, 0x42),
+    INST(EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_PASS),
+    INST(EBPF_OP_JEQ_IMM, 5, 0, 3, 0x0800),
+    INST(EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_DROP),
+    INST(EBPF_OP_JEQ_IMM, 5, 0, 1, 0x86dd),
+    INST(EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_TX),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    INST(EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_ABORTED),
+    INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+};
+
+/* Ethertype and length of each frame, and the verdict on it */
+static const struct
+{
+    uint16_t ethertype;
+    uint32_t len;
+    enum ubpf_xdp_action action;
+} frames[] = {
+    {0x0800, 60, UBPF_XDP_PASS},
+    {0x86dd, 80, UBPF_XDP_DROP},
+    {0x0806, 42, UBPF_XDP_TX},
+    {0x0800, 1514, UBPF_XDP_PASS},
+    {0x0800, 10, UBPF_XDP_ABORTED},
+};
+
+static void
+fill_frame(uint8_t* frame, size_t i)
+{
+    memset(frame, 0xab, frames[i].len);
+    if (frames[i].len >= 14) {
+        frame[12] = frames[i].ethertype >> 8;
+        frame[13] = frames[i].ethertype & 0xff;
+    }
+}
+
+/* One packet at a time, in place, interpreted and compiled */
+static void
+test_exec_xdp(void)
+{
+    struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+    char* errmsg;
+    uint8_t frame[1514];
+
+    for (int compiled = 0; compiled < 2; compiled++) {
+        CHECK(!compiled || ubpf_compile(vm, &errmsg) != NULL);
+        for (size_t i = 0; i < NUM_INSTS(frames); i++) {
+            struct ubpf_xdp_md md = {
+                .data = (uintptr_t)frame,
+                .data_end = (uintptr_t)frame + frames[i].len,
+                .data_meta = (uintptr_t)frame,
+            };
+            uint64_t action;
+            fill_frame(frame, i);
+            CHECK(ubpf_exec_xdp(vm, &md, &action) == 0);
+            CHECK(action == frames[i].action);
+            CHECK(frame[0] == (action == UBPF_XDP_ABORTED ? 0xab : 0x42));
+        }
+    }
+    ubpf_destroy(vm);
+
+    /* The interpreter keeps the program inside the packet */
+    struct ebpf_inst past_end[] = {
+        INST(EBPF_OP_LDXDW, 2, 1, 0, 0),
+        INST(EBPF_OP_LDXB, 0, 2, 60, 0),
+        INST(EBPF_OP_EXIT, 0, 0, 0, 0),
+    };
+    vm = load(past_end, NUM_INSTS(past_end));
+    struct ubpf_xdp_md md = {
+        .data = (uintptr_t)frame,
+        .data_end = (uintptr_t)frame + 60,
+        .data_meta = (uintptr_t)frame,
+    };
+    uint64_t action;
+    CHECK(ubpf_exec_xdp(vm, &md, &action) == -1);
+    ubpf_destroy(vm);
+}
+
+static void
+write_u32(FILE* f, uint32_t value)
+{
+    CHECK(fwrite(&value, sizeof(value), 1, f) == 1);
+}
+
+/* A pcap file of the frames above, copies times over */
+static void
+write_pcap(const char* path, int copies)
+{
+    FILE* f = fopen(path, "wb");
+    uint8_t frame[1514];
+    CHECK(f != NULL);
+
+    write_u32(f, 0xa1b2c3d4);
+    write_u32(f, 2 | 4 << 16);
+    write_u32(f, 0);
+    write_u32(f, 0);
+    write_u32(f, 65535);
+    write_u32(f, 1);
+    for (int c = 0; c < copies; c++) {
+        for (size_t i = 0; i < NUM_INSTS(frames); i++) {
+            fill_frame(frame, i);
+            write_u32(f, 0);
+            write_u32(f, 0);
+            write_u32(f, frames[i].len);
+            write_u32(f, frames[i].len);
+            CHECK(fwrite(frame, frames[i].len, 1, f) == 1);
+        }
+    }
+    fclose(f);
+}
+
+/* Every packet of a capture gets a verdict, and the file is left alone */
+static void
+test_run_pcap(void)
+{
+    char dir[] = "/tmp/ubpf_xdp.XXXXXX";
+    char path[sizeof(dir) + 16], bad_path[sizeof(dir) + 16];
+    struct ubpf_xdp_stats stats;
+    char* errmsg;
+    uint8_t first;
+    FILE* f;
+
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/a.pcap", dir);
+    snprintf(bad_path, sizeof(bad_path), "%s/bad.pcap", dir);
+    write_pcap(path, 3);
+
+    for (int compiled = 0; compiled < 2; compiled++) {
+        struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+        CHECK(!compiled || ubpf_compile(vm, &errmsg) != NULL);
+        CHECK(ubpf_xdp_run_pcap(vm, path, &stats, &errmsg) == 0);
+        CHECK(stats.packets == 3 * NUM_INSTS(frames) && stats.errors == 0);
+        for (int action = 0; action < UBPF_XDP_ACTIONS; action++) {
+            uint64_t expected = 0;
+            for (size_t i = 0; i < NUM_INSTS(frames); i++) {
+                expected += frames[i].action == action ? 3 : 0;
+            }
+            CHECK(stats.actions[action] == expected);
+        }
+        ubpf_destroy(vm);
+    }
+    f = fopen(path, "rb");
+    CHECK(f != NULL && fseek(f, 24 + 16, SEEK_SET) == 0 && fread(&first, 1, 1, f) == 1);
+    fclose(f);
+    CHECK(first == 0xab);
+
+    /* Not a capture, or a missing one */
+    struct ubpf_vm* vm = load(insts, NUM_INSTS(insts));
+    f = fopen(bad_path, "wb");
+    CHECK(f != NULL && fputs("hello world this is not a pcap", f) >= 0);
+    fclose(f);
+    CHECK(ubpf_xdp_run_pcap(vm, bad_path, &stats, &errmsg) == -1);
+    free(errmsg);
+    unlink(bad_path);
+    CHECK(ubpf_xdp_run_pcap(vm, bad_path, &stats, &errmsg) == -1);
+    free(errmsg);
+    ubpf_destroy(vm);
+
+    unlink(path);
+    rmdir(dir);
+}
+
+int
+main(void)
+{
+    test_exec_xdp();
+    test_run_pcap();
+    printf("ok\n");
+    return 0;
+}
@@ -54,6 +54,18 @@ struct ebpf_inst
 /* Other memory modes are not yet supported */
 #define EBPF_MODE_IMM 0x00
 #define EBPF_MODE_MEM 0x60
+#define EBPF_MODE_ATOMIC 0xc0
+
+/* ALU operations, as used in the imm of atomic instructions */
+#define EBPF_ALU_OP_ADD 0x00
+#define EBPF_ALU_OP_OR 0x40
+#define EBPF_ALU_OP_AND 0x50
+#define EBPF_ALU_OP_XOR 0xa0
+
+/* With FETCH, the source register receives the old value */
+#define EBPF_ATOMIC_OP_FETCH 0x01
+#define EBPF_ATOMIC_OP_XCHG (0xe0 | EBPF_ATOMIC_OP_FETCH)
+#define EBPF_ATOMIC_OP_CMPXCHG (0xf0 | EBPF_ATOMIC_OP_FETCH)
 
 #define EBPF_OP_ADD_IMM (EBPF_CLS_ALU | EBPF_SRC_IMM | 0x00)
 #define EBPF_OP_ADD_REG (EBPF_CLS_ALU | EBPF_SRC_REG | 0x00)
@@ -122,6 +134,8 @@ struct ebpf_inst
 #define EBPF_OP_STXB (EBPF_CLS_STX | EBPF_MODE_MEM | EBPF_SIZE_B)
 #define EBPF_OP_STXDW (EBPF_CLS_STX | EBPF_MODE_MEM | EBPF_SIZE_DW)
 #define EBPF_OP_LDDW (EBPF_CLS_LD | EBPF_MODE_IMM | EBPF_SIZE_DW)
+#define EBPF_OP_ATOMIC32_STORE (EBPF_CLS_STX | EBPF_MODE_ATOMIC | EBPF_SIZE_W)
+#define EBPF_OP_ATOMIC_STORE (EBPF_CLS_STX | EBPF_MODE_ATOMIC | EBPF_SIZE_DW)
 
 #define EBPF_MODE_JA 0x00
 #define EBPF_MODE_JEQ 0x10
@@ -16,6 +16,7 @@
 
 #include <emscripten.h>
 #include "ubpf_int.h"
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -70,9 +71,38 @@ uint64_t ebpf_trace_printk(struct ubpf_vm *vm, uint64_t call, uint64_t r1, uint6
 struct ubpf_vm *vm = NULL;
 
 typedef void (*printCallback)(const char *c);
-typedef uint64_t (*trampCallback)(struct ubpf_vm *vm, uint64_t call, uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5);
+typedef void (*callCallback)(void);
 
-int EMSCRIPTEN_KEEPALIVE ebpfvm_create_vm(printCallback printCb, trampCallback trampCb) {
+/*
+ * Helpers implemented in JavaScript are all called through one callback that
+ * takes no arguments: the call id and r1-r5 are left in call_block, which JS
+ * reads through a typed array (see ebpfvm_get_call_block()), and JS leaves the
+ * return value there too.  Passing them as arguments would turn each of the
+ * seven 64-bit values into a BigInt and back on every call.
+ */
+static struct {
+    uint64_t call;
+    uint64_t args[5];
+    uint64_t ret;
+} call_block;
+static callCallback js_call;
+
+static uint64_t ebpf_js_trampoline(struct ubpf_vm *vm, uint64_t call, uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5) {
+    call_block.call = call;
+    call_block.args[0] = r1;
+    call_block.args[1] = r2;
+    call_block.args[2] = r3;
+    call_block.args[3] = r4;
+    call_block.args[4] = r5;
+    js_call();
+    return call_block.ret;
+}
+
+void * EMSCRIPTEN_KEEPALIVE ebpfvm_get_call_block() {
+    return &call_block;
+}
+
+int EMSCRIPTEN_KEEPALIVE ebpfvm_create_vm(printCallback printCb, callCallback callCb) {
     if (vm != NULL) {
         EM_ASM({
             console.error("epbfvm_create_vm(): already created");
@@ -89,9 +119,10 @@ int EMSCRIPTEN_KEEPALIVE ebpfvm_create_vm(printCallback printCb, trampCallback t
     }
 
     vm->printCb = printCb;
+    js_call = callCb;
 
-    for (unsigned int i = 0; i < 64; i++) {
-        if (ubpf_register(vm, i, "ebpf_trampoline_cb", trampCb) < 0) {
+    for (unsigned int i = 0; i < MAX_EXT_FUNCS; i++) {
+        if (ubpf_register(vm, i, "ebpf_trampoline_cb", ebpf_js_trampoline) < 0) {
             error_printf(NULL, "ebpfvm_create_vm(): failed to register extension func %d", i);
             return -1;
         }
@@ -100,54 +131,91 @@ int EMSCRIPTEN_KEEPALIVE ebpfvm_create_vm(printCallback printCb, trampCallback t
         error_printf(NULL, "ebpfvm_create_vm(): failed to register extension func ebpf_trace_printk");
         return -1;
     }
+    if (ubpf_register_packet_helpers(vm) < 0) {
+        error_printf(NULL, "ebpfvm_create_vm(): failed to register packet helpers");
+        return -1;
+    }
+    if (ubpf_register_memory_helpers(vm) < 0) {
+        error_printf(NULL, "ebpfvm_create_vm(): failed to register memory helpers");
+        return -1;
+    }
 
     ubpf_set_pointer_secret(vm, 0);
     ubpf_set_error_print(vm, error_printf);
     return 0;
 }
 
+/*
+ * JS writes a new program here (see ebpfvm_get_instructions()) and then
+ * loads it with ebpfvm_validate_instructions(), so the loaded program is
+ * untouched until the new one has validated.  The buffer is sized for each
+ * program and freed once it is loaded.
+ */
+static struct ebpf_inst *staged_insts = NULL;
+static int max_staged_insts = 0;
+
+/* Make room to stage n instructions, returning n */
 int EMSCRIPTEN_KEEPALIVE ebpfvm_allocate_instructions(int n) {
-    int bytes = n * 8;
-    if (vm->insts != NULL) {
-        error_printf(NULL, "ebpfvm_allocate_instructions(): already allocated");
+    if (n < 0 || n > UBPF_MAX_INSTS) {
+        error_printf(NULL, "ebpfvm_allocate_instructions(): bad number of instructions %d", n);
+        return -1;
+    }
+    if (n == 0) {
+        free(staged_insts);
+        staged_insts = NULL;
+        max_staged_insts = 0;
+        return 0;
+    }
+    struct ebpf_inst *insts = realloc(staged_insts, (size_t)n * sizeof(*insts));
+    if (insts == NULL) {
+        error_printf(NULL, "ebpfvm_allocate_instructions(): out of memory");
         return -1;
     }
-    vm->insts = malloc(bytes);
-    vm->max_num_insts = n;
+    staged_insts = insts;
+    max_staged_insts = n;
     return n;
 }
 
+/*
+ * Load the n staged instructions in place of the current program, which
+ * keeps running if they don't validate.  A program being stepped through
+ * starts over with the new one.
+ */
 int EMSCRIPTEN_KEEPALIVE ebpfvm_validate_instructions(int n) {
-    if (vm->insts == NULL) {
+    if (staged_insts == NULL) {
         error_printf(NULL, "ebpfvm_validate_instructions(): no instructions");
         return -1;
     }
-    if (n > vm->max_num_insts) {
+    if (n > max_staged_insts) {
         error_printf(
             NULL,
             "ebpfvm_validate_instructions(): too many instructions (%d > %d)",
             n,
-            vm->max_num_insts);
+            max_staged_insts);
+        return -1;
     }
-    vm->num_insts = n;
 
+    uint32_t pc = vm->pc;
+    vm->pc = 0;
     char *errmsg = NULL;
-    if (!validate(vm, vm->insts, vm->num_insts, &errmsg)) {
+    int rc = ubpf_swap_code(vm, staged_insts, n * 8, &errmsg);
+    if (rc < 0) {
         error_printf(NULL, "ebpfvm_validate_instructions(): %s", errmsg);
         free(errmsg);
-        return -1;
+        vm->pc = pc;
     }
-    return 0;
+    ebpfvm_allocate_instructions(0);
+    return rc;
 }
 
 void * EMSCRIPTEN_KEEPALIVE ebpfvm_get_instructions() {
     if (vm == NULL) {
         return NULL;
     }
-    return vm->insts;
+    return staged_insts;
 }
 
-uint16_t EMSCRIPTEN_KEEPALIVE ebpfvm_get_instructions_count() {
+uint32_t EMSCRIPTEN_KEEPALIVE ebpfvm_get_instructions_count() {
     if (vm == NULL) {
         return 0;
     }
@@ -179,10 +247,10 @@ int EMSCRIPTEN_KEEPALIVE ebpfvm_get_stack_len() {
     if (vm == NULL) {
         return 0;
     }
-    return UBPF_STACK_SIZE;
+    return vm->stack_size;
 }
 
-uint16_t * EMSCRIPTEN_KEEPALIVE ebpfvm_get_programcounter_address() {
+uint32_t * EMSCRIPTEN_KEEPALIVE ebpfvm_get_programcounter_address() {
     if (vm == NULL) {
         return NULL;
     }
@@ -210,6 +278,41 @@ uint64_t * EMSCRIPTEN_KEEPALIVE ebpfvm_get_hot_address_size() {
     return &(vm->hot_address_size);
 }
 
+static uint8_t *wasm_code = NULL;
+
+/*
+ * Translate the loaded program to a WebAssembly module and return its size,
+ * or -1 if it can't be (the caller keeps interpreting).  The module stays at
+ * ebpfvm_get_wasm_code() until the next call.
+ */
+int EMSCRIPTEN_KEEPALIVE ebpfvm_compile_wasm() {
+    if (vm == NULL || vm->num_insts == 0) {
+        return -1;
+    }
+
+    size_t size = 1024 + (size_t)vm->num_insts * 64;
+    uint8_t *code = realloc(wasm_code, size);
+    if (code == NULL) {
+        error_printf(NULL, "ebpfvm_compile_wasm(): out of memory");
+        return -1;
+    }
+    wasm_code = code;
+
+    char *errmsg = NULL;
+    if (ubpf_translate_wasm(vm, wasm_code, &size, &errmsg) < 0) {
+        EM_ASM({
+            console.log("ebpfvm_compile_wasm(): interpreting: ", UTF8ToString($0));
+        }, errmsg);
+        free(errmsg);
+        return -1;
+    }
+    return size;
+}
+
+void * EMSCRIPTEN_KEEPALIVE ebpfvm_get_wasm_code() {
+    return wasm_code;
+}
+
 int EMSCRIPTEN_KEEPALIVE ebpfvm_exec_step() {
     if (vm == NULL) {
         error_printf(NULL, "ebpfvm_exec_step(): VM not initialized");
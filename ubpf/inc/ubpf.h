@@ -36,12 +36,68 @@ extern "C" {
 #endif
 
 /**
- * @brief Default stack size for the VM.
+ * @brief Default stack size for the VM.  ubpf_load() shrinks the stack (and
+ * the JIT's frame) to what the program was found to use.
  */
 #if !defined(UBPF_STACK_SIZE)
 #define UBPF_STACK_SIZE 512
 #endif
 
+/**
+ * @brief Most iterations the verifier allows any one loop, see
+ * ubpf_toggle_loop_check().
+ */
+#if !defined(UBPF_MAX_LOOP_ITERATIONS)
+#define UBPF_MAX_LOOP_ITERATIONS 65536
+#endif
+
+/**
+ * @brief Most instructions the verifier will follow, over all paths, before
+ * giving up on a program as too complex.
+ */
+#if !defined(UBPF_MAX_VERIFIED_INSNS)
+#define UBPF_MAX_VERIFIED_INSNS 1000000
+#endif
+
+/**
+ * @brief Default number of interpreted runs after which ubpf_exec_tiered()
+ * hands a program to the JIT. Zero disables this trigger.
+ */
+#if !defined(UBPF_JIT_INVOCATION_THRESHOLD)
+#define UBPF_JIT_INVOCATION_THRESHOLD 1000
+#endif
+
+/**
+ * @brief Default number of interpreted instructions after which
+ * ubpf_exec_tiered() hands a program to the JIT. Zero disables this trigger.
+ */
+#if !defined(UBPF_JIT_INSTRUCTION_THRESHOLD)
+#define UBPF_JIT_INSTRUCTION_THRESHOLD 1000000
+#endif
+
+/**
+ * @brief Default number of instructions a ubpf_sched job runs before it is
+ * put back in the queue.
+ */
+#if !defined(UBPF_SCHED_DEFAULT_BUDGET)
+#define UBPF_SCHED_DEFAULT_BUDGET 10000
+#endif
+
+/**
+ * @brief Number of value slots in a per-CPU map, and so the most threads
+ * ubpf_exec_batch() and ubpf_sched_create() will use.
+ */
+#if !defined(UBPF_MAX_CPUS)
+#define UBPF_MAX_CPUS 64
+#endif
+
+/**
+ * @brief Most tail calls one run may chain before tail_call starts failing.
+ */
+#if !defined(UBPF_MAX_TAIL_CALLS)
+#define UBPF_MAX_TAIL_CALLS 33
+#endif
+
 /**
  * @brief Opaque type for a the uBPF VM.
  */
@@ -78,6 +134,71 @@ ubpf_destroy(struct ubpf_vm* vm);
 bool
 ubpf_toggle_bounds_check(struct ubpf_vm* vm, bool enable);
 
+/**
+ * @brief Enable / disable loop checking. Programs may jump backwards, and by
+ * default ubpf_load() only accepts them if every loop is counted: a counter
+ * set to a constant before the loop, changed by a constant once per
+ * iteration and compared against a constant, for at most
+ * UBPF_MAX_LOOP_ITERATIONS iterations. Disable it for programs that are
+ * stopped some other way, such as by ubpf_exec_budget().
+ *
+ * @param[in] vm The VM to enable / disable loop checking on.
+ * @param[in] enable Enable loop checking if true, disable if false.
+ * @retval true Loop checking was previously enabled.
+ */
+bool
+ubpf_toggle_loop_check(struct ubpf_vm* vm, bool enable);
+
+/**
+ * @brief Enable / disable the verifier. By default ubpf_load() follows every
+ * path through a program, tracking what each register holds, and rejects
+ * programs that read uninitialized registers, access the stack or map values
+ * out of bounds, use a map_lookup_elem result without checking it for NULL,
+ * or run off the end. Accesses it can't check statically are still checked
+ * at run time.
+ *
+ * @param[in] vm The VM to enable / disable the verifier on.
+ * @param[in] enable Enable the verifier if true, disable if false.
+ * @retval true The verifier was previously enabled.
+ */
+bool
+ubpf_toggle_verifier(struct ubpf_vm* vm, bool enable);
+
+/**
+ * @brief Enable / disable the branch profile. While it is enabled the
+ * interpreter counts how often each conditional jump is taken, and the x86-64
+ * JIT lays out the code it compiles afterwards so that the hot path falls
+ * through and blocks that never ran move to the end. Loading code clears the
+ * counts; disabling the profile discards them. Disabled by default.
+ *
+ * @param[in] vm The VM to enable / disable the branch profile on.
+ * @param[in] enable Enable the branch profile if true, disable if false.
+ * @retval true The branch profile was previously enabled.
+ */
+bool
+ubpf_toggle_branch_profile(struct ubpf_vm* vm, bool enable);
+
+/**
+ * @brief What the verifier did for the last program loaded.
+ */
+struct ubpf_verifier_stats
+{
+    uint64_t insns_processed; /* Instructions followed, over all paths */
+    uint32_t states_stored;   /* States kept at jump targets */
+    uint32_t states_pruned;   /* Paths cut short by a stored state */
+    uint32_t stack_depth;     /* Deepest stack use below r10, in bytes */
+    uint64_t time_ns;         /* Time taken */
+};
+
+/**
+ * @brief Get statistics on the verification of the last program loaded.
+ *
+ * @param[in] vm The VM the program was loaded into.
+ * @param[out] stats Filled in with the statistics.
+ */
+void
+ubpf_get_verifier_stats(const struct ubpf_vm* vm, struct ubpf_verifier_stats* stats);
+
 /**
  * @brief Set the function to be invoked if the program hits a fatal error.
  *
@@ -103,6 +224,31 @@ ubpf_set_error_print(struct ubpf_vm* vm, int (*error_printf)(FILE* stream, const
 int
 ubpf_register(struct ubpf_vm* vm, unsigned int index, const char* name, void* fn);
 
+/**
+ * @brief Flag for ubpf_describe_helper(): the helper's result depends only
+ * on the values of its arguments (not on memory they point to), and calling
+ * it has no side effects.
+ */
+#define UBPF_HELPER_PURE 0x1
+
+/**
+ * @brief Describe a registered function, so that calls to it cost less.
+ *
+ * Compiled code only moves r1 to r<num_args> into place before calling it,
+ * and ubpf_optimize() replaces calls to a UBPF_HELPER_PURE function whose
+ * arguments are all known with the value it returns for them.  Registering
+ * the function again forgets the description.
+ *
+ * @param[in] vm The VM the function is registered on.
+ * @param[in] index The index the function is registered at.
+ * @param[in] num_args How many of r1-r5 the function reads (at most 5).
+ * @param[in] flags 0 or UBPF_HELPER_PURE.
+ * @retval 0 Success.
+ * @retval -1 Failure (nothing registered at index, or invalid arguments).
+ */
+int
+ubpf_describe_helper(struct ubpf_vm* vm, unsigned int index, unsigned int num_args, unsigned int flags);
+
 /**
  * @brief Load code into a VM.
  * This must be done before calling ubpf_exec or ubpf_compile and after
@@ -121,6 +267,63 @@ ubpf_register(struct ubpf_vm* vm, unsigned int index, const char* name, void* fn
 int
 ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg);
 
+/**
+ * @brief Optimize the code loaded into a VM.
+ * Propagates and folds constants, including through stack spills, turns
+ * reloads of spilled registers into moves, and removes unreachable code,
+ * dead stores and redundant jumps. The result is validated again and
+ * replaces the loaded program; on failure the original is kept.
+ *
+ * This must be done after ubpf_load and before ubpf_compile.
+ *
+ * @param[in] vm The VM whose code to optimize.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_optimize(struct ubpf_vm* vm, char** errmsg);
+
+/**
+ * @brief A context field whose value is known, for ubpf_specialize().
+ */
+struct ubpf_ctx_field
+{
+    uint32_t offset; ///< Offset of the field in the context.
+    uint32_t size;   ///< Size of the field: 1, 2, 4 or 8 bytes.
+    uint64_t value;  ///< The field's value.
+};
+
+/**
+ * @brief Specialize the loaded program for the values it will see.
+ * Optimizes the program as ubpf_optimize() does, treating loads of the given
+ * context fields, lookups in read-only maps (see ubpf_map_set_readonly()) and
+ * loads from their values as constants, so branches on them fold away.
+ * Map values are only folded in if the verifier is enabled. If the program
+ * has been compiled, it is compiled again.
+ *
+ * When a map whose values were folded in changes, the next ubpf_exec(),
+ * ubpf_compile() or other way of running the program specializes it again
+ * first, so the code returned by an earlier ubpf_compile() must not be
+ * called after the map changes. Like ubpf_load(), this must not happen
+ * while the program runs, so don't change the maps while batches or
+ * scheduler jobs running it are outstanding. Calling ubpf_specialize() again
+ * replaces the fields, starting from the program as it was before it was
+ * specialized.
+ *
+ * @param[in] vm The VM whose code to specialize.
+ * @param[in] fields Context fields that hold the same value on every run. The
+ *  program must not change them.
+ * @param[in] num_fields The number of fields.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure; the program is left as it was, unless it was
+ *  specialized but could not be compiled again, in which case it is
+ *  interpreted.
+ */
+int
+ubpf_specialize(struct ubpf_vm* vm, const struct ubpf_ctx_field* fields, unsigned int num_fields, char** errmsg);
+
 /*
  * Unload code from a VM
  *
@@ -141,6 +344,33 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
 void
 ubpf_unload_code(struct ubpf_vm* vm);
 
+/**
+ * @brief Replace the program of a VM while other threads run it.
+ *
+ * The new program is validated (and, if the VM's program has been compiled
+ * with ubpf_compile(), compiled) before anything changes, so on failure the
+ * old program stays loaded.  On success new runs, batch and scheduler jobs
+ * and tail calls into the VM get the new program, while ones that had
+ * already started finish with the old one; this returns once they have and
+ * the old program is freed.  Specialization and tiered or ahead-of-time
+ * compiled code are dropped, as ubpf_unload_code() would.
+ *
+ * The VM's own runs (ubpf_exec() and friends on this VM) must not overlap a
+ * swap, nor may a swap be made from a helper.  Compiled code the host calls
+ * directly, through the pointer ubpf_compile() returned, isn't tracked: it
+ * must not be running this VM's program (or tail calling into it) meanwhile.
+ * ubpf_exec_xdp() and ubpf_exec_tiered() are tracked.
+ *
+ * @param[in] vm The VM to load the code into.
+ * @param[in] code The eBPF bytecodes to load.
+ * @param[in] code_len The length of the eBPF bytecodes.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure, including when a run of the VM is paused mid-way.
+ */
+int
+ubpf_swap_code(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg);
+
 #if defined(UBPF_HAS_ELF_H)
 /**
  * @brief Load code from an ELF file.
@@ -173,6 +403,7 @@ ubpf_load_elf(struct ubpf_vm* vm, const void* elf, size_t elf_len, char** errmsg
  * registered before calling this function.
  *
  * The return value of the executed program is stored in vm->return_value.
+ * If a run was paused by ubpf_exec_budget(), this finishes it.
  *
  * @param[in] vm The VM to execute the program in.
  * @retval 0 Success.
@@ -181,6 +412,23 @@ ubpf_load_elf(struct ubpf_vm* vm, const void* elf, size_t elf_len, char** errmsg
 int
 ubpf_exec(struct ubpf_vm* vm);
 
+/**
+ * @brief Execute at most budget instructions of a BPF program using the
+ * interpreter.
+ *
+ * If the budget runs out before the program exits, the run is paused and the
+ * next call to ubpf_exec_budget() or ubpf_exec() picks up where it left off.
+ * Once the program exits (or fails), the next call starts a new run.
+ *
+ * @param[in] vm The VM to execute the program in.
+ * @param[in] budget The maximum number of instructions to run, or 0 for no limit.
+ * @retval 0 Success; the return value is in vm->return_value.
+ * @retval -1 Failure.
+ * @retval 1 The budget ran out; call again to continue.
+ */
+int
+ubpf_exec_budget(struct ubpf_vm* vm, uint64_t budget);
+
 /**
  * @brief Execute one instruction of a BPF program in the VM.
  *
@@ -197,6 +445,528 @@ ubpf_exec(struct ubpf_vm* vm);
  int
  ubpf_exec_step(struct ubpf_vm* vm);
 
+/**
+ * @brief Execute a BPF program, interpreting it until it is hot and then
+ * switching to JIT-compiled code.
+ *
+ * Each interpreted run adds to the program's invocation and instruction
+ * counters. Once either crosses its threshold (see ubpf_set_jit_threshold())
+ * the program is compiled on a background thread; calls keep going through
+ * the interpreter until the compiled code is published, after which every
+ * call goes straight to it.
+ *
+ * As with ubpf_exec(), r1 and r2 are taken from the VM's registers and the
+ * return value is stored in vm->return_value. Note that compiled code does
+ * not perform runtime bounds checks.
+ *
+ * @param[in] vm The VM to execute the program in.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_exec_tiered(struct ubpf_vm* vm);
+
+/**
+ * @brief Set when ubpf_exec_tiered() promotes a program to the JIT.
+ *
+ * Must be called before code is loaded. A threshold of zero disables that
+ * trigger; with both zero the program is never compiled.
+ *
+ * @param[in] vm The VM to configure.
+ * @param[in] invocations Number of interpreted runs before compiling.
+ * @param[in] instructions Number of interpreted instructions before compiling.
+ * @retval 0 Success.
+ * @retval -1 Failure (code is already loaded).
+ */
+int
+ubpf_set_jit_threshold(struct ubpf_vm* vm, uint64_t invocations, uint64_t instructions);
+
+/**
+ * @brief Counters maintained by ubpf_exec_tiered().
+ */
+struct ubpf_tier_stats
+{
+    uint64_t invocations;  ///< Number of interpreted runs.
+    uint64_t instructions; ///< Number of interpreted instructions.
+    bool jitted;           ///< True once calls go to compiled code.
+};
+
+/**
+ * @brief Retrieve the tiered execution counters for the loaded program.
+ *
+ * @param[in] vm The VM to query.
+ * @param[out] stats The current counters.
+ */
+void
+ubpf_get_tier_stats(const struct ubpf_vm* vm, struct ubpf_tier_stats* stats);
+
+/**
+ * @brief One input for ubpf_exec_batch(): bytes copied to the start of the
+ * worker's memory before the program runs.
+ */
+struct ubpf_batch_input
+{
+    const void* data;
+    size_t len;
+};
+
+/**
+ * @brief The outcome of running the program over one input.
+ */
+struct ubpf_batch_result
+{
+    uint64_t return_value; ///< r0 at exit, if rc is 0.
+    int rc;                ///< 0 on success, -1 on failure (as ubpf_exec()).
+};
+
+/**
+ * @brief Called for each input after it is copied in, to fix up pointers in
+ * the input or set up registers beyond the defaults (r1 = mem, r2 = input
+ * length, r10 = top of stack).
+ *
+ * @param[in] mem The worker's memory, holding the input.
+ * @param[in] mem_len The size of mem.
+ * @param[in,out] regs The worker's registers.
+ * @param[in] index The index of the input.
+ * @param[in] arg The apply_arg passed to ubpf_exec_batch().
+ */
+typedef void (*ubpf_batch_apply)(void* mem, size_t mem_len, uint64_t* regs, size_t index, void* arg);
+
+/**
+ * @brief Run the loaded program once per input, spread over a pool of threads.
+ *
+ * Each worker thread has its own registers, stack and memory; the program,
+ * helpers and compiled code are shared. If the program has been compiled
+ * with ubpf_compile() the compiled code is used, otherwise it is interpreted.
+ * Helpers may be called from several threads at once. Memory past the end of
+ * an input holds whatever earlier inputs on the same worker left there.
+ *
+ * @param[in] vm The VM holding the program.
+ * @param[in] inputs The inputs to run the program over.
+ * @param[out] results One result per input, in the same order.
+ * @param[in] count The number of inputs.
+ * @param[in] num_threads The number of threads to use, or 0 for one per CPU.
+ * @param[in] apply Optional per-input setup hook, or NULL.
+ * @param[in] apply_arg Passed to apply.
+ * @retval 0 Every input was run; see results for each one.
+ * @retval -1 Failure (no program loaded, or out of memory).
+ */
+int
+ubpf_exec_batch(
+    struct ubpf_vm* vm,
+    const struct ubpf_batch_input* inputs,
+    struct ubpf_batch_result* results,
+    size_t count,
+    unsigned int num_threads,
+    ubpf_batch_apply apply,
+    void* apply_arg);
+
+/**
+ * @brief Opaque type for a pool of threads running ubpf_sched_submit() jobs.
+ */
+struct ubpf_sched;
+
+/**
+ * @brief Called from a worker thread when a job finishes.
+ *
+ * @param[in] rc 0 on success, -1 on failure (as ubpf_exec()).
+ * @param[in] return_value r0 at exit, if rc is 0.
+ * @param[in] arg The arg passed to ubpf_sched_submit().
+ */
+typedef void (*ubpf_sched_done)(int rc, uint64_t return_value, void* arg);
+
+/**
+ * @brief Start a scheduler for many concurrent jobs.
+ *
+ * Jobs are interpreted budget instructions at a time, so one long-running
+ * program can't hold up the short ones queued behind it. Each thread has its
+ * own queue of jobs and steals from the others when it runs dry.
+ *
+ * @param[in] num_threads The number of worker threads, or 0 for one per CPU.
+ * @param[in] budget Instructions per time slice, or 0 for UBPF_SCHED_DEFAULT_BUDGET.
+ * @return The scheduler, or NULL on failure.
+ */
+struct ubpf_sched*
+ubpf_sched_create(unsigned int num_threads, uint64_t budget);
+
+/**
+ * @brief Queue a run of the program loaded in vm over ctx.
+ *
+ * The job gets its own registers and stack; r1 and r2 are ctx and ctx_len,
+ * and ctx is the only memory the program may access besides its stack.
+ * Many jobs may share one VM. The VM and ctx must stay valid, and the VM's
+ * code must not be reloaded other than by ubpf_swap_code(), until the job's
+ * done callback has run.
+ *
+ * @param[in] sched The scheduler.
+ * @param[in] vm The VM holding the program.
+ * @param[in] ctx The context the program runs over.
+ * @param[in] ctx_len The size of ctx.
+ * @param[in] done Called when the job finishes.
+ * @param[in] arg Passed to done.
+ * @retval 0 Success.
+ * @retval -1 Failure (no program loaded, or out of memory).
+ */
+int
+ubpf_sched_submit(
+    struct ubpf_sched* sched, struct ubpf_vm* vm, void* ctx, size_t ctx_len, ubpf_sched_done done, void* arg);
+
+/**
+ * @brief Wait for every submitted job to finish.
+ *
+ * @param[in] sched The scheduler.
+ */
+void
+ubpf_sched_wait(struct ubpf_sched* sched);
+
+/**
+ * @brief Wait for every submitted job to finish, then stop the threads and
+ * free the scheduler.
+ *
+ * @param[in] sched The scheduler.
+ */
+void
+ubpf_sched_destroy(struct ubpf_sched* sched);
+
+/**
+ * @brief Map types, numbered as in Linux.
+ */
+enum ubpf_map_type
+{
+    UBPF_MAP_TYPE_HASH = 1,
+    UBPF_MAP_TYPE_ARRAY = 2,
+    UBPF_MAP_TYPE_PROG_ARRAY = 3, ///< Programs to tail call; values are struct ubpf_vm pointers.
+    UBPF_MAP_TYPE_PERCPU_HASH = 5,
+    UBPF_MAP_TYPE_PERCPU_ARRAY = 6,
+};
+
+/**
+ * @brief Flags for ubpf_map_update_elem() (and the map_update_elem helper).
+ */
+#define UBPF_ANY 0     ///< Create the element or update it.
+#define UBPF_NOEXIST 1 ///< Only create a new element.
+#define UBPF_EXIST 2   ///< Only update an existing element.
+
+/**
+ * @brief Opaque type for a map.
+ */
+struct ubpf_map;
+
+/**
+ * @brief Create a map.
+ *
+ * Every element is allocated up front. Per-CPU maps hold UBPF_MAX_CPUS copies
+ * of each value, one per executor thread, and each thread's copies are kept
+ * on cache lines of their own so counters updated from many threads don't
+ * contend. Array keys are 4-byte indexes; per-CPU values must be a multiple
+ * of 8 bytes.
+ *
+ * A program array's values are VMs (value_size is sizeof(struct ubpf_vm*)),
+ * which the host sets and clears with ubpf_map_update_elem() and
+ * ubpf_map_delete_elem(), even while programs are tail calling through it.
+ * A VM must be taken out of every program array before it is unloaded or
+ * destroyed. Programs can't look up or change a program array themselves.
+ *
+ * @param[in] type The type of map.
+ * @param[in] key_size The size of a key in bytes.
+ * @param[in] value_size The size of a value in bytes.
+ * @param[in] max_entries The number of elements.
+ * @return The map, or NULL on failure.
+ */
+struct ubpf_map*
+ubpf_map_create(enum ubpf_map_type type, uint32_t key_size, uint32_t value_size, uint32_t max_entries);
+
+/**
+ * @brief Free a map. It must not be registered with a VM that still runs.
+ *
+ * @param[in] map The map to free.
+ */
+void
+ubpf_map_destroy(struct ubpf_map* map);
+
+/**
+ * @brief Make a map available to programs.
+ *
+ * Programs pass id as the first argument of the map helpers, which this
+ * registers as external functions 1 (map_lookup_elem), 2 (map_update_elem)
+ * and 3 (map_delete_elem). The interpreter's bounds checks allow access to
+ * the map's values, and apply to the keys and values programs pass the
+ * helpers: a lookup with a key the program can't read finds nothing, and an
+ * update or delete fails with -EFAULT. One map may be registered with
+ * several VMs.
+ *
+ * Registering a program array also registers external function 12,
+ * `long tail_call(void* ctx, u64 id, u32 index)`. If slot index of program
+ * array id holds a VM, the program stops and that VM's program runs in its
+ * place, with the same context and stack, and its result is the run's
+ * result. Otherwise, or after UBPF_MAX_TAIL_CALLS tail calls in one run,
+ * tail_call returns -1 and the program carries on. The interpreter and the
+ * x86-64 JIT make tail calls; JIT'd code only tail calls VMs that have been
+ * compiled with ubpf_compile(), and other engines always get -1.
+ *
+ * @param[in] vm The VM to register the map with.
+ * @param[in] id The map's id, below 64.
+ * @param[in] map The map.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_register_map(struct ubpf_vm* vm, unsigned int id, struct ubpf_map* map);
+
+/**
+ * @brief Look up an element. For per-CPU maps this is the calling thread's
+ * copy of the value.
+ *
+ * @param[in] map The map.
+ * @param[in] key The key.
+ * @return The value, or NULL if there is no such element.
+ */
+void*
+ubpf_map_lookup_elem(struct ubpf_map* map, const void* key);
+
+/**
+ * @brief Create or update an element. For per-CPU maps only the calling
+ * thread's copy of the value is written; a new element's other copies are
+ * zeroed.
+ *
+ * @param[in] map The map.
+ * @param[in] key The key.
+ * @param[in] value The value.
+ * @param[in] flags UBPF_ANY, UBPF_NOEXIST or UBPF_EXIST.
+ * @retval 0 Success.
+ * @retval -1 Failure (bad key, the flags don't allow it, or the map is full).
+ */
+int
+ubpf_map_update_elem(struct ubpf_map* map, const void* key, const void* value, uint64_t flags);
+
+/**
+ * @brief Delete an element from a hash map, or empty a program array slot.
+ *
+ * @param[in] map The map.
+ * @param[in] key The key.
+ * @retval 0 Success.
+ * @retval -1 Failure (no such element, or another kind of array map).
+ */
+int
+ubpf_map_delete_elem(struct ubpf_map* map, const void* key);
+
+/**
+ * @brief Read an element from the host. For per-CPU maps the value is the
+ * sum of every thread's copy, taken 64 bits at a time.
+ *
+ * @param[in] map The map.
+ * @param[in] key The key.
+ * @param[out] value Receives value_size bytes.
+ * @retval 0 Success.
+ * @retval -1 No such element.
+ */
+int
+ubpf_map_read(struct ubpf_map* map, const void* key, void* value);
+
+/**
+ * @brief Read every thread's copy of a per-CPU map element.
+ *
+ * @param[in] map The map.
+ * @param[in] key The key.
+ * @param[out] values Receives UBPF_MAX_CPUS values of value_size bytes each.
+ * @retval 0 Success.
+ * @retval -1 No such element, or not a per-CPU map.
+ */
+int
+ubpf_map_read_percpu(struct ubpf_map* map, const void* key, void* values);
+
+/**
+ * @brief Make a map read-only to programs, or writable again. The
+ * map_update_elem and map_delete_elem helpers fail on read-only maps, and the
+ * verifier rejects programs that store to their values. The host can still
+ * change them with ubpf_map_update_elem() and ubpf_map_delete_elem(), which
+ * makes programs specialized on them (see ubpf_specialize()) specialize
+ * again.
+ *
+ * @param[in] map The map.
+ * @param[in] readonly Whether programs may only read the map.
+ */
+void
+ubpf_map_set_readonly(struct ubpf_map* map, bool readonly);
+
+/**
+ * @brief XDP verdicts, numbered as in Linux.
+ */
+enum ubpf_xdp_action
+{
+    UBPF_XDP_ABORTED = 0,
+    UBPF_XDP_DROP = 1,
+    UBPF_XDP_PASS = 2,
+    UBPF_XDP_TX = 3,
+    UBPF_XDP_REDIRECT = 4,
+    UBPF_XDP_ACTIONS ///< The number of verdicts.
+};
+
+/**
+ * @brief The context of a program run in packet mode. Like Linux's struct
+ * xdp_md, except that the packet pointers are real 64-bit pointers (load
+ * them with ldxdw) instead of 32-bit fields the kernel rewrites.
+ */
+struct ubpf_xdp_md
+{
+    uint64_t data;     ///< The first byte of the packet.
+    uint64_t data_end; ///< One past the last byte of the packet.
+    uint64_t data_meta; ///< Start of metadata before data; equal to data if there is none.
+    uint32_t ingress_ifindex;
+    uint32_t rx_queue_index;
+    uint64_t data_hard_start; ///< Start of the buffer holding the packet, for xdp_adjust_head(); 0 if there's no headroom.
+    uint64_t data_hard_end;   ///< End of that buffer, for xdp_adjust_tail(); 0 if there's no tailroom.
+};
+
+/**
+ * @brief What ubpf_xdp_run_pcap() saw.
+ */
+struct ubpf_xdp_stats
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t actions[UBPF_XDP_ACTIONS]; ///< Packets per verdict; failed runs and unknown verdicts count as aborted.
+    uint64_t errors;                    ///< Runs that failed (as ubpf_exec()).
+    uint64_t elapsed_ns;
+    double packets_per_second;
+};
+
+/**
+ * @brief Run the loaded program over one packet, with ctx as its context.
+ *
+ * r1 points at ctx and the packet is used in place; the interpreter's bounds
+ * checks allow the program to read and write from data_meta to data_end, as
+ * well as ctx itself. JIT-compiled code is used if there is any.
+ *
+ * @param[in] vm The VM holding the program.
+ * @param[in] ctx The context, pointing at the packet.
+ * @param[out] action The program's return value, normally an enum ubpf_xdp_action.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_exec_xdp(struct ubpf_vm* vm, struct ubpf_xdp_md* ctx, uint64_t* action);
+
+/**
+ * @brief Run the loaded program over every packet of a pcap or pcapng file.
+ *
+ * The file is mapped into memory and each packet is passed to
+ * ubpf_exec_xdp() where it lies, without copying; changes the program makes
+ * to packets are not written back. For pcapng, ingress_ifindex is the
+ * packet's interface id.
+ *
+ * @param[in] vm The VM holding the program.
+ * @param[in] path The capture file.
+ * @param[out] stats Packet and verdict counts, and how long the run took.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure (the file can't be read or is malformed); stats cover
+ * the packets before the problem.
+ */
+int
+ubpf_xdp_run_pcap(struct ubpf_vm* vm, const char* path, struct ubpf_xdp_stats* stats, char** errmsg);
+
+/**
+ * @brief Register the native packet helpers, at their Linux helper ids:
+ * l3_csum_replace (10), l4_csum_replace (11), skb_load_bytes (26),
+ * csum_diff (28), xdp_adjust_head (44) and xdp_adjust_tail (65).
+ *
+ * They expect the struct ubpf_xdp_md of ubpf_exec_xdp() as their context
+ * argument, with offsets relative to data. xdp_adjust_head() and
+ * xdp_adjust_tail() can grow the packet as far as data_hard_start and
+ * data_hard_end, and shrink it down to an Ethernet header.
+ *
+ * @param[in] vm The VM to register the helpers in.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_register_packet_helpers(struct ubpf_vm* vm);
+
+/**
+ * @brief Helper ids of uBPF's own bulk memory helpers, which Linux doesn't
+ * have. They are at the top of the helper table, clear of the Linux helpers
+ * uBPF implements.
+ */
+#define UBPF_HELPER_MEMCPY 125 ///< long memcpy(void* dst, const void* src, u32 n); the buffers may overlap.
+#define UBPF_HELPER_MEMSET 126 ///< long memset(void* dst, int c, u32 n).
+#define UBPF_HELPER_MEMCMP 127 ///< long memcmp(const void* a, const void* b, u32 n); returns -1, 0 or 1.
+
+/**
+ * @brief Register the bulk memory helpers: probe_read (4), probe_read_str
+ * (45), memcpy, memset and memcmp.
+ *
+ * When the interpreter runs with bounds checks, each buffer is checked
+ * against the program's memory, stack, packet and map values before the
+ * copy, and a buffer outside them fails the call with -EFAULT. memcpy,
+ * memset and memcmp otherwise return 0, and memcmp returns the sign of the
+ * comparison.
+ *
+ * @param[in] vm The VM to register the helpers in.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_register_memory_helpers(struct ubpf_vm* vm);
+
+/**
+ * @brief A classic BPF instruction, laid out like Linux's struct sock_filter.
+ */
+struct ubpf_cbpf_insn
+{
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+/**
+ * @brief Parse a classic BPF program in the format printed by `tcpdump -ddd`:
+ * the instruction count, then one "code jt jf k" line per instruction.
+ *
+ * @param[in] text The program text.
+ * @param[out] insns The instructions. This should be freed by the caller.
+ * @param[out] count The number of instructions.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_parse_cbpf(const char* text, struct ubpf_cbpf_insn** insns, size_t* count, char** errmsg);
+
+/**
+ * @brief Translate a classic BPF filter to eBPF that runs in packet mode.
+ *
+ * The result expects a struct ubpf_xdp_md in r1, as ubpf_exec_xdp() passes.
+ * Packet loads are bounds-checked against data_end; a filter that accepts
+ * (returns non-zero) returns UBPF_XDP_PASS, and one that rejects, or loads
+ * past the end of the packet, returns UBPF_XDP_DROP. Ancillary loads (Linux's
+ * SKF_AD_* offsets) aren't supported.
+ *
+ * @param[in] insns The classic BPF instructions.
+ * @param[in] count The number of instructions.
+ * @param[out] code The eBPF bytecode, ready for ubpf_load(). This should be freed by the caller.
+ * @param[out] code_len The length of the bytecode in bytes.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 The filter is invalid or uses something unsupported.
+ */
+int
+ubpf_translate_cbpf(const struct ubpf_cbpf_insn* insns, size_t count, void** code, size_t* code_len, char** errmsg);
+
+/**
+ * @brief Translate a classic BPF filter with ubpf_translate_cbpf() and load it.
+ *
+ * @param[in] vm The VM to load the filter into.
+ * @param[in] insns The classic BPF instructions.
+ * @param[in] count The number of instructions.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_load_cbpf(struct ubpf_vm* vm, const struct ubpf_cbpf_insn* insns, size_t count, char** errmsg);
+
 /**
  * @brief Compile a BPF program in the VM to native code.
  *
@@ -210,6 +980,79 @@ ubpf_exec(struct ubpf_vm* vm);
 ubpf_jit_fn
 ubpf_compile(struct ubpf_vm* vm, char** errmsg);
 
+/**
+ * @brief Flags for ubpf_set_jit_profiling().
+ */
+#define UBPF_JIT_PERF_MAP 0x1       ///< Append a symbol per program to /tmp/perf-<pid>.map.
+#define UBPF_JIT_PERF_MAP_INSTS 0x2 ///< Append a symbol per eBPF instruction instead.
+#define UBPF_JIT_JITDUMP 0x4        ///< Write code and eBPF pc line info to /tmp/jit-<pid>.dump.
+
+/**
+ * @brief Describe JIT-compiled code to perf.
+ *
+ * Every program compiled afterwards, by ubpf_compile() or by the tiered
+ * compiler, is announced to perf. The perf map is enough for perf report to
+ * name programs (or individual eBPF instructions); the jitdump file, used with
+ * "perf record -k mono" and "perf inject --jit", also gives perf annotate the
+ * machine code with each instruction attributed to its eBPF pc.
+ *
+ * @param[in] vm The VM to configure.
+ * @param[in] flags A combination of UBPF_JIT_PERF_MAP, UBPF_JIT_PERF_MAP_INSTS
+ * and UBPF_JIT_JITDUMP, or 0 to stop.
+ * @param[in] name The program name used in symbols, or NULL for "anon".
+ * @retval 0 Success.
+ * @retval -1 Failure (out of memory).
+ */
+int
+ubpf_set_jit_profiling(struct ubpf_vm* vm, unsigned int flags, const char* name);
+
+/**
+ * @brief Translate the loaded program to C for ahead-of-time compilation.
+ *
+ * The C follows the interpreter's semantics instruction by instruction. Like
+ * JIT'd code it does no bounds checking, and it calls helpers through a table
+ * filled in by ubpf_aot_load().
+ *
+ * @param[in] vm The VM whose program should be translated.
+ * @param[in] out Where to write the C source.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_translate_c(struct ubpf_vm* vm, FILE* out, char** errmsg);
+
+/**
+ * @brief Compile the loaded program ahead of time into a shared object.
+ *
+ * Translates with ubpf_translate_c() and builds the result with $CC (default
+ * "cc") at -O2. All external functions the program calls must be registered.
+ *
+ * @param[in] vm The VM whose program should be compiled.
+ * @param[in] so_path Where to write the shared object.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_aot_compile(struct ubpf_vm* vm, const char* so_path, char** errmsg);
+
+/**
+ * @brief Load a shared object built by ubpf_aot_compile().
+ *
+ * The object's helper calls are bound to the external functions registered
+ * in this VM. The object is closed when code is unloaded from the VM, and
+ * since the dynamic loader shares one copy of an object per path, a path
+ * should only be loaded into one VM at a time.
+ *
+ * @param[in] vm The VM to bind helpers from.
+ * @param[in] so_path The shared object to load.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @return The compiled program, or NULL on failure.
+ */
+ubpf_jit_fn
+ubpf_aot_load(struct ubpf_vm* vm, const char* so_path, char** errmsg);
+
 /*
  * Translate the eBPF byte code to x64 machine code, store in buffer, and
  * write the resulting count of bytes to size.
@@ -236,6 +1079,24 @@ ubpf_compile(struct ubpf_vm* vm, char** errmsg);
 int
 ubpf_translate(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
 
+/**
+ * @brief Translate the eBPF byte code to a WebAssembly module.
+ *
+ * The module imports the VM's memory and function table as env.memory and
+ * env.table and exports run(r1, r2, r10), which returns r0. It is only
+ * useful when the VM itself is running in WebAssembly. Programs with
+ * backward jumps are rejected, so callers should be ready to interpret.
+ *
+ * @param[in] vm The VM to translate the program in.
+ * @param[out] buffer The buffer to store the module in.
+ * @param[in,out] size The size of the buffer; set to the size of the module.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_translate_wasm(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
+
 /**
  * @brief Instruct the uBPF runtime to apply unwind-on-success semantics to a helper function.
  * If the function returns 0, the uBPF runtime will end execution of
@@ -0,0 +1,503 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Ahead-of-time compilation: translate the program to C, one statement per
+ * eBPF instruction with the expressions used by ubpf_exec_step(), and let the
+ * system compiler build it into a shared object.  Registers become locals, so
+ * the compiler is free to allocate, schedule and fold across instructions,
+ * which the one-pass JIT can not.
+ *
+ * Helpers are reached through a table in the shared object that
+ * ubpf_aot_load() fills from the VM, so the object does not bake in any
+ * addresses and can be built once and loaded by many processes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "ubpf_int.h"
+
+#define _countof(array) (sizeof(array) / sizeof(array[0]))
+
+#define AOT_ENTRY "ubpf_aot_entry"
+#define AOT_HELPERS "ubpf_aot_helpers"
+#define AOT_HELPER_COUNT "ubpf_aot_helper_count"
+#define AOT_VM "ubpf_aot_vm"
+
+static const char aot_prelude[] =
+    "#include <stdint.h>\n"
+    "#include <stddef.h>\n"
+    "#include <string.h>\n"
+    "#include <endian.h>\n"
+    "\n"
+    "typedef uint64_t (*ubpf_aot_helper)(void*, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);\n"
+    "ubpf_aot_helper " AOT_HELPERS "[%d];\n"
+    "const unsigned int " AOT_HELPER_COUNT " = %d;\n"
+    "void* " AOT_VM ";\n"
+    "\n"
+    "static inline uint32_t u32(uint64_t x) { return x; }\n"
+    "static inline int32_t i32(uint64_t x) { return x; }\n"
+    "#define LOAD(type, addr) ({ type v_; memcpy(&v_, (void*)(uintptr_t)(addr), sizeof(v_)); (uint64_t)v_; })\n"
+    "#define STORE(type, addr, val) do { type v_ = (val); memcpy((void*)(uintptr_t)(addr), &v_, sizeof(v_)); } while (0)\n"
+    "\n"
+    "uint64_t " AOT_ENTRY "(void* mem, size_t mem_len)\n"
+    "{\n"
+    "    uint64_t stack[(%d + 7) / 8];\n"
+    "    uint64_t r0 = 0, r1 = (uintptr_t)mem, r2 = mem_len, r3 = 0, r4 = 0, r5 = 0;\n"
+    "    uint64_t r6 = 0, r7 = 0, r8 = 0, r9 = 0, r10 = (uintptr_t)(stack + (%d + 7) / 8);\n"
+    "\n";
+
+/*
+ * Templates for instructions that only touch registers, with $d, $s and $i
+ * standing for dst, src and imm.  Each is the interpreter's expression;
+ * shift counts are masked the way the hardware masks them, so the C is well
+ * defined and computes what the interpreter computes.
+ */
+struct aot_template
+{
+    uint8_t opcode;
+    const char* code;
+};
+
+static const struct aot_template alu_templates[] = {
+    {EBPF_OP_ADD_IMM, "$d += $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_ADD_REG, "$d += $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_SUB_IMM, "$d -= $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_SUB_REG, "$d -= $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_MUL_IMM, "$d *= $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_MUL_REG, "$d *= $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_DIV_IMM, "$d = u32($i) ? u32($d) / u32($i) : 0; $d &= UINT32_MAX;"},
+    {EBPF_OP_DIV_REG, "$d = u32($s) ? u32($d) / u32($s) : 0; $d &= UINT32_MAX;"},
+    {EBPF_OP_OR_IMM, "$d |= $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_OR_REG, "$d |= $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_AND_IMM, "$d &= $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_AND_REG, "$d &= $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_LSH_IMM, "$d <<= ($i & 31); $d &= UINT32_MAX;"},
+    {EBPF_OP_LSH_REG, "$d <<= ($s & 31); $d &= UINT32_MAX;"},
+    {EBPF_OP_RSH_IMM, "$d = u32($d) >> ($i & 31); $d &= UINT32_MAX;"},
+    {EBPF_OP_RSH_REG, "$d = u32($d) >> ($s & 31); $d &= UINT32_MAX;"},
+    {EBPF_OP_NEG, "$d = -$d; $d &= UINT32_MAX;"},
+    {EBPF_OP_MOD_IMM, "$d = u32($i) ? u32($d) % u32($i) : u32($d); $d &= UINT32_MAX;"},
+    {EBPF_OP_MOD_REG, "$d = u32($s) ? u32($d) % u32($s) : u32($d);"},
+    {EBPF_OP_XOR_IMM, "$d ^= $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_XOR_REG, "$d ^= $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_MOV_IMM, "$d = $i; $d &= UINT32_MAX;"},
+    {EBPF_OP_MOV_REG, "$d = $s; $d &= UINT32_MAX;"},
+    {EBPF_OP_ARSH_IMM, "$d = (int32_t)$d >> ($i & 31); $d &= UINT32_MAX;"},
+    {EBPF_OP_ARSH_REG, "$d = (int32_t)$d >> (u32($s) & 31); $d &= UINT32_MAX;"},
+
+    {EBPF_OP_ADD64_IMM, "$d += $i;"},
+    {EBPF_OP_ADD64_REG, "$d += $s;"},
+    {EBPF_OP_SUB64_IMM, "$d -= $i;"},
+    {EBPF_OP_SUB64_REG, "$d -= $s;"},
+    {EBPF_OP_MUL64_IMM, "$d *= $i;"},
+    {EBPF_OP_MUL64_REG, "$d *= $s;"},
+    {EBPF_OP_DIV64_IMM, "$d = $i ? $d / $i : 0;"},
+    {EBPF_OP_DIV64_REG, "$d = $s ? $d / $s : 0;"},
+    {EBPF_OP_OR64_IMM, "$d |= $i;"},
+    {EBPF_OP_OR64_REG, "$d |= $s;"},
+    {EBPF_OP_AND64_IMM, "$d &= $i;"},
+    {EBPF_OP_AND64_REG, "$d &= $s;"},
+    {EBPF_OP_LSH64_IMM, "$d <<= ($i & 63);"},
+    {EBPF_OP_LSH64_REG, "$d <<= ($s & 63);"},
+    {EBPF_OP_RSH64_IMM, "$d >>= ($i & 63);"},
+    {EBPF_OP_RSH64_REG, "$d >>= ($s & 63);"},
+    {EBPF_OP_NEG64, "$d = -$d;"},
+    {EBPF_OP_MOD64_IMM, "$d = $i ? $d % $i : $d;"},
+    {EBPF_OP_MOD64_REG, "$d = $s ? $d % $s : $d;"},
+    {EBPF_OP_XOR64_IMM, "$d ^= $i;"},
+    {EBPF_OP_XOR64_REG, "$d ^= $s;"},
+    {EBPF_OP_MOV64_IMM, "$d = $i;"},
+    {EBPF_OP_MOV64_REG, "$d = $s;"},
+    {EBPF_OP_ARSH64_IMM, "$d = (int64_t)$d >> ($i & 63);"},
+    {EBPF_OP_ARSH64_REG, "$d = (int64_t)$d >> ($s & 63);"},
+};
+
+/* Branch conditions; the jump itself is added by the translator */
+static const struct aot_template jump_templates[] = {
+    {EBPF_OP_JA, "1"},
+    {EBPF_OP_JEQ_IMM, "$d == $i"},
+    {EBPF_OP_JEQ_REG, "$d == $s"},
+    {EBPF_OP_JEQ32_IMM, "u32($d) == u32($i)"},
+    {EBPF_OP_JEQ32_REG, "u32($d) == u32($s)"},
+    {EBPF_OP_JGT_IMM, "$d > $i"},
+    {EBPF_OP_JGT_REG, "$d > $s"},
+    {EBPF_OP_JGT32_IMM, "u32($d) > u32($i)"},
+    {EBPF_OP_JGT32_REG, "u32($d) > u32($s)"},
+    {EBPF_OP_JGE_IMM, "$d >= $i"},
+    {EBPF_OP_JGE_REG, "$d >= $s"},
+    {EBPF_OP_JGE32_IMM, "u32($d) >= u32($i)"},
+    {EBPF_OP_JGE32_REG, "u32($d) >= u32($s)"},
+    {EBPF_OP_JLT_IMM, "$d < $i"},
+    {EBPF_OP_JLT_REG, "$d < $s"},
+    {EBPF_OP_JLT32_IMM, "u32($d) < u32($i)"},
+    {EBPF_OP_JLT32_REG, "u32($d) < u32($s)"},
+    {EBPF_OP_JLE_IMM, "$d <= $i"},
+    {EBPF_OP_JLE_REG, "$d <= $s"},
+    {EBPF_OP_JLE32_IMM, "u32($d) <= u32($i)"},
+    {EBPF_OP_JLE32_REG, "u32($d) <= u32($s)"},
+    {EBPF_OP_JSET_IMM, "$d & $i"},
+    {EBPF_OP_JSET_REG, "$d & $s"},
+    {EBPF_OP_JSET32_IMM, "u32($d) & u32($i)"},
+    {EBPF_OP_JSET32_REG, "u32($d) & u32($s)"},
+    {EBPF_OP_JNE_IMM, "$d != $i"},
+    {EBPF_OP_JNE_REG, "$d != $s"},
+    {EBPF_OP_JNE32_IMM, "u32($d) != u32($i)"},
+    {EBPF_OP_JNE32_REG, "u32($d) != u32($s)"},
+    {EBPF_OP_JSGT_IMM, "(int64_t)$d > $i"},
+    {EBPF_OP_JSGT_REG, "(int64_t)$d > (int64_t)$s"},
+    {EBPF_OP_JSGT32_IMM, "i32($d) > i32($i)"},
+    {EBPF_OP_JSGT32_REG, "i32($d) > i32($s)"},
+    {EBPF_OP_JSGE_IMM, "(int64_t)$d >= $i"},
+    {EBPF_OP_JSGE_REG, "(int64_t)$d >= (int64_t)$s"},
+    {EBPF_OP_JSGE32_IMM, "i32($d) >= i32($i)"},
+    {EBPF_OP_JSGE32_REG, "i32($d) >= i32($s)"},
+    {EBPF_OP_JSLT_IMM, "(int64_t)$d < $i"},
+    {EBPF_OP_JSLT_REG, "(int64_t)$d < (int64_t)$s"},
+    {EBPF_OP_JSLT32_IMM, "i32($d) < i32($i)"},
+    {EBPF_OP_JSLT32_REG, "i32($d) < i32($s)"},
+    {EBPF_OP_JSLE_IMM, "(int64_t)$d <= $i"},
+    {EBPF_OP_JSLE_REG, "(int64_t)$d <= (int64_t)$s"},
+    {EBPF_OP_JSLE32_IMM, "i32($d) <= i32($i)"},
+    {EBPF_OP_JSLE32_REG, "i32($d) <= i32($s)"},
+};
+
+static const char*
+find_template(const struct aot_template* templates, size_t count, uint8_t opcode)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (templates[i].opcode == opcode) {
+            return templates[i].code;
+        }
+    }
+    return NULL;
+}
+
+static void
+expand_template(FILE* out, const char* code, struct ebpf_inst inst)
+{
+    for (const char* p = code; *p; p++) {
+        if (p[0] != '$' || p[1] == '\0') {
+            fputc(*p, out);
+            continue;
+        }
+        switch (*++p) {
+        case 'd':
+            fprintf(out, "r%d", inst.dst);
+            break;
+        case 's':
+            fprintf(out, "r%d", inst.src);
+            break;
+        case 'i':
+            fprintf(out, "((int32_t)%" PRId32 ")", inst.imm);
+            break;
+        default:
+            fputc('$', out);
+            fputc(*p, out);
+            break;
+        }
+    }
+}
+
+static const char*
+mem_type(uint8_t opcode)
+{
+    switch (opcode & EBPF_SIZE_DW) {
+    case EBPF_SIZE_B:
+        return "uint8_t";
+    case EBPF_SIZE_H:
+        return "uint16_t";
+    case EBPF_SIZE_W:
+        return "uint32_t";
+    default:
+        return "uint64_t";
+    }
+}
+
+/* Atomics go through the compiler's builtins, which emit lock-prefixed code */
+static int
+translate_atomic(FILE* out, struct ebpf_inst inst)
+{
+    const char* type = mem_type(inst.opcode);
+    const char* fetch;
+
+    switch (inst.imm & ~EBPF_ATOMIC_OP_FETCH) {
+    case EBPF_ALU_OP_ADD:
+        fetch = "__atomic_fetch_add";
+        break;
+    case EBPF_ALU_OP_OR:
+        fetch = "__atomic_fetch_or";
+        break;
+    case EBPF_ALU_OP_AND:
+        fetch = "__atomic_fetch_and";
+        break;
+    case EBPF_ALU_OP_XOR:
+        fetch = "__atomic_fetch_xor";
+        break;
+    default:
+        fetch = NULL;
+        break;
+    }
+
+    if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+        fprintf(
+            out,
+            "{ %s e_ = r0; __atomic_compare_exchange_n((%s*)(uintptr_t)(r%d + %d), &e_, (%s)r%d, 0, "
+            "__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); r0 = e_; }\n",
+            type,
+            type,
+            inst.dst,
+            inst.offset,
+            type,
+            inst.src);
+        return 0;
+    }
+    if (inst.imm == EBPF_ATOMIC_OP_XCHG) {
+        fetch = "__atomic_exchange_n";
+    } else if (fetch == NULL) {
+        return -1;
+    }
+
+    if (inst.imm & EBPF_ATOMIC_OP_FETCH) {
+        fprintf(out, "r%d = ", inst.src);
+    }
+    fprintf(
+        out,
+        "%s((%s*)(uintptr_t)(r%d + %d), (%s)r%d, __ATOMIC_SEQ_CST);\n",
+        fetch,
+        type,
+        inst.dst,
+        inst.offset,
+        type,
+        inst.src);
+    return 0;
+}
+
+int
+ubpf_translate_c(struct ubpf_vm* vm, FILE* out, char** errmsg)
+{
+    *errmsg = NULL;
+
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return -1;
+    }
+
+    fprintf(out, aot_prelude, MAX_EXT_FUNCS, MAX_EXT_FUNCS, vm->stack_usage, vm->stack_usage);
+
+    for (int i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+        const char* code;
+
+        fprintf(out, "pc%d:;\n    ", i);
+
+        if ((code = find_template(alu_templates, _countof(alu_templates), inst.opcode)) != NULL) {
+            expand_template(out, code, inst);
+            fputc('\n', out);
+            continue;
+        }
+
+        if ((code = find_template(jump_templates, _countof(jump_templates), inst.opcode)) != NULL) {
+            fputs("if (", out);
+            expand_template(out, code, inst);
+            fprintf(out, ") goto pc%d;\n", i + inst.offset + 1);
+            continue;
+        }
+
+        switch (inst.opcode) {
+        case EBPF_OP_LE:
+        case EBPF_OP_BE:
+            if (inst.imm == 16 || inst.imm == 32 || inst.imm == 64) {
+                fprintf(
+                    out,
+                    "r%d = hto%s%d(r%d);\n",
+                    inst.dst,
+                    inst.opcode == EBPF_OP_LE ? "le" : "be",
+                    inst.imm,
+                    inst.dst);
+            } else {
+                fputs(";\n", out);
+            }
+            break;
+
+        case EBPF_OP_LDXB:
+        case EBPF_OP_LDXH:
+        case EBPF_OP_LDXW:
+        case EBPF_OP_LDXDW:
+            fprintf(out, "r%d = LOAD(%s, r%d + %d);\n", inst.dst, mem_type(inst.opcode), inst.src, inst.offset);
+            break;
+
+        case EBPF_OP_STB:
+        case EBPF_OP_STH:
+        case EBPF_OP_STW:
+        case EBPF_OP_STDW:
+            fprintf(
+                out,
+                "STORE(%s, r%d + %d, (int32_t)%" PRId32 ");\n",
+                mem_type(inst.opcode),
+                inst.dst,
+                inst.offset,
+                inst.imm);
+            break;
+
+        case EBPF_OP_STXB:
+        case EBPF_OP_STXH:
+        case EBPF_OP_STXW:
+        case EBPF_OP_STXDW:
+            fprintf(out, "STORE(%s, r%d + %d, r%d);\n", mem_type(inst.opcode), inst.dst, inst.offset, inst.src);
+            break;
+
+        case EBPF_OP_ATOMIC32_STORE:
+        case EBPF_OP_ATOMIC_STORE:
+            if (translate_atomic(out, inst) < 0) {
+                *errmsg = ubpf_error("invalid atomic operation 0x%x at PC %d", inst.imm, i);
+                return -1;
+            }
+            break;
+
+        case EBPF_OP_LDDW: {
+            struct ebpf_inst inst2 = ubpf_fetch_instruction(vm, ++i);
+            uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+            fprintf(out, "r%d = UINT64_C(0x%" PRIx64 ");\npc%d:;\n", inst.dst, imm, i);
+            break;
+        }
+
+        case EBPF_OP_EXIT:
+            fputs("return r0;\n", out);
+            break;
+
+        case EBPF_OP_CALL:
+            if (inst.imm < 0 || inst.imm >= MAX_EXT_FUNCS || vm->ext_funcs[inst.imm] == NULL) {
+                *errmsg = ubpf_error("call to nonexistent function %d at PC %d", inst.imm, i);
+                return -1;
+            }
+            fprintf(
+                out,
+                "r0 = " AOT_HELPERS "[%d](" AOT_VM ", %d, r1, r2, r3, r4, r5);\n",
+                inst.imm,
+                inst.imm);
+            if (inst.imm == vm->unwind_stack_extension_index) {
+                fputs("    if (r0 == 0) return r0;\n", out);
+            }
+            break;
+
+        default:
+            *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+            return -1;
+        }
+    }
+
+    fprintf(out, "pc%d:;\n    return r0;\n}\n", vm->num_insts);
+
+    if (ferror(out)) {
+        *errmsg = ubpf_error("error writing C translation");
+        return -1;
+    }
+    return 0;
+}
+
+int
+ubpf_aot_compile(struct ubpf_vm* vm, const char* so_path, char** errmsg)
+{
+    char c_path[] = "/tmp/ubpf-aot-XXXXXX.c";
+    int fd = mkstemps(c_path, 2);
+    if (fd < 0) {
+        *errmsg = ubpf_error("could not create temporary file: %s", strerror(errno));
+        return -1;
+    }
+
+    FILE* out = fdopen(fd, "w");
+    if (out == NULL) {
+        *errmsg = ubpf_error("could not open temporary file: %s", strerror(errno));
+        close(fd);
+        unlink(c_path);
+        return -1;
+    }
+
+    int rc = ubpf_translate_c(vm, out, errmsg);
+    if (fclose(out) != 0 && rc == 0) {
+        *errmsg = ubpf_error("could not write %s: %s", c_path, strerror(errno));
+        rc = -1;
+    }
+    if (rc < 0) {
+        unlink(c_path);
+        return -1;
+    }
+
+    const char* cc = getenv("CC");
+    char* command = NULL;
+    if (asprintf(&command, "%s -O2 -fPIC -shared -w -o '%s' '%s'", cc ? cc : "cc", so_path, c_path) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        unlink(c_path);
+        return -1;
+    }
+
+    int status = system(command);
+    if (status != 0) {
+        *errmsg = ubpf_error("AOT compile failed (status %d): %s", status, command);
+        rc = -1;
+    }
+
+    free(command);
+    unlink(c_path);
+    return rc;
+}
+
+ubpf_jit_fn
+ubpf_aot_load(struct ubpf_vm* vm, const char* so_path, char** errmsg)
+{
+    *errmsg = NULL;
+
+    void* handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        *errmsg = ubpf_error("dlopen failed: %s", dlerror());
+        return NULL;
+    }
+
+    ubpf_jit_fn entry = (ubpf_jit_fn)dlsym(handle, AOT_ENTRY);
+    ext_func* helpers = dlsym(handle, AOT_HELPERS);
+    const unsigned int* helper_count = dlsym(handle, AOT_HELPER_COUNT);
+    void** aot_vm = dlsym(handle, AOT_VM);
+    if (entry == NULL || helpers == NULL || helper_count == NULL || aot_vm == NULL) {
+        *errmsg = ubpf_error("%s is not a uBPF AOT object", so_path);
+        dlclose(handle);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < *helper_count && i < MAX_EXT_FUNCS; i++) {
+        helpers[i] = vm->ext_funcs[i];
+    }
+    *aot_vm = vm;
+
+    ubpf_aot_unload(vm);
+    vm->aot_handle = handle;
+    return entry;
+}
+
+void
+ubpf_aot_unload(struct ubpf_vm* vm)
+{
+    if (vm->aot_handle) {
+        dlclose(vm->aot_handle);
+        vm->aot_handle = NULL;
+    }
+}
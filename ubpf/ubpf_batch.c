@@ -0,0 +1,203 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Batch execution: run one program over many inputs on a pool of threads.
+ *
+ * Every worker runs on a shadow copy of the VM (see ubpf_shadow_init()) with
+ * its own memory, so the interpreter can run on all of them at once.
+ * Workers take inputs in
+ * chunks from a shared counter, so nobody sits idle while another worker
+ * still has a long queue.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ubpf_int.h"
+
+/* Inputs claimed at a time; big enough that the counter isn't contended. */
+#define BATCH_CHUNK 64
+
+struct batch
+{
+    const struct ubpf_batch_input* inputs;
+    struct ubpf_batch_result* results;
+    size_t count;
+    ubpf_batch_apply apply;
+    void* apply_arg;
+    atomic_size_t next;
+};
+
+struct batch_worker
+{
+    struct batch* batch;
+    struct ubpf_vm shadow;
+    unsigned int index;
+    pthread_t thread;
+    bool started;
+};
+
+static bool
+batch_worker_init(struct batch_worker* worker, unsigned int index, struct ubpf_vm* vm, struct batch* batch)
+{
+    worker->batch = batch;
+    worker->index = index;
+    if (!ubpf_shadow_init(&worker->shadow, vm)) {
+        return false;
+    }
+    worker->shadow.mem = calloc(vm->mem_len, 1);
+    return worker->shadow.mem != NULL;
+}
+
+static void
+batch_worker_cleanup(struct batch_worker* worker)
+{
+    free(worker->shadow.mem);
+    ubpf_shadow_cleanup(&worker->shadow);
+}
+
+static void
+batch_run_one(struct batch_worker* worker, size_t index)
+{
+    struct batch* batch = worker->batch;
+    struct ubpf_vm* vm = &worker->shadow;
+    const struct ubpf_batch_input* input = &batch->inputs[index];
+    struct ubpf_batch_result* result = &batch->results[index];
+
+    if (input->len > (size_t)vm->mem_len) {
+        result->return_value = 0;
+        result->rc = -1;
+        return;
+    }
+
+    memcpy(vm->mem, input->data, input->len);
+    memset(vm->stack, 0, vm->stack_size);
+    memset(vm->regs, 0, EBPF_REGISTERS_COUNT * sizeof(uint64_t));
+    vm->regs[1] = (uintptr_t)vm->mem;
+    vm->regs[2] = input->len;
+    vm->regs[10] = (uintptr_t)((char*)vm->stack + vm->stack_size);
+    if (batch->apply) {
+        batch->apply(vm->mem, vm->mem_len, vm->regs, index, batch->apply_arg);
+    }
+
+    if (vm->jitted) {
+        result->return_value = vm->jitted((void*)(uintptr_t)vm->regs[1], (size_t)vm->regs[2]);
+        result->rc = 0;
+        return;
+    }
+
+    result->rc = ubpf_exec(vm);
+    result->return_value = result->rc == 0 ? vm->return_value : 0;
+}
+
+static void*
+batch_worker_run(void* arg)
+{
+    struct batch_worker* worker = arg;
+    struct batch* batch = worker->batch;
+
+    ubpf_set_cpu(worker->index);
+    while (1) {
+        size_t start = atomic_fetch_add_explicit(&batch->next, BATCH_CHUNK, memory_order_relaxed);
+        if (start >= batch->count) {
+            break;
+        }
+        size_t end = start + BATCH_CHUNK < batch->count ? start + BATCH_CHUNK : batch->count;
+        for (size_t i = start; i < end; i++) {
+            batch_run_one(worker, i);
+        }
+    }
+    return NULL;
+}
+
+int
+ubpf_exec_batch(
+    struct ubpf_vm* vm,
+    const struct ubpf_batch_input* inputs,
+    struct ubpf_batch_result* results,
+    size_t count,
+    unsigned int num_threads,
+    ubpf_batch_apply apply,
+    void* apply_arg)
+{
+    if (!vm->insts) {
+        /* Code must be loaded before we can execute */
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    ubpf_spec_refresh(vm);
+
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? online : 1;
+    }
+    if (num_threads > UBPF_MAX_CPUS) {
+        num_threads = UBPF_MAX_CPUS;
+    }
+    size_t chunks = (count + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    if (num_threads > chunks) {
+        num_threads = chunks;
+    }
+
+    struct batch batch = {
+        .inputs = inputs,
+        .results = results,
+        .count = count,
+        .apply = apply,
+        .apply_arg = apply_arg,
+    };
+    atomic_init(&batch.next, 0);
+
+    struct batch_worker* workers = calloc(num_threads, sizeof(*workers));
+    if (workers == NULL) {
+        return -1;
+    }
+
+    int rc = 0;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        if (!batch_worker_init(&workers[i], i, vm, &batch)) {
+            vm->error_printf(stderr, "uBPF error: out of memory for batch worker\n");
+            rc = -1;
+            goto out;
+        }
+    }
+
+    /*
+     * The calling thread is worker 0.  If a thread can't be started the
+     * remaining workers just pick up its share.
+     */
+    for (unsigned int i = 1; i < num_threads; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, batch_worker_run, &workers[i]) == 0;
+    }
+    batch_worker_run(&workers[0]);
+    for (unsigned int i = 1; i < num_threads; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+out:
+    for (unsigned int i = 0; i < num_threads; i++) {
+        batch_worker_cleanup(&workers[i]);
+    }
+    free(workers);
+    return rc;
+}
@@ -0,0 +1,498 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Classic BPF to eBPF translation, so tcpdump-style filters run in packet
+ * mode (ubpf_exec_xdp()) on the interpreter or the JIT.
+ *
+ * The accumulator and index live in r6 and r7 and are kept as zero-extended
+ * 32-bit values by doing all arithmetic with ALU32/JMP32 instructions.  The
+ * packet bounds are loaded from the xdp_md into r8 and r9 once, and every
+ * packet load checks its end against r9 first; a load past the end drops the
+ * packet, as it rejects it in the kernel.  The scratch words M[] are on the
+ * stack.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "ubpf_int.h"
+
+/* Classic BPF encoding, as in linux/filter.h */
+#define CBPF_CLASS(code) ((code)&0x07)
+#define CBPF_LD 0x00
+#define CBPF_LDX 0x01
+#define CBPF_ST 0x02
+#define CBPF_STX 0x03
+#define CBPF_ALU 0x04
+#define CBPF_JMP 0x05
+#define CBPF_RET 0x06
+#define CBPF_MISC 0x07
+
+#define CBPF_SIZE(code) ((code)&0x18)
+#define CBPF_W 0x00
+#define CBPF_H 0x08
+#define CBPF_B 0x10
+
+#define CBPF_MODE(code) ((code)&0xe0)
+#define CBPF_IMM 0x00
+#define CBPF_ABS 0x20
+#define CBPF_IND 0x40
+#define CBPF_MEM 0x60
+#define CBPF_LEN 0x80
+#define CBPF_MSH 0xa0
+
+#define CBPF_OP(code) ((code)&0xf0)
+#define CBPF_SRC(code) ((code)&0x08)
+#define CBPF_K 0x00
+#define CBPF_X 0x08
+
+#define CBPF_JA 0x00
+#define CBPF_JEQ 0x10
+#define CBPF_JGT 0x20
+#define CBPF_JGE 0x30
+#define CBPF_JSET 0x40
+
+#define CBPF_RVAL(code) ((code)&0x18)
+#define CBPF_RET_A 0x10
+
+#define CBPF_MISCOP(code) ((code)&0xf8)
+#define CBPF_TAX 0x00
+#define CBPF_TXA 0x80
+
+#define CBPF_MEMWORDS 16
+#define CBPF_MAXINSNS 4096
+/* Loads at or above this offset are Linux's ancillary data (SKF_AD_OFF) */
+#define CBPF_ANCILLARY 0xfffff000u
+
+#define REG_A 6
+#define REG_X 7
+#define REG_DATA 8
+#define REG_DATA_END 9
+
+/* The most eBPF instructions one classic instruction becomes, and the prologue and epilogue */
+#define MAX_EXPANSION 9
+#define MAX_OVERHEAD 32
+
+/* Jump target meaning "drop the packet" */
+#define TARGET_FAIL ((size_t)-1)
+
+struct fixup
+{
+    size_t inst;   /* The jump */
+    size_t target; /* Classic pc, or TARGET_FAIL */
+};
+
+struct translation
+{
+    struct ebpf_inst* insts;
+    size_t num_insts;
+    struct fixup* fixups;
+    size_t num_fixups;
+};
+
+static void
+emit(struct translation* t, uint8_t opcode, uint8_t dst, uint8_t src, int16_t offset, int32_t imm)
+{
+    t->insts[t->num_insts++] = (struct ebpf_inst){
+        .opcode = opcode,
+        .dst = dst,
+        .src = src,
+        .offset = offset,
+        .imm = imm,
+    };
+}
+
+static void
+emit_jump(struct translation* t, uint8_t opcode, uint8_t dst, uint8_t src, int32_t imm, size_t target)
+{
+    t->fixups[t->num_fixups++] = (struct fixup){.inst = t->num_insts, .target = target};
+    emit(t, opcode, dst, src, 0, imm);
+}
+
+/*
+ * Load size bytes of the packet, in network order, into dst. The offset is
+ * k, plus X for indirect loads.
+ */
+static void
+emit_packet_load(struct translation* t, uint8_t dst, int size, uint32_t k, bool indirect)
+{
+    static const uint8_t ldx[] = {[1] = EBPF_OP_LDXB, [2] = EBPF_OP_LDXH, [4] = EBPF_OP_LDXW};
+
+    if (!indirect && k <= INT16_MAX) {
+        /* The common case, ldh [12]: check the end and load straight from data */
+        emit(t, EBPF_OP_MOV64_REG, 2, REG_DATA, 0, 0);
+        emit(t, EBPF_OP_ADD64_IMM, 2, 0, 0, k + size);
+        emit_jump(t, EBPF_OP_JGT_REG, 2, REG_DATA_END, 0, TARGET_FAIL);
+        emit(t, ldx[size], dst, REG_DATA, k, 0);
+    } else {
+        /* The offset is 32-bit unsigned and may be anything, so compute it whole */
+        if (indirect) {
+            emit(t, EBPF_OP_MOV_REG, 2, REG_X, 0, 0);
+            emit(t, EBPF_OP_ADD_IMM, 2, 0, 0, k);
+        } else {
+            emit(t, EBPF_OP_MOV_IMM, 2, 0, 0, k);
+        }
+        emit(t, EBPF_OP_ADD64_REG, 2, REG_DATA, 0, 0);
+        emit(t, EBPF_OP_MOV64_REG, 3, 2, 0, 0);
+        emit(t, EBPF_OP_ADD64_IMM, 3, 0, 0, size);
+        emit_jump(t, EBPF_OP_JGT_REG, 3, REG_DATA_END, 0, TARGET_FAIL);
+        emit(t, ldx[size], dst, 2, 0, 0);
+    }
+    if (size > 1) {
+        emit(t, EBPF_OP_BE, dst, 0, 0, size * 8);
+    }
+}
+
+static int
+load_size(uint16_t code)
+{
+    switch (CBPF_SIZE(code)) {
+    case CBPF_W:
+        return 4;
+    case CBPF_H:
+        return 2;
+    case CBPF_B:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int16_t
+scratch_offset(uint32_t k)
+{
+    return -(int16_t)((CBPF_MEMWORDS - k) * 4);
+}
+
+static int
+translate_insn(struct translation* t, const struct ubpf_cbpf_insn* insn, size_t pc, size_t count, char** errmsg)
+{
+    uint16_t code = insn->code;
+    uint32_t k = insn->k;
+
+    switch (CBPF_CLASS(code)) {
+    case CBPF_LD:
+    case CBPF_LDX: {
+        bool ldx = CBPF_CLASS(code) == CBPF_LDX;
+        uint8_t dst = ldx ? REG_X : REG_A;
+        int size = load_size(code);
+        switch (CBPF_MODE(code)) {
+        case CBPF_IMM:
+            emit(t, EBPF_OP_MOV_IMM, dst, 0, 0, k);
+            return 0;
+        case CBPF_LEN:
+            emit(t, EBPF_OP_MOV64_REG, 2, REG_DATA_END, 0, 0);
+            emit(t, EBPF_OP_SUB64_REG, 2, REG_DATA, 0, 0);
+            emit(t, EBPF_OP_MOV_REG, dst, 2, 0, 0);
+            return 0;
+        case CBPF_MEM:
+            if (k >= CBPF_MEMWORDS) {
+                *errmsg = ubpf_error("invalid scratch word %u at PC %zu", k, pc);
+                return -1;
+            }
+            emit(t, EBPF_OP_LDXW, dst, 10, scratch_offset(k), 0);
+            return 0;
+        case CBPF_ABS:
+        case CBPF_IND:
+            if (ldx || !size) {
+                break;
+            }
+            if (CBPF_MODE(code) == CBPF_ABS && k >= CBPF_ANCILLARY) {
+                *errmsg = ubpf_error("unsupported ancillary load at PC %zu", pc);
+                return -1;
+            }
+            emit_packet_load(t, REG_A, size, k, CBPF_MODE(code) == CBPF_IND);
+            return 0;
+        case CBPF_MSH:
+            /* ldxb 4*([k]&0xf), the IP header length */
+            if (!ldx || size != 1) {
+                break;
+            }
+            emit_packet_load(t, REG_X, 1, k, false);
+            emit(t, EBPF_OP_AND_IMM, REG_X, 0, 0, 0xf);
+            emit(t, EBPF_OP_LSH_IMM, REG_X, 0, 0, 2);
+            return 0;
+        }
+        break;
+    }
+    case CBPF_ST:
+    case CBPF_STX:
+        if (code != CBPF_ST && code != CBPF_STX) {
+            break;
+        }
+        if (k >= CBPF_MEMWORDS) {
+            *errmsg = ubpf_error("invalid scratch word %u at PC %zu", k, pc);
+            return -1;
+        }
+        emit(t, EBPF_OP_STXW, 10, code == CBPF_ST ? REG_A : REG_X, scratch_offset(k), 0);
+        return 0;
+    case CBPF_ALU: {
+        /* Classic ALU encodings are eBPF's ALU32 ones */
+        uint8_t op = CBPF_OP(code);
+        switch (op) {
+        case 0x00: /* add */
+        case 0x10: /* sub */
+        case 0x20: /* mul */
+        case 0x40: /* or */
+        case 0x50: /* and */
+        case 0x60: /* lsh */
+        case 0x70: /* rsh */
+        case 0xa0: /* xor */
+            break;
+        case 0x30: /* div */
+        case 0x90: /* mod */
+            if (CBPF_SRC(code) == CBPF_K && k == 0) {
+                *errmsg = ubpf_error("division by zero at PC %zu", pc);
+                return -1;
+            }
+            if (CBPF_SRC(code) == CBPF_X) {
+                /* As in the kernel, dividing by a zero X rejects the packet */
+                emit_jump(t, EBPF_OP_JEQ32_IMM, REG_X, 0, 0, TARGET_FAIL);
+            }
+            break;
+        case 0x80: /* neg */
+            if (CBPF_SRC(code) != CBPF_K) {
+                *errmsg = ubpf_error("unknown classic BPF opcode 0x%04x at PC %zu", code, pc);
+                return -1;
+            }
+            emit(t, EBPF_OP_NEG, REG_A, 0, 0, 0);
+            return 0;
+        default:
+            *errmsg = ubpf_error("unknown classic BPF opcode 0x%04x at PC %zu", code, pc);
+            return -1;
+        }
+        if (CBPF_SRC(code) == CBPF_X) {
+            emit(t, EBPF_CLS_ALU | EBPF_SRC_REG | op, REG_A, REG_X, 0, 0);
+        } else {
+            emit(t, EBPF_CLS_ALU | EBPF_SRC_IMM | op, REG_A, 0, 0, k);
+        }
+        return 0;
+    }
+    case CBPF_JMP: {
+        if (CBPF_OP(code) == CBPF_JA) {
+            if (code != (CBPF_JMP | CBPF_JA)) {
+                break;
+            }
+            if (k >= count - pc - 1) {
+                *errmsg = ubpf_error("jump out of bounds at PC %zu", pc);
+                return -1;
+            }
+            emit_jump(t, EBPF_OP_JA, 0, 0, 0, pc + 1 + k);
+            return 0;
+        }
+        uint8_t mode, inverse;
+        switch (CBPF_OP(code)) {
+        case CBPF_JEQ:
+            mode = EBPF_MODE_JEQ;
+            inverse = EBPF_MODE_JNE;
+            break;
+        case CBPF_JGT:
+            mode = EBPF_MODE_JGT;
+            inverse = EBPF_MODE_JLE;
+            break;
+        case CBPF_JGE:
+            mode = EBPF_MODE_JGE;
+            inverse = EBPF_MODE_JLT;
+            break;
+        case CBPF_JSET:
+            mode = EBPF_MODE_JSET;
+            inverse = 0;
+            break;
+        default:
+            *errmsg = ubpf_error("unknown classic BPF opcode 0x%04x at PC %zu", code, pc);
+            return -1;
+        }
+        if (insn->jt >= count - pc - 1 || insn->jf >= count - pc - 1) {
+            *errmsg = ubpf_error("jump out of bounds at PC %zu", pc);
+            return -1;
+        }
+        uint8_t src = CBPF_SRC(code) == CBPF_X ? EBPF_SRC_REG : EBPF_SRC_IMM;
+        uint8_t src_reg = src == EBPF_SRC_REG ? REG_X : 0;
+        size_t jt = pc + 1 + insn->jt, jf = pc + 1 + insn->jf;
+        if (jt == jf) {
+            if (jt != pc + 1) {
+                emit_jump(t, EBPF_OP_JA, 0, 0, 0, jt);
+            }
+        } else if (jf == pc + 1) {
+            emit_jump(t, EBPF_CLS_JMP32 | src | mode, REG_A, src_reg, k, jt);
+        } else if (jt == pc + 1 && inverse) {
+            emit_jump(t, EBPF_CLS_JMP32 | src | inverse, REG_A, src_reg, k, jf);
+        } else {
+            emit_jump(t, EBPF_CLS_JMP32 | src | mode, REG_A, src_reg, k, jt);
+            emit_jump(t, EBPF_OP_JA, 0, 0, 0, jf);
+        }
+        return 0;
+    }
+    case CBPF_RET:
+        /* Classic filters return how much of the packet to keep; any is a pass */
+        if (CBPF_RVAL(code) == CBPF_RET_A) {
+            emit(t, EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_PASS);
+            emit(t, EBPF_OP_JNE32_IMM, REG_A, 0, 1, 0);
+            emit(t, EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_DROP);
+        } else if (CBPF_RVAL(code) == CBPF_K) {
+            emit(t, EBPF_OP_MOV64_IMM, 0, 0, 0, k ? UBPF_XDP_PASS : UBPF_XDP_DROP);
+        } else {
+            break;
+        }
+        emit(t, EBPF_OP_EXIT, 0, 0, 0, 0);
+        return 0;
+    case CBPF_MISC:
+        if (CBPF_MISCOP(code) == CBPF_TAX) {
+            emit(t, EBPF_OP_MOV_REG, REG_X, REG_A, 0, 0);
+            return 0;
+        } else if (CBPF_MISCOP(code) == CBPF_TXA) {
+            emit(t, EBPF_OP_MOV_REG, REG_A, REG_X, 0, 0);
+            return 0;
+        }
+        break;
+    }
+    *errmsg = ubpf_error("unknown classic BPF opcode 0x%04x at PC %zu", code, pc);
+    return -1;
+}
+
+int
+ubpf_translate_cbpf(const struct ubpf_cbpf_insn* insns, size_t count, void** code, size_t* code_len, char** errmsg)
+{
+    *errmsg = NULL;
+    *code = NULL;
+    *code_len = 0;
+
+    if (count == 0 || count > CBPF_MAXINSNS) {
+        *errmsg = ubpf_error("classic BPF programs have 1 to %d instructions, not %zu", CBPF_MAXINSNS, count);
+        return -1;
+    }
+    if (CBPF_CLASS(insns[count - 1].code) != CBPF_RET) {
+        *errmsg = ubpf_error("classic BPF program doesn't end with ret");
+        return -1;
+    }
+
+    struct translation t = {
+        .insts = calloc(count * MAX_EXPANSION + MAX_OVERHEAD, sizeof(struct ebpf_inst)),
+        .fixups = calloc(count * 2, sizeof(struct fixup)),
+    };
+    size_t* starts = calloc(count, sizeof(*starts));
+    int rc = -1;
+    if (!t.insts || !t.fixups || !starts) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    /* A, X and, as in the kernel, M[] start out zero */
+    emit(&t, EBPF_OP_LDXDW, REG_DATA, 1, offsetof(struct ubpf_xdp_md, data), 0);
+    emit(&t, EBPF_OP_LDXDW, REG_DATA_END, 1, offsetof(struct ubpf_xdp_md, data_end), 0);
+    emit(&t, EBPF_OP_MOV_IMM, REG_A, 0, 0, 0);
+    emit(&t, EBPF_OP_MOV_IMM, REG_X, 0, 0, 0);
+    for (int i = 0; i < CBPF_MEMWORDS; i += 2) {
+        emit(&t, EBPF_OP_STDW, 10, 0, scratch_offset(i), 0);
+    }
+
+    for (size_t pc = 0; pc < count; pc++) {
+        starts[pc] = t.num_insts;
+        if (translate_insn(&t, &insns[pc], pc, count, errmsg) < 0) {
+            goto out;
+        }
+    }
+
+    /* Out-of-bounds loads and division by zero end up here */
+    size_t fail = t.num_insts;
+    emit(&t, EBPF_OP_MOV64_IMM, 0, 0, 0, UBPF_XDP_DROP);
+    emit(&t, EBPF_OP_EXIT, 0, 0, 0, 0);
+
+    for (size_t i = 0; i < t.num_fixups; i++) {
+        size_t target = t.fixups[i].target == TARGET_FAIL ? fail : starts[t.fixups[i].target];
+        ptrdiff_t offset = (ptrdiff_t)target - (ptrdiff_t)t.fixups[i].inst - 1;
+        if (offset > INT16_MAX) {
+            *errmsg = ubpf_error("jump too far after translation at instruction %zu", t.fixups[i].inst);
+            goto out;
+        }
+        t.insts[t.fixups[i].inst].offset = offset;
+    }
+
+    *code = t.insts;
+    *code_len = t.num_insts * sizeof(struct ebpf_inst);
+    t.insts = NULL;
+    rc = 0;
+
+out:
+    free(t.insts);
+    free(t.fixups);
+    free(starts);
+    return rc;
+}
+
+int
+ubpf_parse_cbpf(const char* text, struct ubpf_cbpf_insn** insns, size_t* count, char** errmsg)
+{
+    *errmsg = NULL;
+    *insns = NULL;
+    *count = 0;
+
+    /* tcpdump -ddd: the instruction count, then "code jt jf k" per line, in decimal */
+    char* end;
+    unsigned long n = strtoul(text, &end, 10);
+    if (end == text || n == 0 || n > CBPF_MAXINSNS) {
+        *errmsg = ubpf_error("expected an instruction count of 1 to %d", CBPF_MAXINSNS);
+        return -1;
+    }
+    struct ubpf_cbpf_insn* out = calloc(n, sizeof(*out));
+    if (!out) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+
+    const char* p = end;
+    for (unsigned long i = 0; i < n; i++) {
+        unsigned long field[4];
+        for (int f = 0; f < 4; f++) {
+            field[f] = strtoul(p, &end, 10);
+            if (end == p) {
+                free(out);
+                *errmsg = ubpf_error("expected 4 numbers for instruction %lu", i);
+                return -1;
+            }
+            p = end;
+        }
+        if (field[0] > UINT16_MAX || field[1] > UINT8_MAX || field[2] > UINT8_MAX || field[3] > UINT32_MAX) {
+            free(out);
+            *errmsg = ubpf_error("field out of range in instruction %lu", i);
+            return -1;
+        }
+        out[i] = (struct ubpf_cbpf_insn){
+            .code = field[0],
+            .jt = field[1],
+            .jf = field[2],
+            .k = field[3],
+        };
+    }
+
+    *insns = out;
+    *count = n;
+    return 0;
+}
+
+int
+ubpf_load_cbpf(struct ubpf_vm* vm, const struct ubpf_cbpf_insn* insns, size_t count, char** errmsg)
+{
+    void* code;
+    size_t code_len;
+    if (ubpf_translate_cbpf(insns, count, &code, &code_len, errmsg) < 0) {
+        return -1;
+    }
+    int rc = ubpf_load(vm, code, code_len, errmsg);
+    free(code);
+    return rc;
+}
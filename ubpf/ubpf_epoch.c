@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Epoch-based reclamation, so ubpf_swap_code() can free a program once
+ * nothing runs it any more.
+ *
+ * Executors that copy a program out of a VM (shadows, tail calls, compiled
+ * code) do so inside a read section.  A reader counts itself in one of two
+ * counters, picked by the parity of the epoch.  A writer publishes its new
+ * pointer, moves the epoch on and waits for the old parity's counter to
+ * drain: a reader that could still hold the old pointer was counted there
+ * before the epoch moved, and any later one sees the new pointer.  A reader
+ * that raced with the move counts itself again under the new parity.
+ *
+ * Read sections may nest and may end on another thread than they started on
+ * (scheduler jobs move between workers), but a thread inside one must not
+ * wait for a writer.
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ubpf_int.h"
+
+static atomic_uint epoch;
+static atomic_long readers[2];
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int
+ubpf_epoch_enter(void)
+{
+    while (1) {
+        unsigned int parity = atomic_load(&epoch) & 1;
+        atomic_fetch_add(&readers[parity], 1);
+        if ((atomic_load(&epoch) & 1) == parity) {
+            return parity + 1;
+        }
+        /* A writer may already have seen this counter drain */
+        atomic_fetch_sub(&readers[parity], 1);
+    }
+}
+
+void
+ubpf_epoch_exit(unsigned int token)
+{
+    atomic_fetch_sub_explicit(&readers[token - 1], 1, memory_order_release);
+}
+
+void
+ubpf_epoch_synchronize(void)
+{
+    pthread_mutex_lock(&writer_lock);
+    unsigned int parity = atomic_fetch_add(&epoch, 1) & 1;
+    while (atomic_load(&readers[parity]) != 0) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
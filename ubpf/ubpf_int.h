@@ -19,47 +19,266 @@
 #define UBPF_INT_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include <ubpf.h>
 #include "ebpf.h"
 
+#define MAX_EXT_FUNCS 128
+#define MAX_MAPS 64
+#define EBPF_REGISTERS_COUNT 11
+
 struct ebpf_inst;
+struct ubpf_tier;
+struct ubpf_spec;
+struct ubpf_branch_count;
+struct ubpf_helper_info;
+struct ubpf_image;
 typedef uint64_t (*ext_func)(struct ubpf_vm *vm, uint64_t call, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4);
 
 struct ubpf_vm
 {
     struct ebpf_inst* insts;
-    uint16_t num_insts;
-    uint16_t max_num_insts;
+    uint32_t num_insts;
     ubpf_jit_fn jitted;
     size_t jitted_size;
     ext_func* ext_funcs;
     const char** ext_func_names;
+    struct ubpf_helper_info* ext_func_info;
     bool bounds_check_enabled;
+    bool loop_check_enabled;
+    bool verifier_enabled;
+    bool branch_profile_enabled;
+    struct ubpf_verifier_stats verifier_stats;
     int (*error_printf)(FILE* stream, const char* format, ...);
-    int (*translate)(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
+    int (*translate)(
+        struct ubpf_vm* vm, uint8_t* buffer, size_t* size, uint32_t* pc_locs, bool in_place, char** errmsg);
     int unwind_stack_extension_index;
     uint64_t pointer_secret;
     uint64_t* regs;
     void *mem;
     int mem_len;
     void *stack;
-    uint16_t pc;
+    uint32_t stack_size;  /* bytes at stack; r10 starts at its end */
+    uint32_t stack_usage; /* bytes below r10 the validated program may use */
+    uint32_t pc;
+    bool suspended;
     uint64_t return_value;
     uint64_t hot_address;
     uint64_t hot_address_size;
     void (*printCb)(const char *fmt);
+    struct ubpf_tier* tier;
+    unsigned int jit_profiling;
+    char* jit_name;
+    void* aot_handle;
+    struct ubpf_map** maps;
+    struct ubpf_spec* spec;
+    struct ubpf_branch_count* branch_counts; /* per pc, see ubpf_toggle_branch_profile() */
+    void* packet;
+    size_t packet_len;
+    bool checked_call;    /* the interpreter is calling a helper, see ubpf_accessible() */
+    struct ubpf_vm* tail; /* the program tail called into, run on this VM's state */
+    uint32_t tail_calls;  /* made so far by this run; while nonzero, tail is running */
+    _Atomic(struct ubpf_image*) image; /* published by ubpf_swap_code(), see below */
+    unsigned int epoch;      /* read section a shadow holds its program under, or 0 */
+    unsigned int tail_epoch; /* read section an interpreted tail call chain holds, or 0 */
+};
+
+/*
+ * A program published by ubpf_swap_code().  Executors that copy a VM's
+ * program (shadows, tail calls) take it from here inside a read section, and
+ * it is freed only after the epoch has moved past every such section.  While
+ * a VM has an image its own program fields point into it.
+ */
+struct ubpf_image
+{
+    struct ebpf_inst* insts;
+    uint32_t num_insts;
+    uint32_t stack_usage;
+    ubpf_jit_fn jitted;
+    size_t jitted_size;
+    struct ubpf_branch_count* branch_counts;
+};
+
+/* Hand an image's contents back to the VM that published it, see ubpf_vm.c */
+void
+ubpf_unpublish(struct ubpf_vm* vm);
+
+/* Epoch-based reclamation, see ubpf_epoch.c; enter returns a nonzero token for exit */
+unsigned int
+ubpf_epoch_enter(void);
+void
+ubpf_epoch_exit(unsigned int token);
+void
+ubpf_epoch_synchronize(void);
+
+bool
+validate(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+
+/* What ubpf_describe_helper() said about a helper */
+struct ubpf_helper_info
+{
+    uint8_t num_args; /* it reads r1 to r<num_args> */
+    uint8_t flags;    /* UBPF_HELPER_* */
+};
+
+/* How often the interpreter took the conditional jump at a pc, and didn't */
+struct ubpf_branch_count
+{
+    _Atomic uint64_t taken;
+    _Atomic uint64_t not_taken;
+};
+
+/* A program specialized by ubpf_specialize(), see ubpf_optimize.c */
+struct ubpf_spec
+{
+    struct ebpf_inst* insts; /* as it was before specializing */
+    uint32_t num_insts;
+    uint32_t stack_usage;
+    struct ubpf_ctx_field* fields;
+    unsigned int num_fields;
+    uint64_t maps;                  /* bit i: values of map i were folded in */
+    uint32_t generations[MAX_MAPS]; /* of each such map when it was read */
 };
 
+/* Specialize the program again if a map it was specialized on has changed */
+void
+ubpf_spec_refresh(struct ubpf_vm* vm);
+/* Forget the specialization, leaving the specialized program loaded */
+void
+ubpf_spec_free(struct ubpf_vm* vm);
+
+/* Validate insts and make them the loaded program, replacing any already loaded */
+int
+ubpf_replace_code(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+
+/* Check that every loop in a program is bounded, see ubpf_loops.c */
+bool
+ubpf_check_loops(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+
+/* Check every path through a program, see ubpf_verifier.c */
+bool
+ubpf_verify(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+
+/* The registers inst reads, as a bitmask; the ones it writes go in defs */
+uint16_t
+ubpf_inst_regs(const struct ebpf_inst* inst, uint16_t* defs);
+
+/* result = a op b (an EBPF_ALU_OP_MASK op) as the interpreter computes it, if it is defined */
 bool
-validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+ubpf_alu_fold(uint8_t op, bool is64, uint64_t a, uint64_t b, uint64_t* result);
 
-/* The various JIT targets.  */
+/*
+ * The various JIT targets.  If pc_locs is not NULL it receives num_insts + 1
+ * offsets into buffer: where each instruction's code starts, then the epilogue.
+ * The code is then laid out in program order, otherwise the x86-64 JIT may
+ * reorder it following vm->branch_counts.  If in_place is true the code will
+ * run from buffer itself, so it may call helpers by relative address.
+ */
 int
-ubpf_translate_arm64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
+ubpf_translate_arm64(
+    struct ubpf_vm* vm, uint8_t* buffer, size_t* size, uint32_t* pc_locs, bool in_place, char** errmsg);
 int
-ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
+ubpf_translate_x86_64(
+    struct ubpf_vm* vm, uint8_t* buffer, size_t* size, uint32_t* pc_locs, bool in_place, char** errmsg);
 int
-ubpf_translate_null(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
+ubpf_translate_null(
+    struct ubpf_vm* vm, uint8_t* buffer, size_t* size, uint32_t* pc_locs, bool in_place, char** errmsg);
+
+/**
+ * @brief Translate the loaded program and map it executable, without
+ * publishing it in vm->jitted.
+ *
+ * @param[in] vm The VM whose program should be compiled.
+ * @param[out] jitted_size The size of the returned mapping.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @return The compiled program (unmap with munmap()), or NULL on failure.
+ */
+ubpf_jit_fn
+ubpf_jit_build(struct ubpf_vm* vm, size_t* jitted_size, char** errmsg);
+
+/* Tell perf about freshly JIT'd code, see ubpf_jit_perf.c */
+void
+ubpf_jit_perf_record(struct ubpf_vm* vm, const void* code, size_t size, const uint32_t* pc_locs);
+
+/* Close the object loaded by ubpf_aot_load(), if any */
+void
+ubpf_aot_unload(struct ubpf_vm* vm);
+
+/* Tiered execution state, see ubpf_tiered.c */
+struct ubpf_tier*
+ubpf_tier_create(struct ubpf_vm* vm);
+void
+ubpf_tier_reset(struct ubpf_tier* tier);
+void
+ubpf_tier_destroy(struct ubpf_tier* tier);
+
+/*
+ * A shadow is a copy of a VM that shares its program, helpers and compiled
+ * code but has its own registers and stack, so it can run on another thread.
+ * mem still points at the original's memory; point it somewhere else (and
+ * set mem_len) before running shadows concurrently.  The original must
+ * outlive the shadow.  Its code may be swapped with ubpf_swap_code() while
+ * the shadow runs (the shadow keeps the program it started with), but not
+ * otherwise reloaded.
+ */
+bool
+ubpf_shadow_init(struct ubpf_vm* shadow, const struct ubpf_vm* vm);
+void
+ubpf_shadow_cleanup(struct ubpf_vm* shadow);
+
+/* Maps, see ubpf_maps.c */
+bool
+ubpf_maps_contain(const struct ubpf_vm* vm, const void* addr, int size);
+/* Bytes from addr to the end of the map values it is in, or 0 */
+size_t
+ubpf_maps_avail(const struct ubpf_vm* vm, const void* addr);
+/* Value size of the map registered as id, or 0 if there isn't one */
+uint32_t
+ubpf_maps_value_size(const struct ubpf_vm* vm, uint64_t id);
+/* Key size of the map registered as id, or 0 if there isn't one */
+uint32_t
+ubpf_maps_key_size(const struct ubpf_vm* vm, uint64_t id);
+/* Whether any map registered with an id in [min, max] is read-only to programs */
+bool
+ubpf_maps_readonly(const struct ubpf_vm* vm, uint64_t min, uint64_t max);
+/* Whether helper is a map helper that only reads through argument arg (1-5) */
+bool
+ubpf_maps_reads_only(const struct ubpf_vm* vm, int32_t helper, int arg);
+/* Whether helper is map_lookup_elem */
+bool
+ubpf_maps_is_lookup(const struct ubpf_vm* vm, int32_t helper);
+/* Whether helper is tail_call */
+bool
+ubpf_maps_is_tail_call(const struct ubpf_vm* vm, int32_t helper);
+/* The VM in slot index of the program array registered as id, or NULL */
+struct ubpf_vm*
+ubpf_maps_prog(const struct ubpf_vm* vm, uint64_t id, uint64_t index);
+/* Bumped whenever the map registered as id changes while read-only */
+uint32_t
+ubpf_maps_generation(const struct ubpf_vm* vm, unsigned int id);
+/*
+ * For specializing on read-only maps that aren't per-CPU: the result of
+ * map_lookup_elem, or the value at addr, and the map's generation before it
+ * was read.  False if the map or address doesn't qualify.
+ */
+bool
+ubpf_maps_const_lookup(const struct ubpf_vm* vm, uint64_t id, const void* key, uint64_t* value, uint32_t* generation);
+bool
+ubpf_maps_const_read(
+    const struct ubpf_vm* vm, uint64_t addr, int size, uint64_t* value, unsigned int* id, uint32_t* generation);
+/* Which copy of per-CPU map values the calling thread uses */
+void
+ubpf_set_cpu(unsigned int cpu);
+
+/*
+ * How many bytes from addr a helper may access on behalf of the running
+ * program: up to the end of the memory, stack, packet or map value it is in,
+ * as the interpreter's bounds checks allow. Only calls made by the
+ * interpreter (vm->checked_call) are checked; calls from compiled code, and
+ * VMs without bounds checks, get SIZE_MAX.
+ */
+size_t
+ubpf_accessible(const struct ubpf_vm* vm, const void* addr);
 
 char*
 ubpf_error(const char* fmt, ...);
@@ -74,7 +293,7 @@ ubpf_lookup_registered_function(struct ubpf_vm* vm, const char* name);
  * @return The instruction.
  */
 struct ebpf_inst
-ubpf_fetch_instruction(const struct ubpf_vm* vm, uint16_t pc);
+ubpf_fetch_instruction(const struct ubpf_vm* vm, uint32_t pc);
 
 /**
  * @brief Store the given instruction at the given index.
@@ -84,6 +303,6 @@ ubpf_fetch_instruction(const struct ubpf_vm* vm, uint16_t pc);
  * @param[in] inst The instruction to store.
  */
 void
-ubpf_store_instruction(const struct ubpf_vm* vm, uint16_t pc, struct ebpf_inst inst);
+ubpf_store_instruction(const struct ubpf_vm* vm, uint32_t pc, struct ebpf_inst inst);
 
 #endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ * Copyright 2017 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ubpf_int.h"
+
+/* Enough room for the longest single-instruction expansion in any backend. */
+#define JIT_BYTES_PER_INST 128
+#define JIT_MIN_BUFFER_SIZE 65536
+#define JIT_HINT_DISTANCE (256u << 20)
+
+int
+ubpf_translate(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg)
+{
+    return vm->translate(vm, buffer, size, NULL, false, errmsg);
+}
+
+int
+ubpf_translate_null(
+    struct ubpf_vm* vm, uint8_t* buffer, size_t* size, uint32_t* pc_locs, bool in_place, char** errmsg)
+{
+    /* NULL JIT target - just returns an error. */
+    *errmsg = ubpf_error("Code can not be JITed on this target.");
+    return -1;
+}
+
+/*
+ * Where to ask for the code to be mapped: near this library, and so likely
+ * near the helpers it calls, for x86-64's 32-bit relative calls to reach them.
+ */
+static void*
+jit_address_hint(void)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t here = (uintptr_t)&ubpf_jit_build & ~(page - 1);
+    return (void*)(here > JIT_HINT_DISTANCE ? here - JIT_HINT_DISTANCE : here + JIT_HINT_DISTANCE);
+}
+
+ubpf_jit_fn
+ubpf_jit_build(struct ubpf_vm* vm, size_t* jitted_size, char** errmsg)
+{
+    uint8_t* jitted = NULL;
+    uint32_t* pc_locs = NULL;
+    size_t buffer_size;
+    size_t size;
+
+    *errmsg = NULL;
+
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return NULL;
+    }
+
+    buffer_size = (size_t)vm->num_insts * JIT_BYTES_PER_INST;
+    if (buffer_size < JIT_MIN_BUFFER_SIZE) {
+        buffer_size = JIT_MIN_BUFFER_SIZE;
+    }
+
+    /* Asking for pc_locs also keeps the code in program order, see ubpf_int.h */
+    if (vm->jit_profiling & (UBPF_JIT_PERF_MAP_INSTS | UBPF_JIT_JITDUMP)) {
+        pc_locs = calloc((size_t)vm->num_insts + 1, sizeof(*pc_locs));
+        if (pc_locs == NULL) {
+            *errmsg = ubpf_error("out of memory");
+            return NULL;
+        }
+    }
+
+    /* Translate straight into the mapping the code will run from, then give back what it didn't use */
+    jitted = mmap(jit_address_hint(), buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jitted == MAP_FAILED) {
+        *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
+        jitted = NULL;
+        goto out;
+    }
+
+    size = buffer_size;
+    if (vm->translate(vm, jitted, &size, pc_locs, true, errmsg) < 0) {
+        munmap(jitted, buffer_size);
+        jitted = NULL;
+        goto out;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t used = (size + page - 1) & ~(page - 1);
+    if (used < buffer_size) {
+        munmap(jitted + used, buffer_size - used);
+    }
+
+    if (mprotect(jitted, size, PROT_READ | PROT_EXEC) < 0) {
+        *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
+        munmap(jitted, size);
+        jitted = NULL;
+        goto out;
+    }
+
+    *jitted_size = size;
+
+    if (vm->jit_profiling) {
+        ubpf_jit_perf_record(vm, jitted, size, pc_locs);
+    }
+
+out:
+    free(pc_locs);
+    return (ubpf_jit_fn)jitted;
+}
+
+ubpf_jit_fn
+ubpf_compile(struct ubpf_vm* vm, char** errmsg)
+{
+    ubpf_jit_fn jitted;
+    size_t jitted_size;
+
+    *errmsg = NULL;
+
+    ubpf_spec_refresh(vm);
+    if (vm->jitted) {
+        return vm->jitted;
+    }
+
+    jitted = ubpf_jit_build(vm, &jitted_size, errmsg);
+    if (jitted == NULL) {
+        return NULL;
+    }
+
+    ubpf_unpublish(vm);
+    vm->jitted = jitted;
+    vm->jitted_size = jitted_size;
+    return vm->jitted;
+}
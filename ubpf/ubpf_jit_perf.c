@@ -0,0 +1,310 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tell perf where JIT'd programs live.
+ *
+ * The perf map (/tmp/perf-<pid>.map) is a text file of "start size name"
+ * lines that perf report reads directly.  The jitdump (/tmp/jit-<pid>.dump)
+ * is the binary format described in the Linux tree under
+ * tools/perf/Documentation/jitdump-specification.txt; perf inject --jit turns
+ * each code load into a small ELF image, so perf annotate gets the machine
+ * code too.  Line info in the jitdump points at a listing we write next to
+ * it, one eBPF instruction per line, so line N is pc N-1.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <inttypes.h>
+#include "ubpf_int.h"
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_DEBUG_INFO 2
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define JITDUMP_ELF_MACH 183 /* EM_AARCH64 */
+#else
+#define JITDUMP_ELF_MACH 62 /* EM_X86_64 */
+#endif
+
+struct jitdump_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jitdump_prefix
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jitdump_code_load
+{
+    struct jitdump_prefix p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    /* followed by the NUL terminated name, then the code bytes */
+};
+
+struct jitdump_debug_info
+{
+    struct jitdump_prefix p;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+    /* followed by nr_entry jitdump_debug_entry, each with a filename */
+};
+
+struct jitdump_debug_entry
+{
+    uint64_t addr;
+    int32_t lineno;
+    int32_t discrim;
+    /* followed by the NUL terminated filename */
+};
+
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* perf_map;
+static FILE* jitdump;
+static void* jitdump_marker;
+static uint64_t code_index;
+
+static uint64_t
+perf_timestamp(void)
+{
+    /* perf record -k mono */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static FILE*
+open_perf_map(struct ubpf_vm* vm)
+{
+    if (perf_map == NULL) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        perf_map = fopen(path, "a");
+        if (perf_map == NULL) {
+            vm->error_printf(stderr, "uBPF error: could not open %s: %s\n", path, strerror(errno));
+        }
+    }
+    return perf_map;
+}
+
+static FILE*
+open_jitdump(struct ubpf_vm* vm)
+{
+    if (jitdump != NULL) {
+        return jitdump;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+    FILE* f = fopen(path, "w+");
+    if (f == NULL) {
+        vm->error_printf(stderr, "uBPF error: could not open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    /*
+     * perf finds the dump by seeing it mapped executable in the process;
+     * the mapping is never used for anything else.
+     */
+    jitdump_marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(f), 0);
+    if (jitdump_marker == MAP_FAILED) {
+        vm->error_printf(stderr, "uBPF error: could not map %s: %s\n", path, strerror(errno));
+        jitdump_marker = NULL;
+        fclose(f);
+        return NULL;
+    }
+
+    struct jitdump_header header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(header),
+        .elf_mach = JITDUMP_ELF_MACH,
+        .pid = getpid(),
+        .timestamp = perf_timestamp(),
+    };
+    fwrite(&header, sizeof(header), 1, f);
+    fflush(f);
+
+    jitdump = f;
+    return jitdump;
+}
+
+/*
+ * pc's code is [pc_locs[pc], pc_locs[pc + 1]); some instructions (the second
+ * half of lddw, a no-op byte swap, a final exit) produce none.
+ */
+static bool
+owns_code(const uint32_t* pc_locs, int pc)
+{
+    return pc_locs[pc] != pc_locs[pc + 1];
+}
+
+static void
+write_perf_map(struct ubpf_vm* vm, FILE* f, uintptr_t code, size_t size, const uint32_t* pc_locs)
+{
+    const char* name = vm->jit_name;
+
+    if (!(vm->jit_profiling & UBPF_JIT_PERF_MAP_INSTS) || pc_locs == NULL) {
+        fprintf(f, "%" PRIxPTR " %zx ubpf_prog_%s\n", code, size, name);
+        fflush(f);
+        return;
+    }
+
+    fprintf(f, "%" PRIxPTR " %x ubpf_prog_%s_prologue\n", code, pc_locs[0], name);
+    for (int pc = 0; pc < vm->num_insts; pc++) {
+        if (!owns_code(pc_locs, pc)) {
+            continue;
+        }
+        fprintf(f, "%" PRIxPTR " %x ubpf_prog_%s+pc%d\n", code + pc_locs[pc], pc_locs[pc + 1] - pc_locs[pc], name, pc);
+    }
+    fprintf(
+        f,
+        "%" PRIxPTR " %zx ubpf_prog_%s_epilogue\n",
+        code + pc_locs[vm->num_insts],
+        size - pc_locs[vm->num_insts],
+        name);
+    fflush(f);
+}
+
+/* One line per instruction slot, so jitdump line numbers are pc + 1. */
+static bool
+write_listing(struct ubpf_vm* vm, const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        vm->error_printf(stderr, "uBPF error: could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    for (int pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        fprintf(
+            f,
+            "%5d: op=0x%02x dst=r%d src=r%d off=%d imm=%d\n",
+            pc,
+            inst.opcode,
+            inst.dst,
+            inst.src,
+            inst.offset,
+            inst.imm);
+    }
+    fclose(f);
+    return true;
+}
+
+static void
+write_jitdump(struct ubpf_vm* vm, FILE* f, uintptr_t code, size_t size, const uint32_t* pc_locs)
+{
+    uint64_t index = code_index++;
+    char name[256];
+    snprintf(name, sizeof(name), "ubpf_prog_%s", vm->jit_name);
+
+    if (pc_locs != NULL) {
+        char listing[128];
+        snprintf(listing, sizeof(listing), "/tmp/ubpf-%d-%" PRIu64 ".bpf", getpid(), index);
+        if (write_listing(vm, listing)) {
+            size_t listing_len = strlen(listing) + 1;
+            uint64_t nr_entry = 0;
+            for (int pc = 0; pc < vm->num_insts; pc++) {
+                nr_entry += owns_code(pc_locs, pc);
+            }
+
+            struct jitdump_debug_info info = {
+                .p.id = JIT_CODE_DEBUG_INFO,
+                .p.total_size = sizeof(info) + nr_entry * (sizeof(struct jitdump_debug_entry) + listing_len),
+                .p.timestamp = perf_timestamp(),
+                .code_addr = code,
+                .nr_entry = nr_entry,
+            };
+            fwrite(&info, sizeof(info), 1, f);
+            for (int pc = 0; pc < vm->num_insts; pc++) {
+                if (!owns_code(pc_locs, pc)) {
+                    continue;
+                }
+                struct jitdump_debug_entry entry = {
+                    .addr = code + pc_locs[pc],
+                    .lineno = pc + 1,
+                };
+                fwrite(&entry, sizeof(entry), 1, f);
+                fwrite(listing, listing_len, 1, f);
+            }
+        }
+    }
+
+    size_t name_len = strlen(name) + 1;
+    struct jitdump_code_load load = {
+        .p.id = JIT_CODE_LOAD,
+        .p.total_size = sizeof(load) + name_len + size,
+        .p.timestamp = perf_timestamp(),
+        .pid = getpid(),
+        .tid = syscall(SYS_gettid),
+        .vma = code,
+        .code_addr = code,
+        .code_size = size,
+        .code_index = index,
+    };
+    fwrite(&load, sizeof(load), 1, f);
+    fwrite(name, name_len, 1, f);
+    fwrite((const void*)code, size, 1, f);
+    fflush(f);
+}
+
+void
+ubpf_jit_perf_record(struct ubpf_vm* vm, const void* code, size_t size, const uint32_t* pc_locs)
+{
+    pthread_mutex_lock(&perf_lock);
+
+    if (vm->jit_profiling & (UBPF_JIT_PERF_MAP | UBPF_JIT_PERF_MAP_INSTS)) {
+        FILE* f = open_perf_map(vm);
+        if (f) {
+            write_perf_map(vm, f, (uintptr_t)code, size, pc_locs);
+        }
+    }
+
+    if (vm->jit_profiling & UBPF_JIT_JITDUMP) {
+        FILE* f = open_jitdump(vm);
+        if (f) {
+            write_jitdump(vm, f, (uintptr_t)code, size, pc_locs);
+        }
+    }
+
+    pthread_mutex_unlock(&perf_lock);
+}
@@ -0,0 +1,1161 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * WebAssembly backend: translate a program into a standalone module that
+ * the browser compiles to native code.
+ *
+ * The module imports the VM's linear memory as env.memory and its function
+ * table as env.table, and exports run(r1, r2, r10) -> r0.  On exit it sets
+ * the VM's pc and return_value as the interpreter would.  Registers are
+ * i64 locals; the context and stack are addressed in the shared memory, and
+ * helpers are called through the table with the same (vm, call, r1..r5)
+ * arguments the interpreter passes, so this only makes sense for a VM that
+ * lives in the same WebAssembly instance (the emscripten build).
+ *
+ * WebAssembly only has structured control flow.  A forward jump to pc T
+ * becomes a branch out of a block that ends right before T: blocks for all
+ * targets are opened at the top, innermost first, and each is closed when
+ * translation reaches its target.  Backward jumps are rejected; callers fall
+ * back to the interpreter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#define WASM_I32 0x7f
+#define WASM_I64 0x7e
+#define WASM_FUNCREF 0x70
+#define WASM_VOID 0x40
+
+#define WASM_BLOCK 0x02
+#define WASM_IF 0x04
+#define WASM_ELSE 0x05
+#define WASM_END 0x0b
+#define WASM_BR 0x0c
+#define WASM_BR_IF 0x0d
+#define WASM_RETURN 0x0f
+#define WASM_CALL 0x10
+#define WASM_CALL_INDIRECT 0x11
+#define WASM_LOCAL_GET 0x20
+#define WASM_LOCAL_SET 0x21
+#define WASM_I64_LOAD 0x29
+#define WASM_I64_LOAD8_U 0x31
+#define WASM_I64_LOAD16_U 0x33
+#define WASM_I64_LOAD32_U 0x35
+#define WASM_I64_STORE 0x37
+#define WASM_I64_STORE8 0x3c
+#define WASM_I64_STORE16 0x3d
+#define WASM_I64_STORE32 0x3e
+#define WASM_I32_CONST 0x41
+#define WASM_I64_CONST 0x42
+#define WASM_I32_EQZ 0x45
+#define WASM_I32_EQ 0x46
+#define WASM_I32_NE 0x47
+#define WASM_I32_LT_S 0x48
+#define WASM_I32_LT_U 0x49
+#define WASM_I32_GT_S 0x4a
+#define WASM_I32_GT_U 0x4b
+#define WASM_I32_LE_S 0x4c
+#define WASM_I32_LE_U 0x4d
+#define WASM_I32_GE_S 0x4e
+#define WASM_I32_GE_U 0x4f
+#define WASM_I64_EQZ 0x50
+#define WASM_I64_EQ 0x51
+#define WASM_I64_NE 0x52
+#define WASM_I64_LT_S 0x53
+#define WASM_I64_LT_U 0x54
+#define WASM_I64_GT_S 0x55
+#define WASM_I64_GT_U 0x56
+#define WASM_I64_LE_S 0x57
+#define WASM_I64_LE_U 0x58
+#define WASM_I64_GE_S 0x59
+#define WASM_I64_GE_U 0x5a
+#define WASM_I32_DIV_U 0x6e
+#define WASM_I32_REM_U 0x70
+#define WASM_I32_AND 0x71
+#define WASM_I32_OR 0x72
+#define WASM_I32_SHL 0x74
+#define WASM_I32_SHR_S 0x75
+#define WASM_I32_SHR_U 0x76
+#define WASM_I32_ROTL 0x77
+#define WASM_I32_ROTR 0x78
+#define WASM_I64_ADD 0x7c
+#define WASM_I64_SUB 0x7d
+#define WASM_I64_MUL 0x7e
+#define WASM_I64_DIV_U 0x80
+#define WASM_I64_REM_U 0x82
+#define WASM_I64_AND 0x83
+#define WASM_I64_OR 0x84
+#define WASM_I64_XOR 0x85
+#define WASM_I64_SHL 0x86
+#define WASM_I64_SHR_S 0x87
+#define WASM_I64_SHR_U 0x88
+#define WASM_I32_WRAP_I64 0xa7
+#define WASM_I64_EXTEND_I32_U 0xad
+
+/* Type indices */
+#define TYPE_RUN 0
+#define TYPE_HELPER 1
+#define TYPE_BSWAP32 2
+#define TYPE_BSWAP64 3
+
+/* Function indices (nothing is imported, so these start at 0) */
+#define FUNC_RUN 0
+#define FUNC_BSWAP32 1
+#define FUNC_BSWAP64 2
+
+/* run()'s parameters, then a local per eBPF register */
+#define PARAM_R1 0
+#define PARAM_R2 1
+#define PARAM_R10 2
+#define REG_LOCAL(r) (3 + (r))
+/* Scratch locals for atomics */
+#define ADDR_LOCAL REG_LOCAL(11)
+#define OLD_LOCAL REG_LOCAL(12)
+
+struct wasm_buf
+{
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    bool oom;
+};
+
+static void
+emit_byte(struct wasm_buf* b, uint8_t x)
+{
+    if (b->len == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        uint8_t* data = b->oom ? NULL : realloc(b->data, cap);
+        if (data == NULL) {
+            b->oom = true;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    b->data[b->len++] = x;
+}
+
+static void
+emit_bytes(struct wasm_buf* b, const void* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        emit_byte(b, ((const uint8_t*)data)[i]);
+    }
+}
+
+static void
+emit_uleb(struct wasm_buf* b, uint64_t x)
+{
+    do {
+        uint8_t byte = x & 0x7f;
+        x >>= 7;
+        emit_byte(b, byte | (x ? 0x80 : 0));
+    } while (x);
+}
+
+static void
+emit_sleb(struct wasm_buf* b, int64_t x)
+{
+    bool more = true;
+    while (more) {
+        uint8_t byte = x & 0x7f;
+        x >>= 7;
+        more = !((x == 0 && !(byte & 0x40)) || (x == -1 && (byte & 0x40)));
+        emit_byte(b, byte | (more ? 0x80 : 0));
+    }
+}
+
+static void
+emit_name(struct wasm_buf* b, const char* name)
+{
+    emit_uleb(b, strlen(name));
+    emit_bytes(b, name, strlen(name));
+}
+
+/* Append a length-prefixed copy of src (optionally behind a section id) */
+static void
+emit_section(struct wasm_buf* b, int id, const struct wasm_buf* src)
+{
+    if (id >= 0) {
+        emit_byte(b, id);
+    }
+    emit_uleb(b, src->len);
+    emit_bytes(b, src->data, src->len);
+    b->oom |= src->oom;
+}
+
+static void
+emit_get(struct wasm_buf* b, int reg)
+{
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, REG_LOCAL(reg));
+}
+
+static void
+emit_set(struct wasm_buf* b, int reg)
+{
+    emit_byte(b, WASM_LOCAL_SET);
+    emit_uleb(b, REG_LOCAL(reg));
+}
+
+static void
+emit_i64_const(struct wasm_buf* b, int64_t x)
+{
+    emit_byte(b, WASM_I64_CONST);
+    emit_sleb(b, x);
+}
+
+static void
+emit_i32_const(struct wasm_buf* b, int32_t x)
+{
+    emit_byte(b, WASM_I32_CONST);
+    emit_sleb(b, x);
+}
+
+/* Push the low 32 bits of a register as an i32 */
+static void
+emit_get32(struct wasm_buf* b, int reg)
+{
+    emit_get(b, reg);
+    emit_byte(b, WASM_I32_WRAP_I64);
+}
+
+static void
+emit_mask32(struct wasm_buf* b)
+{
+    emit_i64_const(b, UINT32_MAX);
+    emit_byte(b, WASM_I64_AND);
+}
+
+/* Push the effective address reg + offset as an i32 */
+static void
+emit_address(struct wasm_buf* b, int reg, int16_t offset)
+{
+    emit_get(b, reg);
+    if (offset) {
+        emit_i64_const(b, offset);
+        emit_byte(b, WASM_I64_ADD);
+    }
+    emit_byte(b, WASM_I32_WRAP_I64);
+}
+
+static void
+emit_memarg(struct wasm_buf* b)
+{
+    /* Unaligned, no offset: eBPF offsets are signed */
+    emit_uleb(b, 0);
+    emit_uleb(b, 0);
+}
+
+/*
+ * ALU operations that are a single wasm opcode applied to the full 64-bit
+ * values.  The 32-bit variants mask the result, like the interpreter.
+ */
+struct simple_alu
+{
+    uint8_t opcode;
+    uint8_t wasm_op;
+    bool is_imm;
+    bool mask;
+};
+
+static const struct simple_alu simple_alus[] = {
+    {EBPF_OP_ADD_IMM, WASM_I64_ADD, true, true},
+    {EBPF_OP_ADD_REG, WASM_I64_ADD, false, true},
+    {EBPF_OP_SUB_IMM, WASM_I64_SUB, true, true},
+    {EBPF_OP_SUB_REG, WASM_I64_SUB, false, true},
+    {EBPF_OP_MUL_IMM, WASM_I64_MUL, true, true},
+    {EBPF_OP_MUL_REG, WASM_I64_MUL, false, true},
+    {EBPF_OP_OR_IMM, WASM_I64_OR, true, true},
+    {EBPF_OP_OR_REG, WASM_I64_OR, false, true},
+    {EBPF_OP_AND_IMM, WASM_I64_AND, true, true},
+    {EBPF_OP_AND_REG, WASM_I64_AND, false, true},
+    {EBPF_OP_XOR_IMM, WASM_I64_XOR, true, true},
+    {EBPF_OP_XOR_REG, WASM_I64_XOR, false, true},
+    {EBPF_OP_ADD64_IMM, WASM_I64_ADD, true, false},
+    {EBPF_OP_ADD64_REG, WASM_I64_ADD, false, false},
+    {EBPF_OP_SUB64_IMM, WASM_I64_SUB, true, false},
+    {EBPF_OP_SUB64_REG, WASM_I64_SUB, false, false},
+    {EBPF_OP_MUL64_IMM, WASM_I64_MUL, true, false},
+    {EBPF_OP_MUL64_REG, WASM_I64_MUL, false, false},
+    {EBPF_OP_OR64_IMM, WASM_I64_OR, true, false},
+    {EBPF_OP_OR64_REG, WASM_I64_OR, false, false},
+    {EBPF_OP_AND64_IMM, WASM_I64_AND, true, false},
+    {EBPF_OP_AND64_REG, WASM_I64_AND, false, false},
+    {EBPF_OP_LSH64_IMM, WASM_I64_SHL, true, false},
+    {EBPF_OP_LSH64_REG, WASM_I64_SHL, false, false},
+    {EBPF_OP_RSH64_IMM, WASM_I64_SHR_U, true, false},
+    {EBPF_OP_RSH64_REG, WASM_I64_SHR_U, false, false},
+    {EBPF_OP_XOR64_IMM, WASM_I64_XOR, true, false},
+    {EBPF_OP_XOR64_REG, WASM_I64_XOR, false, false},
+    {EBPF_OP_ARSH64_IMM, WASM_I64_SHR_S, true, false},
+    {EBPF_OP_ARSH64_REG, WASM_I64_SHR_S, false, false},
+};
+
+/*
+ * Conditional jumps.  Comparisons are 64-bit unless is32; like the
+ * interpreter, 64-bit comparisons sign-extend the immediate.
+ */
+struct cond_jump
+{
+    uint8_t opcode;
+    uint8_t wasm_op;
+    bool is_imm;
+    bool is32;
+};
+
+static const struct cond_jump cond_jumps[] = {
+    {EBPF_OP_JEQ_IMM, WASM_I64_EQ, true, false},
+    {EBPF_OP_JEQ_REG, WASM_I64_EQ, false, false},
+    {EBPF_OP_JEQ32_IMM, WASM_I32_EQ, true, true},
+    {EBPF_OP_JEQ32_REG, WASM_I32_EQ, false, true},
+    {EBPF_OP_JGT_IMM, WASM_I64_GT_U, true, false},
+    {EBPF_OP_JGT_REG, WASM_I64_GT_U, false, false},
+    {EBPF_OP_JGT32_IMM, WASM_I32_GT_U, true, true},
+    {EBPF_OP_JGT32_REG, WASM_I32_GT_U, false, true},
+    {EBPF_OP_JGE_IMM, WASM_I64_GE_U, true, false},
+    {EBPF_OP_JGE_REG, WASM_I64_GE_U, false, false},
+    {EBPF_OP_JGE32_IMM, WASM_I32_GE_U, true, true},
+    {EBPF_OP_JGE32_REG, WASM_I32_GE_U, false, true},
+    {EBPF_OP_JLT_IMM, WASM_I64_LT_U, true, false},
+    {EBPF_OP_JLT_REG, WASM_I64_LT_U, false, false},
+    {EBPF_OP_JLT32_IMM, WASM_I32_LT_U, true, true},
+    {EBPF_OP_JLT32_REG, WASM_I32_LT_U, false, true},
+    {EBPF_OP_JLE_IMM, WASM_I64_LE_U, true, false},
+    {EBPF_OP_JLE_REG, WASM_I64_LE_U, false, false},
+    {EBPF_OP_JLE32_IMM, WASM_I32_LE_U, true, true},
+    {EBPF_OP_JLE32_REG, WASM_I32_LE_U, false, true},
+    {EBPF_OP_JNE_IMM, WASM_I64_NE, true, false},
+    {EBPF_OP_JNE_REG, WASM_I64_NE, false, false},
+    {EBPF_OP_JNE32_IMM, WASM_I32_NE, true, true},
+    {EBPF_OP_JNE32_REG, WASM_I32_NE, false, true},
+    {EBPF_OP_JSGT_IMM, WASM_I64_GT_S, true, false},
+    {EBPF_OP_JSGT_REG, WASM_I64_GT_S, false, false},
+    {EBPF_OP_JSGT32_IMM, WASM_I32_GT_S, true, true},
+    {EBPF_OP_JSGT32_REG, WASM_I32_GT_S, false, true},
+    {EBPF_OP_JSGE_IMM, WASM_I64_GE_S, true, false},
+    {EBPF_OP_JSGE_REG, WASM_I64_GE_S, false, false},
+    {EBPF_OP_JSGE32_IMM, WASM_I32_GE_S, true, true},
+    {EBPF_OP_JSGE32_REG, WASM_I32_GE_S, false, true},
+    {EBPF_OP_JSLT_IMM, WASM_I64_LT_S, true, false},
+    {EBPF_OP_JSLT_REG, WASM_I64_LT_S, false, false},
+    {EBPF_OP_JSLT32_IMM, WASM_I32_LT_S, true, true},
+    {EBPF_OP_JSLT32_REG, WASM_I32_LT_S, false, true},
+    {EBPF_OP_JSLE_IMM, WASM_I64_LE_S, true, false},
+    {EBPF_OP_JSLE_REG, WASM_I64_LE_S, false, false},
+    {EBPF_OP_JSLE32_IMM, WASM_I32_LE_S, true, true},
+    {EBPF_OP_JSLE32_REG, WASM_I32_LE_S, false, true},
+};
+
+/* Push the condition of a conditional jump as an i32; false if not one */
+static bool
+emit_condition(struct wasm_buf* b, struct ebpf_inst inst)
+{
+    switch (inst.opcode) {
+    case EBPF_OP_JSET_IMM:
+    case EBPF_OP_JSET_REG:
+        emit_get(b, inst.dst);
+        if (inst.opcode == EBPF_OP_JSET_IMM) {
+            emit_i64_const(b, inst.imm);
+        } else {
+            emit_get(b, inst.src);
+        }
+        emit_byte(b, WASM_I64_AND);
+        emit_i64_const(b, 0);
+        emit_byte(b, WASM_I64_NE);
+        return true;
+    case EBPF_OP_JSET32_IMM:
+    case EBPF_OP_JSET32_REG:
+        emit_get32(b, inst.dst);
+        if (inst.opcode == EBPF_OP_JSET32_IMM) {
+            emit_i32_const(b, inst.imm);
+        } else {
+            emit_get32(b, inst.src);
+        }
+        emit_byte(b, WASM_I32_AND);
+        return true;
+    }
+
+    for (size_t i = 0; i < sizeof(cond_jumps) / sizeof(cond_jumps[0]); i++) {
+        const struct cond_jump* j = &cond_jumps[i];
+        if (j->opcode != inst.opcode) {
+            continue;
+        }
+        if (j->is32) {
+            emit_get32(b, inst.dst);
+            if (j->is_imm) {
+                emit_i32_const(b, inst.imm);
+            } else {
+                emit_get32(b, inst.src);
+            }
+        } else {
+            emit_get(b, inst.dst);
+            if (j->is_imm) {
+                emit_i64_const(b, inst.imm);
+            } else {
+                emit_get(b, inst.src);
+            }
+        }
+        emit_byte(b, j->wasm_op);
+        return true;
+    }
+    return false;
+}
+
+/* Operations the interpreter does on the low 32 bits */
+static bool
+emit_alu32(struct wasm_buf* b, struct ebpf_inst inst)
+{
+    uint32_t imm = inst.imm;
+
+    switch (inst.opcode) {
+    case EBPF_OP_LSH_IMM:
+    case EBPF_OP_LSH_REG:
+    case EBPF_OP_RSH_IMM:
+    case EBPF_OP_RSH_REG:
+    case EBPF_OP_ARSH_IMM:
+    case EBPF_OP_ARSH_REG:
+        /* wasm takes 32-bit shift counts mod 32, as the interpreter does */
+        emit_get32(b, inst.dst);
+        if (!(inst.opcode & EBPF_SRC_REG)) {
+            emit_i32_const(b, inst.imm);
+        } else {
+            emit_get32(b, inst.src);
+        }
+        switch (inst.opcode & EBPF_ALU_OP_MASK) {
+        case EBPF_OP_LSH_IMM & EBPF_ALU_OP_MASK:
+            emit_byte(b, WASM_I32_SHL);
+            break;
+        case EBPF_OP_RSH_IMM & EBPF_ALU_OP_MASK:
+            emit_byte(b, WASM_I32_SHR_U);
+            break;
+        default:
+            emit_byte(b, WASM_I32_SHR_S);
+            break;
+        }
+        emit_byte(b, WASM_I64_EXTEND_I32_U);
+        break;
+
+    case EBPF_OP_DIV_IMM:
+    case EBPF_OP_MOD_IMM:
+        if (imm == 0) {
+            if (inst.opcode == EBPF_OP_DIV_IMM) {
+                emit_i64_const(b, 0);
+            } else {
+                emit_get(b, inst.dst);
+                emit_mask32(b);
+            }
+            break;
+        }
+        emit_get32(b, inst.dst);
+        emit_i32_const(b, inst.imm);
+        emit_byte(b, inst.opcode == EBPF_OP_DIV_IMM ? WASM_I32_DIV_U : WASM_I32_REM_U);
+        emit_byte(b, WASM_I64_EXTEND_I32_U);
+        break;
+
+    case EBPF_OP_DIV_REG:
+        emit_get32(b, inst.src);
+        emit_byte(b, WASM_I32_EQZ);
+        emit_byte(b, WASM_IF);
+        emit_byte(b, WASM_I64);
+        emit_i64_const(b, 0);
+        emit_byte(b, WASM_ELSE);
+        emit_get32(b, inst.dst);
+        emit_get32(b, inst.src);
+        emit_byte(b, WASM_I32_DIV_U);
+        emit_byte(b, WASM_I64_EXTEND_I32_U);
+        emit_byte(b, WASM_END);
+        break;
+
+    case EBPF_OP_MOD_REG:
+        emit_get32(b, inst.src);
+        emit_byte(b, WASM_I32_EQZ);
+        emit_byte(b, WASM_IF);
+        emit_byte(b, WASM_I64);
+        emit_get(b, inst.dst);
+        emit_mask32(b);
+        emit_byte(b, WASM_ELSE);
+        emit_get32(b, inst.dst);
+        emit_get32(b, inst.src);
+        emit_byte(b, WASM_I32_REM_U);
+        emit_byte(b, WASM_I64_EXTEND_I32_U);
+        emit_byte(b, WASM_END);
+        break;
+
+    case EBPF_OP_NEG:
+        emit_i64_const(b, 0);
+        emit_get(b, inst.dst);
+        emit_byte(b, WASM_I64_SUB);
+        emit_mask32(b);
+        break;
+
+    case EBPF_OP_MOV_IMM:
+        emit_i64_const(b, imm);
+        break;
+
+    case EBPF_OP_MOV_REG:
+        emit_get(b, inst.src);
+        emit_mask32(b);
+        break;
+
+    default:
+        return false;
+    }
+
+    emit_set(b, inst.dst);
+    return true;
+}
+
+/* Everything else: 64-bit operations, and the 32-bit ones that are masked */
+static bool
+emit_alu(struct wasm_buf* b, struct ebpf_inst inst)
+{
+    switch (inst.opcode) {
+    case EBPF_OP_DIV64_IMM:
+    case EBPF_OP_MOD64_IMM:
+        if (inst.imm == 0) {
+            if (inst.opcode == EBPF_OP_DIV64_IMM) {
+                emit_i64_const(b, 0);
+                emit_set(b, inst.dst);
+            }
+            return true;
+        }
+        emit_get(b, inst.dst);
+        emit_i64_const(b, inst.imm);
+        emit_byte(b, inst.opcode == EBPF_OP_DIV64_IMM ? WASM_I64_DIV_U : WASM_I64_REM_U);
+        break;
+
+    case EBPF_OP_DIV64_REG:
+    case EBPF_OP_MOD64_REG:
+        emit_get(b, inst.src);
+        emit_byte(b, WASM_I64_EQZ);
+        emit_byte(b, WASM_IF);
+        emit_byte(b, WASM_I64);
+        if (inst.opcode == EBPF_OP_DIV64_REG) {
+            emit_i64_const(b, 0);
+        } else {
+            emit_get(b, inst.dst);
+        }
+        emit_byte(b, WASM_ELSE);
+        emit_get(b, inst.dst);
+        emit_get(b, inst.src);
+        emit_byte(b, inst.opcode == EBPF_OP_DIV64_REG ? WASM_I64_DIV_U : WASM_I64_REM_U);
+        emit_byte(b, WASM_END);
+        break;
+
+    case EBPF_OP_NEG64:
+        emit_i64_const(b, 0);
+        emit_get(b, inst.dst);
+        emit_byte(b, WASM_I64_SUB);
+        break;
+
+    case EBPF_OP_MOV64_IMM:
+        emit_i64_const(b, inst.imm);
+        break;
+
+    case EBPF_OP_MOV64_REG:
+        emit_get(b, inst.src);
+        break;
+
+    default:
+        for (size_t i = 0; i < sizeof(simple_alus) / sizeof(simple_alus[0]); i++) {
+            const struct simple_alu* alu = &simple_alus[i];
+            if (alu->opcode != inst.opcode) {
+                continue;
+            }
+            emit_get(b, inst.dst);
+            if (alu->is_imm) {
+                emit_i64_const(b, inst.imm);
+            } else {
+                emit_get(b, inst.src);
+            }
+            emit_byte(b, alu->wasm_op);
+            if (alu->mask) {
+                emit_mask32(b);
+            }
+            emit_set(b, inst.dst);
+            return true;
+        }
+        return false;
+    }
+
+    emit_set(b, inst.dst);
+    return true;
+}
+
+static void
+emit_byteswap(struct wasm_buf* b, struct ebpf_inst inst)
+{
+    if (inst.imm != 16 && inst.imm != 32 && inst.imm != 64) {
+        return;
+    }
+    if (inst.opcode == EBPF_OP_LE) {
+        /* Little-endian host: just truncate */
+        if (inst.imm != 64) {
+            emit_get(b, inst.dst);
+            emit_i64_const(b, inst.imm == 16 ? UINT16_MAX : UINT32_MAX);
+            emit_byte(b, WASM_I64_AND);
+            emit_set(b, inst.dst);
+        }
+        return;
+    }
+
+    switch (inst.imm) {
+    case 16:
+        emit_get(b, inst.dst);
+        emit_i64_const(b, 0xff);
+        emit_byte(b, WASM_I64_AND);
+        emit_i64_const(b, 8);
+        emit_byte(b, WASM_I64_SHL);
+        emit_get(b, inst.dst);
+        emit_i64_const(b, 8);
+        emit_byte(b, WASM_I64_SHR_U);
+        emit_i64_const(b, 0xff);
+        emit_byte(b, WASM_I64_AND);
+        emit_byte(b, WASM_I64_OR);
+        break;
+    case 32:
+        emit_get32(b, inst.dst);
+        emit_byte(b, WASM_CALL);
+        emit_uleb(b, FUNC_BSWAP32);
+        emit_byte(b, WASM_I64_EXTEND_I32_U);
+        break;
+    case 64:
+        emit_get(b, inst.dst);
+        emit_byte(b, WASM_CALL);
+        emit_uleb(b, FUNC_BSWAP64);
+        break;
+    }
+    emit_set(b, inst.dst);
+}
+
+static bool
+emit_memory(struct wasm_buf* b, struct ebpf_inst inst)
+{
+    uint8_t op;
+
+    switch (inst.opcode) {
+    case EBPF_OP_LDXB:
+    case EBPF_OP_LDXH:
+    case EBPF_OP_LDXW:
+    case EBPF_OP_LDXDW:
+        switch (inst.opcode) {
+        case EBPF_OP_LDXB:
+            op = WASM_I64_LOAD8_U;
+            break;
+        case EBPF_OP_LDXH:
+            op = WASM_I64_LOAD16_U;
+            break;
+        case EBPF_OP_LDXW:
+            op = WASM_I64_LOAD32_U;
+            break;
+        default:
+            op = WASM_I64_LOAD;
+            break;
+        }
+        emit_address(b, inst.src, inst.offset);
+        emit_byte(b, op);
+        emit_memarg(b);
+        emit_set(b, inst.dst);
+        return true;
+    }
+
+    switch (inst.opcode & EBPF_SIZE_DW) {
+    case EBPF_SIZE_B:
+        op = WASM_I64_STORE8;
+        break;
+    case EBPF_SIZE_H:
+        op = WASM_I64_STORE16;
+        break;
+    case EBPF_SIZE_W:
+        op = WASM_I64_STORE32;
+        break;
+    default:
+        op = WASM_I64_STORE;
+        break;
+    }
+
+    switch (inst.opcode) {
+    case EBPF_OP_STB:
+    case EBPF_OP_STH:
+    case EBPF_OP_STW:
+    case EBPF_OP_STDW:
+        emit_address(b, inst.dst, inst.offset);
+        emit_i64_const(b, inst.imm);
+        break;
+    case EBPF_OP_STXB:
+    case EBPF_OP_STXH:
+    case EBPF_OP_STXW:
+    case EBPF_OP_STXDW:
+        emit_address(b, inst.dst, inst.offset);
+        emit_get(b, inst.src);
+        break;
+    default:
+        return false;
+    }
+    emit_byte(b, op);
+    emit_memarg(b);
+    return true;
+}
+
+static void
+emit_local(struct wasm_buf* b, uint8_t op, uint32_t local)
+{
+    emit_byte(b, op);
+    emit_uleb(b, local);
+}
+
+/*
+ * Nothing else runs against this memory while the module does (it is not
+ * shared with other threads), so atomics are plain read-modify-writes.
+ */
+static bool
+emit_atomic(struct wasm_buf* b, struct ebpf_inst inst)
+{
+    bool is64 = inst.opcode == EBPF_OP_ATOMIC_STORE;
+    uint8_t alu_op;
+
+    switch (inst.imm & ~EBPF_ATOMIC_OP_FETCH) {
+    case EBPF_ALU_OP_ADD:
+        alu_op = WASM_I64_ADD;
+        break;
+    case EBPF_ALU_OP_OR:
+        alu_op = WASM_I64_OR;
+        break;
+    case EBPF_ALU_OP_AND:
+        alu_op = WASM_I64_AND;
+        break;
+    case EBPF_ALU_OP_XOR:
+        alu_op = WASM_I64_XOR;
+        break;
+    default:
+        if (inst.imm != EBPF_ATOMIC_OP_XCHG && inst.imm != EBPF_ATOMIC_OP_CMPXCHG) {
+            return false;
+        }
+        alu_op = 0;
+        break;
+    }
+
+    emit_get(b, inst.dst);
+    if (inst.offset) {
+        emit_i64_const(b, inst.offset);
+        emit_byte(b, WASM_I64_ADD);
+    }
+    emit_local(b, WASM_LOCAL_SET, ADDR_LOCAL);
+
+    emit_local(b, WASM_LOCAL_GET, ADDR_LOCAL);
+    emit_byte(b, WASM_I32_WRAP_I64);
+    emit_byte(b, is64 ? WASM_I64_LOAD : WASM_I64_LOAD32_U);
+    emit_memarg(b);
+    emit_local(b, WASM_LOCAL_SET, OLD_LOCAL);
+
+    if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+        emit_local(b, WASM_LOCAL_GET, OLD_LOCAL);
+        emit_get(b, 0);
+        if (!is64) {
+            emit_mask32(b);
+        }
+        emit_byte(b, WASM_I64_EQ);
+        emit_byte(b, WASM_IF);
+        emit_byte(b, WASM_VOID);
+    }
+
+    emit_local(b, WASM_LOCAL_GET, ADDR_LOCAL);
+    emit_byte(b, WASM_I32_WRAP_I64);
+    if (alu_op) {
+        emit_local(b, WASM_LOCAL_GET, OLD_LOCAL);
+        emit_get(b, inst.src);
+        emit_byte(b, alu_op);
+    } else {
+        emit_get(b, inst.src);
+    }
+    emit_byte(b, is64 ? WASM_I64_STORE : WASM_I64_STORE32);
+    emit_memarg(b);
+
+    if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+        emit_byte(b, WASM_END);
+        emit_local(b, WASM_LOCAL_GET, OLD_LOCAL);
+        emit_set(b, 0);
+    } else if (inst.imm & EBPF_ATOMIC_OP_FETCH) {
+        emit_local(b, WASM_LOCAL_GET, OLD_LOCAL);
+        emit_set(b, inst.src);
+    }
+    return true;
+}
+
+static int
+compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool
+is_jump(uint8_t opcode)
+{
+    uint8_t cls = opcode & EBPF_CLS_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && opcode != EBPF_OP_CALL && opcode != EBPF_OP_EXIT;
+}
+
+/* Sorted, distinct targets of all jumps */
+static int
+collect_targets(const struct ubpf_vm* vm, uint32_t* targets, int* num_targets, char** errmsg)
+{
+    int n = 0;
+    for (int i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+            continue;
+        }
+        if (!is_jump(inst.opcode)) {
+            continue;
+        }
+        int target = i + inst.offset + 1;
+        if (target <= i) {
+            *errmsg = ubpf_error("backward jump at PC %d can not be translated to WebAssembly", i);
+            return -1;
+        }
+        if (target > vm->num_insts) {
+            *errmsg = ubpf_error("jump out of bounds at PC %d", i);
+            return -1;
+        }
+        targets[n++] = target;
+    }
+
+    qsort(targets, n, sizeof(targets[0]), compare_u32);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || targets[i] != targets[unique - 1]) {
+            targets[unique++] = targets[i];
+        }
+    }
+    *num_targets = unique;
+    return 0;
+}
+
+static int
+find_target(const uint32_t* targets, int num_targets, uint32_t target)
+{
+    const uint32_t* found = bsearch(&target, targets, num_targets, sizeof(targets[0]), compare_u32);
+    return found - targets;
+}
+
+static int
+translate_run(struct ubpf_vm* vm, struct wasm_buf* b, char** errmsg)
+{
+    uint32_t* targets = calloc(vm->num_insts + 1, sizeof(*targets));
+    int num_targets;
+    int next_target = 0;
+    int result = -1;
+
+    if (targets == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+    if (collect_targets(vm, targets, &num_targets, errmsg) < 0) {
+        goto out;
+    }
+
+    /* One local group: the eleven registers and the scratch locals */
+    emit_uleb(b, 1);
+    emit_uleb(b, 13);
+    emit_byte(b, WASM_I64);
+
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, PARAM_R1);
+    emit_set(b, 1);
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, PARAM_R2);
+    emit_set(b, 2);
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, PARAM_R10);
+    emit_set(b, 10);
+
+    /* The block for the last target is outermost */
+    for (int i = 0; i < num_targets; i++) {
+        emit_byte(b, WASM_BLOCK);
+        emit_byte(b, WASM_VOID);
+    }
+
+    for (int i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+
+        while (next_target < num_targets && targets[next_target] == (uint32_t)i) {
+            emit_byte(b, WASM_END);
+            next_target++;
+        }
+
+        if (is_jump(inst.opcode)) {
+            uint32_t target = i + inst.offset + 1;
+            int depth = find_target(targets, num_targets, target) - next_target;
+            if (inst.opcode == EBPF_OP_JA) {
+                emit_byte(b, WASM_BR);
+            } else if (emit_condition(b, inst)) {
+                emit_byte(b, WASM_BR_IF);
+            } else {
+                *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+                goto out;
+            }
+            emit_uleb(b, depth);
+            continue;
+        }
+
+        if (emit_alu32(b, inst) || emit_alu(b, inst) || emit_memory(b, inst)) {
+            continue;
+        }
+
+        switch (inst.opcode) {
+        case EBPF_OP_LE:
+        case EBPF_OP_BE:
+            emit_byteswap(b, inst);
+            break;
+
+        case EBPF_OP_ATOMIC32_STORE:
+        case EBPF_OP_ATOMIC_STORE:
+            if (!emit_atomic(b, inst)) {
+                *errmsg = ubpf_error("invalid atomic operation 0x%x at PC %d", inst.imm, i);
+                goto out;
+            }
+            break;
+
+        case EBPF_OP_LDDW: {
+            struct ebpf_inst inst2 = ubpf_fetch_instruction(vm, ++i);
+            if (next_target < num_targets && targets[next_target] == (uint32_t)i) {
+                *errmsg = ubpf_error("jump into the middle of lddw at PC %d", i);
+                goto out;
+            }
+            emit_i64_const(b, (int64_t)((uint32_t)inst.imm | ((uint64_t)inst2.imm << 32)));
+            emit_set(b, inst.dst);
+            break;
+        }
+
+        case EBPF_OP_EXIT:
+            /* Leave the VM as the interpreter's exit does: pc past the exit, r0 returned */
+            emit_i32_const(b, (int32_t)(uintptr_t)&vm->pc);
+            emit_i64_const(b, i + 1);
+            emit_byte(b, WASM_I64_STORE32);
+            emit_memarg(b);
+            emit_i32_const(b, (int32_t)(uintptr_t)&vm->return_value);
+            emit_get(b, 0);
+            emit_byte(b, WASM_I64_STORE);
+            emit_memarg(b);
+            emit_get(b, 0);
+            emit_byte(b, WASM_RETURN);
+            break;
+
+        case EBPF_OP_CALL:
+            if (inst.imm < 0 || inst.imm >= MAX_EXT_FUNCS || vm->ext_funcs[inst.imm] == NULL) {
+                *errmsg = ubpf_error("call to nonexistent function %d at PC %d", inst.imm, i);
+                goto out;
+            }
+            emit_i32_const(b, (int32_t)(uintptr_t)vm);
+            emit_i64_const(b, inst.imm);
+            for (int r = 1; r <= 5; r++) {
+                emit_get(b, r);
+            }
+            /* In WebAssembly a function pointer is an index into the table */
+            emit_i32_const(b, (int32_t)(uintptr_t)vm->ext_funcs[inst.imm]);
+            emit_byte(b, WASM_CALL_INDIRECT);
+            emit_uleb(b, TYPE_HELPER);
+            emit_uleb(b, 0);
+            emit_set(b, 0);
+            if (inst.imm == vm->unwind_stack_extension_index) {
+                emit_get(b, 0);
+                emit_byte(b, WASM_I64_EQZ);
+                emit_byte(b, WASM_IF);
+                emit_byte(b, WASM_VOID);
+                emit_get(b, 0);
+                emit_byte(b, WASM_RETURN);
+                emit_byte(b, WASM_END);
+            }
+            break;
+
+        default:
+            *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+            goto out;
+        }
+    }
+
+    while (next_target < num_targets) {
+        emit_byte(b, WASM_END);
+        next_target++;
+    }
+    emit_get(b, 0);
+    emit_byte(b, WASM_END);
+    result = 0;
+
+out:
+    free(targets);
+    return result;
+}
+
+static void
+translate_bswap32(struct wasm_buf* b)
+{
+    /* (rotl(x, 8) & 0x00ff00ff) | (rotr(x, 8) & 0xff00ff00) */
+    emit_uleb(b, 0);
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, 0);
+    emit_i32_const(b, 8);
+    emit_byte(b, WASM_I32_ROTL);
+    emit_i32_const(b, 0x00ff00ff);
+    emit_byte(b, WASM_I32_AND);
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, 0);
+    emit_i32_const(b, 8);
+    emit_byte(b, WASM_I32_ROTR);
+    emit_i32_const(b, (int32_t)0xff00ff00);
+    emit_byte(b, WASM_I32_AND);
+    emit_byte(b, WASM_I32_OR);
+    emit_byte(b, WASM_END);
+}
+
+static void
+translate_bswap64(struct wasm_buf* b)
+{
+    /* (bswap32(low) << 32) | bswap32(high) */
+    emit_uleb(b, 0);
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, 0);
+    emit_byte(b, WASM_I32_WRAP_I64);
+    emit_byte(b, WASM_CALL);
+    emit_uleb(b, FUNC_BSWAP32);
+    emit_byte(b, WASM_I64_EXTEND_I32_U);
+    emit_i64_const(b, 32);
+    emit_byte(b, WASM_I64_SHL);
+    emit_byte(b, WASM_LOCAL_GET);
+    emit_uleb(b, 0);
+    emit_i64_const(b, 32);
+    emit_byte(b, WASM_I64_SHR_U);
+    emit_byte(b, WASM_I32_WRAP_I64);
+    emit_byte(b, WASM_CALL);
+    emit_uleb(b, FUNC_BSWAP32);
+    emit_byte(b, WASM_I64_EXTEND_I32_U);
+    emit_byte(b, WASM_I64_OR);
+    emit_byte(b, WASM_END);
+}
+
+static void
+emit_func_type(struct wasm_buf* b, int num_params, const uint8_t* params, uint8_t result)
+{
+    emit_byte(b, 0x60);
+    emit_uleb(b, num_params);
+    emit_bytes(b, params, num_params);
+    emit_uleb(b, 1);
+    emit_byte(b, result);
+}
+
+int
+ubpf_translate_wasm(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg)
+{
+    static const uint8_t header[] = {0x00, 'a', 's', 'm', 0x01, 0x00, 0x00, 0x00};
+    static const uint8_t run_params[] = {WASM_I64, WASM_I64, WASM_I64};
+    static const uint8_t helper_params[] = {WASM_I32, WASM_I64, WASM_I64, WASM_I64, WASM_I64, WASM_I64, WASM_I64};
+    static const uint8_t bswap32_params[] = {WASM_I32};
+    static const uint8_t bswap64_params[] = {WASM_I64};
+
+    struct wasm_buf module = {0}, section = {0}, body = {0};
+    int result = -1;
+
+    *errmsg = NULL;
+
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return -1;
+    }
+
+    emit_bytes(&module, header, sizeof(header));
+
+    /* Types */
+    emit_uleb(&section, 4);
+    emit_func_type(&section, 3, run_params, WASM_I64);
+    emit_func_type(&section, 7, helper_params, WASM_I64);
+    emit_func_type(&section, 1, bswap32_params, WASM_I32);
+    emit_func_type(&section, 1, bswap64_params, WASM_I64);
+    emit_section(&module, 1, &section);
+    section.len = 0;
+
+    /* Imports: the VM's memory and function table */
+    emit_uleb(&section, 2);
+    emit_name(&section, "env");
+    emit_name(&section, "memory");
+    emit_byte(&section, 0x02);
+    emit_byte(&section, 0x00);
+    emit_uleb(&section, 0);
+    emit_name(&section, "env");
+    emit_name(&section, "table");
+    emit_byte(&section, 0x01);
+    emit_byte(&section, WASM_FUNCREF);
+    emit_byte(&section, 0x00);
+    emit_uleb(&section, 0);
+    emit_section(&module, 2, &section);
+    section.len = 0;
+
+    /* Functions */
+    emit_uleb(&section, 3);
+    emit_uleb(&section, TYPE_RUN);
+    emit_uleb(&section, TYPE_BSWAP32);
+    emit_uleb(&section, TYPE_BSWAP64);
+    emit_section(&module, 3, &section);
+    section.len = 0;
+
+    /* Exports */
+    emit_uleb(&section, 1);
+    emit_name(&section, "run");
+    emit_byte(&section, 0x00);
+    emit_uleb(&section, FUNC_RUN);
+    emit_section(&module, 7, &section);
+    section.len = 0;
+
+    /* Code */
+    emit_uleb(&section, 3);
+    if (translate_run(vm, &body, errmsg) < 0) {
+        goto out;
+    }
+    emit_section(&section, -1, &body);
+    body.len = 0;
+    translate_bswap32(&body);
+    emit_section(&section, -1, &body);
+    body.len = 0;
+    translate_bswap64(&body);
+    emit_section(&section, -1, &body);
+    emit_section(&module, 10, &section);
+
+    if (module.oom) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    if (module.len > *size) {
+        *errmsg = ubpf_error("Target buffer too small");
+        goto out;
+    }
+    memcpy(buffer, module.data, module.len);
+    *size = module.len;
+    result = 0;
+
+out:
+    free(module.data);
+    free(section.data);
+    free(body.data);
+    return result;
+}
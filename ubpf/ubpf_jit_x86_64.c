@@ -35,9 +35,15 @@
 #define TARGET_PC_EXIT -1
 #define TARGET_PC_DIV_BY_ZERO -2
 
+/* Bytes into JIT'd code where tail calls enter, past the depth reset (see translate()) */
+#define TAIL_CALL_ENTRY 3
+
 static void
 muldivmod(struct jit_state* state, uint8_t opcode, int src, int dst, int32_t imm);
 
+static void
+emit_atomic(struct jit_state* state, struct ebpf_inst inst);
+
 #define REGISTER_MAP_SIZE 11
 
 /*
@@ -48,7 +54,6 @@ muldivmod(struct jit_state* state, uint8_t opcode, int src, int dst, int32_t imm
 #if defined(_WIN32)
 static int platform_nonvolatile_registers[] = {RBP, RBX, RDI, RSI, R12, R13, R14, R15};
 static int platform_parameter_registers[] = {RCX, RDX, R8, R9};
-#define RCX_ALT R10
 // Register assignments:
 // BPF R0-R4 are "volatile"
 // BPF R5-R10 are "non-volatile"
@@ -69,7 +74,6 @@ static int register_map[REGISTER_MAP_SIZE] = {
     RBP,
 };
 #else
-#define RCX_ALT R9
 static int platform_nonvolatile_registers[] = {RBP, RBX, R13, R14, R15};
 static int platform_parameter_registers[] = {RDI, RSI, RDX, RCX, R8, R9};
 static int register_map[REGISTER_MAP_SIZE] = {
@@ -118,454 +122,994 @@ ubpf_set_register_offset(int x)
     }
 }
 
-static int
-translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
+/*
+ * Move src[i] into dst[i] for each of the n (at most 4) moves, as if all at
+ * once: no move may overwrite a register another still has to read.  Cycles
+ * go through the stack.
+ */
+static void
+emit_parallel_move(struct jit_state* state, const int* src, const int* dst, int n)
+{
+    bool done[4] = {false};
+    int left = n;
+    assert(n <= _countof(done));
+    while (left > 0) {
+        bool progress = false;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) {
+                continue;
+            }
+            bool blocked = false;
+            for (int j = 0; j < n; j++) {
+                blocked |= j != i && !done[j] && src[j] == dst[i];
+            }
+            if (blocked) {
+                continue;
+            }
+            if (src[i] != dst[i]) {
+                emit_mov(state, src[i], dst[i]);
+            }
+            done[i] = true;
+            left--;
+            progress = true;
+        }
+        if (!progress) {
+            for (int i = 0; i < n; i++) {
+                if (!done[i]) {
+                    emit_push(state, src[i]);
+                }
+            }
+            for (int i = n - 1; i >= 0; i--) {
+                if (!done[i]) {
+                    emit_pop(state, dst[i]);
+                    done[i] = true;
+                }
+            }
+            left = 0;
+        }
+    }
+}
+
+/*
+ * Call fn, the external function imm or one standing in for it, with the
+ * same arguments the interpreter passes, (vm, imm, r1, r2, r3, r4, r5), of
+ * which it reads the first num_args eBPF ones. That is two more than fit in eBPF's argument
+ * registers, so the eBPF arguments are shuffled into the slots the platform
+ * ABI expects, r5 through the stack. R1-R5 are clobbered by calls anyway.
+ */
+static void
+emit_helper_call(struct jit_state* state, struct ubpf_vm* vm, int32_t imm, void* fn, int num_args)
 {
     int i;
 
-    /* Save platform non-volatile registers */
-    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
-        emit_push(state, platform_nonvolatile_registers[i]);
+#if defined(_WIN32)
+    /* r3-r5 go on the stack above the 32-byte home area, r1-r2 in R8/R9 */
+    for (i = 5; i >= 1; i--) {
+        emit_push(state, map_register(i));
+    }
+    emit_pop(state, R8);
+    emit_pop(state, R9);
+    emit_load_imm(state, RDX, imm);
+    emit_load_imm(state, RCX, (uintptr_t)vm);
+    emit_alu64_imm32(state, 0x81, 5, RSP, 4 * sizeof(uint64_t));
+    emit_call(state, fn);
+    emit_alu64_imm32(state, 0x81, 0, RSP, 7 * sizeof(uint64_t));
+#else
+    /*
+     * r1-r4 go in RDX, RCX, R8, R9 and r5 on the stack (padded to 16 bytes),
+     * but only as many as the helper reads (see ubpf_describe_helper()).
+     */
+    static const int arg_registers[] = {RDX, RCX, R8, R9};
+    bool r5 = num_args == 5;
+    int src[_countof(arg_registers)];
+    if (r5) {
+        emit_alu64_imm32(state, 0x81, 5, RSP, sizeof(uint64_t));
+        emit_push(state, map_register(5));
+        num_args = 4;
+    }
+    for (i = 0; i < num_args; i++) {
+        src[i] = map_register(i + 1);
     }
+    emit_parallel_move(state, src, arg_registers, num_args);
+    emit_load_imm(state, RDI, (uintptr_t)vm);
+    emit_load_imm(state, RSI, imm);
+    emit_call(state, fn);
+    if (r5) {
+        emit_alu64_imm32(state, 0x81, 0, RSP, 2 * sizeof(uint64_t));
+    }
+#endif
+}
 
-    /* Move first platform parameter register into register 1 */
-    if (map_register(1) != platform_parameter_registers[0]) {
-        emit_mov(state, platform_parameter_registers[0], map_register(1));
+/* Bytes of frame below the stack pointer: the program's stack, and for tail calls two slots */
+static uint32_t
+frame_size(const struct ubpf_vm* vm, const struct jit_state* state)
+{
+    return vm->stack_usage + (state->tail_calls ? 2 * sizeof(uint64_t) : 0);
+}
+
+/* Where the tail call depth and the context are kept while a tail call is looked up */
+#define TAIL_DEPTH_SLOT(vm) (-(int32_t)(vm)->stack_usage - 8)
+#define TAIL_CTX_SLOT(vm) (-(int32_t)(vm)->stack_usage - 16)
+
+/* Free the frame and restore the caller's registers, leaving its return address on top */
+static void
+emit_leave(struct jit_state* state, const struct ubpf_vm* vm)
+{
+    emit_alu64_imm32(state, 0x81, 0, RSP, frame_size(vm, state));
+    for (int i = 0; i < _countof(platform_nonvolatile_registers); i++) {
+        emit_pop(state, platform_nonvolatile_registers[_countof(platform_nonvolatile_registers) - i - 1]);
     }
+}
 
-    /* Copy stack pointer to R10 */
-    emit_mov(state, RSP, map_register(10));
+/*
+ * Where code tail calling slot index of program array id jumps, or 0 to carry
+ * on.  Whoever runs the calling code holds a read section (see
+ * ubpf_swap_code()), so the target's code stays mapped until the chain ends.
+ */
+static uint64_t
+tail_call_code(struct ubpf_vm* vm, uint64_t call, uint64_t ctx, uint64_t id, uint64_t index, uint64_t depth, uint64_t r5)
+{
+    struct ubpf_vm* target = ubpf_maps_prog(vm, id, index);
+    if (target == NULL || depth >= UBPF_MAX_TAIL_CALLS) {
+        return 0;
+    }
+    struct ubpf_image* image = atomic_load_explicit(&target->image, memory_order_acquire);
+    ubpf_jit_fn jitted = image ? image->jitted : target->jitted;
+    return jitted ? (uintptr_t)jitted + TAIL_CALL_ENTRY : 0;
+}
 
-    /* Allocate stack space */
-    emit_alu64_imm32(state, 0x81, 5, RSP, UBPF_STACK_SIZE);
+/*
+ * tail_call(ctx, id, index): look up the target's code, passing the depth
+ * in r4, and if there is any, leave this frame just as the epilogue would
+ * and jump to it with the context as its argument and the depth plus one in
+ * R11.  The caller's caller gets its result.  Otherwise r0 is -1 and the
+ * program carries on.
+ */
+static void
+emit_tail_call(struct jit_state* state, struct ubpf_vm* vm, int32_t imm)
+{
+    emit_store(state, S64, map_register(1), map_register(10), TAIL_CTX_SLOT(vm));
+    emit_load(state, S64, map_register(10), map_register(4), TAIL_DEPTH_SLOT(vm));
+    emit_helper_call(state, vm, imm, tail_call_code, 4);
+
+    emit_alu64(state, 0x85, RAX, RAX);
+    uint32_t fail = emit_local_jcc(state, 0x84);
+    emit_load(state, S64, map_register(10), R11, TAIL_DEPTH_SLOT(vm));
+    emit_alu64_imm8(state, 0x83, 0, R11, 1);
+    emit_load(state, S64, map_register(10), platform_parameter_registers[0], TAIL_CTX_SLOT(vm));
+    emit_leave(state, vm);
+    /* jmp *%rax */
+    emit1(state, 0xff);
+    emit1(state, 0xe0);
+
+    patch_local_jump(state, fail);
+    emit_load_imm(state, map_register(0), -1);
+}
 
-    for (i = 0; i < vm->num_insts; i++) {
+/*
+ * Compare ladders: a run of jeq-immediate tests on one register, which is
+ * what packet classifiers (and filters translated from classic BPF) are made
+ * of:
+ *
+ *   jeq r2, 0x0800, +20
+ *   jeq r2, 0x86dd, +30
+ *   jeq r2, 0x0806, +40
+ *   ...
+ *
+ * Testing the cases one at a time costs a compare per case on the way to the
+ * default.  Instead we sort the cases and binary search them, which gets any
+ * outcome in O(log n) compares.  The first test of a value wins, as it would
+ * have in the original sequence.
+ */
+#define LADDER_MIN_CASES 4
+#define LADDER_LINEAR_CASES 3
+
+struct ladder_case
+{
+    int64_t value;
+    uint32_t target_pc;
+    int order;
+};
+
+static void
+mark_jump_targets(const struct ubpf_vm* vm, bool* jump_targets)
+{
+    for (int i = 0; i < vm->num_insts; i++) {
         struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
-        state->pc_locs[i] = state->offset;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        } else if (
+            (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && inst.opcode != EBPF_OP_CALL &&
+            inst.opcode != EBPF_OP_EXIT) {
+            int target = i + inst.offset + 1;
+            if (target >= 0 && target <= vm->num_insts) {
+                jump_targets[target] = true;
+            }
+        }
+    }
+}
 
-        int dst = map_register(inst.dst);
-        int src = map_register(inst.src);
-        uint32_t target_pc = i + inst.offset + 1;
+/* How many instructions, starting at pc, form a ladder (0 if none) */
+static int
+ladder_length(const struct ubpf_vm* vm, const struct jit_state* state, int pc)
+{
+    struct ebpf_inst first = ubpf_fetch_instruction(vm, pc);
+    if (first.opcode != EBPF_OP_JEQ_IMM && first.opcode != EBPF_OP_JEQ32_IMM) {
+        return 0;
+    }
 
-        switch (inst.opcode) {
-        case EBPF_OP_ADD_IMM:
-            emit_alu32_imm32(state, 0x81, 0, dst, inst.imm);
-            break;
-        case EBPF_OP_ADD_REG:
-            emit_alu32(state, 0x01, src, dst);
-            break;
-        case EBPF_OP_SUB_IMM:
-            emit_alu32_imm32(state, 0x81, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_SUB_REG:
-            emit_alu32(state, 0x29, src, dst);
-            break;
-        case EBPF_OP_MUL_IMM:
-        case EBPF_OP_MUL_REG:
-        case EBPF_OP_DIV_IMM:
-        case EBPF_OP_DIV_REG:
-        case EBPF_OP_MOD_IMM:
-        case EBPF_OP_MOD_REG:
-            muldivmod(state, inst.opcode, src, dst, inst.imm);
-            break;
-        case EBPF_OP_OR_IMM:
-            emit_alu32_imm32(state, 0x81, 1, dst, inst.imm);
-            break;
-        case EBPF_OP_OR_REG:
-            emit_alu32(state, 0x09, src, dst);
-            break;
-        case EBPF_OP_AND_IMM:
-            emit_alu32_imm32(state, 0x81, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_AND_REG:
-            emit_alu32(state, 0x21, src, dst);
-            break;
-        case EBPF_OP_LSH_IMM:
-            emit_alu32_imm8(state, 0xc1, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_LSH_REG:
-            emit_mov(state, src, RCX);
-            emit_alu32(state, 0xd3, 4, dst);
-            break;
-        case EBPF_OP_RSH_IMM:
-            emit_alu32_imm8(state, 0xc1, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_RSH_REG:
-            emit_mov(state, src, RCX);
-            emit_alu32(state, 0xd3, 5, dst);
-            break;
-        case EBPF_OP_NEG:
-            emit_alu32(state, 0xf7, 3, dst);
-            break;
-        case EBPF_OP_XOR_IMM:
-            emit_alu32_imm32(state, 0x81, 6, dst, inst.imm);
-            break;
-        case EBPF_OP_XOR_REG:
-            emit_alu32(state, 0x31, src, dst);
-            break;
-        case EBPF_OP_MOV_IMM:
-            emit_alu32_imm32(state, 0xc7, 0, dst, inst.imm);
-            break;
-        case EBPF_OP_MOV_REG:
-            emit_mov(state, src, dst);
-            break;
-        case EBPF_OP_ARSH_IMM:
-            emit_alu32_imm8(state, 0xc1, 7, dst, inst.imm);
-            break;
-        case EBPF_OP_ARSH_REG:
-            emit_mov(state, src, RCX);
-            emit_alu32(state, 0xd3, 7, dst);
+    int n = 1;
+    while (pc + n < vm->num_insts && !state->jump_targets[pc + n]) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc + n);
+        if (inst.opcode != first.opcode || inst.dst != first.dst) {
             break;
+        }
+        n++;
+    }
+    return n >= LADDER_MIN_CASES ? n : 0;
+}
 
-        case EBPF_OP_LE:
-            /* No-op */
-            break;
-        case EBPF_OP_BE:
-            if (inst.imm == 16) {
-                /* rol */
-                emit1(state, 0x66); /* 16-bit override */
-                emit_alu32_imm8(state, 0xc1, 0, dst, 8);
-                /* and */
-                emit_alu32_imm32(state, 0x81, 4, dst, 0xffff);
-            } else if (inst.imm == 32 || inst.imm == 64) {
-                /* bswap */
-                emit_basic_rex(state, inst.imm == 64, 0, dst);
-                emit1(state, 0x0f);
-                emit1(state, 0xc8 | (dst & 7));
+static int
+compare_ladder_cases(const void* a, const void* b)
+{
+    const struct ladder_case* x = a;
+    const struct ladder_case* y = b;
+    if (x->value != y->value) {
+        return x->value < y->value ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+static void
+emit_ladder_search(
+    struct jit_state* state,
+    bool is32,
+    int dst,
+    const struct ladder_case* cases,
+    int n,
+    uint32_t default_pc,
+    bool falls_through)
+{
+    if (n <= LADDER_LINEAR_CASES) {
+        for (int i = 0; i < n; i++) {
+            if (is32) {
+                emit_cmp32_imm32(state, dst, cases[i].value);
+            } else {
+                emit_cmp_imm32(state, dst, cases[i].value);
             }
-            break;
+            emit_jcc(state, 0x84, cases[i].target_pc);
+        }
+        if (!falls_through) {
+            emit_jmp(state, default_pc);
+        }
+        return;
+    }
 
-        case EBPF_OP_ADD64_IMM:
-            emit_alu64_imm32(state, 0x81, 0, dst, inst.imm);
-            break;
-        case EBPF_OP_ADD64_REG:
-            emit_alu64(state, 0x01, src, dst);
-            break;
-        case EBPF_OP_SUB64_IMM:
-            emit_alu64_imm32(state, 0x81, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_SUB64_REG:
-            emit_alu64(state, 0x29, src, dst);
-            break;
-        case EBPF_OP_MUL64_IMM:
-        case EBPF_OP_MUL64_REG:
-        case EBPF_OP_DIV64_IMM:
-        case EBPF_OP_DIV64_REG:
-        case EBPF_OP_MOD64_IMM:
-        case EBPF_OP_MOD64_REG:
-            muldivmod(state, inst.opcode, src, dst, inst.imm);
-            break;
-        case EBPF_OP_OR64_IMM:
-            emit_alu64_imm32(state, 0x81, 1, dst, inst.imm);
-            break;
-        case EBPF_OP_OR64_REG:
-            emit_alu64(state, 0x09, src, dst);
-            break;
-        case EBPF_OP_AND64_IMM:
-            emit_alu64_imm32(state, 0x81, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_AND64_REG:
-            emit_alu64(state, 0x21, src, dst);
-            break;
-        case EBPF_OP_LSH64_IMM:
-            emit_alu64_imm8(state, 0xc1, 4, dst, inst.imm);
-            break;
-        case EBPF_OP_LSH64_REG:
-            emit_mov(state, src, RCX);
-            emit_alu64(state, 0xd3, 4, dst);
-            break;
-        case EBPF_OP_RSH64_IMM:
-            emit_alu64_imm8(state, 0xc1, 5, dst, inst.imm);
-            break;
-        case EBPF_OP_RSH64_REG:
-            emit_mov(state, src, RCX);
-            emit_alu64(state, 0xd3, 5, dst);
-            break;
-        case EBPF_OP_NEG64:
-            emit_alu64(state, 0xf7, 3, dst);
-            break;
-        case EBPF_OP_XOR64_IMM:
-            emit_alu64_imm32(state, 0x81, 6, dst, inst.imm);
-            break;
-        case EBPF_OP_XOR64_REG:
-            emit_alu64(state, 0x31, src, dst);
-            break;
-        case EBPF_OP_MOV64_IMM:
-            emit_load_imm(state, dst, inst.imm);
-            break;
-        case EBPF_OP_MOV64_REG:
-            emit_mov(state, src, dst);
-            break;
-        case EBPF_OP_ARSH64_IMM:
-            emit_alu64_imm8(state, 0xc1, 7, dst, inst.imm);
-            break;
-        case EBPF_OP_ARSH64_REG:
-            emit_mov(state, src, RCX);
-            emit_alu64(state, 0xd3, 7, dst);
-            break;
+    int mid = n / 2;
+    if (is32) {
+        emit_cmp32_imm32(state, dst, cases[mid].value);
+    } else {
+        emit_cmp_imm32(state, dst, cases[mid].value);
+    }
+    emit_jcc(state, 0x84, cases[mid].target_pc);
+    uint32_t upper = emit_local_jcc(state, 0x8f);
+    emit_ladder_search(state, is32, dst, cases, mid, default_pc, false);
+    patch_local_jump(state, upper);
+    emit_ladder_search(state, is32, dst, cases + mid + 1, n - mid - 1, default_pc, falls_through);
+}
 
-        /* TODO use 8 bit immediate when possible */
-        case EBPF_OP_JA:
-            emit_jmp(state, target_pc);
-            break;
-        case EBPF_OP_JEQ_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x84, target_pc);
-            break;
-        case EBPF_OP_JEQ_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x84, target_pc);
-            break;
-        case EBPF_OP_JGT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x87, target_pc);
-            break;
-        case EBPF_OP_JGT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x87, target_pc);
-            break;
-        case EBPF_OP_JGE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x83, target_pc);
-            break;
-        case EBPF_OP_JGE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x83, target_pc);
-            break;
-        case EBPF_OP_JLT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x82, target_pc);
-            break;
-        case EBPF_OP_JLT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x82, target_pc);
-            break;
-        case EBPF_OP_JLE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x86, target_pc);
-            break;
-        case EBPF_OP_JLE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x86, target_pc);
-            break;
-        case EBPF_OP_JSET_IMM:
-            emit_alu64_imm32(state, 0xf7, 0, dst, inst.imm);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JSET_REG:
-            emit_alu64(state, 0x85, src, dst);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JNE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JNE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JSGT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8f, target_pc);
-            break;
-        case EBPF_OP_JSGT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8f, target_pc);
-            break;
-        case EBPF_OP_JSGE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8d, target_pc);
-            break;
-        case EBPF_OP_JSGE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8d, target_pc);
-            break;
-        case EBPF_OP_JSLT_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8c, target_pc);
-            break;
-        case EBPF_OP_JSLT_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8c, target_pc);
-            break;
-        case EBPF_OP_JSLE_IMM:
-            emit_cmp_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8e, target_pc);
-            break;
-        case EBPF_OP_JSLE_REG:
-            emit_cmp(state, src, dst);
-            emit_jcc(state, 0x8e, target_pc);
-            break;
-        case EBPF_OP_JEQ32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x84, target_pc);
-            break;
-        case EBPF_OP_JEQ32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x84, target_pc);
-            break;
-        case EBPF_OP_JGT32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x87, target_pc);
-            break;
-        case EBPF_OP_JGT32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x87, target_pc);
-            break;
-        case EBPF_OP_JGE32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x83, target_pc);
-            break;
-        case EBPF_OP_JGE32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x83, target_pc);
-            break;
-        case EBPF_OP_JLT32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x82, target_pc);
-            break;
-        case EBPF_OP_JLT32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x82, target_pc);
-            break;
-        case EBPF_OP_JLE32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x86, target_pc);
-            break;
-        case EBPF_OP_JLE32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x86, target_pc);
-            break;
-        case EBPF_OP_JSET32_IMM:
-            emit_alu32_imm32(state, 0xf7, 0, dst, inst.imm);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JSET32_REG:
-            emit_alu32(state, 0x85, src, dst);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JNE32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JNE32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x85, target_pc);
-            break;
-        case EBPF_OP_JSGT32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8f, target_pc);
-            break;
-        case EBPF_OP_JSGT32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8f, target_pc);
-            break;
-        case EBPF_OP_JSGE32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8d, target_pc);
-            break;
-        case EBPF_OP_JSGE32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8d, target_pc);
-            break;
-        case EBPF_OP_JSLT32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8c, target_pc);
-            break;
-        case EBPF_OP_JSLT32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8c, target_pc);
-            break;
-        case EBPF_OP_JSLE32_IMM:
-            emit_cmp32_imm32(state, dst, inst.imm);
-            emit_jcc(state, 0x8e, target_pc);
-            break;
-        case EBPF_OP_JSLE32_REG:
-            emit_cmp32(state, src, dst);
-            emit_jcc(state, 0x8e, target_pc);
-            break;
-        case EBPF_OP_CALL:
-            /* We reserve RCX for shifts */
-            emit_mov(state, RCX_ALT, RCX);
-            emit_call(state, vm->ext_funcs[inst.imm]);
-            if (inst.imm == vm->unwind_stack_extension_index) {
-                emit_cmp_imm32(state, map_register(0), 0);
-                emit_jcc(state, 0x84, TARGET_PC_EXIT);
+static int
+emit_ladder(struct ubpf_vm* vm, struct jit_state* state, int pc, int n, char** errmsg)
+{
+    struct ladder_case* cases = calloc(n, sizeof(*cases));
+    if (cases == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+
+    struct ebpf_inst first = ubpf_fetch_instruction(vm, pc);
+    bool is32 = first.opcode == EBPF_OP_JEQ32_IMM;
+    for (int i = 0; i < n; i++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc + i);
+        cases[i].value = is32 ? (int64_t)(int32_t)inst.imm : (int64_t)inst.imm;
+        cases[i].target_pc = pc + i + inst.offset + 1;
+        cases[i].order = i;
+    }
+    qsort(cases, n, sizeof(*cases), compare_ladder_cases);
+
+    /* Later tests of an already tested value are dead */
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || cases[i].value != cases[unique - 1].value) {
+            cases[unique++] = cases[i];
+        }
+    }
+
+    emit_ladder_search(state, is32, map_register(first.dst), cases, unique, pc + n, pc + n == state->next_pc);
+    free(cases);
+    return 0;
+}
+
+/* How many instructions, starting at pc, are translated together */
+static int
+unit_length(const struct ubpf_vm* vm, const struct jit_state* state, int pc)
+{
+    int ladder = ladder_length(vm, state, pc);
+    if (ladder) {
+        return ladder;
+    }
+    return ubpf_fetch_instruction(vm, pc).opcode == EBPF_OP_LDDW ? 2 : 1;
+}
+
+/* Whether inst ends a block: a jump or exit */
+static bool
+ends_block(struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && inst.opcode != EBPF_OP_CALL;
+}
+
+static uint64_t
+branch_count(const struct ubpf_vm* vm, uint32_t pc, bool taken)
+{
+    struct ubpf_branch_count* count = &vm->branch_counts[pc];
+    return atomic_load_explicit(taken ? &count->taken : &count->not_taken, memory_order_relaxed);
+}
+
+static void
+mark_hot(const struct ubpf_vm* vm, const int* block_at, bool* hot, int* worklist, int* n, uint32_t pc)
+{
+    if (pc < vm->num_insts && block_at[pc] >= 0 && !hot[block_at[pc]]) {
+        hot[block_at[pc]] = true;
+        worklist[(*n)++] = block_at[pc];
+    }
+}
+
+/* Mark the blocks the profile shows running: those reached from the entry by edges that were taken */
+static void
+mark_hot_blocks(const struct ubpf_vm* vm, const struct block* blocks, const int* block_at, bool* hot, int* worklist)
+{
+    int n = 0;
+    mark_hot(vm, block_at, hot, worklist, &n, 0);
+    while (n > 0) {
+        const struct block* block = &blocks[worklist[--n]];
+        /* A ladder's tests are each counted; its default follows the last one */
+        for (uint32_t pc = block->last; pc < block->end; pc++) {
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            if (inst.opcode == EBPF_OP_EXIT) {
+                break;
+            } else if (!ends_block(inst)) {
+                mark_hot(vm, block_at, hot, worklist, &n, block->end);
+                break;
+            } else if (inst.opcode == EBPF_OP_JA) {
+                mark_hot(vm, block_at, hot, worklist, &n, pc + inst.offset + 1);
+                break;
             }
-            break;
-        case EBPF_OP_EXIT:
-            if (i != vm->num_insts - 1) {
-                emit_jmp(state, TARGET_PC_EXIT);
+            if (branch_count(vm, pc, true)) {
+                mark_hot(vm, block_at, hot, worklist, &n, pc + inst.offset + 1);
             }
-            break;
+            if (pc + 1 == block->end && branch_count(vm, pc, false)) {
+                mark_hot(vm, block_at, hot, worklist, &n, block->end);
+            }
+        }
+    }
+}
 
-        case EBPF_OP_LDXW:
-            emit_load(state, S32, src, dst, inst.offset);
-            break;
-        case EBPF_OP_LDXH:
-            emit_load(state, S16, src, dst, inst.offset);
-            break;
-        case EBPF_OP_LDXB:
-            emit_load(state, S8, src, dst, inst.offset);
-            break;
-        case EBPF_OP_LDXDW:
-            emit_load(state, S64, src, dst, inst.offset);
-            break;
+/* The block that should follow block, or -1 */
+static int
+preferred_successor(const struct ubpf_vm* vm, const struct block* block, const int* block_at)
+{
+    struct ebpf_inst inst = ubpf_fetch_instruction(vm, block->last);
+    uint32_t next = block->end;
+    if (inst.opcode == EBPF_OP_EXIT) {
+        return -1;
+    } else if (inst.opcode == EBPF_OP_JA) {
+        next = block->last + inst.offset + 1;
+    } else if (
+        ends_block(inst) && block->end == block->last + 1 &&
+        branch_count(vm, block->last, true) > branch_count(vm, block->last, false)) {
+        next = block->last + inst.offset + 1;
+    }
+    return next < vm->num_insts ? block_at[next] : -1;
+}
 
-        case EBPF_OP_STW:
-            emit_store_imm32(state, S32, dst, inst.offset, inst.imm);
-            break;
-        case EBPF_OP_STH:
-            emit_store_imm32(state, S16, dst, inst.offset, inst.imm);
-            break;
-        case EBPF_OP_STB:
-            emit_store_imm32(state, S8, dst, inst.offset, inst.imm);
-            break;
-        case EBPF_OP_STDW:
-            emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
-            break;
+/*
+ * Split the program into blocks and choose the order to emit them in.  With
+ * a branch profile, chains of blocks that ran are laid out so that each falls
+ * through to its likelier successor, and the blocks that never ran go last;
+ * otherwise, and if reorder is false, the blocks stay in program order.
+ */
+static int
+plan_layout(struct ubpf_vm* vm, struct jit_state* state, bool reorder, char** errmsg)
+{
+    uint32_t num_insts = vm->num_insts;
+    struct block* blocks = calloc(num_insts + 1, sizeof(*blocks));
+    int* block_at = calloc(num_insts + 1, sizeof(*block_at));
+    bool* hot = calloc(num_insts + 1, sizeof(*hot));
+    int* worklist = calloc(num_insts + 1, sizeof(*worklist));
+    bool* placed = calloc(num_insts + 1, sizeof(*placed));
+    int* order = calloc(num_insts + 1, sizeof(*order));
+    int result = -1;
+    if (blocks == NULL || block_at == NULL || hot == NULL || worklist == NULL || placed == NULL || order == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
 
-        case EBPF_OP_STXW:
-            emit_store(state, S32, src, dst, inst.offset);
-            break;
-        case EBPF_OP_STXH:
-            emit_store(state, S16, src, dst, inst.offset);
-            break;
-        case EBPF_OP_STXB:
-            emit_store(state, S8, src, dst, inst.offset);
-            break;
-        case EBPF_OP_STXDW:
-            emit_store(state, S64, src, dst, inst.offset);
-            break;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        block_at[pc] = -1;
+    }
+    int num_blocks = 0;
+    bool ended = true;
+    for (uint32_t pc = 0; pc < num_insts;) {
+        int len = unit_length(vm, state, pc);
+        if (ended || state->jump_targets[pc]) {
+            block_at[pc] = num_blocks;
+            blocks[num_blocks++].start = pc;
+        }
+        blocks[num_blocks - 1].last = pc;
+        blocks[num_blocks - 1].end = pc + len;
+        ended = ends_block(ubpf_fetch_instruction(vm, pc));
+        pc += len;
+    }
 
-        case EBPF_OP_LDDW: {
-            struct ebpf_inst inst2 = ubpf_fetch_instruction(vm, ++i);
-            uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
-            emit_load_imm(state, dst, imm);
-            break;
+    bool profiled = false;
+    for (uint32_t pc = 0; reorder && vm->branch_counts != NULL && pc < num_insts && !profiled; pc++) {
+        profiled = branch_count(vm, pc, true) || branch_count(vm, pc, false);
+    }
+
+    int num_placed = 0;
+    if (profiled) {
+        mark_hot_blocks(vm, blocks, block_at, hot, worklist);
+        /* The entry block is hot, so it stays first, right after the prologue */
+        for (int b = 0; b < num_blocks; b++) {
+            int next = b;
+            while (next >= 0 && hot[next] && !placed[next]) {
+                placed[next] = true;
+                order[num_placed++] = next;
+                next = preferred_successor(vm, &blocks[next], block_at);
+            }
+        }
+    }
+    for (int b = 0; b < num_blocks; b++) {
+        if (!placed[b]) {
+            order[num_placed++] = b;
         }
+    }
+
+    state->layout = calloc(num_blocks + 1, sizeof(*state->layout));
+    if (state->layout == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    for (int b = 0; b < num_blocks; b++) {
+        state->layout[b] = blocks[order[b]];
+    }
+    state->num_blocks = num_blocks;
+    result = 0;
+
+out:
+    free(blocks);
+    free(block_at);
+    free(hot);
+    free(worklist);
+    free(placed);
+    free(order);
+    return result;
+}
+
+/*
+ * Conditional jump to target_pc that otherwise continues at fall_pc.  If
+ * target_pc is emitted next, the condition is inverted so that it falls
+ * through there instead.
+ */
+static void
+emit_branch(struct jit_state* state, int code, uint32_t target_pc, uint32_t fall_pc)
+{
+    if (target_pc == state->next_pc && fall_pc != target_pc) {
+        /* x86 condition codes come in pairs that differ in the low bit */
+        emit_jcc(state, code ^ 1, fall_pc);
+        return;
+    }
+    emit_jcc(state, code, target_pc);
+    if (fall_pc != state->next_pc) {
+        emit_jmp(state, fall_pc);
+    }
+}
 
-        default:
-            *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+/* Translate the len instructions at pc i that unit_length() groups together */
+static int
+translate_unit(struct ubpf_vm* vm, struct jit_state* state, int i, int len, char** errmsg)
+{
+    struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+    state->pc_locs[i] = state->offset;
+
+    if (len > 1 && inst.opcode != EBPF_OP_LDDW) {
+        if (emit_ladder(vm, state, i, len, errmsg) < 0) {
             return -1;
         }
+        /* Nothing jumps into a ladder; its code all belongs to the first test */
+        while (--len) {
+            state->pc_locs[++i] = state->offset;
+        }
+        return 0;
+    }
+
+    int dst = map_register(inst.dst);
+    int src = map_register(inst.src);
+    uint32_t target_pc = i + inst.offset + 1;
+
+    switch (inst.opcode) {
+    case EBPF_OP_ADD_IMM:
+        emit_alu32_imm32(state, 0x81, 0, dst, inst.imm);
+        break;
+    case EBPF_OP_ADD_REG:
+        emit_alu32(state, 0x01, src, dst);
+        break;
+    case EBPF_OP_SUB_IMM:
+        emit_alu32_imm32(state, 0x81, 5, dst, inst.imm);
+        break;
+    case EBPF_OP_SUB_REG:
+        emit_alu32(state, 0x29, src, dst);
+        break;
+    case EBPF_OP_MUL_IMM:
+    case EBPF_OP_MUL_REG:
+    case EBPF_OP_DIV_IMM:
+    case EBPF_OP_DIV_REG:
+    case EBPF_OP_MOD_IMM:
+    case EBPF_OP_MOD_REG:
+        muldivmod(state, inst.opcode, src, dst, inst.imm);
+        break;
+    case EBPF_OP_OR_IMM:
+        emit_alu32_imm32(state, 0x81, 1, dst, inst.imm);
+        break;
+    case EBPF_OP_OR_REG:
+        emit_alu32(state, 0x09, src, dst);
+        break;
+    case EBPF_OP_AND_IMM:
+        emit_alu32_imm32(state, 0x81, 4, dst, inst.imm);
+        break;
+    case EBPF_OP_AND_REG:
+        emit_alu32(state, 0x21, src, dst);
+        break;
+    case EBPF_OP_LSH_IMM:
+        emit_alu32_imm8(state, 0xc1, 4, dst, inst.imm);
+        break;
+    case EBPF_OP_LSH_REG:
+        emit_mov(state, src, RCX);
+        emit_alu32(state, 0xd3, 4, dst);
+        break;
+    case EBPF_OP_RSH_IMM:
+        emit_alu32_imm8(state, 0xc1, 5, dst, inst.imm);
+        break;
+    case EBPF_OP_RSH_REG:
+        emit_mov(state, src, RCX);
+        emit_alu32(state, 0xd3, 5, dst);
+        break;
+    case EBPF_OP_NEG:
+        emit_alu32(state, 0xf7, 3, dst);
+        break;
+    case EBPF_OP_XOR_IMM:
+        emit_alu32_imm32(state, 0x81, 6, dst, inst.imm);
+        break;
+    case EBPF_OP_XOR_REG:
+        emit_alu32(state, 0x31, src, dst);
+        break;
+    case EBPF_OP_MOV_IMM:
+        emit_alu32_imm32(state, 0xc7, 0, dst, inst.imm);
+        break;
+    case EBPF_OP_MOV_REG:
+        emit_mov32(state, src, dst);
+        break;
+    case EBPF_OP_ARSH_IMM:
+        emit_alu32_imm8(state, 0xc1, 7, dst, inst.imm);
+        break;
+    case EBPF_OP_ARSH_REG:
+        emit_mov(state, src, RCX);
+        emit_alu32(state, 0xd3, 7, dst);
+        break;
+
+    case EBPF_OP_LE:
+        /* No-op */
+        break;
+    case EBPF_OP_BE:
+        if (inst.imm == 16) {
+            /* rol */
+            emit1(state, 0x66); /* 16-bit override */
+            emit_alu32_imm8(state, 0xc1, 0, dst, 8);
+            /* and */
+            emit_alu32_imm32(state, 0x81, 4, dst, 0xffff);
+        } else if (inst.imm == 32 || inst.imm == 64) {
+            /* bswap */
+            emit_basic_rex(state, inst.imm == 64, 0, dst);
+            emit1(state, 0x0f);
+            emit1(state, 0xc8 | (dst & 7));
+        }
+        break;
+
+    case EBPF_OP_ADD64_IMM:
+        emit_alu64_imm32(state, 0x81, 0, dst, inst.imm);
+        break;
+    case EBPF_OP_ADD64_REG:
+        emit_alu64(state, 0x01, src, dst);
+        break;
+    case EBPF_OP_SUB64_IMM:
+        emit_alu64_imm32(state, 0x81, 5, dst, inst.imm);
+        break;
+    case EBPF_OP_SUB64_REG:
+        emit_alu64(state, 0x29, src, dst);
+        break;
+    case EBPF_OP_MUL64_IMM:
+    case EBPF_OP_MUL64_REG:
+    case EBPF_OP_DIV64_IMM:
+    case EBPF_OP_DIV64_REG:
+    case EBPF_OP_MOD64_IMM:
+    case EBPF_OP_MOD64_REG:
+        muldivmod(state, inst.opcode, src, dst, inst.imm);
+        break;
+    case EBPF_OP_OR64_IMM:
+        emit_alu64_imm32(state, 0x81, 1, dst, inst.imm);
+        break;
+    case EBPF_OP_OR64_REG:
+        emit_alu64(state, 0x09, src, dst);
+        break;
+    case EBPF_OP_AND64_IMM:
+        emit_alu64_imm32(state, 0x81, 4, dst, inst.imm);
+        break;
+    case EBPF_OP_AND64_REG:
+        emit_alu64(state, 0x21, src, dst);
+        break;
+    case EBPF_OP_LSH64_IMM:
+        emit_alu64_imm8(state, 0xc1, 4, dst, inst.imm);
+        break;
+    case EBPF_OP_LSH64_REG:
+        emit_mov(state, src, RCX);
+        emit_alu64(state, 0xd3, 4, dst);
+        break;
+    case EBPF_OP_RSH64_IMM:
+        emit_alu64_imm8(state, 0xc1, 5, dst, inst.imm);
+        break;
+    case EBPF_OP_RSH64_REG:
+        emit_mov(state, src, RCX);
+        emit_alu64(state, 0xd3, 5, dst);
+        break;
+    case EBPF_OP_NEG64:
+        emit_alu64(state, 0xf7, 3, dst);
+        break;
+    case EBPF_OP_XOR64_IMM:
+        emit_alu64_imm32(state, 0x81, 6, dst, inst.imm);
+        break;
+    case EBPF_OP_XOR64_REG:
+        emit_alu64(state, 0x31, src, dst);
+        break;
+    case EBPF_OP_MOV64_IMM:
+        emit_load_imm(state, dst, inst.imm);
+        break;
+    case EBPF_OP_MOV64_REG:
+        emit_mov(state, src, dst);
+        break;
+    case EBPF_OP_ARSH64_IMM:
+        emit_alu64_imm8(state, 0xc1, 7, dst, inst.imm);
+        break;
+    case EBPF_OP_ARSH64_REG:
+        emit_mov(state, src, RCX);
+        emit_alu64(state, 0xd3, 7, dst);
+        break;
+
+    /* TODO use 8 bit immediate when possible */
+    case EBPF_OP_JA:
+        if (target_pc != state->next_pc) {
+            emit_jmp(state, target_pc);
+        }
+        break;
+    case EBPF_OP_JEQ_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x84, target_pc, i + 1);
+        break;
+    case EBPF_OP_JEQ_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x84, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGT_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x87, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGT_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x87, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGE_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x83, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGE_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x83, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLT_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x82, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLT_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x82, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLE_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x86, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLE_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x86, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSET_IMM:
+        emit_alu64_imm32(state, 0xf7, 0, dst, inst.imm);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSET_REG:
+        emit_alu64(state, 0x85, src, dst);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JNE_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JNE_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGT_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8f, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGT_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x8f, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGE_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8d, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGE_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x8d, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLT_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8c, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLT_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x8c, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLE_IMM:
+        emit_cmp_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8e, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLE_REG:
+        emit_cmp(state, src, dst);
+        emit_branch(state, 0x8e, target_pc, i + 1);
+        break;
+    case EBPF_OP_JEQ32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x84, target_pc, i + 1);
+        break;
+    case EBPF_OP_JEQ32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x84, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGT32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x87, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGT32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x87, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGE32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x83, target_pc, i + 1);
+        break;
+    case EBPF_OP_JGE32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x83, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLT32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x82, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLT32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x82, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLE32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x86, target_pc, i + 1);
+        break;
+    case EBPF_OP_JLE32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x86, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSET32_IMM:
+        emit_alu32_imm32(state, 0xf7, 0, dst, inst.imm);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSET32_REG:
+        emit_alu32(state, 0x85, src, dst);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JNE32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JNE32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x85, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGT32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8f, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGT32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x8f, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGE32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8d, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSGE32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x8d, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLT32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8c, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLT32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x8c, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLE32_IMM:
+        emit_cmp32_imm32(state, dst, inst.imm);
+        emit_branch(state, 0x8e, target_pc, i + 1);
+        break;
+    case EBPF_OP_JSLE32_REG:
+        emit_cmp32(state, src, dst);
+        emit_branch(state, 0x8e, target_pc, i + 1);
+        break;
+    case EBPF_OP_CALL:
+        if (ubpf_maps_is_tail_call(vm, inst.imm)) {
+            emit_tail_call(state, vm, inst.imm);
+            break;
+        }
+        emit_helper_call(state, vm, inst.imm, vm->ext_funcs[inst.imm], vm->ext_func_info[inst.imm].num_args);
+        if (inst.imm == vm->unwind_stack_extension_index) {
+            emit_cmp_imm32(state, map_register(0), 0);
+            emit_jcc(state, 0x84, TARGET_PC_EXIT);
+        }
+        break;
+    case EBPF_OP_EXIT:
+        if (state->next_pc != vm->num_insts) {
+            emit_jmp(state, TARGET_PC_EXIT);
+        }
+        break;
+
+    case EBPF_OP_LDXW:
+        emit_load(state, S32, src, dst, inst.offset);
+        break;
+    case EBPF_OP_LDXH:
+        emit_load(state, S16, src, dst, inst.offset);
+        break;
+    case EBPF_OP_LDXB:
+        emit_load(state, S8, src, dst, inst.offset);
+        break;
+    case EBPF_OP_LDXDW:
+        emit_load(state, S64, src, dst, inst.offset);
+        break;
+
+    case EBPF_OP_STW:
+        emit_store_imm32(state, S32, dst, inst.offset, inst.imm);
+        break;
+    case EBPF_OP_STH:
+        emit_store_imm32(state, S16, dst, inst.offset, inst.imm);
+        break;
+    case EBPF_OP_STB:
+        emit_store_imm32(state, S8, dst, inst.offset, inst.imm);
+        break;
+    case EBPF_OP_STDW:
+        emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
+        break;
+
+    case EBPF_OP_STXW:
+        emit_store(state, S32, src, dst, inst.offset);
+        break;
+    case EBPF_OP_STXH:
+        emit_store(state, S16, src, dst, inst.offset);
+        break;
+    case EBPF_OP_STXB:
+        emit_store(state, S8, src, dst, inst.offset);
+        break;
+    case EBPF_OP_STXDW:
+        emit_store(state, S64, src, dst, inst.offset);
+        break;
+
+    case EBPF_OP_ATOMIC32_STORE:
+    case EBPF_OP_ATOMIC_STORE:
+        emit_atomic(state, inst);
+        break;
+
+    case EBPF_OP_LDDW: {
+        struct ebpf_inst inst2 = ubpf_fetch_instruction(vm, ++i);
+        uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+        emit_load_imm(state, dst, imm);
+        /* The second slot owns no code */
+        state->pc_locs[i] = state->offset;
+        break;
+    }
+
+    default:
+        *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
+{
+    int i;
+
+    /* Runs start with no tail calls made; tail calls enter below with the count in R11 */
+    emit_alu32(state, 0x31, R11, R11);
+    assert(state->offset == TAIL_CALL_ENTRY);
+
+    /* Save platform non-volatile registers */
+    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
+        emit_push(state, platform_nonvolatile_registers[i]);
+    }
+
+    /* Move first platform parameter register into register 1 */
+    if (map_register(1) != platform_parameter_registers[0]) {
+        emit_mov(state, platform_parameter_registers[0], map_register(1));
+    }
+
+    /* Copy stack pointer to R10 */
+    emit_mov(state, RSP, map_register(10));
+
+    /* Allocate stack space */
+    emit_alu64_imm32(state, 0x81, 5, RSP, frame_size(vm, state));
+    if (state->tail_calls) {
+        emit_store(state, S64, R11, map_register(10), TAIL_DEPTH_SLOT(vm));
+    }
+
+    for (int b = 0; b < state->num_blocks; b++) {
+        const struct block* block = &state->layout[b];
+        uint32_t next = b + 1 < state->num_blocks ? state->layout[b + 1].start : vm->num_insts;
+        for (uint32_t pc = block->start; pc < block->end;) {
+            int len = unit_length(vm, state, pc);
+            state->next_pc = pc + len < block->end ? pc + len : next;
+            if (translate_unit(vm, state, pc, len, errmsg) < 0) {
+                return -1;
+            }
+            pc += len;
+        }
+        if (!ends_block(ubpf_fetch_instruction(vm, block->last)) && block->end != next) {
+            emit_jmp(state, block->end);
+        }
     }
 
     /* Epilogue */
     state->exit_loc = state->offset;
+    state->pc_locs[vm->num_insts] = state->offset;
 
     /* Move register 0 into rax */
     if (map_register(0) != RAX) {
         emit_mov(state, map_register(0), RAX);
     }
 
-    /* Deallocate stack space */
-    emit_alu64_imm32(state, 0x81, 0, RSP, UBPF_STACK_SIZE);
-
-    /* Restore platform non-volatile registers */
-    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
-        emit_pop(state, platform_nonvolatile_registers[_countof(platform_nonvolatile_registers) - i - 1]);
-    }
+    /* Deallocate stack space and restore platform non-volatile registers */
+    emit_leave(state, vm);
 
     emit1(state, 0xc3); /* ret */
 
@@ -588,7 +1132,11 @@ muldivmod(struct jit_state* state, uint8_t opcode, int src, int dst, int32_t imm
             emit_alu32(state, 0x31, dst, dst);
         } else {
             // For modulo, set result to dividend.
-            emit_mov(state, dst, dst);
+            if (is64) {
+                emit_mov(state, dst, dst);
+            } else {
+                emit_mov32(state, dst, dst);
+            }
         }
         return;
     }
@@ -602,7 +1150,7 @@ muldivmod(struct jit_state* state, uint8_t opcode, int src, int dst, int32_t imm
     }
 
     // Load the divisor into RCX.
-    if (imm) {
+    if (!reg) {
         emit_load_imm(state, RCX, imm);
     } else {
         emit_mov(state, src, RCX);
@@ -694,6 +1242,10 @@ muldivmod(struct jit_state* state, uint8_t opcode, int src, int dst, int32_t imm
         }
         emit_pop(state, RAX);
     }
+    if (!is64) {
+        // A zero divisor leaves the whole 64-bit dividend in place.
+        emit_mov32(state, dst, dst);
+    }
 }
 
 static void
@@ -721,7 +1273,8 @@ resolve_jumps(struct jit_state* state)
 }
 
 int
-ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg)
+ubpf_translate_x86_64(
+    struct ubpf_vm* vm, uint8_t* buffer, size_t* size, uint32_t* pc_locs, bool in_place, char** errmsg)
 {
     struct jit_state state;
     int result = -1;
@@ -729,9 +1282,28 @@ ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char**
     state.offset = 0;
     state.size = *size;
     state.buf = buffer;
+    state.in_place = in_place;
     state.pc_locs = calloc(UBPF_MAX_INSTS + 1, sizeof(state.pc_locs[0]));
     state.jumps = calloc(UBPF_MAX_INSTS, sizeof(state.jumps[0]));
     state.num_jumps = 0;
+    state.jump_targets = calloc(UBPF_MAX_INSTS + 1, sizeof(state.jump_targets[0]));
+    state.layout = NULL;
+    state.num_blocks = 0;
+    state.tail_calls = false;
+    for (uint32_t i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, i);
+        state.tail_calls |= inst.opcode == EBPF_OP_CALL && ubpf_maps_is_tail_call(vm, inst.imm);
+    }
+
+    if (state.pc_locs == NULL || state.jumps == NULL || state.jump_targets == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    mark_jump_targets(vm, state.jump_targets);
+
+    if (plan_layout(vm, &state, pc_locs == NULL, errmsg) < 0) {
+        goto out;
+    }
 
     if (translate(vm, &state, errmsg) < 0) {
         goto out;
@@ -751,9 +1323,104 @@ ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char**
     result = 0;
 
     *size = state.offset;
+    if (pc_locs) {
+        memcpy(pc_locs, state.pc_locs, ((size_t)vm->num_insts + 1) * sizeof(pc_locs[0]));
+    }
 
 out:
     free(state.pc_locs);
     free(state.jumps);
+    free(state.jump_targets);
+    free(state.layout);
     return result;
 }
+
+/* An eBPF register, read from R11 if it lives in RAX (saved there first) */
+static int
+atomic_operand(int r)
+{
+    int reg = map_register(r);
+    return reg == RAX ? R11 : reg;
+}
+
+static void
+emit_atomic(struct jit_state* state, struct ebpf_inst inst)
+{
+    enum operand_size size = inst.opcode == EBPF_OP_ATOMIC_STORE ? S64 : S32;
+    int dst = map_register(inst.dst);
+    int src = map_register(inst.src);
+    int alu_op;
+
+    switch (inst.imm & ~EBPF_ATOMIC_OP_FETCH) {
+    case EBPF_ALU_OP_ADD:
+        alu_op = 0x01;
+        break;
+    case EBPF_ALU_OP_OR:
+        alu_op = 0x09;
+        break;
+    case EBPF_ALU_OP_AND:
+        alu_op = 0x21;
+        break;
+    case EBPF_ALU_OP_XOR:
+        alu_op = 0x31;
+        break;
+    default:
+        alu_op = 0;
+        break;
+    }
+
+    if (alu_op && !(inst.imm & EBPF_ATOMIC_OP_FETCH)) {
+        /* lock add/or/and/xor [dst + offset], src */
+        emit_locked_rmw(state, size, alu_op, src, dst, inst.offset);
+        return;
+    }
+    if (inst.imm == (EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH)) {
+        /* lock xadd leaves the old value in src */
+        emit_locked_rmw(state, size, 0x0fc1, src, dst, inst.offset);
+        return;
+    }
+    if (inst.imm == EBPF_ATOMIC_OP_XCHG) {
+        emit_locked_rmw(state, size, 0x87, src, dst, inst.offset);
+        return;
+    }
+
+    /*
+     * cmpxchg and the fetching or/and/xor need RAX, which holds some eBPF
+     * register: park it in R11 and read that register from there.
+     */
+    emit_mov(state, RAX, R11);
+    int base = atomic_operand(inst.dst);
+    int operand = atomic_operand(inst.src);
+    int result;
+
+    if (inst.imm == EBPF_ATOMIC_OP_CMPXCHG) {
+        if (map_register(0) != RAX) {
+            emit_mov(state, map_register(0), RAX);
+        }
+        emit_locked_rmw(state, size, 0x0fb1, operand, base, inst.offset);
+        result = map_register(0);
+    } else {
+        /* Retry with the freshly read value until nobody raced us */
+        emit_load(state, size, base, RAX, inst.offset);
+        uint32_t loop = state->offset;
+        emit_mov(state, RAX, RCX);
+        if (size == S64) {
+            emit_alu64(state, alu_op, operand, RCX);
+        } else {
+            emit_alu32(state, alu_op, operand, RCX);
+        }
+        emit_locked_rmw(state, size, 0x0fb1, RCX, base, inst.offset);
+        emit1(state, 0x75); /* jne rel8 */
+        emit1(state, loop - (state->offset + 1));
+        result = src;
+    }
+
+    if (size == S32) {
+        /* Zero-extend the old value */
+        emit_alu32(state, 0x89, RAX, RAX);
+    }
+    if (result != RAX) {
+        emit_mov(state, RAX, result);
+        emit_mov(state, R11, RAX);
+    }
+}
@@ -22,6 +22,7 @@
 #define UBPF_JIT_X86_64_H
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -51,6 +52,14 @@ enum operand_size
     S64,
 };
 
+/* Instructions [start, end) that are only ever entered at start */
+struct block
+{
+    uint32_t start;
+    uint32_t end;
+    uint32_t last; /* the last unit, see unit_length() */
+};
+
 struct jump
 {
     uint32_t offset_loc;
@@ -68,6 +77,12 @@ struct jit_state
     uint32_t unwind_loc;
     struct jump* jumps;
     int num_jumps;
+    bool* jump_targets;
+    struct block* layout; /* in the order they are emitted, see plan_layout() */
+    int num_blocks;
+    uint32_t next_pc; /* pc emitted after the current instruction, or num_insts for the epilogue */
+    bool in_place;    /* buf is where the code will run */
+    bool tail_calls;  /* the program makes tail calls, so its frame keeps their depth */
 };
 
 static inline void
@@ -134,13 +149,22 @@ emit_modrm_reg2reg(struct jit_state* state, int r, int m)
 static inline void
 emit_modrm_and_displacement(struct jit_state* state, int r, int m, int32_t d)
 {
+    int mod;
     if (d == 0 && (m & 7) != RBP) {
-        emit_modrm(state, 0x00, r, m);
+        mod = 0x00;
     } else if (d >= -128 && d <= 127) {
-        emit_modrm(state, 0x40, r, m);
-        emit1(state, d);
+        mod = 0x40;
     } else {
-        emit_modrm(state, 0x80, r, m);
+        mod = 0x80;
+    }
+    emit_modrm(state, mod, r, m);
+    if ((m & 7) == RSP) {
+        /* RSP/R12 as a base can only be encoded through a SIB byte */
+        emit1(state, 0x24);
+    }
+    if (mod == 0x40) {
+        emit1(state, d);
+    } else if (mod == 0x80) {
         emit4(state, d);
     }
 }
@@ -242,6 +266,13 @@ emit_mov(struct jit_state* state, int src, int dst)
     emit_alu64(state, 0x89, src, dst);
 }
 
+/* 32-bit move, which clears the upper half of dst */
+static inline void
+emit_mov32(struct jit_state* state, int src, int dst)
+{
+    emit_alu32(state, 0x89, src, dst);
+}
+
 static inline void
 emit_cmp_imm32(struct jit_state* state, int dst, int32_t imm)
 {
@@ -321,6 +352,22 @@ emit_store(struct jit_state* state, enum operand_size size, int src, int dst, in
     emit_modrm_and_displacement(state, src, dst, offset);
 }
 
+/*
+ * lock-prefixed read-modify-write of [dst + offset] with register src;
+ * op is a one byte opcode, or 0x0fxx for the two byte ones.
+ */
+static inline void
+emit_locked_rmw(struct jit_state* state, enum operand_size size, int op, int src, int dst, int32_t offset)
+{
+    emit1(state, 0xf0); /* lock */
+    emit_basic_rex(state, size == S64, src, dst);
+    if (op > 0xff) {
+        emit1(state, op >> 8);
+    }
+    emit1(state, op & 0xff);
+    emit_modrm_and_displacement(state, src, dst, offset);
+}
+
 /* Store immediate to [dst + offset] */
 static inline void
 emit_store_imm32(struct jit_state* state, enum operand_size size, int dst, int32_t offset, int32_t imm)
@@ -343,25 +390,19 @@ emit_store_imm32(struct jit_state* state, enum operand_size size, int dst, int32
 static inline void
 emit_call(struct jit_state* state, void* target)
 {
-#if defined(_WIN32)
-    /* Windows x64 ABI spills 5th parameter to stack */
-    emit_push(state, map_register(5));
-
-    /* Windows x64 ABI requires home register space */
-    /* Allocate home register space - 4 registers */
-    emit_alu64_imm32(state, 0x81, 5, RSP, 4 * sizeof(uint64_t));
-#endif
-
-    /* TODO use direct call when possible */
+    if (state->in_place) {
+        /* call rel32, if target is in reach */
+        int64_t rel = (int64_t)((uintptr_t)target - (uintptr_t)(state->buf + state->offset + 5));
+        if (rel >= INT32_MIN && rel <= INT32_MAX) {
+            emit1(state, 0xe8);
+            emit4(state, (int32_t)rel);
+            return;
+        }
+    }
     emit_load_imm(state, RAX, (uintptr_t)target);
     /* callq *%rax */
     emit1(state, 0xff);
     emit1(state, 0xd0);
-
-#if defined(_WIN32)
-    /* Deallocate home register space + spilled register - 5 registers */
-    emit_alu64_imm32(state, 0x81, 0, RSP, 5 * sizeof(uint64_t));
-#endif
 }
 
 static inline void
@@ -371,4 +412,30 @@ emit_jmp(struct jit_state* state, uint32_t target_pc)
     emit_jump_offset(state, target_pc);
 }
 
+/*
+ * Conditional jump to a point later in the code that has no pc of its own.
+ * Returns where the displacement lives, for patch_local_jump().
+ */
+static inline uint32_t
+emit_local_jcc(struct jit_state* state, int code)
+{
+    emit1(state, 0x0f);
+    emit1(state, code);
+    uint32_t loc = state->offset;
+    emit4(state, 0);
+    return loc;
+}
+
+/* Point a jump from emit_local_jcc() at the current offset */
+static inline void
+patch_local_jump(struct jit_state* state, uint32_t loc)
+{
+    if (loc + sizeof(uint32_t) > state->offset) {
+        /* Ran out of buffer; translation will fail anyway */
+        return;
+    }
+    uint32_t rel = state->offset - (loc + sizeof(uint32_t));
+    memcpy(&state->buf[loc], &rel, sizeof(uint32_t));
+}
+
 #endif
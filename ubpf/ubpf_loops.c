@@ -0,0 +1,321 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bounded loop verification.  Every backward jump closes a loop, and each
+ * loop must be a counted loop the verifier can run ahead of time:
+ *
+ *     mov r6, 0                 mov r6, 0
+ *   loop:                     loop:
+ *     ...                       jge r6, 16, done
+ *     add r6, 1                 ...
+ *     jlt r6, 16, loop          add r6, 1
+ *                               ja loop
+ *
+ * The counter is set by a mov of a constant on the straight-line path into
+ * the loop, changed by exactly one add or sub of a constant that runs on
+ * every iteration, and compared against a constant by the back edge (or, for
+ * a loop ending in ja, by the test at its top).  The loop is only entered
+ * through its first instruction, and loops nest without overlapping.  The
+ * counter's values are then simulated and the loop rejected if it could run
+ * more than UBPF_MAX_LOOP_ITERATIONS times.  Leaving the loop early, by
+ * jumping past its end or exiting, is always fine.
+ */
+
+#include <stdlib.h>
+#include "ubpf_int.h"
+
+struct loop
+{
+    uint32_t head; /* first instruction, the back edge's target */
+    uint32_t tail; /* the back edge */
+};
+
+/* If insts[pc] jumps, store its target and return true */
+static bool
+jump_target(const struct ebpf_inst* insts, uint32_t pc, uint32_t* target)
+{
+    uint8_t cls = insts[pc].opcode & EBPF_CLS_MASK;
+    uint8_t op = insts[pc].opcode & EBPF_JMP_OP_MASK;
+    if ((cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) || op == EBPF_MODE_CALL || op == EBPF_MODE_EXIT) {
+        return false;
+    }
+    *target = pc + 1 + insts[pc].offset;
+    return true;
+}
+
+static bool
+writes_reg(const struct ebpf_inst* inst, uint8_t reg)
+{
+    switch (inst->opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+    case EBPF_CLS_LDX:
+        return inst->dst == reg;
+    case EBPF_CLS_LD:
+        return inst->opcode == EBPF_OP_LDDW && inst->dst == reg;
+    case EBPF_CLS_STX:
+        if ((inst->opcode & 0xe0) != EBPF_MODE_ATOMIC) {
+            return false;
+        }
+        if (inst->imm == EBPF_ATOMIC_OP_CMPXCHG) {
+            return reg == 0;
+        }
+        return (inst->imm & EBPF_ATOMIC_OP_FETCH) && inst->src == reg;
+    case EBPF_CLS_JMP:
+        /* Helpers return in r0 and clobber r1-r5 */
+        return inst->opcode == EBPF_OP_CALL && reg <= 5;
+    default:
+        return false;
+    }
+}
+
+/* Whether the conditional jump inst is taken when its register holds value */
+static bool
+jump_taken(const struct ebpf_inst* inst, uint64_t value)
+{
+    if ((inst->opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) {
+        uint32_t a = (uint32_t)value, b = (uint32_t)inst->imm;
+        switch (inst->opcode & EBPF_JMP_OP_MASK) {
+        case EBPF_MODE_JEQ:
+            return a == b;
+        case EBPF_MODE_JNE:
+            return a != b;
+        case EBPF_MODE_JGT:
+            return a > b;
+        case EBPF_MODE_JGE:
+            return a >= b;
+        case EBPF_MODE_JLT:
+            return a < b;
+        case EBPF_MODE_JLE:
+            return a <= b;
+        case EBPF_MODE_JSET:
+            return a & b;
+        case EBPF_MODE_JSGT:
+            return (int32_t)a > (int32_t)b;
+        case EBPF_MODE_JSGE:
+            return (int32_t)a >= (int32_t)b;
+        case EBPF_MODE_JSLT:
+            return (int32_t)a < (int32_t)b;
+        case EBPF_MODE_JSLE:
+            return (int32_t)a <= (int32_t)b;
+        }
+    } else {
+        uint64_t a = value, b = (int64_t)inst->imm;
+        switch (inst->opcode & EBPF_JMP_OP_MASK) {
+        case EBPF_MODE_JEQ:
+            return a == b;
+        case EBPF_MODE_JNE:
+            return a != b;
+        case EBPF_MODE_JGT:
+            return a > b;
+        case EBPF_MODE_JGE:
+            return a >= b;
+        case EBPF_MODE_JLT:
+            return a < b;
+        case EBPF_MODE_JLE:
+            return a <= b;
+        case EBPF_MODE_JSET:
+            return a & b;
+        case EBPF_MODE_JSGT:
+            return (int64_t)a > (int64_t)b;
+        case EBPF_MODE_JSGE:
+            return (int64_t)a >= (int64_t)b;
+        case EBPF_MODE_JSLT:
+            return (int64_t)a < (int64_t)b;
+        case EBPF_MODE_JSLE:
+            return (int64_t)a <= (int64_t)b;
+        }
+    }
+    return false;
+}
+
+static uint64_t
+step(const struct ebpf_inst* inst, uint64_t value)
+{
+    switch (inst->opcode) {
+    case EBPF_OP_ADD_IMM:
+        return (uint32_t)(value + inst->imm);
+    case EBPF_OP_SUB_IMM:
+        return (uint32_t)(value - inst->imm);
+    case EBPF_OP_ADD64_IMM:
+        return value + (int64_t)inst->imm;
+    default: /* EBPF_OP_SUB64_IMM */
+        return value - (int64_t)inst->imm;
+    }
+}
+
+static bool
+check_loop(
+    const struct ebpf_inst* insts,
+    uint32_t num_insts,
+    const struct loop* loops,
+    uint32_t num_loops,
+    const struct loop* l,
+    char** errmsg)
+{
+    uint32_t i, pc, target;
+
+    for (i = 0; i < num_loops; i++) {
+        const struct loop* m = &loops[i];
+        if (m == l || m->tail < l->head || m->head > l->tail) {
+            continue;
+        }
+        if (m->head == l->head) {
+            *errmsg = ubpf_error("second back edge to loop at PC %d", m->tail);
+            return false;
+        }
+        bool inside = m->head > l->head && m->tail < l->tail;
+        bool outside = m->head < l->head && m->tail > l->tail;
+        if (!inside && !outside) {
+            *errmsg = ubpf_error("overlapping loops at PC %d", m->tail);
+            return false;
+        }
+    }
+
+    /* The test that bounds the loop, and what it means to go round again */
+    const struct ebpf_inst* test;
+    bool again_if_taken;
+    if (insts[l->tail].opcode == EBPF_OP_JA) {
+        test = &insts[l->head];
+        again_if_taken = false;
+        uint8_t cls = test->opcode & EBPF_CLS_MASK;
+        if ((cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) || test->opcode == EBPF_OP_JA ||
+            !jump_target(insts, l->head, &target) || target <= l->tail) {
+            *errmsg = ubpf_error("unbounded loop at PC %d", l->tail);
+            return false;
+        }
+    } else {
+        test = &insts[l->tail];
+        again_if_taken = true;
+    }
+    if (test->opcode & EBPF_SRC_REG) {
+        *errmsg = ubpf_error("loop bound is not a constant at PC %d", (int)(test - insts));
+        return false;
+    }
+    uint8_t counter = test->dst;
+
+    /* Exactly one add or sub of a non-zero constant */
+    const struct ebpf_inst* update = NULL;
+    uint32_t update_pc = 0;
+    for (pc = l->head; pc <= l->tail; pc++) {
+        if (!writes_reg(&insts[pc], counter)) {
+            continue;
+        }
+        if (update) {
+            *errmsg = ubpf_error("loop counter r%d written again at PC %d", counter, pc);
+            return false;
+        }
+        update = &insts[pc];
+        update_pc = pc;
+    }
+    if (!update || update->imm == 0 ||
+        (update->opcode != EBPF_OP_ADD_IMM && update->opcode != EBPF_OP_SUB_IMM &&
+         update->opcode != EBPF_OP_ADD64_IMM && update->opcode != EBPF_OP_SUB64_IMM)) {
+        *errmsg = ubpf_error("unbounded loop at PC %d", l->tail);
+        return false;
+    }
+
+    /* ... that runs once every time round */
+    for (i = 0; i < num_loops; i++) {
+        const struct loop* m = &loops[i];
+        if (m != l && m->head > l->head && m->tail < l->tail && m->head <= update_pc && update_pc <= m->tail) {
+            *errmsg = ubpf_error("loop counter update in inner loop at PC %d", update_pc);
+            return false;
+        }
+    }
+    for (pc = l->head; pc < update_pc; pc++) {
+        if (jump_target(insts, pc, &target) && target > update_pc && target <= l->tail) {
+            *errmsg = ubpf_error("jump over loop counter update at PC %d", pc);
+            return false;
+        }
+    }
+
+    /* The last write before the loop must set the counter to a constant */
+    uint32_t init_pc = l->head;
+    while (init_pc > 0 && !writes_reg(&insts[init_pc - 1], counter)) {
+        init_pc--;
+    }
+    if (init_pc == 0 ||
+        (insts[init_pc - 1].opcode != EBPF_OP_MOV_IMM && insts[init_pc - 1].opcode != EBPF_OP_MOV64_IMM)) {
+        *errmsg = ubpf_error("loop counter r%d not set to a constant before loop at PC %d", counter, l->head);
+        return false;
+    }
+    init_pc--;
+    uint64_t value = insts[init_pc].opcode == EBPF_OP_MOV_IMM ? (uint32_t)insts[init_pc].imm
+                                                               : (uint64_t)(int64_t)insts[init_pc].imm;
+
+    /* Nothing may jump into the loop, or past the initialization to its top */
+    for (pc = 0; pc < num_insts; pc++) {
+        if (!jump_target(insts, pc, &target) || (pc >= l->head && pc <= l->tail)) {
+            continue;
+        }
+        bool into_body = target > l->head && target <= l->tail;
+        bool past_init = target > init_pc && target <= l->head && (pc < init_pc || pc > l->tail);
+        if (into_body || past_init) {
+            *errmsg = ubpf_error("jump into loop at PC %d", pc);
+            return false;
+        }
+    }
+
+    uint32_t iterations = 0;
+    for (;;) {
+        if (!again_if_taken && jump_taken(test, value)) {
+            break;
+        }
+        if (++iterations > UBPF_MAX_LOOP_ITERATIONS) {
+            *errmsg = ubpf_error(
+                "loop at PC %d may run more than %d iterations", l->tail, UBPF_MAX_LOOP_ITERATIONS);
+            return false;
+        }
+        value = step(update, value);
+        if (again_if_taken && !jump_taken(test, value)) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool
+ubpf_check_loops(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+{
+    struct loop* loops = NULL;
+    uint32_t num_loops = 0;
+    uint32_t pc, target;
+    bool ok = true;
+
+    for (pc = 0; pc < num_insts; pc++) {
+        if (!jump_target(insts, pc, &target) || target > pc) {
+            continue;
+        }
+        if (!loops) {
+            loops = calloc(num_insts, sizeof(*loops));
+            if (!loops) {
+                *errmsg = ubpf_error("out of memory");
+                return false;
+            }
+        }
+        loops[num_loops].head = target;
+        loops[num_loops].tail = pc;
+        num_loops++;
+    }
+
+    for (uint32_t i = 0; ok && i < num_loops; i++) {
+        ok = check_loop(insts, num_insts, loops, num_loops, &loops[i], errmsg);
+    }
+    free(loops);
+    return ok;
+}
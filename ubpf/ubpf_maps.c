@@ -0,0 +1,634 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Array and hash maps, plus their per-CPU variants, and program arrays.
+ *
+ * All values live in one allocation.  A per-CPU map has UBPF_MAX_CPUS copies
+ * of it, each starting on its own cache line, and every executor thread
+ * (ubpf_exec_batch() and ubpf_sched workers) uses the copy matching its
+ * index, so threads bumping the same counter never share a cache line.
+ *
+ * Maps can be made read-only to programs, so ubpf_specialize() may fold their
+ * values into the program.  Every host-side change to such a map bumps its
+ * generation, which tells the VM to specialize again.
+ *
+ * Hash lookups take no lock, since they run on every thread at once; updates
+ * and deletes are serialized by the map's lock.  Elements are preallocated
+ * and reused, so a lookup can land on an element that is deleted and
+ * reinserted under another key while it walks the chain.  Chains therefore
+ * end in a marker naming their bucket, and a lookup that finishes in some
+ * other bucket's chain starts over.
+ *
+ * A program array's slots are atomic VM pointers, so the host can swap the
+ * programs in it while others tail call through it.  Programs only reach
+ * them through tail_call, never as map values.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ubpf_int.h"
+
+#define CACHE_LINE 64
+#define ROUND_UP(x, n) (((x) + (n)-1) / (n) * (n))
+
+#define CHAIN_END(bucket) (0x80000000u | (bucket))
+#define IS_CHAIN_END(link) ((link)&0x80000000u)
+
+struct hash_elem
+{
+    atomic_uint next;   /* Index + 1 of the next element, or CHAIN_END() */
+    uint32_t free_next; /* Index + 1 of the next free element, or 0 */
+    uint32_t hash;
+    unsigned char key[];
+};
+
+struct ubpf_map
+{
+    enum ubpf_map_type type;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t max_entries;
+    unsigned int cpus;
+    size_t value_stride;
+    size_t cpu_stride;
+    unsigned char* values;
+    bool readonly;          /* to programs */
+    atomic_uint generation; /* bumped when a read-only map changes */
+
+    /* Hash maps only */
+    unsigned char* elems;
+    size_t elem_size;
+    uint32_t bucket_mask;
+    atomic_uint* buckets;
+    uint32_t free_head;
+    pthread_mutex_t lock;
+};
+
+static _Thread_local unsigned int current_cpu;
+
+void
+ubpf_set_cpu(unsigned int cpu)
+{
+    current_cpu = cpu % UBPF_MAX_CPUS;
+}
+
+static bool
+is_hash(const struct ubpf_map* map)
+{
+    return map->type == UBPF_MAP_TYPE_HASH || map->type == UBPF_MAP_TYPE_PERCPU_HASH;
+}
+
+static unsigned char*
+map_value(const struct ubpf_map* map, uint32_t index, unsigned int cpu)
+{
+    return map->values + cpu * map->cpu_stride + index * map->value_stride;
+}
+
+static _Atomic(struct ubpf_vm*)*
+prog_slot(const struct ubpf_map* map, uint32_t index)
+{
+    return (_Atomic(struct ubpf_vm*)*)map_value(map, index, 0);
+}
+
+static struct hash_elem*
+hash_elem(const struct ubpf_map* map, uint32_t index)
+{
+    return (struct hash_elem*)(map->elems + index * map->elem_size);
+}
+
+/* FNV-1a */
+static uint32_t
+hash_key(const struct ubpf_map* map, const void* key)
+{
+    const unsigned char* p = key;
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < map->key_size; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int64_t
+hash_find(const struct ubpf_map* map, const void* key, uint32_t hash)
+{
+    uint32_t bucket = hash & map->bucket_mask;
+    uint32_t link;
+
+    do {
+        link = atomic_load_explicit(&map->buckets[bucket], memory_order_acquire);
+        while (!IS_CHAIN_END(link)) {
+            struct hash_elem* elem = hash_elem(map, link - 1);
+            if (elem->hash == hash && memcmp(elem->key, key, map->key_size) == 0) {
+                return link - 1;
+            }
+            link = atomic_load_explicit(&elem->next, memory_order_acquire);
+        }
+    } while (link != CHAIN_END(bucket));
+    return -1;
+}
+
+/* The element's index, or -1 if there isn't one */
+static int64_t
+map_find(const struct ubpf_map* map, const void* key)
+{
+    if (is_hash(map)) {
+        return hash_find(map, key, hash_key(map, key));
+    }
+    uint32_t index;
+    memcpy(&index, key, sizeof(index));
+    return index < map->max_entries ? (int64_t)index : -1;
+}
+
+struct ubpf_map*
+ubpf_map_create(enum ubpf_map_type type, uint32_t key_size, uint32_t value_size, uint32_t max_entries)
+{
+    bool percpu = type == UBPF_MAP_TYPE_PERCPU_ARRAY || type == UBPF_MAP_TYPE_PERCPU_HASH;
+    bool hash = type == UBPF_MAP_TYPE_HASH || type == UBPF_MAP_TYPE_PERCPU_HASH;
+
+    if (!hash && type != UBPF_MAP_TYPE_ARRAY && type != UBPF_MAP_TYPE_PERCPU_ARRAY &&
+        type != UBPF_MAP_TYPE_PROG_ARRAY) {
+        return NULL;
+    }
+    if (type == UBPF_MAP_TYPE_PROG_ARRAY && value_size != sizeof(struct ubpf_vm*)) {
+        return NULL;
+    }
+    if (key_size == 0 || value_size == 0 || max_entries == 0 || max_entries >= 0x7fffffff) {
+        return NULL;
+    }
+    if ((!hash && key_size != sizeof(uint32_t)) || (percpu && value_size % sizeof(uint64_t))) {
+        return NULL;
+    }
+
+    struct ubpf_map* map = calloc(1, sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->type = type;
+    map->key_size = key_size;
+    map->value_size = value_size;
+    map->max_entries = max_entries;
+    map->cpus = percpu ? UBPF_MAX_CPUS : 1;
+    map->value_stride = ROUND_UP(value_size, sizeof(uint64_t));
+    atomic_init(&map->generation, 0);
+    pthread_mutex_init(&map->lock, NULL);
+
+    if (map->value_stride > (SIZE_MAX - CACHE_LINE) / max_entries / map->cpus) {
+        goto fail;
+    }
+    map->cpu_stride = ROUND_UP(map->value_stride * max_entries, CACHE_LINE);
+    map->values = aligned_alloc(CACHE_LINE, map->cpu_stride * map->cpus);
+    if (map->values == NULL) {
+        goto fail;
+    }
+    memset(map->values, 0, map->cpu_stride * map->cpus);
+
+    if (hash) {
+        uint32_t buckets = 1;
+        while (buckets < max_entries) {
+            buckets <<= 1;
+        }
+        map->bucket_mask = buckets - 1;
+        map->buckets = calloc(buckets, sizeof(*map->buckets));
+        map->elem_size = ROUND_UP(sizeof(struct hash_elem) + key_size, sizeof(uint64_t));
+        map->elems = calloc(max_entries, map->elem_size);
+        if (map->buckets == NULL || map->elems == NULL) {
+            goto fail;
+        }
+        for (uint32_t i = 0; i < buckets; i++) {
+            atomic_init(&map->buckets[i], CHAIN_END(i));
+        }
+        for (uint32_t i = 0; i < max_entries; i++) {
+            hash_elem(map, i)->free_next = i + 1 < max_entries ? i + 2 : 0;
+        }
+        map->free_head = 1;
+    }
+    return map;
+
+fail:
+    ubpf_map_destroy(map);
+    return NULL;
+}
+
+void
+ubpf_map_destroy(struct ubpf_map* map)
+{
+    if (map == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&map->lock);
+    free(map->values);
+    free(map->buckets);
+    free(map->elems);
+    free(map);
+}
+
+/* Tell anything specialized on a read-only map's values that they changed */
+static void
+changed(struct ubpf_map* map)
+{
+    if (map->readonly) {
+        atomic_fetch_add_explicit(&map->generation, 1, memory_order_release);
+    }
+}
+
+void
+ubpf_map_set_readonly(struct ubpf_map* map, bool readonly)
+{
+    map->readonly = readonly;
+    atomic_fetch_add_explicit(&map->generation, 1, memory_order_release);
+}
+
+void*
+ubpf_map_lookup_elem(struct ubpf_map* map, const void* key)
+{
+    int64_t index = map_find(map, key);
+    if (index < 0) {
+        return NULL;
+    }
+    return map_value(map, index, map->cpus > 1 ? current_cpu : 0);
+}
+
+int
+ubpf_map_update_elem(struct ubpf_map* map, const void* key, const void* value, uint64_t flags)
+{
+    unsigned int cpu = map->cpus > 1 ? current_cpu : 0;
+
+    if (flags > UBPF_EXIST) {
+        return -1;
+    }
+    if (!is_hash(map)) {
+        int64_t index = map_find(map, key);
+        if (index < 0 || flags == UBPF_NOEXIST) {
+            return -1;
+        }
+        if (map->type == UBPF_MAP_TYPE_PROG_ARRAY) {
+            struct ubpf_vm* prog;
+            memcpy(&prog, value, sizeof(prog));
+            atomic_store_explicit(prog_slot(map, index), prog, memory_order_release);
+            return 0;
+        }
+        memcpy(map_value(map, index, cpu), value, map->value_size);
+        changed(map);
+        return 0;
+    }
+
+    uint32_t hash = hash_key(map, key);
+    pthread_mutex_lock(&map->lock);
+    int64_t index = hash_find(map, key, hash);
+    if (index >= 0) {
+        if (flags == UBPF_NOEXIST) {
+            goto fail;
+        }
+        memcpy(map_value(map, index, cpu), value, map->value_size);
+        changed(map);
+        pthread_mutex_unlock(&map->lock);
+        return 0;
+    }
+    if (flags == UBPF_EXIST || map->free_head == 0) {
+        goto fail;
+    }
+
+    index = map->free_head - 1;
+    struct hash_elem* elem = hash_elem(map, index);
+    map->free_head = elem->free_next;
+    elem->hash = hash;
+    memcpy(elem->key, key, map->key_size);
+    for (unsigned int i = 0; i < map->cpus; i++) {
+        memset(map_value(map, index, i), 0, map->value_size);
+    }
+    memcpy(map_value(map, index, cpu), value, map->value_size);
+
+    /* Publish it at the head of its chain, once it's filled in */
+    uint32_t bucket = hash & map->bucket_mask;
+    atomic_store_explicit(
+        &elem->next, atomic_load_explicit(&map->buckets[bucket], memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&map->buckets[bucket], index + 1, memory_order_release);
+    changed(map);
+    pthread_mutex_unlock(&map->lock);
+    return 0;
+
+fail:
+    pthread_mutex_unlock(&map->lock);
+    return -1;
+}
+
+int
+ubpf_map_delete_elem(struct ubpf_map* map, const void* key)
+{
+    if (map->type == UBPF_MAP_TYPE_PROG_ARRAY) {
+        int64_t index = map_find(map, key);
+        if (index < 0) {
+            return -1;
+        }
+        atomic_store_explicit(prog_slot(map, index), NULL, memory_order_release);
+        return 0;
+    }
+    if (!is_hash(map)) {
+        return -1;
+    }
+
+    uint32_t hash = hash_key(map, key);
+    pthread_mutex_lock(&map->lock);
+    atomic_uint* prev = &map->buckets[hash & map->bucket_mask];
+    uint32_t link = atomic_load_explicit(prev, memory_order_relaxed);
+    while (!IS_CHAIN_END(link)) {
+        struct hash_elem* elem = hash_elem(map, link - 1);
+        if (elem->hash == hash && memcmp(elem->key, key, map->key_size) == 0) {
+            /* Leave elem->next alone: a lookup standing on elem still needs it */
+            atomic_store_explicit(
+                prev, atomic_load_explicit(&elem->next, memory_order_relaxed), memory_order_release);
+            elem->free_next = map->free_head;
+            map->free_head = link;
+            changed(map);
+            pthread_mutex_unlock(&map->lock);
+            return 0;
+        }
+        prev = &elem->next;
+        link = atomic_load_explicit(prev, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&map->lock);
+    return -1;
+}
+
+int
+ubpf_map_read(struct ubpf_map* map, const void* key, void* value)
+{
+    int64_t index = map_find(map, key);
+    if (index < 0) {
+        return -1;
+    }
+    if (map->cpus == 1) {
+        memcpy(value, map_value(map, index, 0), map->value_size);
+        return 0;
+    }
+
+    for (uint32_t off = 0; off < map->value_size; off += sizeof(uint64_t)) {
+        uint64_t sum = 0;
+        for (unsigned int cpu = 0; cpu < map->cpus; cpu++) {
+            uint64_t v;
+            memcpy(&v, map_value(map, index, cpu) + off, sizeof(v));
+            sum += v;
+        }
+        memcpy((unsigned char*)value + off, &sum, sizeof(sum));
+    }
+    return 0;
+}
+
+int
+ubpf_map_read_percpu(struct ubpf_map* map, const void* key, void* values)
+{
+    if (map->cpus == 1) {
+        return -1;
+    }
+    int64_t index = map_find(map, key);
+    if (index < 0) {
+        return -1;
+    }
+    for (unsigned int cpu = 0; cpu < map->cpus; cpu++) {
+        memcpy((unsigned char*)values + cpu * map->value_size, map_value(map, index, cpu), map->value_size);
+    }
+    return 0;
+}
+
+bool
+ubpf_maps_contain(const struct ubpf_vm* vm, const void* addr, int size)
+{
+    return size >= 0 && ubpf_maps_avail(vm, addr) >= (size_t)size;
+}
+
+size_t
+ubpf_maps_avail(const struct ubpf_vm* vm, const void* addr)
+{
+    for (unsigned int i = 0; i < MAX_MAPS; i++) {
+        const struct ubpf_map* map = vm->maps[i];
+        const unsigned char* end = map ? map->values + map->cpu_stride * map->cpus : NULL;
+        if (map && map->type != UBPF_MAP_TYPE_PROG_ARRAY && (const unsigned char*)addr >= map->values && (const unsigned char*)addr < end) {
+            return end - (const unsigned char*)addr;
+        }
+    }
+    return 0;
+}
+
+static struct ubpf_map*
+helper_map(const struct ubpf_vm* vm, uint64_t id)
+{
+    return vm->maps && id < MAX_MAPS ? vm->maps[id] : NULL;
+}
+
+uint32_t
+ubpf_maps_value_size(const struct ubpf_vm* vm, uint64_t id)
+{
+    const struct ubpf_map* map = helper_map(vm, id);
+    return map ? map->value_size : 0;
+}
+
+uint32_t
+ubpf_maps_key_size(const struct ubpf_vm* vm, uint64_t id)
+{
+    const struct ubpf_map* map = helper_map(vm, id);
+    return map ? map->key_size : 0;
+}
+
+bool
+ubpf_maps_readonly(const struct ubpf_vm* vm, uint64_t min, uint64_t max)
+{
+    for (uint64_t id = min; vm->maps && id <= max && id < MAX_MAPS; id++) {
+        if (vm->maps[id] && vm->maps[id]->readonly) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t
+ubpf_maps_generation(const struct ubpf_vm* vm, unsigned int id)
+{
+    const struct ubpf_map* map = helper_map(vm, id);
+    return map ? atomic_load_explicit(&map->generation, memory_order_acquire) : 0;
+}
+
+/* A read-only map whose values are the same on every thread */
+static struct ubpf_map*
+const_map(const struct ubpf_vm* vm, uint64_t id)
+{
+    struct ubpf_map* map = helper_map(vm, id);
+    return map && map->readonly && map->cpus == 1 && map->type != UBPF_MAP_TYPE_PROG_ARRAY ? map : NULL;
+}
+
+bool
+ubpf_maps_const_lookup(const struct ubpf_vm* vm, uint64_t id, const void* key, uint64_t* value, uint32_t* generation)
+{
+    const struct ubpf_map* map = const_map(vm, id);
+    if (map == NULL) {
+        return false;
+    }
+    *generation = atomic_load_explicit(&map->generation, memory_order_acquire);
+    int64_t index = map_find(map, key);
+    *value = index < 0 ? 0 : (uintptr_t)map_value(map, index, 0);
+    return true;
+}
+
+bool
+ubpf_maps_const_read(
+    const struct ubpf_vm* vm, uint64_t addr, int size, uint64_t* value, unsigned int* id, uint32_t* generation)
+{
+    for (unsigned int i = 0; vm->maps && i < MAX_MAPS; i++) {
+        const struct ubpf_map* map = const_map(vm, i);
+        uintptr_t start = map ? (uintptr_t)map->values : 0;
+        if (!map || addr < start || addr + size > start + map->value_stride * map->max_entries) {
+            continue;
+        }
+        *id = i;
+        *generation = atomic_load_explicit(&map->generation, memory_order_acquire);
+        const void* p = (const void*)(uintptr_t)addr;
+        switch (size) {
+        case 1:
+            *value = *(const uint8_t*)p;
+            break;
+        case 2:
+            *value = *(const uint16_t*)p;
+            break;
+        case 4:
+            *value = *(const uint32_t*)p;
+            break;
+        default:
+            *value = *(const uint64_t*)p;
+            break;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Whether the program may pass size bytes at addr to a helper, see ubpf_accessible() */
+static bool
+accessible(const struct ubpf_vm* vm, uint64_t addr, uint32_t size)
+{
+    return ubpf_accessible(vm, (const void*)(uintptr_t)addr) >= size;
+}
+
+/* A bad key finds nothing: the program can only test the result for NULL */
+static uint64_t
+map_lookup_elem(struct ubpf_vm* vm, uint64_t call, uint64_t id, uint64_t key, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    struct ubpf_map* map = helper_map(vm, id);
+    if (map == NULL || map->type == UBPF_MAP_TYPE_PROG_ARRAY || !accessible(vm, key, map->key_size)) {
+        return 0;
+    }
+    return (uintptr_t)ubpf_map_lookup_elem(map, (const void*)(uintptr_t)key);
+}
+
+static uint64_t
+map_update_elem(
+    struct ubpf_vm* vm, uint64_t call, uint64_t id, uint64_t key, uint64_t value, uint64_t flags, uint64_t r5)
+{
+    struct ubpf_map* map = helper_map(vm, id);
+    if (map == NULL || map->readonly || map->type == UBPF_MAP_TYPE_PROG_ARRAY) {
+        return -1;
+    }
+    if (!accessible(vm, key, map->key_size) || !accessible(vm, value, map->value_size)) {
+        return -EFAULT;
+    }
+    return ubpf_map_update_elem(map, (const void*)(uintptr_t)key, (const void*)(uintptr_t)value, flags);
+}
+
+static uint64_t
+map_delete_elem(struct ubpf_vm* vm, uint64_t call, uint64_t id, uint64_t key, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    struct ubpf_map* map = helper_map(vm, id);
+    if (map == NULL || map->readonly || map->type == UBPF_MAP_TYPE_PROG_ARRAY) {
+        return -1;
+    }
+    if (!accessible(vm, key, map->key_size)) {
+        return -EFAULT;
+    }
+    return ubpf_map_delete_elem(map, (const void*)(uintptr_t)key);
+}
+
+/*
+ * The interpreter and JIT handle calls to this themselves (see
+ * ubpf_maps_is_tail_call()); anything else that calls it gets the failure
+ * a tail call to an empty slot would.
+ */
+static uint64_t
+tail_call(struct ubpf_vm* vm, uint64_t call, uint64_t ctx, uint64_t id, uint64_t index, uint64_t r4, uint64_t r5)
+{
+    return -1;
+}
+
+int
+ubpf_register_map(struct ubpf_vm* vm, unsigned int id, struct ubpf_map* map)
+{
+    if (id >= MAX_MAPS) {
+        return -1;
+    }
+    if (vm->maps == NULL) {
+        vm->maps = calloc(MAX_MAPS, sizeof(*vm->maps));
+        if (vm->maps == NULL) {
+            return -1;
+        }
+    }
+    vm->maps[id] = map;
+
+    ubpf_register(vm, 1, "map_lookup_elem", map_lookup_elem);
+    ubpf_register(vm, 2, "map_update_elem", map_update_elem);
+    ubpf_register(vm, 3, "map_delete_elem", map_delete_elem);
+    ubpf_describe_helper(vm, 1, 2, 0);
+    ubpf_describe_helper(vm, 2, 4, 0);
+    ubpf_describe_helper(vm, 3, 2, 0);
+    if (map->type == UBPF_MAP_TYPE_PROG_ARRAY) {
+        ubpf_register(vm, 12, "tail_call", tail_call);
+        ubpf_describe_helper(vm, 12, 3, 0);
+    }
+    return 0;
+}
+
+bool
+ubpf_maps_reads_only(const struct ubpf_vm* vm, int32_t helper, int arg)
+{
+    if (helper < 0 || helper >= MAX_EXT_FUNCS) {
+        return false;
+    }
+    ext_func fn = vm->ext_funcs[helper];
+    return (fn == map_lookup_elem && arg == 2) || (fn == map_update_elem && (arg == 2 || arg == 3)) ||
+           (fn == map_delete_elem && arg == 2);
+}
+
+bool
+ubpf_maps_is_lookup(const struct ubpf_vm* vm, int32_t helper)
+{
+    return helper >= 0 && helper < MAX_EXT_FUNCS && vm->ext_funcs[helper] == map_lookup_elem;
+}
+
+bool
+ubpf_maps_is_tail_call(const struct ubpf_vm* vm, int32_t helper)
+{
+    return helper >= 0 && helper < MAX_EXT_FUNCS && vm->ext_funcs[helper] == tail_call;
+}
+
+struct ubpf_vm*
+ubpf_maps_prog(const struct ubpf_vm* vm, uint64_t id, uint64_t index)
+{
+    const struct ubpf_map* map = helper_map(vm, id);
+    if (map == NULL || map->type != UBPF_MAP_TYPE_PROG_ARRAY || index >= map->max_entries) {
+        return NULL;
+    }
+    return atomic_load_explicit(prog_slot(map, index), memory_order_acquire);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bulk memory helpers.  Each checks its buffers once against the regions the
+ * running program may touch (ubpf_accessible()) and then hands the whole
+ * operation to the C library, whose memcpy, memset, memcmp and memchr are
+ * vectorized (and become WebAssembly bulk memory instructions in the browser
+ * build).  A buffer that isn't accessible fails the call with -EFAULT.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "ubpf_int.h"
+
+static inline bool
+accessible(const struct ubpf_vm* vm, uint64_t addr, uint64_t size)
+{
+    return size == 0 || ubpf_accessible(vm, (const void*)(uintptr_t)addr) >= size;
+}
+
+/* long probe_read(void* dst, u32 size, const void* src): dst is zeroed on failure */
+static uint64_t
+probe_read(struct ubpf_vm* vm, uint64_t call, uint64_t dst, uint64_t size, uint64_t src, uint64_t r4, uint64_t r5)
+{
+    size = (uint32_t)size;
+    if (!accessible(vm, dst, size)) {
+        return -EFAULT;
+    }
+    if (!accessible(vm, src, size)) {
+        memset((void*)(uintptr_t)dst, 0, size);
+        return -EFAULT;
+    }
+    memcpy((void*)(uintptr_t)dst, (const void*)(uintptr_t)src, size);
+    return 0;
+}
+
+/*
+ * long probe_read_str(void* dst, u32 size, const void* src): copy a string
+ * of at most size - 1 characters and its terminator, and return how many
+ * bytes that was.
+ */
+static uint64_t
+probe_read_str(struct ubpf_vm* vm, uint64_t call, uint64_t dst, uint64_t size, uint64_t src, uint64_t r4, uint64_t r5)
+{
+    size = (uint32_t)size;
+    if (size == 0) {
+        return 0;
+    }
+    if (!accessible(vm, dst, size)) {
+        return -EFAULT;
+    }
+
+    /* The string only has to be readable up to its terminator */
+    const char* from = (const char*)(uintptr_t)src;
+    size_t avail = ubpf_accessible(vm, from);
+    size_t scan = avail < size - 1 ? avail : size - 1;
+    const char* nul = memchr(from, 0, scan);
+    if (!nul && scan < size - 1) {
+        memset((void*)(uintptr_t)dst, 0, size);
+        return -EFAULT;
+    }
+    size_t len = nul ? (size_t)(nul - from) : scan;
+    memcpy((void*)(uintptr_t)dst, from, len);
+    ((char*)(uintptr_t)dst)[len] = '\0';
+    return len + 1;
+}
+
+/* long memcpy(void* dst, const void* src, u32 n): the buffers may overlap */
+static uint64_t
+helper_memcpy(struct ubpf_vm* vm, uint64_t call, uint64_t dst, uint64_t src, uint64_t n, uint64_t r4, uint64_t r5)
+{
+    n = (uint32_t)n;
+    if (!accessible(vm, dst, n) || !accessible(vm, src, n)) {
+        return -EFAULT;
+    }
+    memmove((void*)(uintptr_t)dst, (const void*)(uintptr_t)src, n);
+    return 0;
+}
+
+/* long memset(void* dst, int c, u32 n) */
+static uint64_t
+helper_memset(struct ubpf_vm* vm, uint64_t call, uint64_t dst, uint64_t c, uint64_t n, uint64_t r4, uint64_t r5)
+{
+    n = (uint32_t)n;
+    if (!accessible(vm, dst, n)) {
+        return -EFAULT;
+    }
+    memset((void*)(uintptr_t)dst, (unsigned char)c, n);
+    return 0;
+}
+
+/* long memcmp(const void* a, const void* b, u32 n): -1, 0 or 1 */
+static uint64_t
+helper_memcmp(struct ubpf_vm* vm, uint64_t call, uint64_t a, uint64_t b, uint64_t n, uint64_t r4, uint64_t r5)
+{
+    n = (uint32_t)n;
+    if (!accessible(vm, a, n) || !accessible(vm, b, n)) {
+        return -EFAULT;
+    }
+    int rc = memcmp((const void*)(uintptr_t)a, (const void*)(uintptr_t)b, n);
+    return (int64_t)((rc > 0) - (rc < 0));
+}
+
+int
+ubpf_register_memory_helpers(struct ubpf_vm* vm)
+{
+    if (ubpf_register(vm, 4, "probe_read", probe_read) < 0 ||
+        ubpf_register(vm, 45, "probe_read_str", probe_read_str) < 0 ||
+        ubpf_register(vm, UBPF_HELPER_MEMCPY, "memcpy", helper_memcpy) < 0 ||
+        ubpf_register(vm, UBPF_HELPER_MEMSET, "memset", helper_memset) < 0 ||
+        ubpf_register(vm, UBPF_HELPER_MEMCMP, "memcmp", helper_memcmp) < 0) {
+        return -1;
+    }
+    ubpf_describe_helper(vm, 4, 3, 0);
+    ubpf_describe_helper(vm, 45, 3, 0);
+    ubpf_describe_helper(vm, UBPF_HELPER_MEMCPY, 3, 0);
+    ubpf_describe_helper(vm, UBPF_HELPER_MEMSET, 3, 0);
+    ubpf_describe_helper(vm, UBPF_HELPER_MEMCMP, 3, 0);
+    return 0;
+}
@@ -0,0 +1,1323 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bytecode optimizer.  ubpf_optimize() rewrites the loaded program into an
+ * equivalent, usually shorter one, which the interpreter and the JITs then
+ * run in its place:
+ *
+ *  - Constants, whether from mov, lddw or a stack slot they were spilled
+ *    to, are propagated and folded.  Register operands that hold constants
+ *    become immediates, and conditional jumps that always go the same way
+ *    become ja or disappear.  Calls to pure helpers (see
+ *    ubpf_describe_helper()) with constant arguments become their result.
+ *  - Reloads of a stack slot whose value is still in a register become a
+ *    mov, or disappear if it's the same register.
+ *  - Unreachable instructions, writes to registers or stack slots that are
+ *    never read, pure helper calls whose result is unused, and jumps to the
+ *    next instruction are removed.
+ *
+ * Registers holding r10 or the context plus a constant are tracked as such,
+ * so loads and stores through copies of r10 reach the stack slots too.  The
+ * stack is only tracked if every pointer into it is followed: used as the
+ * base of loads and stores, moved, offset by constants, or passed to the map
+ * helpers as a key or value, which they only read.  Anything else, such as
+ * storing the pointer or passing it to another helper, and the stack is left
+ * alone.  Values are tracked in aligned 8-byte slots; other stores just
+ * forget what they overlap.
+ *
+ * ubpf_specialize() runs the same passes over the program as it was loaded,
+ * also knowing the values of some context fields and what is in read-only
+ * maps.  A map_lookup_elem with a constant map and key becomes an lddw of
+ * the value's address (or NULL), and loads from the values of read-only
+ * maps become constants.  The maps read are remembered along with their
+ * generations, and ubpf_spec_refresh(), called whenever the program is about
+ * to run, specializes it again once any of them has changed.
+ *
+ * The passes edit the program in place, marking instructions removed, and
+ * repeat until nothing changes.  The result is then compacted, its jump
+ * offsets recomputed, and validated again before it replaces the original.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ubpf_int.h"
+
+#define MAX_ROUNDS 8
+#define STACK_WORDS (UBPF_STACK_SIZE / 64)
+
+enum fact_kind
+{
+    UNKNOWN,
+    CONSTANT, /* in a stack slot, only the bytes set in reg are known */
+    STACK, /* registers only: r10 + value */
+    CTX,   /* registers only: the context + value */
+    COPY,  /* stack slots only: holds the value of register reg */
+};
+
+struct fact
+{
+    uint8_t kind;
+    uint8_t reg;
+    uint64_t value;
+};
+
+/* Registers, then stack slots (slot i is [r10 - 8 * (i + 1)]) */
+struct facts
+{
+    bool reached;
+    struct fact f[];
+};
+
+struct liveness
+{
+    uint16_t regs;
+    uint64_t stack[STACK_WORDS]; /* byte i is [r10 - 1 - i] */
+};
+
+struct block
+{
+    uint32_t start, end; /* [start, end) */
+    uint32_t succ[2];
+    int num_succ;
+};
+
+/* What the last propagation learned about an instruction */
+struct site
+{
+    bool stack;       /* loads or stores [r10 + off] */
+    bool reads_stack; /* calls a helper with pointers into the stack */
+    bool folded;      /* a map lookup or pure call whose result is value */
+    int64_t off;
+    uint64_t value;
+};
+
+struct optimizer
+{
+    struct ubpf_vm* vm;
+    const struct ubpf_spec* spec; /* NULL unless specializing */
+    bool fold_maps;
+    uint64_t maps;                  /* read while specializing */
+    uint32_t generations[MAX_MAPS]; /* of each when first read */
+    struct ebpf_inst* insts;
+    uint32_t num_insts;
+    bool* removed;
+    bool* leader;
+    uint32_t* block_of;
+    struct block* blocks;
+    uint32_t num_blocks;
+    struct site* sites;
+    uint32_t num_slots;  /* tracked stack slots, 0 if the stack isn't tracked */
+    uint32_t num_facts;  /* registers + slots */
+    uint8_t* facts;      /* at the start of each block */
+    struct liveness* live; /* at the start of each block */
+    bool escaped;        /* a pointer into the stack went where it can't be followed */
+    bool changed;
+};
+
+static struct facts*
+facts_at(const struct optimizer* o, uint32_t block)
+{
+    return (struct facts*)(o->facts + (size_t)block * (sizeof(struct facts) + o->num_facts * sizeof(struct fact)));
+}
+
+static bool
+is_jump(const struct ebpf_inst* inst)
+{
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && inst->opcode != EBPF_OP_CALL &&
+           inst->opcode != EBPF_OP_EXIT;
+}
+
+/* The instruction after the one at pc */
+static uint32_t
+next_pc(const struct optimizer* o, uint32_t pc)
+{
+    return pc + (!o->removed[pc] && o->insts[pc].opcode == EBPF_OP_LDDW ? 2 : 1);
+}
+
+static void
+remove_inst(struct optimizer* o, uint32_t pc)
+{
+    if (o->insts[pc].opcode == EBPF_OP_LDDW) {
+        o->removed[pc + 1] = true;
+    }
+    o->removed[pc] = true;
+    o->changed = true;
+}
+
+static void
+replace_inst(struct optimizer* o, uint32_t pc, uint8_t opcode, uint8_t src, int32_t imm)
+{
+    struct ebpf_inst* inst = &o->insts[pc];
+    if (inst->opcode == EBPF_OP_LDDW && opcode != EBPF_OP_LDDW) {
+        o->removed[pc + 1] = true;
+    }
+    inst->opcode = opcode;
+    inst->src = src;
+    inst->imm = imm;
+    o->changed = true;
+}
+
+static bool
+fits_imm(uint64_t value)
+{
+    return (uint64_t)(int64_t)(int32_t)value == value;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    static const int sizes[] = {4, 2, 1, 8};
+    return sizes[(opcode >> 3) & 3];
+}
+
+/* A pointer into the stack is going where it can't be followed */
+static void
+escape(struct optimizer* o, const struct fact* f)
+{
+    if (f->kind == STACK) {
+        o->escaped = true;
+    }
+}
+
+/* If inst loads or stores through a pointer into the tracked stack, store the offset and size of the access */
+static bool
+stack_access(const struct optimizer* o, const struct facts* s, const struct ebpf_inst* inst, int64_t* off, int* size)
+{
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    if (!o->num_slots || (cls != EBPF_CLS_LDX && cls != EBPF_CLS_ST && cls != EBPF_CLS_STX)) {
+        return false;
+    }
+    const struct fact* base = &s->f[cls == EBPF_CLS_LDX ? inst->src : inst->dst];
+    if (base->kind != STACK) {
+        return false;
+    }
+    *off = (int64_t)base->value + inst->offset;
+    *size = access_size(inst->opcode);
+    return true;
+}
+
+/* Whether [r10 + off, + size) lies within the tracked slots */
+static bool
+in_slots(const struct optimizer* o, int64_t off, int size)
+{
+    return off < 0 && off + size <= 0 && -off <= (int64_t)o->num_slots * 8;
+}
+
+static struct fact*
+slot(const struct optimizer* o, const struct facts* s, int64_t off)
+{
+    return (struct fact*)&s->f[EBPF_REGISTERS_COUNT + (-off - 1) / 8];
+}
+
+static void
+forget_slots(const struct optimizer* o, struct facts* s, int64_t off, int size)
+{
+    for (int64_t b = off; b < off + size; b++) {
+        if (b < 0 && -b <= (int64_t)o->num_slots * 8) {
+            slot(o, s, b)->kind = UNKNOWN;
+        }
+    }
+}
+
+/* Register reg is about to be overwritten */
+static void
+clobber(const struct optimizer* o, struct facts* s, uint8_t reg)
+{
+    for (uint32_t i = 0; i < o->num_slots; i++) {
+        struct fact* f = &s->f[EBPF_REGISTERS_COUNT + i];
+        if (f->kind == COPY && f->reg == reg) {
+            f->kind = UNKNOWN;
+        }
+    }
+    s->f[reg].kind = UNKNOWN;
+}
+
+static void
+set_fact(const struct optimizer* o, struct facts* s, uint8_t reg, struct fact f)
+{
+    clobber(o, s, reg);
+    s->f[reg] = f;
+}
+
+static void
+set_const(const struct optimizer* o, struct facts* s, uint8_t reg, uint64_t value)
+{
+    set_fact(o, s, reg, (struct fact){.kind = CONSTANT, .value = value});
+}
+
+/* The constant value of [r10 + off, + size), if known */
+static bool
+slot_const(const struct optimizer* o, const struct facts* s, int64_t off, int size, uint64_t* value)
+{
+    int64_t base = off & ~7;
+    if (!in_slots(o, off, size) || off + size > base + 8) {
+        return false;
+    }
+    const struct fact* f = slot(o, s, base);
+    uint8_t bytes = ((1 << size) - 1) << (off - base);
+    uint64_t v;
+    if (f->kind == CONSTANT && (f->reg & bytes) == bytes) {
+        v = f->value;
+    } else if (f->kind == COPY && s->f[f->reg].kind == CONSTANT) {
+        v = s->f[f->reg].value;
+    } else {
+        return false;
+    }
+    v >>= 8 * (off - base);
+    *value = size == 8 ? v : v & (((uint64_t)1 << (size * 8)) - 1);
+    return true;
+}
+
+/* Record the constant value stored to [r10 + off, + size), which lies within one slot */
+static void
+store_slot(const struct optimizer* o, struct facts* s, int64_t off, int size, uint64_t value)
+{
+    int64_t base = off & ~7;
+    struct fact* f = slot(o, s, base);
+    int shift = 8 * (off - base);
+    uint64_t mask = size == 8 ? UINT64_MAX : (((uint64_t)1 << (size * 8)) - 1) << shift;
+
+    if (f->kind != CONSTANT) {
+        f->kind = CONSTANT;
+        f->reg = 0;
+        f->value = 0;
+    }
+    f->reg |= ((1 << size) - 1) << (off - base);
+    f->value = (f->value & ~mask) | ((value << shift) & mask);
+}
+
+/* Note that the program now depends on what is in map id */
+static void
+use_map(struct optimizer* o, unsigned int id, uint32_t generation)
+{
+    if (!((o->maps >> id) & 1)) {
+        o->maps |= (uint64_t)1 << id;
+        o->generations[id] = generation;
+    }
+}
+
+/* The value the load inst reads, if it is known */
+static bool
+load_const(struct optimizer* o, const struct facts* s, const struct ebpf_inst* inst, uint64_t* value)
+{
+    const struct fact* base = &s->f[inst->src];
+    int size = access_size(inst->opcode);
+    int64_t off;
+    unsigned int id;
+    uint32_t generation;
+
+    if (stack_access(o, s, inst, &off, &size)) {
+        return slot_const(o, s, off, size, value);
+    }
+    if (base->kind == CTX && o->spec) {
+        off = (int64_t)base->value + inst->offset;
+        for (unsigned int i = 0; i < o->spec->num_fields; i++) {
+            const struct ubpf_ctx_field* field = &o->spec->fields[i];
+            if (off >= field->offset && off + size <= (int64_t)field->offset + field->size) {
+                uint64_t v = field->value >> (8 * (off - field->offset));
+                *value = size == 8 ? v : v & (((uint64_t)1 << (size * 8)) - 1);
+                return true;
+            }
+        }
+    }
+    if (base->kind == CONSTANT && o->fold_maps &&
+        ubpf_maps_const_read(o->vm, base->value + inst->offset, size, value, &id, &generation)) {
+        use_map(o, id, generation);
+        return true;
+    }
+    return false;
+}
+
+/* The result of the map lookup called by inst, if it is known */
+static bool
+lookup_const(struct optimizer* o, const struct facts* s, const struct ebpf_inst* inst, uint64_t* value)
+{
+    const struct fact* id = &s->f[1];
+    const struct fact* key = &s->f[2];
+    uint8_t bytes[UBPF_STACK_SIZE];
+    uint32_t key_size, generation;
+
+    if (!o->fold_maps || !ubpf_maps_is_lookup(o->vm, inst->imm) || id->kind != CONSTANT || key->kind != STACK) {
+        return false;
+    }
+    key_size = ubpf_maps_key_size(o->vm, id->value);
+    if (!key_size || key_size > sizeof(bytes)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < key_size; i++) {
+        uint64_t byte;
+        if (!slot_const(o, s, (int64_t)key->value + i, 1, &byte)) {
+            return false;
+        }
+        bytes[i] = byte;
+    }
+    if (!ubpf_maps_const_lookup(o->vm, id->value, bytes, value, &generation)) {
+        return false;
+    }
+    use_map(o, id->value, generation);
+    return true;
+}
+
+/* Whether inst calls a UBPF_HELPER_PURE helper, which reads no memory */
+static bool
+calls_pure(const struct optimizer* o, const struct ebpf_inst* inst)
+{
+    return (o->vm->ext_func_info[inst->imm].flags & UBPF_HELPER_PURE) &&
+           inst->imm != o->vm->unwind_stack_extension_index;
+}
+
+/* The result of the call inst makes, if it is known: a pure helper with known arguments, or a map lookup */
+static bool
+call_const(struct optimizer* o, const struct facts* s, const struct ebpf_inst* inst, uint64_t* value)
+{
+    uint64_t args[5] = {0};
+
+    if (!calls_pure(o, inst)) {
+        return lookup_const(o, s, inst, value);
+    }
+    for (int r = 1; r <= o->vm->ext_func_info[inst->imm].num_args; r++) {
+        if (s->f[r].kind != CONSTANT) {
+            return false;
+        }
+        args[r - 1] = s->f[r].value;
+    }
+    *value = o->vm->ext_funcs[inst->imm](o->vm, inst->imm, args[0], args[1], args[2], args[3], args[4]);
+    return true;
+}
+
+/* Update the facts for running the instruction at pc */
+static void
+step(struct optimizer* o, struct facts* s, uint32_t pc)
+{
+    const struct ebpf_inst* inst = &o->insts[pc];
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    int64_t off;
+    int size;
+    uint64_t value;
+
+    switch (cls) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64: {
+        bool is64 = cls == EBPF_CLS_ALU64;
+        uint8_t op = inst->opcode & EBPF_ALU_OP_MASK;
+        struct fact dst = s->f[inst->dst];
+        struct fact src = {.kind = CONSTANT, .value = is64 ? (uint64_t)(int64_t)inst->imm : (uint32_t)inst->imm};
+        uint64_t result;
+
+        if (inst->opcode & EBPF_SRC_REG) {
+            src = s->f[inst->src];
+            if (op != 0xb0 || !is64) {
+                escape(o, &src);
+            }
+        }
+        if (op == 0xb0 && (is64 || src.kind == CONSTANT)) {
+            if (!is64) {
+                src.value = (uint32_t)src.value;
+            }
+            set_fact(o, s, inst->dst, src);
+        } else if (
+            op != 0xb0 && dst.kind == CONSTANT && src.kind == CONSTANT &&
+            ubpf_alu_fold(op, is64, dst.value, src.value, &result)) {
+            set_const(o, s, inst->dst, result);
+        } else if (op == 0x80 && dst.kind == CONSTANT) {
+            set_const(o, s, inst->dst, is64 ? -dst.value : (uint32_t)-dst.value);
+        } else if (
+            is64 && (op == 0x00 || op == 0x10) && (dst.kind == STACK || dst.kind == CTX) && src.kind == CONSTANT) {
+            dst.value = op == 0x00 ? dst.value + src.value : dst.value - src.value;
+            set_fact(o, s, inst->dst, dst);
+        } else {
+            if (op != 0xb0) {
+                escape(o, &dst);
+            }
+            clobber(o, s, inst->dst);
+        }
+        break;
+    }
+
+    case EBPF_CLS_LD:
+        set_const(o, s, inst->dst, (uint32_t)inst->imm | ((uint64_t)inst[1].imm << 32));
+        break;
+
+    case EBPF_CLS_LDX:
+        if (load_const(o, s, inst, &value)) {
+            set_const(o, s, inst->dst, value);
+        } else if (stack_access(o, s, inst, &off, &size) && size == 8 && !(off & 7) && in_slots(o, off, size)) {
+            struct fact* f = slot(o, s, off);
+            struct fact copy = f->kind == COPY ? s->f[f->reg] : (struct fact){.kind = UNKNOWN};
+            set_fact(o, s, inst->dst, copy);
+            f->kind = COPY;
+            f->reg = inst->dst;
+        } else {
+            clobber(o, s, inst->dst);
+        }
+        break;
+
+    case EBPF_CLS_ST:
+    case EBPF_CLS_STX:
+        if (cls == EBPF_CLS_STX) {
+            escape(o, &s->f[inst->src]);
+        }
+        if (stack_access(o, s, inst, &off, &size)) {
+            bool known = cls == EBPF_CLS_ST || s->f[inst->src].kind == CONSTANT;
+            value = cls == EBPF_CLS_ST ? (uint64_t)(int64_t)inst->imm : s->f[inst->src].value;
+            if ((inst->opcode & 0xe0) != EBPF_MODE_MEM || !in_slots(o, off, size) || off + size > (off & ~7) + 8) {
+                forget_slots(o, s, off, size);
+            } else if (known) {
+                store_slot(o, s, off, size, value);
+            } else if (size == 8) {
+                struct fact* f = slot(o, s, off);
+                f->kind = COPY;
+                f->reg = inst->src;
+            } else {
+                forget_slots(o, s, off, size);
+            }
+        }
+        if ((inst->opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            if (inst->imm == EBPF_ATOMIC_OP_CMPXCHG) {
+                clobber(o, s, 0);
+            } else if (inst->imm & EBPF_ATOMIC_OP_FETCH) {
+                clobber(o, s, inst->src);
+            }
+        }
+        break;
+
+    default:
+        if (inst->opcode == EBPF_OP_CALL) {
+            bool known = o->sites[pc].folded;
+            if (known) {
+                value = o->sites[pc].value;
+            } else {
+                known = call_const(o, s, inst, &value);
+            }
+            for (int r = 1; r <= 5 && !known && !calls_pure(o, inst); r++) {
+                if (!ubpf_maps_reads_only(o->vm, inst->imm, r)) {
+                    escape(o, &s->f[r]);
+                }
+            }
+            for (uint8_t r = 0; r <= 5; r++) {
+                clobber(o, s, r);
+            }
+            if (known) {
+                set_const(o, s, 0, value);
+            }
+        }
+        break;
+    }
+}
+
+/* Whether a conditional jump comparing a with b is taken, as the interpreter decides it */
+static bool
+jump_taken(uint8_t opcode, uint64_t a, uint64_t b)
+{
+    if ((opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) {
+        a = (uint32_t)a;
+        b = (uint32_t)b;
+        switch (opcode & EBPF_JMP_OP_MASK) {
+        case EBPF_MODE_JSGT:
+            return (int32_t)a > (int32_t)b;
+        case EBPF_MODE_JSGE:
+            return (int32_t)a >= (int32_t)b;
+        case EBPF_MODE_JSLT:
+            return (int32_t)a < (int32_t)b;
+        case EBPF_MODE_JSLE:
+            return (int32_t)a <= (int32_t)b;
+        }
+    }
+    switch (opcode & EBPF_JMP_OP_MASK) {
+    case EBPF_MODE_JEQ:
+        return a == b;
+    case EBPF_MODE_JNE:
+        return a != b;
+    case EBPF_MODE_JGT:
+        return a > b;
+    case EBPF_MODE_JGE:
+        return a >= b;
+    case EBPF_MODE_JLT:
+        return a < b;
+    case EBPF_MODE_JLE:
+        return a <= b;
+    case EBPF_MODE_JSET:
+        return (a & b) != 0;
+    case EBPF_MODE_JSGT:
+        return (int64_t)a > (int64_t)b;
+    case EBPF_MODE_JSGE:
+        return (int64_t)a >= (int64_t)b;
+    case EBPF_MODE_JSLT:
+        return (int64_t)a < (int64_t)b;
+    default: /* EBPF_MODE_JSLE */
+        return (int64_t)a <= (int64_t)b;
+    }
+}
+
+/* The second operand of a conditional jump, if it is a constant */
+static bool
+jump_operand(const struct facts* s, const struct ebpf_inst* inst, uint64_t* value)
+{
+    bool is32 = (inst->opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+
+    if (inst->opcode & EBPF_SRC_REG) {
+        *value = s->f[inst->src].value;
+        return s->f[inst->src].kind == CONSTANT && *value <= INT32_MAX;
+    }
+    *value = is32 ? (uint32_t)inst->imm : (uint64_t)(int64_t)inst->imm;
+    return true;
+}
+
+/* Rewrite the instruction at pc given the facts before it */
+static void
+rewrite(struct optimizer* o, struct facts* s, uint32_t pc)
+{
+    struct ebpf_inst* inst = &o->insts[pc];
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    int64_t off;
+    int size;
+    uint64_t value;
+
+    switch (cls) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64: {
+        bool is64 = cls == EBPF_CLS_ALU64;
+        uint8_t op = inst->opcode & EBPF_ALU_OP_MASK;
+        uint8_t mov = is64 ? EBPF_OP_MOV64_IMM : EBPF_OP_MOV_IMM;
+        const struct fact* dst = &s->f[inst->dst];
+        bool src_const = !(inst->opcode & EBPF_SRC_REG) || s->f[inst->src].kind == CONSTANT;
+        uint64_t b = !(inst->opcode & EBPF_SRC_REG) ? (is64 ? (uint64_t)(int64_t)inst->imm : (uint32_t)inst->imm)
+                                                     : s->f[inst->src].value;
+        uint64_t result;
+
+        if (op == 0xd0) {
+            break; /* le, be */
+        }
+        if (op == 0x80) {
+            if (dst->kind == CONSTANT && (!is64 || fits_imm(-dst->value))) {
+                replace_inst(o, pc, mov, 0, (int32_t)-dst->value);
+            }
+            break;
+        }
+        if (!src_const) {
+            break;
+        }
+        if (op == 0xb0) {
+            if ((inst->opcode & EBPF_SRC_REG) && (!is64 || fits_imm(b))) {
+                replace_inst(o, pc, mov, 0, (int32_t)b);
+            }
+        } else if (dst->kind == CONSTANT && ubpf_alu_fold(op, is64, dst->value, b, &result) &&
+                   (!is64 || fits_imm(result))) {
+            replace_inst(o, pc, mov, 0, (int32_t)result);
+        } else if ((inst->opcode & EBPF_SRC_REG) && (!is64 || fits_imm(b)) &&
+                   ((op != 0x60 && op != 0x70 && op != 0xc0) || b < (is64 ? 64 : 32)) &&
+                   ((op != 0x30 && op != 0x90) || b)) {
+            replace_inst(o, pc, inst->opcode & ~EBPF_SRC_REG, 0, (int32_t)b);
+        }
+        break;
+    }
+
+    case EBPF_CLS_LD:
+        value = (uint32_t)inst->imm | ((uint64_t)inst[1].imm << 32);
+        if (fits_imm(value)) {
+            replace_inst(o, pc, EBPF_OP_MOV64_IMM, 0, (int32_t)value);
+        }
+        break;
+
+    case EBPF_CLS_LDX:
+        if (load_const(o, s, inst, &value)) {
+            size = access_size(inst->opcode);
+            if (size < 8 || fits_imm(value)) {
+                replace_inst(o, pc, size < 8 ? EBPF_OP_MOV_IMM : EBPF_OP_MOV64_IMM, 0, (int32_t)value);
+            }
+        } else if (
+            stack_access(o, s, inst, &off, &size) && size == 8 && !(off & 7) && in_slots(o, off, size) &&
+            slot(o, s, off)->kind == COPY) {
+            uint8_t reg = slot(o, s, off)->reg;
+            if (reg == inst->dst) {
+                remove_inst(o, pc);
+            } else {
+                replace_inst(o, pc, EBPF_OP_MOV64_REG, reg, 0);
+            }
+        }
+        break;
+
+    case EBPF_CLS_STX:
+        if ((inst->opcode & 0xe0) == EBPF_MODE_MEM && s->f[inst->src].kind == CONSTANT) {
+            value = s->f[inst->src].value;
+            if ((inst->opcode & 0x18) != EBPF_SIZE_DW || fits_imm(value)) {
+                replace_inst(o, pc, (inst->opcode & ~EBPF_CLS_MASK) | EBPF_CLS_ST, 0, (int32_t)value);
+            }
+        }
+        break;
+
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        if (inst->opcode == EBPF_OP_CALL && !o->sites[pc].folded && call_const(o, s, inst, &value)) {
+            o->sites[pc].folded = true;
+            o->sites[pc].value = value;
+            o->changed = true;
+        }
+        if (!is_jump(inst) || inst->opcode == EBPF_OP_JA || !jump_operand(s, inst, &value)) {
+            break;
+        }
+        if (s->f[inst->dst].kind == CONSTANT) {
+            if (jump_taken(inst->opcode, s->f[inst->dst].value, value)) {
+                replace_inst(o, pc, EBPF_OP_JA, 0, 0);
+                inst->dst = 0;
+            } else {
+                remove_inst(o, pc);
+            }
+        } else if (inst->opcode & EBPF_SRC_REG) {
+            replace_inst(o, pc, inst->opcode & ~EBPF_SRC_REG, 0, (int32_t)value);
+        }
+        break;
+    }
+}
+
+/* Record what the later passes need to know about the instruction at pc */
+static void
+note_site(struct optimizer* o, const struct facts* s, uint32_t pc)
+{
+    struct site* site = &o->sites[pc];
+    int size;
+
+    site->stack = stack_access(o, s, &o->insts[pc], &site->off, &size);
+    site->reads_stack = false;
+    if (o->insts[pc].opcode == EBPF_OP_CALL && !site->folded && !calls_pure(o, &o->insts[pc])) {
+        for (int r = 1; r <= 5; r++) {
+            site->reads_stack |= s->f[r].kind == STACK;
+        }
+    }
+}
+
+/* Split the program into basic blocks */
+static void
+find_blocks(struct optimizer* o)
+{
+    uint32_t pc;
+
+    memset(o->leader, 0, o->num_insts * sizeof(*o->leader));
+    o->leader[0] = true;
+    for (pc = 0; pc < o->num_insts; pc = next_pc(o, pc)) {
+        const struct ebpf_inst* inst = &o->insts[pc];
+        if (o->removed[pc] || (!is_jump(inst) && inst->opcode != EBPF_OP_EXIT)) {
+            continue;
+        }
+        if (is_jump(inst)) {
+            o->leader[pc + 1 + inst->offset] = true;
+        }
+        if (pc + 1 < o->num_insts) {
+            o->leader[pc + 1] = true;
+        }
+    }
+
+    o->num_blocks = 0;
+    for (pc = 0; pc < o->num_insts; pc++) {
+        if (o->leader[pc]) {
+            if (o->num_blocks) {
+                o->blocks[o->num_blocks - 1].end = pc;
+            }
+            o->blocks[o->num_blocks].start = pc;
+            o->num_blocks++;
+        }
+        o->block_of[pc] = o->num_blocks - 1;
+    }
+    o->blocks[o->num_blocks - 1].end = o->num_insts;
+
+    for (uint32_t b = 0; b < o->num_blocks; b++) {
+        struct block* blk = &o->blocks[b];
+        uint32_t last = UINT32_MAX;
+        for (pc = blk->start; pc < blk->end; pc = next_pc(o, pc)) {
+            if (!o->removed[pc]) {
+                last = pc;
+            }
+        }
+        blk->num_succ = 0;
+        if (last != UINT32_MAX && is_jump(&o->insts[last])) {
+            blk->succ[blk->num_succ++] = o->block_of[last + 1 + o->insts[last].offset];
+            if (o->insts[last].opcode == EBPF_OP_JA) {
+                continue;
+            }
+        } else if (last != UINT32_MAX && o->insts[last].opcode == EBPF_OP_EXIT) {
+            continue;
+        }
+        if (blk->end < o->num_insts) {
+            blk->succ[blk->num_succ++] = b + 1;
+        }
+    }
+}
+
+/* Merge facts from into the state at the start of block to */
+static void
+meet(struct optimizer* o, uint32_t to, const struct facts* from, bool* changed)
+{
+    struct facts* s = facts_at(o, to);
+    if (!s->reached) {
+        memcpy(s, from, sizeof(*s) + o->num_facts * sizeof(struct fact));
+        *changed = true;
+        return;
+    }
+    for (uint32_t i = 0; i < o->num_facts; i++) {
+        struct fact* a = &s->f[i];
+        const struct fact* b = &from->f[i];
+        if (a->kind == b->kind &&
+            (a->kind == UNKNOWN || (a->reg == b->reg && (a->kind == COPY || a->value == b->value)))) {
+            continue;
+        }
+        escape(o, a);
+        escape(o, b);
+        if (a->kind != UNKNOWN) {
+            a->kind = UNKNOWN;
+            *changed = true;
+        }
+    }
+}
+
+/* Run the facts at the start of every block to a fixpoint */
+static void
+fixpoint(struct optimizer* o, struct facts* cur)
+{
+    size_t size = sizeof(struct facts) + o->num_facts * sizeof(struct fact);
+    struct facts* entry = facts_at(o, 0);
+    bool changed = true;
+
+    memset(o->facts, 0, o->num_blocks * size);
+    entry->reached = true;
+    entry->f[1] = (struct fact){.kind = CTX};
+    entry->f[10] = (struct fact){.kind = STACK};
+
+    while (changed) {
+        changed = false;
+        for (uint32_t b = 0; b < o->num_blocks; b++) {
+            if (!facts_at(o, b)->reached) {
+                continue;
+            }
+            memcpy(cur, facts_at(o, b), size);
+            for (uint32_t pc = o->blocks[b].start; pc < o->blocks[b].end; pc = next_pc(o, pc)) {
+                if (!o->removed[pc]) {
+                    step(o, cur, pc);
+                }
+            }
+            for (int i = 0; i < o->blocks[b].num_succ; i++) {
+                meet(o, o->blocks[b].succ[i], cur, &changed);
+            }
+        }
+    }
+}
+
+/* Propagate constants, pointers and copies forward, then rewrite with what is known */
+static bool
+propagate(struct optimizer* o)
+{
+    size_t size = sizeof(struct facts) + o->num_facts * sizeof(struct fact);
+    struct facts* cur = malloc(size);
+    bool* visited = calloc(o->num_insts, sizeof(*visited));
+
+    if (!cur || !visited) {
+        free(cur);
+        free(visited);
+        return false;
+    }
+
+    fixpoint(o, cur);
+    if (o->escaped && o->num_slots) {
+        /* The stack can't be tracked after all; fewer facts fit in the same space */
+        o->num_slots = 0;
+        o->num_facts = EBPF_REGISTERS_COUNT;
+        fixpoint(o, cur);
+        size = sizeof(struct facts) + o->num_facts * sizeof(struct fact);
+    }
+
+    for (uint32_t b = 0; b < o->num_blocks; b++) {
+        if (!facts_at(o, b)->reached) {
+            continue;
+        }
+        memcpy(cur, facts_at(o, b), size);
+        for (uint32_t pc = o->blocks[b].start; pc < o->blocks[b].end; pc = next_pc(o, pc)) {
+            visited[pc] = true;
+            if (o->insts[pc].opcode == EBPF_OP_LDDW) {
+                visited[pc + 1] = true;
+            }
+            if (!o->removed[pc]) {
+                rewrite(o, cur, pc);
+                if (!o->removed[pc]) {
+                    note_site(o, cur, pc);
+                    step(o, cur, pc);
+                }
+            }
+        }
+    }
+
+    /* Anything not visited can't be reached */
+    for (uint32_t pc = 0; pc < o->num_insts; pc++) {
+        if (!visited[pc] && !o->removed[pc]) {
+            o->removed[pc] = true;
+            o->changed = true;
+        }
+    }
+
+    free(cur);
+    free(visited);
+    return true;
+}
+
+static void
+stack_bytes(struct liveness* l, int64_t off, int size, bool live)
+{
+    for (int64_t b = off; b < off + size; b++) {
+        if (b < 0 && -b <= UBPF_STACK_SIZE) {
+            uint32_t i = -b - 1;
+            if (live) {
+                l->stack[i / 64] |= (uint64_t)1 << (i % 64);
+            } else {
+                l->stack[i / 64] &= ~((uint64_t)1 << (i % 64));
+            }
+        }
+    }
+}
+
+static bool
+any_stack_live(const struct liveness* l, int64_t off, int size)
+{
+    for (int64_t b = off; b < off + size; b++) {
+        uint32_t i = -b - 1;
+        if (b >= 0 || -b > UBPF_STACK_SIZE || (l->stack[i / 64] >> (i % 64)) & 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Run the instruction at pc backwards over l.  If remove is set, first take
+ * it out if all it does is write registers or stack that are dead.
+ */
+static void
+step_back(struct optimizer* o, struct liveness* l, uint32_t pc, bool remove)
+{
+    const struct ebpf_inst* inst = &o->insts[pc];
+    const struct site* site = &o->sites[pc];
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    uint16_t defs, uses = ubpf_inst_regs(inst, &defs);
+    int size = access_size(inst->opcode);
+
+    if (site->folded) {
+        uses = 0;
+        defs = 1 << 0;
+    }
+    if (remove) {
+        bool pure = cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_LD || site->folded ||
+                    (cls == EBPF_CLS_LDX && site->stack && in_slots(o, site->off, size)) ||
+                    (inst->opcode == EBPF_OP_CALL && calls_pure(o, inst));
+        bool dead_store = (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) && (inst->opcode & 0xe0) == EBPF_MODE_MEM &&
+                          site->stack && in_slots(o, site->off, size) && !any_stack_live(l, site->off, size);
+        if ((pure && !(l->regs & defs)) || dead_store) {
+            remove_inst(o, pc);
+            return;
+        }
+    }
+
+    if (inst->opcode == EBPF_OP_EXIT) {
+        memset(l, 0, sizeof(*l));
+    }
+    l->regs = (l->regs & ~defs) | uses;
+    if (site->reads_stack) {
+        memset(l->stack, 0xff, sizeof(l->stack));
+    }
+    if (site->stack) {
+        if (cls == EBPF_CLS_LDX || (inst->opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            stack_bytes(l, site->off, size, true);
+        } else {
+            stack_bytes(l, site->off, size, false);
+        }
+    }
+}
+
+static void
+live_out(const struct optimizer* o, uint32_t b, struct liveness* l)
+{
+    memset(l, 0, sizeof(*l));
+    for (int i = 0; i < o->blocks[b].num_succ; i++) {
+        const struct liveness* s = &o->live[o->blocks[b].succ[i]];
+        l->regs |= s->regs;
+        for (int w = 0; w < STACK_WORDS; w++) {
+            l->stack[w] |= s->stack[w];
+        }
+    }
+}
+
+/* Walk block b backwards from l, removing dead instructions if remove is set */
+static void
+block_back(struct optimizer* o, uint32_t b, struct liveness* l, uint32_t* pcs, bool remove)
+{
+    uint32_t n = 0;
+    for (uint32_t pc = o->blocks[b].start; pc < o->blocks[b].end; pc = next_pc(o, pc)) {
+        if (!o->removed[pc]) {
+            pcs[n++] = pc;
+        }
+    }
+    while (n--) {
+        step_back(o, l, pcs[n], remove);
+    }
+}
+
+/* Remove writes to registers and stack that are never read */
+static bool
+eliminate_dead(struct optimizer* o)
+{
+    uint32_t* pcs = malloc(o->num_insts * sizeof(*pcs));
+    struct liveness l;
+    bool changed = true;
+
+    if (!pcs) {
+        return false;
+    }
+    memset(o->live, 0, o->num_blocks * sizeof(*o->live));
+    while (changed) {
+        changed = false;
+        for (uint32_t b = o->num_blocks; b-- > 0;) {
+            live_out(o, b, &l);
+            block_back(o, b, &l, pcs, false);
+            if (memcmp(&l, &o->live[b], sizeof(l))) {
+                o->live[b] = l;
+                changed = true;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < o->num_blocks; b++) {
+        live_out(o, b, &l);
+        block_back(o, b, &l, pcs, true);
+    }
+    free(pcs);
+    return true;
+}
+
+/* Remove jumps to the instruction that follows them anyway */
+static void
+eliminate_jumps(struct optimizer* o)
+{
+    for (uint32_t pc = 0; pc < o->num_insts; pc = next_pc(o, pc)) {
+        const struct ebpf_inst* inst = &o->insts[pc];
+        if (o->removed[pc] || !is_jump(inst)) {
+            continue;
+        }
+        uint32_t next = pc + 1, target = pc + 1 + inst->offset;
+        while (next < target && o->removed[next]) {
+            next++;
+        }
+        if (next == target) {
+            remove_inst(o, pc);
+        }
+    }
+}
+
+/* Drop removed instructions, expand folded lookups and fix up jump offsets */
+static uint32_t
+compact(struct optimizer* o, struct ebpf_inst* out, char** errmsg)
+{
+    uint32_t* index = malloc((o->num_insts + 1) * sizeof(*index));
+    uint32_t n = 0, pc;
+
+    if (!index) {
+        *errmsg = ubpf_error("out of memory");
+        return UINT32_MAX;
+    }
+    for (pc = 0; pc < o->num_insts; pc++) {
+        index[pc] = n;
+        n += o->removed[pc] ? 0 : o->sites[pc].folded ? 2 : 1;
+    }
+    index[o->num_insts] = n;
+
+    for (pc = 0; pc < o->num_insts; pc++) {
+        if (o->removed[pc]) {
+            continue;
+        }
+        struct ebpf_inst inst = o->insts[pc];
+        if (is_jump(&inst)) {
+            int64_t offset = (int64_t)index[pc + 1 + inst.offset] - index[pc] - 1;
+            if (offset < INT16_MIN || offset > INT16_MAX) {
+                *errmsg = ubpf_error("jump at PC %u out of range after specializing", pc);
+                free(index);
+                return UINT32_MAX;
+            }
+            inst.offset = offset;
+        }
+        if (o->sites[pc].folded) {
+            uint64_t value = o->sites[pc].value;
+            out[index[pc]] = (struct ebpf_inst){.opcode = EBPF_OP_LDDW, .dst = 0, .imm = (uint32_t)value};
+            out[index[pc] + 1] = (struct ebpf_inst){.imm = value >> 32};
+            continue;
+        }
+        out[index[pc]] = inst;
+    }
+    free(index);
+    return n;
+}
+
+/*
+ * Optimize num_insts instructions, specializing them if spec is set, and
+ * load the result into vm.
+ */
+static int
+optimize(
+    struct ubpf_vm* vm,
+    struct ubpf_spec* spec,
+    const struct ebpf_inst* insts,
+    uint32_t num_insts,
+    uint32_t stack_usage,
+    char** errmsg)
+{
+    struct optimizer o = {.vm = vm, .spec = spec, .fold_maps = spec && vm->verifier_enabled && vm->maps};
+    struct ebpf_inst* out = NULL;
+    int rc = -1;
+
+    o.num_insts = num_insts;
+    o.insts = malloc(o.num_insts * sizeof(*o.insts));
+    out = malloc(2 * o.num_insts * sizeof(*out));
+    o.removed = calloc(o.num_insts, sizeof(*o.removed));
+    o.leader = calloc(o.num_insts, sizeof(*o.leader));
+    o.block_of = calloc(o.num_insts, sizeof(*o.block_of));
+    o.blocks = calloc(o.num_insts, sizeof(*o.blocks));
+    o.sites = calloc(o.num_insts, sizeof(*o.sites));
+    o.live = calloc(o.num_insts, sizeof(*o.live));
+    if (!o.insts || !out || !o.removed || !o.leader || !o.block_of || !o.blocks || !o.sites || !o.live) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    memcpy(o.insts, insts, o.num_insts * sizeof(*o.insts));
+
+    o.num_slots = stack_usage / 8;
+    o.num_facts = EBPF_REGISTERS_COUNT + o.num_slots;
+    o.facts = malloc((size_t)o.num_insts * (sizeof(struct facts) + o.num_facts * sizeof(struct fact)));
+    if (!o.facts) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        o.changed = false;
+        find_blocks(&o);
+        if (!propagate(&o)) {
+            *errmsg = ubpf_error("out of memory");
+            goto out;
+        }
+        eliminate_jumps(&o);
+        find_blocks(&o);
+        if (!eliminate_dead(&o)) {
+            *errmsg = ubpf_error("out of memory");
+            goto out;
+        }
+        if (!o.changed) {
+            break;
+        }
+    }
+
+    uint32_t n = compact(&o, out, errmsg);
+    if (n == UINT32_MAX) {
+        goto out;
+    }
+    /* The tiered JIT may be compiling the program being replaced */
+    ubpf_tier_reset(vm->tier);
+    rc = ubpf_replace_code(vm, out, n, errmsg);
+    if (rc < 0) {
+        char* reason = *errmsg;
+        *errmsg = ubpf_error("optimized program failed validation: %s", reason);
+        free(reason);
+    } else if (spec) {
+        spec->maps = o.maps;
+        memcpy(spec->generations, o.generations, sizeof(o.generations));
+    }
+
+out:
+    free(o.insts);
+    free(out);
+    free(o.removed);
+    free(o.leader);
+    free(o.block_of);
+    free(o.blocks);
+    free(o.sites);
+    free(o.live);
+    free(o.facts);
+    return rc;
+}
+
+int
+ubpf_optimize(struct ubpf_vm* vm, char** errmsg)
+{
+    struct ebpf_inst* insts;
+    int rc;
+
+    *errmsg = NULL;
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return -1;
+    }
+    if (vm->jitted || vm->aot_handle) {
+        *errmsg = ubpf_error("code has already been compiled");
+        return -1;
+    }
+
+    insts = malloc(vm->num_insts * sizeof(*insts));
+    if (!insts) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        insts[pc] = ubpf_fetch_instruction(vm, pc);
+    }
+    rc = optimize(vm, NULL, insts, vm->num_insts, vm->stack_usage, errmsg);
+    free(insts);
+    return rc;
+}
+
+/* Replace the compiled code, if there is any, with code for the program as it is now */
+static int
+recompile(struct ubpf_vm* vm, char** errmsg)
+{
+    size_t jitted_size;
+
+    if (!vm->jitted) {
+        return 0;
+    }
+    ubpf_unpublish(vm);
+    munmap(vm->jitted, vm->jitted_size);
+    vm->jitted = NULL;
+    vm->jitted_size = 0;
+
+    ubpf_jit_fn jitted = ubpf_jit_build(vm, &jitted_size, errmsg);
+    if (jitted == NULL) {
+        return -1;
+    }
+    vm->jitted = jitted;
+    vm->jitted_size = jitted_size;
+    return 0;
+}
+
+int
+ubpf_specialize(struct ubpf_vm* vm, const struct ubpf_ctx_field* fields, unsigned int num_fields, char** errmsg)
+{
+    struct ubpf_spec* spec = vm->spec;
+    struct ubpf_ctx_field* copy = NULL;
+
+    *errmsg = NULL;
+    if (!vm->insts) {
+        *errmsg = ubpf_error("code has not been loaded into this VM");
+        return -1;
+    }
+    if (vm->aot_handle) {
+        *errmsg = ubpf_error("code has been compiled ahead of time");
+        return -1;
+    }
+    for (unsigned int i = 0; i < num_fields; i++) {
+        uint32_t size = fields[i].size;
+        if ((size != 1 && size != 2 && size != 4 && size != 8) || fields[i].offset > UINT32_MAX - size) {
+            *errmsg = ubpf_error("invalid context field %u", i);
+            return -1;
+        }
+    }
+
+    if (num_fields) {
+        copy = malloc(num_fields * sizeof(*copy));
+        if (!copy) {
+            *errmsg = ubpf_error("out of memory");
+            return -1;
+        }
+        memcpy(copy, fields, num_fields * sizeof(*copy));
+    }
+    if (!spec) {
+        spec = calloc(1, sizeof(*spec));
+        if (spec) {
+            spec->insts = malloc(vm->num_insts * sizeof(*spec->insts));
+        }
+        if (!spec || !spec->insts) {
+            free(spec);
+            free(copy);
+            *errmsg = ubpf_error("out of memory");
+            return -1;
+        }
+        for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+            spec->insts[pc] = ubpf_fetch_instruction(vm, pc);
+        }
+        spec->num_insts = vm->num_insts;
+        spec->stack_usage = vm->stack_usage;
+    }
+
+    struct ubpf_ctx_field* old_fields = spec->fields;
+    unsigned int old_num_fields = spec->num_fields;
+    spec->fields = copy;
+    spec->num_fields = num_fields;
+    if (optimize(vm, spec, spec->insts, spec->num_insts, spec->stack_usage, errmsg) < 0) {
+        if (vm->spec) {
+            spec->fields = old_fields;
+            spec->num_fields = old_num_fields;
+        } else {
+            free(spec->insts);
+            free(spec);
+        }
+        free(copy);
+        return -1;
+    }
+    free(old_fields);
+    vm->spec = spec;
+    return recompile(vm, errmsg);
+}
+
+void
+ubpf_spec_refresh(struct ubpf_vm* vm)
+{
+    struct ubpf_spec* spec = vm->spec;
+    char* errmsg = NULL;
+    bool stale = false;
+
+    if (!spec) {
+        return;
+    }
+    for (uint64_t maps = spec->maps; maps && !stale; maps &= maps - 1) {
+        unsigned int id = __builtin_ctzll(maps);
+        stale = ubpf_maps_generation(vm, id) != spec->generations[id];
+    }
+    if (!stale) {
+        return;
+    }
+
+    if (optimize(vm, spec, spec->insts, spec->num_insts, spec->stack_usage, &errmsg) < 0) {
+        vm->error_printf(stderr, "uBPF error: could not specialize the program again: %s\n", errmsg);
+        free(errmsg);
+        errmsg = NULL;
+        /* What was folded in is out of date; go back to the program as it was loaded */
+        ubpf_tier_reset(vm->tier);
+        if (ubpf_replace_code(vm, spec->insts, spec->num_insts, &errmsg) < 0) {
+            vm->error_printf(stderr, "uBPF error: could not restore the program: %s\n", errmsg);
+            free(errmsg);
+            errmsg = NULL;
+        }
+        ubpf_spec_free(vm);
+    }
+    if (recompile(vm, &errmsg) < 0) {
+        vm->error_printf(stderr, "uBPF error: could not compile the program again, interpreting it: %s\n", errmsg);
+        free(errmsg);
+    }
+}
+
+void
+ubpf_spec_free(struct ubpf_vm* vm)
+{
+    if (vm->spec) {
+        free(vm->spec->insts);
+        free(vm->spec->fields);
+        free(vm->spec);
+        vm->spec = NULL;
+    }
+}
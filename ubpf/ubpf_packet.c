@@ -0,0 +1,367 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native packet helpers for programs run in packet mode: loading bytes,
+ * checksum updates and moving the packet's head and tail.  They take the
+ * struct ubpf_xdp_md the program got in r1, and return 0 or a negative errno
+ * as Linux's do.
+ *
+ * Checksums are one's complement sums, which don't depend on byte order, so
+ * packet words are summed as they are in memory, 32 bits at a time into
+ * 64-bit accumulators, and folded at the end.  The summing loop is
+ * vectorized with SSE2 or AVX2 natively and with SIMD128 in WebAssembly.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ubpf_int.h"
+
+#if defined(__x86_64__) && !defined(__EMSCRIPTEN__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define CSUM_WASM 1
+#endif
+
+#define ETH_HLEN 14
+
+/* Flags of l3_csum_replace() and l4_csum_replace(), as in Linux */
+#define BPF_F_HDR_FIELD_MASK 0xf
+#define BPF_F_PSEUDO_HDR 0x10
+#define BPF_F_MARK_MANGLED_0 0x20
+#define BPF_F_MARK_ENFORCE 0x40
+#define CSUM_MANGLED_0 0xffff
+
+/* a + b in one's complement */
+static inline uint64_t
+csum_add64(uint64_t a, uint64_t b)
+{
+    a += b;
+    return a + (a < b);
+}
+
+static inline uint32_t
+csum_fold32(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return sum;
+}
+
+static inline uint16_t
+csum_fold16(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+#ifdef CSUM_X86
+__attribute__((target("avx2"))) static uint64_t
+csum_avx2(const unsigned char* p, size_t len, size_t* done)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + i + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(b, zero));
+        acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(b, zero));
+    }
+    acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc0);
+    *done = i;
+    return csum_add64(csum_add64(lanes[0], lanes[1]), csum_add64(lanes[2], lanes[3]));
+}
+
+static uint64_t
+csum_sse2(const unsigned char* p, size_t len, size_t* done)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+    }
+    acc0 = _mm_add_epi64(acc0, acc1);
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc0);
+    *done = i;
+    return csum_add64(lanes[0], lanes[1]);
+}
+#endif
+
+#ifdef CSUM_WASM
+static uint64_t
+csum_simd128(const unsigned char* p, size_t len, size_t* done)
+{
+    v128_t acc0 = wasm_i64x2_splat(0), acc1 = acc0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        v128_t a = wasm_v128_load(p + i);
+        acc0 = wasm_i64x2_add(acc0, wasm_u64x2_extend_low_u32x4(a));
+        acc1 = wasm_i64x2_add(acc1, wasm_u64x2_extend_high_u32x4(a));
+    }
+    acc0 = wasm_i64x2_add(acc0, acc1);
+    *done = i;
+    return csum_add64(wasm_i64x2_extract_lane(acc0, 0), wasm_i64x2_extract_lane(acc0, 1));
+}
+#endif
+
+/*
+ * The one's complement sum of buf, folded to 32 bits. The lanes of the vector
+ * loops can't overflow for any buffer a program can address.
+ */
+static uint32_t
+csum_partial(const void* buf, size_t len, uint32_t seed)
+{
+    const unsigned char* p = buf;
+    uint64_t sum = seed;
+    size_t i = 0;
+
+#if defined(CSUM_X86)
+    if (len >= 64 && __builtin_cpu_supports("avx2")) {
+        sum = csum_add64(sum, csum_avx2(p, len, &i));
+    }
+    size_t done;
+    sum = csum_add64(sum, csum_sse2(p + i, len - i, &done));
+    i += done;
+#elif defined(CSUM_WASM)
+    sum = csum_add64(sum, csum_simd128(p, len, &i));
+#endif
+
+    for (; i + 4 <= len; i += 4) {
+        uint32_t word;
+        memcpy(&word, p + i, sizeof(word));
+        sum = csum_add64(sum, word);
+    }
+    if (i < len) {
+        /* Pad the tail with zeros, where they'd be in the packet */
+        uint32_t word = 0;
+        memcpy(&word, p + i, len - i);
+        sum = csum_add64(sum, word);
+    }
+    return csum_fold32(sum);
+}
+
+static bool
+accessible(const struct ubpf_vm* vm, uint64_t addr, uint64_t size)
+{
+    return size == 0 || ubpf_accessible(vm, (const void*)(uintptr_t)addr) >= size;
+}
+
+static bool
+within(uint64_t start, uint64_t end, const void* base, size_t len)
+{
+    return start <= end && start >= (uintptr_t)base && end <= (uintptr_t)base + len;
+}
+
+/*
+ * The context in r1, or NULL if the helper must not use it.  Calls the
+ * interpreter checks (see ubpf_accessible()) need the run's own context,
+ * with the packet buffer it describes in order and inside the run's packet:
+ * under ubpf_exec_xdp() the context is the run's memory and the packet is
+ * vm->packet.  The browser keeps both in the run's memory instead.
+ */
+static struct ubpf_xdp_md*
+packet_ctx(const struct ubpf_vm* vm, uint64_t r1)
+{
+    struct ubpf_xdp_md* ctx = (struct ubpf_xdp_md*)(uintptr_t)r1;
+    if (!vm->bounds_check_enabled || !vm->checked_call) {
+        return ctx;
+    }
+
+    const void* buf = vm->packet ? vm->packet : vm->mem;
+    size_t buf_len = vm->packet ? vm->packet_len : (size_t)vm->mem_len;
+    if (vm->packet ? (void*)ctx != vm->mem || (size_t)vm->mem_len < sizeof(*ctx)
+                   : !within(r1, r1 + sizeof(*ctx), vm->mem, vm->mem_len)) {
+        return NULL;
+    }
+    uint64_t hard_start = ctx->data_hard_start ? ctx->data_hard_start : ctx->data_meta;
+    uint64_t hard_end = ctx->data_hard_end ? ctx->data_hard_end : ctx->data_end;
+    if (hard_start > ctx->data_meta || ctx->data_meta > ctx->data || ctx->data > ctx->data_end ||
+        ctx->data_end > hard_end || !within(hard_start, hard_end, buf, buf_len)) {
+        return NULL;
+    }
+    return ctx;
+}
+
+/* long skb_load_bytes(ctx, u32 offset, void* to, u32 len) */
+static uint64_t
+skb_load_bytes(struct ubpf_vm* vm, uint64_t call, uint64_t r1, uint64_t offset, uint64_t to, uint64_t len, uint64_t r5)
+{
+    struct ubpf_xdp_md* ctx = packet_ctx(vm, r1);
+    if (ctx == NULL) {
+        return -EFAULT;
+    }
+    uint64_t size = ctx->data_end - ctx->data;
+    if ((uint32_t)offset > size || (uint32_t)len > size - (uint32_t)offset || !accessible(vm, to, (uint32_t)len)) {
+        return -EFAULT;
+    }
+    memcpy((void*)(uintptr_t)to, (const void*)(uintptr_t)(ctx->data + (uint32_t)offset), (uint32_t)len);
+    return 0;
+}
+
+/* s64 csum_diff(__be32* from, u32 from_size, __be32* to, u32 to_size, __wsum seed) */
+static uint64_t
+csum_diff(struct ubpf_vm* vm, uint64_t call, uint64_t from, uint64_t from_size, uint64_t to, uint64_t to_size, uint64_t seed)
+{
+    if (((from_size | to_size) & 3) || from_size > UINT32_MAX || to_size > UINT32_MAX) {
+        return -EINVAL;
+    }
+    if (!accessible(vm, from, from_size) || !accessible(vm, to, to_size)) {
+        return -EFAULT;
+    }
+    uint32_t sum = csum_partial((const void*)(uintptr_t)to, to_size, seed);
+    /* Subtracting is adding the complement */
+    uint32_t removed = csum_partial((const void*)(uintptr_t)from, from_size, 0);
+    return csum_fold32((uint64_t)sum + (uint32_t)~removed);
+}
+
+/*
+ * Update the 16-bit checksum at offset for a field changing from "from" to
+ * "to": size is 2 or 4 for a field of that many bytes, or 0 when "to" is
+ * already a csum_diff() result.
+ */
+static uint64_t
+csum_replace(
+    const struct ubpf_vm* vm, uint64_t r1, uint64_t offset, uint64_t from, uint64_t to, unsigned size, bool mangled_0)
+{
+    struct ubpf_xdp_md* ctx = packet_ctx(vm, r1);
+    if (ctx == NULL || offset > 0xffff || offset + sizeof(uint16_t) > ctx->data_end - ctx->data) {
+        return -EFAULT;
+    }
+    if ((size != 0 && size != 2 && size != 4) || (size == 0 && from != 0)) {
+        return -EINVAL;
+    }
+    if (size == 2) {
+        from &= 0xffff;
+        to &= 0xffff;
+    }
+
+    void* ptr = (void*)(uintptr_t)(ctx->data + offset);
+    uint16_t check;
+    memcpy(&check, ptr, sizeof(check));
+    if (mangled_0 && check == 0) {
+        /* UDP without a checksum */
+        return 0;
+    }
+    uint64_t sum = (uint16_t)~check;
+    sum += (uint32_t)~from;
+    sum += (uint32_t)to;
+    check = ~csum_fold16(csum_fold32(sum));
+    if (mangled_0 && check == 0) {
+        check = CSUM_MANGLED_0;
+    }
+    memcpy(ptr, &check, sizeof(check));
+    return 0;
+}
+
+/* long l3_csum_replace(ctx, u32 offset, u64 from, u64 to, u64 flags) */
+static uint64_t
+l3_csum_replace(struct ubpf_vm* vm, uint64_t call, uint64_t r1, uint64_t offset, uint64_t from, uint64_t to, uint64_t flags)
+{
+    if (flags & ~BPF_F_HDR_FIELD_MASK) {
+        return -EINVAL;
+    }
+    return csum_replace(vm, r1, offset, from, to, flags & BPF_F_HDR_FIELD_MASK, false);
+}
+
+/*
+ * long l4_csum_replace(ctx, u32 offset, u64 from, u64 to, u64 flags)
+ *
+ * There's no checksum offload here, so a change to the pseudo-header
+ * (BPF_F_PSEUDO_HDR) updates the checksum like any other.
+ */
+static uint64_t
+l4_csum_replace(struct ubpf_vm* vm, uint64_t call, uint64_t r1, uint64_t offset, uint64_t from, uint64_t to, uint64_t flags)
+{
+    if (flags & ~(BPF_F_HDR_FIELD_MASK | BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0 | BPF_F_MARK_ENFORCE)) {
+        return -EINVAL;
+    }
+    return csum_replace(
+        vm, r1, offset, from, to, flags & BPF_F_HDR_FIELD_MASK, flags & BPF_F_MARK_MANGLED_0);
+}
+
+/* long xdp_adjust_head(ctx, int delta): move data, and any metadata with it */
+static uint64_t
+xdp_adjust_head(struct ubpf_vm* vm, uint64_t call, uint64_t r1, uint64_t delta, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    struct ubpf_xdp_md* ctx = packet_ctx(vm, r1);
+    if (ctx == NULL) {
+        return -EFAULT;
+    }
+    int64_t offset = (int32_t)delta;
+    uint64_t hard_start = ctx->data_hard_start ? ctx->data_hard_start : ctx->data_meta;
+    uint64_t metalen = ctx->data - ctx->data_meta;
+
+    if (offset < -(int64_t)(ctx->data_meta - hard_start) || offset > (int64_t)(ctx->data_end - ctx->data) - ETH_HLEN) {
+        return -EINVAL;
+    }
+    if (metalen) {
+        memmove((void*)(uintptr_t)(ctx->data_meta + offset), (void*)(uintptr_t)ctx->data_meta, metalen);
+    }
+    ctx->data_meta += offset;
+    ctx->data += offset;
+    return 0;
+}
+
+/* long xdp_adjust_tail(ctx, int delta): grown tails are zeroed */
+static uint64_t
+xdp_adjust_tail(struct ubpf_vm* vm, uint64_t call, uint64_t r1, uint64_t delta, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    struct ubpf_xdp_md* ctx = packet_ctx(vm, r1);
+    if (ctx == NULL) {
+        return -EFAULT;
+    }
+    int64_t offset = (int32_t)delta;
+    uint64_t hard_end = ctx->data_hard_end ? ctx->data_hard_end : ctx->data_end;
+
+    if (offset > (int64_t)(hard_end - ctx->data_end) || offset < ETH_HLEN - (int64_t)(ctx->data_end - ctx->data)) {
+        return -EINVAL;
+    }
+    if (offset > 0) {
+        memset((void*)(uintptr_t)ctx->data_end, 0, offset);
+    }
+    ctx->data_end += offset;
+    return 0;
+}
+
+int
+ubpf_register_packet_helpers(struct ubpf_vm* vm)
+{
+    if (ubpf_register(vm, 10, "l3_csum_replace", l3_csum_replace) < 0 ||
+        ubpf_register(vm, 11, "l4_csum_replace", l4_csum_replace) < 0 ||
+        ubpf_register(vm, 26, "skb_load_bytes", skb_load_bytes) < 0 ||
+        ubpf_register(vm, 28, "csum_diff", csum_diff) < 0 ||
+        ubpf_register(vm, 44, "xdp_adjust_head", xdp_adjust_head) < 0 ||
+        ubpf_register(vm, 65, "xdp_adjust_tail", xdp_adjust_tail) < 0) {
+        return -1;
+    }
+    ubpf_describe_helper(vm, 26, 4, 0);
+    ubpf_describe_helper(vm, 44, 2, 0);
+    ubpf_describe_helper(vm, 65, 2, 0);
+    return 0;
+}
@@ -0,0 +1,335 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A scheduler for many (program, context) jobs on a fixed set of threads.
+ *
+ * Each job runs on its own shadow of the program's VM, interpreted for at
+ * most `budget` instructions at a time (ubpf_exec_budget()).  A job that
+ * runs out of budget goes to the back of its worker's deque, so a long
+ * program only ever holds a thread for one slice before the jobs queued
+ * behind it get a turn.  Workers take from the front of their own deque and
+ * steal from the back of the others' when theirs is empty.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ubpf_int.h"
+
+struct sched_job
+{
+    struct ubpf_vm shadow;
+    ubpf_sched_done done;
+    void* arg;
+};
+
+/* A ring buffer of jobs, grown as needed. */
+struct sched_deque
+{
+    pthread_mutex_t lock;
+    struct sched_job** jobs;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+struct sched_worker
+{
+    struct ubpf_sched* sched;
+    unsigned int index;
+    pthread_t thread;
+};
+
+struct ubpf_sched
+{
+    uint64_t budget;
+    unsigned int num_threads;
+    struct sched_deque* deques;
+    struct sched_worker* workers;
+    unsigned int started;
+    atomic_uint next_deque;
+
+    /* Jobs sitting in a deque; idle workers sleep until this is nonzero. */
+    atomic_size_t queued;
+
+    /* Protects everything below. */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    size_t outstanding;
+    bool stopping;
+};
+
+static bool
+deque_push_back(struct sched_deque* deque, struct sched_job* job)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        struct sched_job** jobs = malloc(capacity * sizeof(*jobs));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static struct sched_job*
+deque_pop_front(struct sched_deque* deque)
+{
+    struct sched_job* job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static struct sched_job*
+deque_pop_back(struct sched_deque* deque)
+{
+    struct sched_job* job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        job = deque->jobs[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static struct sched_job*
+sched_take(struct ubpf_sched* sched, unsigned int self)
+{
+    struct sched_job* job = deque_pop_front(&sched->deques[self]);
+    for (unsigned int i = 1; job == NULL && i < sched->num_threads; i++) {
+        job = deque_pop_back(&sched->deques[(self + i) % sched->num_threads]);
+    }
+    if (job) {
+        atomic_fetch_sub(&sched->queued, 1);
+    }
+    return job;
+}
+
+static void
+sched_finish(struct ubpf_sched* sched, struct sched_job* job, int rc)
+{
+    job->done(rc, rc == 0 ? job->shadow.return_value : 0, job->arg);
+    ubpf_shadow_cleanup(&job->shadow);
+    free(job);
+
+    pthread_mutex_lock(&sched->lock);
+    if (--sched->outstanding == 0) {
+        pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static void*
+sched_worker_run(void* arg)
+{
+    struct sched_worker* worker = arg;
+    struct ubpf_sched* sched = worker->sched;
+
+    ubpf_set_cpu(worker->index);
+    while (1) {
+        struct sched_job* job = sched_take(sched, worker->index);
+        if (job == NULL) {
+            pthread_mutex_lock(&sched->lock);
+            while (atomic_load(&sched->queued) == 0 && !sched->stopping) {
+                pthread_cond_wait(&sched->work, &sched->lock);
+            }
+            bool stop = sched->stopping && atomic_load(&sched->queued) == 0;
+            pthread_mutex_unlock(&sched->lock);
+            if (stop) {
+                break;
+            }
+            continue;
+        }
+
+        int rc = ubpf_exec_budget(&job->shadow, sched->budget);
+        if (rc != 1) {
+            sched_finish(sched, job, rc);
+            continue;
+        }
+
+        /* Out of budget: back of the line.  This worker is awake to run it. */
+        atomic_fetch_add(&sched->queued, 1);
+        if (!deque_push_back(&sched->deques[worker->index], job)) {
+            atomic_fetch_sub(&sched->queued, 1);
+            job->shadow.error_printf(stderr, "uBPF error: out of memory requeueing job\n");
+            sched_finish(sched, job, -1);
+        }
+    }
+    return NULL;
+}
+
+struct ubpf_sched*
+ubpf_sched_create(unsigned int num_threads, uint64_t budget)
+{
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? online : 1;
+    }
+    if (num_threads > UBPF_MAX_CPUS) {
+        num_threads = UBPF_MAX_CPUS;
+    }
+
+    struct ubpf_sched* sched = calloc(1, sizeof(*sched));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->budget = budget ? budget : UBPF_SCHED_DEFAULT_BUDGET;
+    sched->num_threads = num_threads;
+    atomic_init(&sched->next_deque, 0);
+    atomic_init(&sched->queued, 0);
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    sched->deques = calloc(num_threads, sizeof(*sched->deques));
+    sched->workers = calloc(num_threads, sizeof(*sched->workers));
+    if (sched->deques == NULL || sched->workers == NULL) {
+        ubpf_sched_destroy(sched);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&sched->deques[i].lock, NULL);
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        sched->workers[i].sched = sched;
+        sched->workers[i].index = i;
+        if (pthread_create(&sched->workers[i].thread, NULL, sched_worker_run, &sched->workers[i]) != 0) {
+            ubpf_sched_destroy(sched);
+            return NULL;
+        }
+        sched->started++;
+    }
+    return sched;
+}
+
+int
+ubpf_sched_submit(
+    struct ubpf_sched* sched, struct ubpf_vm* vm, void* ctx, size_t ctx_len, ubpf_sched_done done, void* arg)
+{
+    if (!vm->insts) {
+        /* Code must be loaded before we can execute */
+        return -1;
+    }
+    if (ctx_len > INT_MAX) {
+        return -1;
+    }
+    ubpf_spec_refresh(vm);
+
+    struct sched_job* job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return -1;
+    }
+    if (!ubpf_shadow_init(&job->shadow, vm)) {
+        free(job);
+        return -1;
+    }
+    /* The context is the job's memory, so the interpreter's bounds checks allow it. */
+    job->shadow.mem = ctx;
+    job->shadow.mem_len = ctx_len;
+    job->shadow.regs[1] = (uintptr_t)ctx;
+    job->shadow.regs[2] = ctx_len;
+    job->done = done;
+    job->arg = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->outstanding++;
+    pthread_mutex_unlock(&sched->lock);
+
+    unsigned int target = atomic_fetch_add(&sched->next_deque, 1) % sched->num_threads;
+    atomic_fetch_add(&sched->queued, 1);
+    if (!deque_push_back(&sched->deques[target], job)) {
+        atomic_fetch_sub(&sched->queued, 1);
+        ubpf_shadow_cleanup(&job->shadow);
+        free(job);
+        pthread_mutex_lock(&sched->lock);
+        if (--sched->outstanding == 0) {
+            pthread_cond_broadcast(&sched->idle);
+        }
+        pthread_mutex_unlock(&sched->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    pthread_cond_signal(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+void
+ubpf_sched_wait(struct ubpf_sched* sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    while (sched->outstanding > 0) {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void
+ubpf_sched_destroy(struct ubpf_sched* sched)
+{
+    if (sched == NULL) {
+        return;
+    }
+
+    if (sched->started) {
+        ubpf_sched_wait(sched);
+    }
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    for (unsigned int i = 0; i < sched->started; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+
+    if (sched->deques) {
+        for (unsigned int i = 0; i < sched->num_threads; i++) {
+            pthread_mutex_destroy(&sched->deques[i].lock);
+            free(sched->deques[i].jobs);
+        }
+    }
+    free(sched->deques);
+    free(sched->workers);
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->work);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched);
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Tiered execution: a program starts out in the interpreter and is handed
+ * to the JIT on a background thread once it has proven to be hot.  Until
+ * the compiled code is published, callers keep interpreting, so nobody
+ * waits on the compiler.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "ubpf_int.h"
+
+enum ubpf_tier_state
+{
+    UBPF_TIER_INTERPRETED,
+    UBPF_TIER_COMPILING,
+    UBPF_TIER_JITTED,
+    UBPF_TIER_FAILED,
+};
+
+struct ubpf_tier
+{
+    uint64_t invocation_threshold;
+    uint64_t instruction_threshold;
+    atomic_uint_fast64_t invocations;
+    atomic_uint_fast64_t instructions;
+    atomic_int state;
+    _Atomic(ubpf_jit_fn) jitted;
+    size_t jitted_size;
+    pthread_t compiler;
+    bool compiler_started;
+    struct ubpf_vm* vm;
+};
+
+struct ubpf_tier*
+ubpf_tier_create(struct ubpf_vm* vm)
+{
+    struct ubpf_tier* tier = calloc(1, sizeof(*tier));
+    if (tier == NULL) {
+        return NULL;
+    }
+    tier->vm = vm;
+    tier->invocation_threshold = UBPF_JIT_INVOCATION_THRESHOLD;
+    tier->instruction_threshold = UBPF_JIT_INSTRUCTION_THRESHOLD;
+    atomic_init(&tier->invocations, 0);
+    atomic_init(&tier->instructions, 0);
+    atomic_init(&tier->state, UBPF_TIER_INTERPRETED);
+    atomic_init(&tier->jitted, NULL);
+    return tier;
+}
+
+void
+ubpf_tier_reset(struct ubpf_tier* tier)
+{
+    if (tier == NULL) {
+        return;
+    }
+    if (tier->compiler_started) {
+        pthread_join(tier->compiler, NULL);
+        tier->compiler_started = false;
+    }
+    ubpf_jit_fn jitted = atomic_load(&tier->jitted);
+    if (jitted) {
+        munmap(jitted, tier->jitted_size);
+    }
+    atomic_store(&tier->jitted, NULL);
+    tier->jitted_size = 0;
+    atomic_store(&tier->invocations, 0);
+    atomic_store(&tier->instructions, 0);
+    atomic_store(&tier->state, UBPF_TIER_INTERPRETED);
+}
+
+void
+ubpf_tier_destroy(struct ubpf_tier* tier)
+{
+    ubpf_tier_reset(tier);
+    free(tier);
+}
+
+static void*
+tier_compile(void* arg)
+{
+    struct ubpf_tier* tier = arg;
+    char* errmsg = NULL;
+    size_t jitted_size = 0;
+
+    ubpf_jit_fn jitted = ubpf_jit_build(tier->vm, &jitted_size, &errmsg);
+    if (jitted == NULL) {
+        tier->vm->error_printf(stderr, "uBPF error: tiered JIT compilation failed: %s\n", errmsg);
+        free(errmsg);
+        atomic_store(&tier->state, UBPF_TIER_FAILED);
+        return NULL;
+    }
+
+    tier->jitted_size = jitted_size;
+    atomic_store_explicit(&tier->jitted, jitted, memory_order_release);
+    atomic_store(&tier->state, UBPF_TIER_JITTED);
+    return NULL;
+}
+
+static void
+tier_maybe_promote(struct ubpf_tier* tier, uint64_t steps)
+{
+    uint64_t invocations = atomic_fetch_add_explicit(&tier->invocations, 1, memory_order_relaxed) + 1;
+    uint64_t instructions = atomic_fetch_add_explicit(&tier->instructions, steps, memory_order_relaxed) + steps;
+
+    bool hot = (tier->invocation_threshold && invocations >= tier->invocation_threshold) ||
+               (tier->instruction_threshold && instructions >= tier->instruction_threshold);
+    if (!hot) {
+        return;
+    }
+
+    int expected = UBPF_TIER_INTERPRETED;
+    if (!atomic_compare_exchange_strong(&tier->state, &expected, UBPF_TIER_COMPILING)) {
+        /* Someone else already kicked off (or finished) the compile. */
+        return;
+    }
+
+    if (pthread_create(&tier->compiler, NULL, tier_compile, tier) != 0) {
+        tier->vm->error_printf(stderr, "uBPF error: could not start tiered JIT compiler thread\n");
+        atomic_store(&tier->state, UBPF_TIER_FAILED);
+        return;
+    }
+    tier->compiler_started = true;
+}
+
+int
+ubpf_set_jit_threshold(struct ubpf_vm* vm, uint64_t invocations, uint64_t instructions)
+{
+    if (vm->insts) {
+        return -1;
+    }
+    vm->tier->invocation_threshold = invocations;
+    vm->tier->instruction_threshold = instructions;
+    return 0;
+}
+
+int
+ubpf_exec_tiered(struct ubpf_vm* vm)
+{
+    struct ubpf_tier* tier = vm->tier;
+
+    if (vm->pc != 0) {
+        /* Not at the beginning of program */
+        return -1;
+    }
+    if (!vm->insts) {
+        /* Code must be loaded before we can execute */
+        return -1;
+    }
+
+    ubpf_spec_refresh(vm);
+    ubpf_jit_fn jitted = atomic_load_explicit(&tier->jitted, memory_order_acquire);
+    if (jitted) {
+        /* Tail calls may land in programs that are being swapped */
+        unsigned int epoch = ubpf_epoch_enter();
+        vm->return_value = jitted((void*)(uintptr_t)vm->regs[1], (size_t)vm->regs[2]);
+        ubpf_epoch_exit(epoch);
+        return 0;
+    }
+
+    uint64_t steps = 0;
+    int rc;
+    do {
+        rc = ubpf_exec_step(vm);
+        steps++;
+    } while (rc > 0);
+    vm->pc = 0;
+
+    if (rc == 0) {
+        tier_maybe_promote(tier, steps);
+    }
+    return rc;
+}
+
+void
+ubpf_get_tier_stats(const struct ubpf_vm* vm, struct ubpf_tier_stats* stats)
+{
+    struct ubpf_tier* tier = vm->tier;
+    stats->invocations = atomic_load_explicit(&tier->invocations, memory_order_relaxed);
+    stats->instructions = atomic_load_explicit(&tier->instructions, memory_order_relaxed);
+    stats->jitted = atomic_load_explicit(&tier->jitted, memory_order_acquire) != NULL;
+}
@@ -0,0 +1,1077 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Path-sensitive program verifier.
+ *
+ * Each path through the program is executed over abstract register states:
+ * every register is uninitialized, a scalar with an unsigned range of
+ * values, or a pointer (to the context in r1, the stack, or a map value
+ * that may still be NULL) with a range of offsets.  Conditional jumps narrow
+ * the ranges on each side, and a side that can't be taken isn't explored.
+ * Paths are rejected if they read an uninitialized register, access the
+ * stack or a map value out of bounds, dereference a map value that may be
+ * NULL, or run off the end of the program.
+ *
+ * At jump targets the state is stored, with registers that are dead from
+ * there on forgotten, and a later path arriving in a state that is
+ * contained in a stored one is pruned: whatever it could do has already
+ * been checked.  Once MAX_STATES_PER_INSN states are stored at one
+ * instruction, new arrivals are joined with the latest one, widening
+ * ranges that differ to unknown, so every instruction is visited a bounded
+ * number of times and verification stays close to linear in program size.
+ *
+ * Memory accessed through scalars (packet data, or any address computed by
+ * the program) can't be checked here and is left to the run-time bounds
+ * checks, as are context accesses past the offset they start at.
+ *
+ * Along the way the deepest stack offset accessed, or passed to a helper, is
+ * recorded for ubpf_get_verifier_stats().  It only covers the paths
+ * followed, so the stack itself is sized by ubpf_load().  If a stack pointer is lost
+ * track of, by being spilled to memory or turned into a scalar, any of the
+ * stack could be reached and the full UBPF_STACK_SIZE is reported.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "ubpf_int.h"
+
+#define MAX_STATES_PER_INSN 16
+
+/* Largest scalar that may be added to a pointer without losing track of it */
+#define MAX_POINTER_DELTA (1 << 29)
+
+enum reg_type
+{
+    NOT_INIT,
+    SCALAR,
+    PTR_TO_CTX,
+    PTR_TO_STACK,
+    PTR_TO_MAP_VALUE,
+    PTR_TO_MAP_VALUE_OR_NULL,
+};
+
+struct reg_state
+{
+    enum reg_type type;
+    uint32_t id;         /* copies of one map_lookup_elem result share an id */
+    uint32_t value_size; /* map values, 0 if unknown */
+    bool readonly;       /* map values the program may not store to */
+    uint64_t min, max;   /* scalars: unsigned range; pointers: signed offset range */
+};
+
+struct state
+{
+    struct reg_state regs[EBPF_REGISTERS_COUNT];
+};
+
+struct stored_state
+{
+    struct state state;
+    uint32_t next;
+};
+
+struct pending
+{
+    uint32_t pc;
+    struct state state;
+};
+
+struct verifier
+{
+    struct ubpf_vm* vm;
+    const struct ebpf_inst* insts;
+    uint32_t num_insts;
+    char** errmsg;
+
+    uint16_t* live; /* registers that may be read before being written */
+    bool* prune_point;
+    uint32_t* first_stored; /* index + 1 into stored, 0 for none */
+    uint8_t* num_stored_at;
+
+    struct stored_state* stored;
+    uint32_t num_stored, stored_capacity;
+    struct pending* pending;
+    uint32_t num_pending, pending_capacity;
+    uint32_t next_id;
+    bool stack_escaped;
+
+    struct ubpf_verifier_stats stats;
+};
+
+static bool
+is_pointer(enum reg_type type)
+{
+    return type >= PTR_TO_CTX;
+}
+
+static struct reg_state
+scalar(uint64_t min, uint64_t max)
+{
+    struct reg_state r = {.type = SCALAR, .min = min, .max = max};
+    return r;
+}
+
+static struct reg_state
+unknown(bool is64)
+{
+    return scalar(0, is64 ? UINT64_MAX : UINT32_MAX);
+}
+
+static bool
+is_const(const struct reg_state* r)
+{
+    return r->type == SCALAR && r->min == r->max;
+}
+
+/* The range of the low 32 bits */
+static void
+truncate32(uint64_t* min, uint64_t* max)
+{
+    if ((*min >> 32) == (*max >> 32)) {
+        *min &= UINT32_MAX;
+        *max &= UINT32_MAX;
+    } else {
+        *min = 0;
+        *max = UINT32_MAX;
+    }
+}
+
+/* Smallest all-ones value no less than x */
+static uint64_t
+fill_bits(uint64_t x)
+{
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    x |= x >> 32;
+    return x;
+}
+
+static bool
+fail(struct verifier* v, const char* msg, uint32_t pc)
+{
+    *v->errmsg = ubpf_error("%s at PC %d", msg, pc);
+    return false;
+}
+
+/* The program may reach the stack down to offset off from r10 */
+static void
+use_stack(struct verifier* v, int64_t off)
+{
+    if (off < 0 && -off > v->stats.stack_depth) {
+        v->stats.stack_depth = -off;
+    }
+}
+
+/* r is about to be overwritten with something untracked */
+static void
+lose_track(struct verifier* v, const struct reg_state* r)
+{
+    if (r->type == PTR_TO_STACK) {
+        v->stack_escaped = true;
+    }
+}
+
+static bool
+check_init(struct verifier* v, const struct state* st, uint8_t reg, uint32_t pc)
+{
+    if (st->regs[reg].type == NOT_INIT) {
+        *v->errmsg = ubpf_error("r%d is not initialized at PC %d", reg, pc);
+        return false;
+    }
+    return true;
+}
+
+uint16_t
+ubpf_inst_regs(const struct ebpf_inst* inst, uint16_t* defs)
+{
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    uint8_t op = inst->opcode & EBPF_ALU_OP_MASK;
+    uint16_t dst = 1 << inst->dst, src = 1 << inst->src;
+    bool reg_src = inst->opcode & EBPF_SRC_REG;
+
+    *defs = 0;
+    switch (cls) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        *defs = dst;
+        if (op == 0xd0) { /* le, be */
+            return dst;
+        }
+        return (op == 0xb0 ? 0 : dst) | (reg_src ? src : 0);
+    case EBPF_CLS_LD:
+        *defs = inst->opcode == EBPF_OP_LDDW ? dst : 0;
+        return 0;
+    case EBPF_CLS_LDX:
+        *defs = dst;
+        return src;
+    case EBPF_CLS_ST:
+        return dst;
+    case EBPF_CLS_STX:
+        if ((inst->opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            if (inst->imm == EBPF_ATOMIC_OP_CMPXCHG) {
+                *defs = 1;
+                return dst | src | 1;
+            }
+            *defs = (inst->imm & EBPF_ATOMIC_OP_FETCH) ? src : 0;
+        }
+        return dst | src;
+    default: /* jumps */
+        if (inst->opcode == EBPF_OP_CALL) {
+            *defs = 0x3f;
+            return 0x3e;
+        } else if (inst->opcode == EBPF_OP_EXIT) {
+            return 1;
+        } else if (inst->opcode == EBPF_OP_JA) {
+            return 0;
+        }
+        return dst | (reg_src ? src : 0);
+    }
+}
+
+/* Backward liveness, and the jump targets where states are stored */
+static void
+analyze(struct verifier* v)
+{
+    const struct ebpf_inst* insts = v->insts;
+    bool changed = true;
+
+    for (uint32_t pc = 0; pc < v->num_insts; pc++) {
+        uint8_t cls = insts[pc].opcode & EBPF_CLS_MASK;
+        if ((cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && insts[pc].opcode != EBPF_OP_CALL &&
+            insts[pc].opcode != EBPF_OP_EXIT) {
+            v->prune_point[pc + 1 + insts[pc].offset] = true;
+            if (insts[pc].opcode != EBPF_OP_JA && pc + 1 < v->num_insts) {
+                v->prune_point[pc + 1] = true;
+            }
+        }
+    }
+
+    while (changed) {
+        changed = false;
+        for (uint32_t pc = v->num_insts; pc-- > 0;) {
+            const struct ebpf_inst* inst = &insts[pc];
+            uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+            uint16_t out = 0, defs, in;
+
+            if (pc > 0 && insts[pc - 1].opcode == EBPF_OP_LDDW) {
+                continue; /* second half of lddw */
+            }
+            if (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) {
+                if (inst->opcode != EBPF_OP_EXIT) {
+                    if (inst->opcode != EBPF_OP_CALL) {
+                        out |= v->live[pc + 1 + inst->offset];
+                    }
+                    if (inst->opcode != EBPF_OP_JA && pc + 1 < v->num_insts) {
+                        out |= v->live[pc + 1];
+                    }
+                }
+            } else {
+                uint32_t next = pc + (inst->opcode == EBPF_OP_LDDW ? 2 : 1);
+                if (next < v->num_insts) {
+                    out = v->live[next];
+                }
+            }
+            in = ubpf_inst_regs(inst, &defs) | (out & ~defs);
+            if (in != v->live[pc]) {
+                v->live[pc] = in;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool
+push(struct verifier* v, uint32_t pc, const struct state* st)
+{
+    if (v->num_pending == v->pending_capacity) {
+        uint32_t capacity = v->pending_capacity ? v->pending_capacity * 2 : 64;
+        struct pending* p = realloc(v->pending, capacity * sizeof(*p));
+        if (!p) {
+            *v->errmsg = ubpf_error("out of memory");
+            return false;
+        }
+        v->pending = p;
+        v->pending_capacity = capacity;
+    }
+    v->pending[v->num_pending].pc = pc;
+    v->pending[v->num_pending].state = *st;
+    v->num_pending++;
+    return true;
+}
+
+/* Whether every value n could hold is one o could hold */
+static bool
+reg_contains(const struct reg_state* o, const struct reg_state* n)
+{
+    if (o->type != n->type || o->value_size != n->value_size || o->readonly != n->readonly) {
+        return false;
+    }
+    if (o->type == SCALAR) {
+        return n->min >= o->min && n->max <= o->max;
+    }
+    return (int64_t)n->min >= (int64_t)o->min && (int64_t)n->max <= (int64_t)o->max;
+}
+
+/* Whether everything cur could do from here was already checked from old */
+static bool
+contains(const struct state* old, const struct state* cur)
+{
+    for (int i = 0; i < EBPF_REGISTERS_COUNT; i++) {
+        const struct reg_state* o = &old->regs[i];
+        if (o->type == NOT_INIT) {
+            continue;
+        }
+        if (!reg_contains(o, &cur->regs[i])) {
+            return false;
+        }
+        if (o->type == PTR_TO_MAP_VALUE_OR_NULL) {
+            /* A NULL check on one copy must still cover all the others */
+            for (int j = i + 1; j < EBPF_REGISTERS_COUNT; j++) {
+                if (old->regs[j].type == PTR_TO_MAP_VALUE_OR_NULL && old->regs[j].id == o->id &&
+                    cur->regs[j].id != cur->regs[i].id) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Widen old to also cover cur.  Registers that differ become unknown
+ * scalars, except that map values which may be NULL stay that way, so they
+ * still have to be checked before use.
+ */
+static void
+join(struct verifier* v, struct state* old, const struct state* cur)
+{
+    uint32_t old_ids[EBPF_REGISTERS_COUNT], cur_ids[EBPF_REGISTERS_COUNT], new_ids[EBPF_REGISTERS_COUNT];
+    int num_ids = 0;
+
+    for (int i = 0; i < EBPF_REGISTERS_COUNT; i++) {
+        struct reg_state* o = &old->regs[i];
+        const struct reg_state* n = &cur->regs[i];
+        bool map_values = (o->type == PTR_TO_MAP_VALUE || o->type == PTR_TO_MAP_VALUE_OR_NULL) &&
+                          (n->type == PTR_TO_MAP_VALUE || n->type == PTR_TO_MAP_VALUE_OR_NULL);
+
+        if (o->type == NOT_INIT || n->type == NOT_INIT) {
+            o->type = NOT_INIT;
+        } else if (
+            map_values && o->min == n->min && o->max == n->max && o->value_size == n->value_size &&
+            o->readonly == n->readonly && (o->type == PTR_TO_MAP_VALUE_OR_NULL || n->type == PTR_TO_MAP_VALUE_OR_NULL)) {
+            /* Copies that shared a NULL check on both paths keep sharing one */
+            int k;
+            for (k = 0; k < num_ids && (old_ids[k] != o->id || cur_ids[k] != n->id); k++) {
+            }
+            if (k == num_ids) {
+                old_ids[k] = o->id;
+                cur_ids[k] = n->id;
+                new_ids[k] = ++v->next_id;
+                num_ids++;
+            }
+            o->type = PTR_TO_MAP_VALUE_OR_NULL;
+            o->id = new_ids[k];
+        } else if (!reg_contains(o, n)) {
+            lose_track(v, o);
+            lose_track(v, n);
+            *o = unknown(true);
+        }
+    }
+}
+
+static void
+forget_dead(struct state* st, uint16_t live)
+{
+    for (int i = 0; i < EBPF_REGISTERS_COUNT; i++) {
+        if (!(live & (1 << i))) {
+            st->regs[i].type = NOT_INIT;
+        }
+    }
+}
+
+/*
+ * At a prune point: return false if st is contained in a stored state,
+ * otherwise store it (or widen it into the latest stored state) and return
+ * true to keep exploring.
+ */
+static bool
+visit(struct verifier* v, uint32_t pc, struct state* st, bool* ok)
+{
+    struct state cur = *st;
+    forget_dead(&cur, v->live[pc]);
+
+    for (uint32_t i = v->first_stored[pc]; i; i = v->stored[i - 1].next) {
+        if (contains(&v->stored[i - 1].state, &cur)) {
+            v->stats.states_pruned++;
+            return false;
+        }
+    }
+
+    if (v->num_stored_at[pc] >= MAX_STATES_PER_INSN) {
+        struct state* latest = &v->stored[v->first_stored[pc] - 1].state;
+        join(v, latest, &cur);
+        *st = *latest;
+        return true;
+    }
+
+    if (v->num_stored == v->stored_capacity) {
+        uint32_t capacity = v->stored_capacity ? v->stored_capacity * 2 : 256;
+        struct stored_state* s = realloc(v->stored, capacity * sizeof(*s));
+        if (!s) {
+            *v->errmsg = ubpf_error("out of memory");
+            *ok = false;
+            return false;
+        }
+        v->stored = s;
+        v->stored_capacity = capacity;
+    }
+    v->stored[v->num_stored].state = cur;
+    v->stored[v->num_stored].next = v->first_stored[pc];
+    v->first_stored[pc] = ++v->num_stored;
+    v->num_stored_at[pc]++;
+    v->stats.states_stored++;
+    return true;
+}
+
+static bool
+check_access(struct verifier* v, const struct state* st, uint8_t reg, int16_t off, int size, uint32_t pc)
+{
+    const struct reg_state* r = &st->regs[reg];
+    int64_t lo = (int64_t)r->min + off, hi = (int64_t)r->max + off + size;
+
+    switch (r->type) {
+    case NOT_INIT:
+        return check_init(v, st, reg, pc);
+    case PTR_TO_STACK:
+        if (lo < -UBPF_STACK_SIZE || hi > 0) {
+            return fail(v, "invalid stack access", pc);
+        }
+        use_stack(v, lo);
+        return true;
+    case PTR_TO_CTX:
+        if (lo < 0) {
+            return fail(v, "invalid context access", pc);
+        }
+        return true;
+    case PTR_TO_MAP_VALUE:
+        if (lo < 0 || (r->value_size && hi > r->value_size)) {
+            return fail(v, "invalid map value access", pc);
+        }
+        return true;
+    case PTR_TO_MAP_VALUE_OR_NULL:
+        return fail(v, "possible NULL pointer dereference", pc);
+    default:
+        return true;
+    }
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B:
+        return 1;
+    case EBPF_SIZE_H:
+        return 2;
+    case EBPF_SIZE_W:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+bool
+ubpf_alu_fold(uint8_t op, bool is64, uint64_t a, uint64_t b, uint64_t* result)
+{
+    unsigned int width = is64 ? 64 : 32;
+    if (!is64) {
+        a = (uint32_t)a;
+        b = (uint32_t)b;
+    }
+    switch (op) {
+    case 0x00:
+        *result = a + b;
+        break;
+    case 0x10:
+        *result = a - b;
+        break;
+    case 0x20:
+        *result = a * b;
+        break;
+    case 0x30:
+        *result = b ? a / b : 0;
+        break;
+    case 0x40:
+        *result = a | b;
+        break;
+    case 0x50:
+        *result = a & b;
+        break;
+    case 0x60:
+        if (b >= width) {
+            return false;
+        }
+        *result = a << b;
+        break;
+    case 0x70:
+        if (b >= width) {
+            return false;
+        }
+        *result = a >> b;
+        break;
+    case 0x90:
+        *result = b ? a % b : a;
+        break;
+    case 0xa0:
+        *result = a ^ b;
+        break;
+    case 0xc0:
+        if (b >= width) {
+            return false;
+        }
+        *result = is64 ? (uint64_t)((int64_t)a >> b) : (uint64_t)((int32_t)a >> b);
+        break;
+    default:
+        return false;
+    }
+    if (!is64) {
+        *result = (uint32_t)*result;
+    }
+    return true;
+}
+
+static void
+scalar_alu(struct reg_state* dst, const struct reg_state* src, uint8_t op, bool is64)
+{
+    uint64_t a0 = dst->min, a1 = dst->max, b0 = src->min, b1 = src->max, lo = 0, hi = UINT64_MAX, c;
+    uint64_t width = is64 ? 64 : 32;
+
+    if (a0 == a1 && b0 == b1 && ubpf_alu_fold(op, is64, a0, b0, &c)) {
+        *dst = scalar(c, c);
+        return;
+    }
+    if (!is64) {
+        truncate32(&a0, &a1);
+        truncate32(&b0, &b1);
+    }
+    switch (op) {
+    case 0x00: /* add */
+        if (a1 + b1 >= a1) {
+            lo = a0 + b0;
+            hi = a1 + b1;
+        }
+        break;
+    case 0x10: /* sub */
+        if (a0 >= b1) {
+            lo = a0 - b1;
+            hi = a1 - b0;
+        }
+        break;
+    case 0x20: /* mul */
+        if (a1 == 0 || b1 <= UINT64_MAX / a1) {
+            lo = a0 * b0;
+            hi = a1 * b1;
+        }
+        break;
+    case 0x30: /* div */
+        if (b0 == b1 && b0) {
+            lo = a0 / b0;
+            hi = a1 / b0;
+        } else {
+            hi = a1;
+        }
+        break;
+    case 0x90: /* mod */
+        if (b0 == b1 && b0 && a1 >= b0) {
+            hi = b0 - 1;
+        } else if (b0 == b1 && b0) {
+            lo = a0;
+            hi = a1;
+        } else {
+            hi = a1;
+        }
+        break;
+    case 0x40: /* or */
+        lo = a0 > b0 ? a0 : b0;
+        hi = fill_bits(a1 > b1 ? a1 : b1);
+        break;
+    case 0x50: /* and */
+        hi = a1 < b1 ? a1 : b1;
+        break;
+    case 0xa0: /* xor */
+        hi = fill_bits(a1 > b1 ? a1 : b1);
+        break;
+    case 0x60: /* lsh */
+        if (b0 == b1 && b0 < width && (a1 << b0) >> b0 == a1) {
+            lo = a0 << b0;
+            hi = a1 << b0;
+        }
+        break;
+    case 0x70: /* rsh */
+        if (b0 == b1 && b0 < width) {
+            lo = a0 >> b0;
+            hi = a1 >> b0;
+        } else {
+            hi = a1;
+        }
+        break;
+    case 0xc0: /* arsh */
+        if (b0 == b1 && b0 < width && a1 <= (is64 ? (uint64_t)INT64_MAX : INT32_MAX)) {
+            lo = a0 >> b0;
+            hi = a1 >> b0;
+        }
+        break;
+    }
+    if (!is64) {
+        truncate32(&lo, &hi);
+    }
+    *dst = scalar(lo, hi);
+}
+
+/* dst (a pointer) += delta, or -= delta */
+static void
+pointer_add(struct verifier* v, struct reg_state* dst, const struct reg_state* delta, bool subtract)
+{
+    if (delta->min == delta->max) {
+        dst->min = subtract ? dst->min - delta->min : dst->min + delta->min;
+        dst->max = subtract ? dst->max - delta->min : dst->max + delta->min;
+    } else if (delta->max <= MAX_POINTER_DELTA) {
+        dst->min = subtract ? dst->min - delta->max : dst->min + delta->min;
+        dst->max = subtract ? dst->max - delta->min : dst->max + delta->max;
+    } else {
+        /* Could point anywhere: leave it to the run-time checks */
+        lose_track(v, dst);
+        *dst = unknown(true);
+    }
+}
+
+static bool
+do_alu(struct verifier* v, struct state* st, const struct ebpf_inst* inst, uint32_t pc)
+{
+    bool is64 = (inst->opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    uint8_t op = inst->opcode & EBPF_ALU_OP_MASK;
+    struct reg_state* dst = &st->regs[inst->dst];
+    struct reg_state src;
+
+    if (op == 0xd0) { /* le, be */
+        if (!check_init(v, st, inst->dst, pc)) {
+            return false;
+        }
+        uint64_t mask = inst->imm == 64 ? UINT64_MAX : ((uint64_t)1 << inst->imm) - 1;
+        if (dst->type != SCALAR) {
+            lose_track(v, dst);
+            *dst = scalar(0, mask);
+        } else if (inst->opcode == EBPF_OP_LE && dst->max <= mask) {
+            /* unchanged on a little endian host */
+        } else if (dst->min == dst->max && inst->opcode == EBPF_OP_BE) {
+            uint64_t x = dst->min;
+            x = inst->imm == 16 ? __builtin_bswap16(x) : inst->imm == 32 ? __builtin_bswap32(x) : __builtin_bswap64(x);
+            *dst = scalar(x, x);
+        } else {
+            *dst = scalar(0, mask);
+        }
+        return true;
+    }
+
+    if (op == 0x80) { /* neg */
+        if (!check_init(v, st, inst->dst, pc)) {
+            return false;
+        }
+        if (is_const(dst)) {
+            uint64_t x = is64 ? -dst->min : (uint32_t)-dst->min;
+            *dst = scalar(x, x);
+        } else {
+            lose_track(v, dst);
+            *dst = unknown(is64);
+        }
+        return true;
+    }
+
+    if (inst->opcode & EBPF_SRC_REG) {
+        if (!check_init(v, st, inst->src, pc)) {
+            return false;
+        }
+        src = st->regs[inst->src];
+    } else {
+        uint64_t imm = is64 ? (uint64_t)(int64_t)inst->imm : (uint32_t)inst->imm;
+        src = scalar(imm, imm);
+    }
+
+    if (op == 0xb0) { /* mov */
+        if (is64) {
+            *dst = src;
+        } else if (src.type == SCALAR) {
+            truncate32(&src.min, &src.max);
+            *dst = src;
+        } else {
+            lose_track(v, &src);
+            *dst = unknown(false);
+        }
+        return true;
+    }
+
+    if (!check_init(v, st, inst->dst, pc)) {
+        return false;
+    }
+    if (is64 && (op == 0x00 || op == 0x10) && is_pointer(dst->type) && dst->type != PTR_TO_MAP_VALUE_OR_NULL &&
+        src.type == SCALAR) {
+        pointer_add(v, dst, &src, op == 0x10);
+    } else if (is64 && op == 0x00 && dst->type == SCALAR && is_pointer(src.type) &&
+               src.type != PTR_TO_MAP_VALUE_OR_NULL) {
+        struct reg_state delta = *dst;
+        *dst = src;
+        pointer_add(v, dst, &delta, false);
+    } else if (dst->type != SCALAR || src.type != SCALAR) {
+        lose_track(v, dst);
+        lose_track(v, &src);
+        *dst = unknown(is64);
+    } else {
+        scalar_alu(dst, &src, op, is64);
+    }
+    return true;
+}
+
+static bool
+do_call(struct verifier* v, struct state* st, const struct ebpf_inst* inst)
+{
+    struct reg_state result = unknown(true);
+
+    if (ubpf_maps_is_lookup(v->vm, inst->imm)) {
+        const struct reg_state* map = &st->regs[1];
+        result.type = PTR_TO_MAP_VALUE_OR_NULL;
+        result.id = ++v->next_id;
+        result.min = result.max = 0;
+        result.value_size = is_const(map) && v->vm->maps ? ubpf_maps_value_size(v->vm, map->min) : 0;
+        result.readonly = map->type == SCALAR ? ubpf_maps_readonly(v->vm, map->min, map->max)
+                                              : ubpf_maps_readonly(v->vm, 0, MAX_MAPS - 1);
+    }
+    for (int i = 1; i <= 5; i++) {
+        /* Helpers work upwards from the pointers they are given */
+        if (st->regs[i].type == PTR_TO_STACK) {
+            use_stack(v, (int64_t)st->regs[i].min);
+        }
+        st->regs[i].type = NOT_INIT;
+    }
+    st->regs[0] = result;
+    return true;
+}
+
+/* Narrow a conditional jump's register for each side; clear can_* if a side is impossible */
+static void
+branch(
+    const struct state* st,
+    const struct ebpf_inst* inst,
+    struct state* taken,
+    struct state* fallen,
+    bool* can_take,
+    bool* can_fall)
+{
+    bool is32 = (inst->opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+    uint8_t op = inst->opcode & EBPF_JMP_OP_MASK;
+    const struct reg_state* d = &st->regs[inst->dst];
+    struct reg_state other;
+
+    *taken = *st;
+    *fallen = *st;
+    *can_take = *can_fall = true;
+
+    if (inst->opcode & EBPF_SRC_REG) {
+        other = st->regs[inst->src];
+    } else {
+        uint64_t imm = is32 ? (uint32_t)inst->imm : (uint64_t)(int64_t)inst->imm;
+        other = scalar(imm, imm);
+    }
+    if (!is_const(&other)) {
+        return;
+    }
+    uint64_t c = is32 ? (uint32_t)other.min : other.min;
+
+    if (is_pointer(d->type)) {
+        if (is32 || c != 0 || (op != EBPF_MODE_JEQ && op != EBPF_MODE_JNE)) {
+            return;
+        }
+        if (d->type != PTR_TO_MAP_VALUE_OR_NULL) {
+            /* Pointers to the stack, context and map values are never NULL */
+            *(op == EBPF_MODE_JEQ ? can_take : can_fall) = false;
+            return;
+        }
+        struct state* null_side = op == EBPF_MODE_JEQ ? taken : fallen;
+        struct state* valid_side = op == EBPF_MODE_JEQ ? fallen : taken;
+        for (int i = 0; i < EBPF_REGISTERS_COUNT; i++) {
+            if (st->regs[i].type == PTR_TO_MAP_VALUE_OR_NULL && st->regs[i].id == d->id) {
+                null_side->regs[i] = scalar(0, 0);
+                valid_side->regs[i].type = PTR_TO_MAP_VALUE;
+            }
+        }
+        return;
+    }
+
+    uint64_t lo = d->min, hi = d->max;
+    if (is32 && hi > UINT32_MAX) {
+        return;
+    }
+
+    /* Signed comparisons of non-negative values are unsigned ones */
+    if (op == EBPF_MODE_JSGT || op == EBPF_MODE_JSGE || op == EBPF_MODE_JSLT || op == EBPF_MODE_JSLE) {
+        int64_t sc = is32 ? (int32_t)c : (int64_t)c;
+        if (hi > (is32 ? (uint64_t)INT32_MAX : (uint64_t)INT64_MAX)) {
+            return;
+        }
+        if (sc < 0) {
+            *(op == EBPF_MODE_JSGT || op == EBPF_MODE_JSGE ? can_fall : can_take) = false;
+            return;
+        }
+        op = op == EBPF_MODE_JSGT ? EBPF_MODE_JGT
+             : op == EBPF_MODE_JSGE ? EBPF_MODE_JGE
+             : op == EBPF_MODE_JSLT ? EBPF_MODE_JLT
+                                    : EBPF_MODE_JLE;
+    }
+
+    /* The ranges for which the jump is taken and not taken */
+    uint64_t tlo = lo, thi = hi, flo = lo, fhi = hi;
+    bool tnone = false, fnone = false;
+    switch (op) {
+    case EBPF_MODE_JEQ:
+    case EBPF_MODE_JNE:
+        tnone = c < lo || c > hi;
+        tlo = thi = c;
+        fnone = lo == hi && lo == c;
+        flo = lo + (lo == c);
+        fhi = hi - (hi == c);
+        if (op == EBPF_MODE_JNE) {
+            uint64_t t;
+            bool n;
+            t = tlo, tlo = flo, flo = t;
+            t = thi, thi = fhi, fhi = t;
+            n = tnone, tnone = fnone, fnone = n;
+        }
+        break;
+    case EBPF_MODE_JGT:
+        tnone = c >= hi;
+        tlo = lo > c ? lo : c + 1;
+        fnone = lo > c;
+        fhi = hi < c ? hi : c;
+        break;
+    case EBPF_MODE_JGE:
+        tnone = hi < c;
+        tlo = lo > c ? lo : c;
+        fnone = c == 0 || lo > c - 1;
+        fhi = hi < c - 1 ? hi : c - 1;
+        break;
+    case EBPF_MODE_JLT:
+        tnone = c == 0 || lo > c - 1;
+        thi = hi < c - 1 ? hi : c - 1;
+        fnone = hi < c;
+        flo = lo > c ? lo : c;
+        break;
+    case EBPF_MODE_JLE:
+        tnone = lo > c;
+        thi = hi < c ? hi : c;
+        fnone = c >= hi;
+        flo = lo > c ? lo : c + 1;
+        break;
+    case EBPF_MODE_JSET:
+        if (lo == hi) {
+            tnone = !(lo & c);
+            fnone = !tnone;
+        } else if (c == 0 || hi < (c & -c)) {
+            tnone = true;
+        }
+        break;
+    default:
+        return;
+    }
+    *can_take = !tnone;
+    *can_fall = !fnone;
+    taken->regs[inst->dst].min = tlo;
+    taken->regs[inst->dst].max = thi;
+    fallen->regs[inst->dst].min = flo;
+    fallen->regs[inst->dst].max = fhi;
+}
+
+/* Follow one path until it exits, is pruned, or fails */
+static bool
+explore(struct verifier* v, uint32_t pc, struct state* st)
+{
+    for (;;) {
+        if (++v->stats.insns_processed > UBPF_MAX_VERIFIED_INSNS) {
+            *v->errmsg = ubpf_error("program too complex to verify (%d instructions processed)", UBPF_MAX_VERIFIED_INSNS);
+            return false;
+        }
+        if (pc >= v->num_insts) {
+            return fail(v, "execution falls off the end of the program", v->num_insts - 1);
+        }
+        if (v->prune_point[pc]) {
+            bool ok = true;
+            if (!visit(v, pc, st, &ok)) {
+                return ok;
+            }
+        }
+
+        const struct ebpf_inst* inst = &v->insts[pc];
+        uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+        switch (cls) {
+        case EBPF_CLS_ALU:
+        case EBPF_CLS_ALU64:
+            if (!do_alu(v, st, inst, pc)) {
+                return false;
+            }
+            pc++;
+            break;
+
+        case EBPF_CLS_LD: { /* lddw */
+            uint64_t imm = (uint32_t)inst->imm | ((uint64_t)v->insts[pc + 1].imm << 32);
+            st->regs[inst->dst] = scalar(imm, imm);
+            pc += 2;
+            break;
+        }
+
+        case EBPF_CLS_LDX: {
+            int size = access_size(inst->opcode);
+            if (!check_access(v, st, inst->src, inst->offset, size, pc)) {
+                return false;
+            }
+            st->regs[inst->dst] = scalar(0, size == 8 ? UINT64_MAX : ((uint64_t)1 << (size * 8)) - 1);
+            pc++;
+            break;
+        }
+
+        case EBPF_CLS_ST:
+        case EBPF_CLS_STX: {
+            int size = access_size(inst->opcode);
+            if (cls == EBPF_CLS_STX) {
+                if (!check_init(v, st, inst->src, pc)) {
+                    return false;
+                }
+                lose_track(v, &st->regs[inst->src]);
+            }
+            if (!check_access(v, st, inst->dst, inst->offset, size, pc)) {
+                return false;
+            }
+            if (st->regs[inst->dst].type == PTR_TO_MAP_VALUE && st->regs[inst->dst].readonly) {
+                return fail(v, "store to read-only map value", pc);
+            }
+            if ((inst->opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+                if (inst->imm == EBPF_ATOMIC_OP_CMPXCHG) {
+                    if (!check_init(v, st, 0, pc)) {
+                        return false;
+                    }
+                    st->regs[0] = unknown(size == 8);
+                } else if (inst->imm & EBPF_ATOMIC_OP_FETCH) {
+                    st->regs[inst->src] = unknown(size == 8);
+                }
+            }
+            pc++;
+            break;
+        }
+
+        default: /* EBPF_CLS_JMP, EBPF_CLS_JMP32 */
+            if (inst->opcode == EBPF_OP_EXIT) {
+                return check_init(v, st, 0, pc);
+            } else if (inst->opcode == EBPF_OP_CALL) {
+                do_call(v, st, inst);
+                pc++;
+            } else if (inst->opcode == EBPF_OP_JA) {
+                pc += 1 + inst->offset;
+            } else {
+                struct state taken, fallen;
+                bool can_take, can_fall;
+                if (!check_init(v, st, inst->dst, pc) ||
+                    ((inst->opcode & EBPF_SRC_REG) && !check_init(v, st, inst->src, pc))) {
+                    return false;
+                }
+                branch(st, inst, &taken, &fallen, &can_take, &can_fall);
+                if (can_take && can_fall && !push(v, pc + 1 + inst->offset, &taken)) {
+                    return false;
+                }
+                if (can_fall) {
+                    *st = fallen;
+                    pc++;
+                } else {
+                    *st = taken;
+                    pc += 1 + inst->offset;
+                }
+            }
+            break;
+        }
+    }
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool
+ubpf_verify(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+{
+    struct verifier v = {.vm = vm, .insts = insts, .num_insts = num_insts, .errmsg = errmsg};
+    uint64_t begin = now_ns();
+    bool ok = false;
+
+    v.live = calloc(num_insts + 1, sizeof(*v.live));
+    v.prune_point = calloc(num_insts + 1, sizeof(*v.prune_point));
+    v.first_stored = calloc(num_insts + 1, sizeof(*v.first_stored));
+    v.num_stored_at = calloc(num_insts + 1, sizeof(*v.num_stored_at));
+    if (!v.live || !v.prune_point || !v.first_stored || !v.num_stored_at) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    analyze(&v);
+
+    /* r1 points to the context and r2 holds its length, see ubpf_exec() */
+    struct state entry = {0};
+    entry.regs[1].type = PTR_TO_CTX;
+    entry.regs[2] = unknown(true);
+    entry.regs[10].type = PTR_TO_STACK;
+    if (!push(&v, 0, &entry)) {
+        goto out;
+    }
+    while (v.num_pending) {
+        struct pending p = v.pending[--v.num_pending];
+        if (!explore(&v, p.pc, &p.state)) {
+            goto out;
+        }
+    }
+    ok = true;
+
+out:
+    if (v.stack_escaped) {
+        v.stats.stack_depth = UBPF_STACK_SIZE;
+    }
+    v.stats.time_ns = now_ns() - begin;
+    vm->verifier_stats = v.stats;
+    free(v.live);
+    free(v.prune_point);
+    free(v.first_stored);
+    free(v.num_stored_at);
+    free(v.stored);
+    free(v.pending);
+    return ok;
+}
+
+void
+ubpf_get_verifier_stats(const struct ubpf_vm* vm, struct ubpf_verifier_stats* stats)
+{
+    *stats = vm->verifier_stats;
+}
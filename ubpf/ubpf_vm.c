@@ -20,14 +20,13 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <inttypes.h>
 #include <sys/mman.h>
 #include <endian.h>
 #include "ubpf_int.h"
 #include <unistd.h>
 
-#define MAX_EXT_FUNCS 64
-#define EBPF_REGISTERS_COUNT 11
 #define EBPF_MEM_BYTES 1024*128
 
 static bool
@@ -36,7 +35,7 @@ bounds_check(
     void* addr,
     int size,
     const char* type,
-    uint16_t cur_pc,
+    uint32_t cur_pc,
     void* mem,
     size_t mem_len,
     void* stack);
@@ -49,6 +48,38 @@ ubpf_toggle_bounds_check(struct ubpf_vm* vm, bool enable)
     return old;
 }
 
+bool
+ubpf_toggle_loop_check(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->loop_check_enabled;
+    vm->loop_check_enabled = enable;
+    return old;
+}
+
+bool
+ubpf_toggle_verifier(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->verifier_enabled;
+    vm->verifier_enabled = enable;
+    return old;
+}
+
+bool
+ubpf_toggle_branch_profile(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->branch_profile_enabled;
+    vm->branch_profile_enabled = enable;
+    ubpf_unpublish(vm);
+    if (!enable) {
+        free(vm->branch_counts);
+        vm->branch_counts = NULL;
+    } else if (vm->insts && vm->branch_counts == NULL) {
+        /* Best effort: without memory there is just no profile */
+        vm->branch_counts = calloc(vm->num_insts, sizeof(*vm->branch_counts));
+    }
+    return old;
+}
+
 void
 ubpf_set_error_print(struct ubpf_vm* vm, int (*error_printf)(FILE* stream, const char* format, ...))
 {
@@ -78,7 +109,15 @@ ubpf_create(void)
         return NULL;
     }
 
+    vm->ext_func_info = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_func_info));
+    if (vm->ext_func_info == NULL) {
+        ubpf_destroy(vm);
+        return NULL;
+    }
+
     vm->bounds_check_enabled = true;
+    vm->loop_check_enabled = true;
+    vm->verifier_enabled = true;
     vm->error_printf = fprintf;
 
 #if defined(__x86_64__) || defined(_M_X64)
@@ -100,6 +139,8 @@ ubpf_create(void)
         ubpf_destroy(vm);
         return NULL;
     }
+    vm->stack_size = UBPF_STACK_SIZE;
+    vm->stack_usage = UBPF_STACK_SIZE;
     vm->mem = calloc(EBPF_MEM_BYTES, 1);
     if (vm->mem == NULL) {
         ubpf_destroy(vm);
@@ -107,22 +148,91 @@ ubpf_create(void)
     }
     vm->mem_len = EBPF_MEM_BYTES;
 
+    atomic_init(&vm->image, NULL);
+    vm->tier = ubpf_tier_create(vm);
+    if (vm->tier == NULL) {
+        ubpf_destroy(vm);
+        return NULL;
+    }
+
     // Initialize registers
     vm->regs[1] = (uintptr_t)(vm->mem);
     vm->regs[2] = (uint64_t)(EBPF_MEM_BYTES);
-    vm->regs[10] = (uintptr_t)(vm->stack + UBPF_STACK_SIZE);
+    vm->regs[10] = (uintptr_t)(vm->stack + vm->stack_size);
     vm->pc = 0;
     vm->return_value = 0;
 
     return vm;
 }
 
+bool
+ubpf_shadow_init(struct ubpf_vm* shadow, const struct ubpf_vm* vm)
+{
+    /* Held until cleanup, so a swapped out program outlives the shadow */
+    unsigned int epoch = ubpf_epoch_enter();
+    struct ubpf_image* image = atomic_load_explicit(&((struct ubpf_vm*)vm)->image, memory_order_acquire);
+
+    *shadow = *vm;
+    if (image) {
+        shadow->insts = image->insts;
+        shadow->num_insts = image->num_insts;
+        shadow->stack_usage = image->stack_usage;
+        shadow->stack_size = image->stack_usage;
+        shadow->jitted = image->jitted;
+        shadow->jitted_size = image->jitted_size;
+        shadow->branch_counts = image->branch_counts;
+    }
+    atomic_store_explicit(&shadow->image, NULL, memory_order_relaxed);
+    shadow->epoch = epoch;
+    shadow->tail_epoch = 0;
+    shadow->tier = NULL;
+    shadow->spec = NULL;
+    shadow->tail = NULL;
+    shadow->tail_calls = 0;
+    shadow->pc = 0;
+    shadow->suspended = false;
+    shadow->regs = calloc(EBPF_REGISTERS_COUNT, sizeof(uint64_t));
+    shadow->stack = calloc((shadow->stack_size + 7) / 8, sizeof(uint64_t));
+    if (shadow->regs == NULL || shadow->stack == NULL) {
+        ubpf_shadow_cleanup(shadow);
+        return false;
+    }
+    shadow->regs[1] = (uintptr_t)(shadow->mem);
+    shadow->regs[2] = (uint64_t)(shadow->mem_len);
+    shadow->regs[10] = (uintptr_t)(shadow->stack + shadow->stack_size);
+    return true;
+}
+
+void
+ubpf_shadow_cleanup(struct ubpf_vm* shadow)
+{
+    free(shadow->regs);
+    free(shadow->stack);
+    free(shadow->tail);
+    shadow->regs = NULL;
+    shadow->stack = NULL;
+    shadow->tail = NULL;
+    if (shadow->tail_epoch) {
+        ubpf_epoch_exit(shadow->tail_epoch);
+        shadow->tail_epoch = 0;
+    }
+    if (shadow->epoch) {
+        ubpf_epoch_exit(shadow->epoch);
+        shadow->epoch = 0;
+    }
+}
+
 void
 ubpf_destroy(struct ubpf_vm* vm)
 {
     ubpf_unload_code(vm);
+    ubpf_tier_destroy(vm->tier);
+    free(vm->jit_name);
     free(vm->ext_funcs);
     free(vm->ext_func_names);
+    free(vm->ext_func_info);
+    free(vm->maps);
+    free(vm->tail);
     free(vm->regs);
     free(vm->stack);
     free(vm->mem);
@@ -138,10 +248,24 @@ ubpf_register(struct ubpf_vm* vm, unsigned int idx, const char* name, void* fn)
 
     vm->ext_funcs[idx] = (ext_func)fn;
     vm->ext_func_names[idx] = name;
+    vm->ext_func_info[idx].num_args = 5;
+    vm->ext_func_info[idx].flags = 0;
 
     return 0;
 }
 
+int
+ubpf_describe_helper(struct ubpf_vm* vm, unsigned int idx, unsigned int num_args, unsigned int flags)
+{
+    if (idx >= MAX_EXT_FUNCS || vm->ext_funcs[idx] == NULL || num_args > 5 || (flags & ~UBPF_HELPER_PURE)) {
+        return -1;
+    }
+
+    vm->ext_func_info[idx].num_args = num_args;
+    vm->ext_func_info[idx].flags = flags;
+    return 0;
+}
+
 int
 ubpf_set_unwind_function_index(struct ubpf_vm* vm, unsigned int idx)
 {
@@ -169,7 +293,6 @@ ubpf_lookup_registered_function(struct ubpf_vm* vm, const char* name)
 int
 ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
 {
-    const struct ebpf_inst* source_inst = code;
     *errmsg = NULL;
 
     if (vm->insts) {
@@ -183,39 +306,184 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
         return -1;
     }
 
-    if (!validate(vm, code, code_len / 8, errmsg)) {
+    return ubpf_replace_code(vm, code, code_len / 8, errmsg);
+}
+
+int
+ubpf_replace_code(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+{
+    ubpf_unpublish(vm);
+    if (!validate(vm, insts, num_insts, errmsg)) {
         return -1;
     }
 
-    vm->insts = malloc(code_len);
-    if (vm->insts == NULL) {
+    struct ebpf_inst* copy = malloc(num_insts * sizeof(*copy));
+    if (copy == NULL) {
         *errmsg = ubpf_error("out of memory");
         return -1;
     }
 
-    vm->num_insts = code_len / sizeof(vm->insts[0]);
+    /* Only keep as much stack as the program can use */
+    if (vm->stack_usage != vm->stack_size) {
+        void* stack = calloc(vm->stack_usage / 8, sizeof(uint64_t));
+        if (stack == NULL) {
+            free(copy);
+            *errmsg = ubpf_error("out of memory");
+            return -1;
+        }
+        free(vm->stack);
+        vm->stack = stack;
+        vm->stack_size = vm->stack_usage;
+        vm->regs[10] = (uintptr_t)(vm->stack + vm->stack_size);
+    }
+
+    free(vm->insts);
+    vm->insts = copy;
+    vm->num_insts = num_insts;
+
+    /* Counts of the old program don't describe this one */
+    free(vm->branch_counts);
+    vm->branch_counts = vm->branch_profile_enabled ? calloc(num_insts, sizeof(*vm->branch_counts)) : NULL;
 
     // Store instructions in the vm.
     for (uint32_t i = 0; i < vm->num_insts; i++) {
-        ubpf_store_instruction(vm, i, source_inst[i]);
+        ubpf_store_instruction(vm, i, insts[i]);
     }
 
     return 0;
 }
 
+int
+ubpf_swap_code(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
+{
+    *errmsg = NULL;
+
+    if (vm->pc != 0 || vm->suspended || vm->tail_calls) {
+        *errmsg = ubpf_error("the VM is in the middle of a run");
+        return -1;
+    }
+    if (code_len % 8 != 0) {
+        *errmsg = ubpf_error("code_len must be a multiple of 8");
+        return -1;
+    }
+
+    /* Load (and compile) the new program into a copy, leaving vm running the old one */
+    uint64_t regs[EBPF_REGISTERS_COUNT];
+    struct ubpf_vm side = *vm;
+    atomic_store_explicit(&side.image, NULL, memory_order_relaxed);
+    side.insts = NULL;
+    side.num_insts = 0;
+    side.jitted = NULL;
+    side.jitted_size = 0;
+    side.branch_counts = NULL;
+    side.regs = regs;
+    side.stack = NULL;
+    side.stack_size = 0;
+    side.tier = NULL;
+    side.spec = NULL;
+    side.aot_handle = NULL;
+    side.tail = NULL;
+    if (ubpf_replace_code(&side, code, code_len / 8, errmsg) < 0) {
+        free(side.stack);
+        return -1;
+    }
+    free(side.stack);
+
+    struct ubpf_image* image = malloc(sizeof(*image));
+    void* stack = NULL;
+    if (vm->stack_size < side.stack_usage) {
+        stack = calloc(side.stack_usage / 8, sizeof(uint64_t));
+    }
+    if (vm->jitted && image) {
+        side.jitted = ubpf_jit_build(&side, &side.jitted_size, errmsg);
+    }
+    if (image == NULL || (vm->stack_size < side.stack_usage && stack == NULL) || (vm->jitted && !side.jitted)) {
+        if (*errmsg == NULL) {
+            *errmsg = ubpf_error("out of memory");
+        }
+        free(image);
+        free(stack);
+        free(side.insts);
+        free(side.branch_counts);
+        return -1;
+    }
+    image->insts = side.insts;
+    image->num_insts = side.num_insts;
+    image->stack_usage = side.stack_usage;
+    image->jitted = side.jitted;
+    image->jitted_size = side.jitted_size;
+    image->branch_counts = side.branch_counts;
+
+    /* From here on new shadows and tail calls get the new program; wait out the old one */
+    struct ubpf_image* old = atomic_exchange(&vm->image, image);
+    ubpf_epoch_synchronize();
+
+    ubpf_tier_reset(vm->tier);
+    ubpf_aot_unload(vm);
+    ubpf_spec_free(vm);
+    if (vm->jitted) {
+        munmap(vm->jitted, vm->jitted_size);
+    }
+    free(vm->insts);
+    free(vm->branch_counts);
+    free(old);
+
+    vm->insts = image->insts;
+    vm->num_insts = image->num_insts;
+    vm->stack_usage = image->stack_usage;
+    vm->jitted = image->jitted;
+    vm->jitted_size = image->jitted_size;
+    vm->branch_counts = image->branch_counts;
+    vm->verifier_stats = side.verifier_stats;
+    /* The stack only grows: the browser keeps a view of it */
+    if (stack) {
+        free(vm->stack);
+        vm->stack = stack;
+        vm->stack_size = image->stack_usage;
+        vm->regs[10] = (uintptr_t)(vm->stack + vm->stack_size);
+    }
+    return 0;
+}
+
+void
+ubpf_unpublish(struct ubpf_vm* vm)
+{
+    struct ubpf_image* image = atomic_load_explicit(&vm->image, memory_order_relaxed);
+    if (image == NULL) {
+        return;
+    }
+    /* The VM's own fields already point at the contents, which it now owns */
+    atomic_store(&vm->image, NULL);
+    ubpf_epoch_synchronize();
+    free(image);
+}
+
 void
 ubpf_unload_code(struct ubpf_vm* vm)
 {
+    ubpf_unpublish(vm);
     if (vm->jitted) {
         munmap(vm->jitted, vm->jitted_size);
         vm->jitted = NULL;
         vm->jitted_size = 0;
     }
+    ubpf_tier_reset(vm->tier);
+    ubpf_aot_unload(vm);
+    ubpf_spec_free(vm);
+    vm->pc = 0;
+    vm->suspended = false;
+    vm->tail_calls = 0;
+    if (vm->tail_epoch) {
+        ubpf_epoch_exit(vm->tail_epoch);
+        vm->tail_epoch = 0;
+    }
     if (vm->insts) {
         free(vm->insts);
         vm->insts = NULL;
         vm->num_insts = 0;
     }
+    free(vm->branch_counts);
+    vm->branch_counts = NULL;
 }
 
 static uint32_t
@@ -288,11 +556,157 @@ ubpf_mem_store(struct ubpf_vm *vm, uint64_t address, uint64_t value, size_t size
     }
 }
 
-int
-ubpf_exec_step(struct ubpf_vm* vm)
+/*
+ * The operation is in imm; r0 is the implicit comparand of cmpxchg.  Like
+ * the kernel, atomics must be naturally aligned, and a 32-bit fetch
+ * zero-extends the old value into the register.
+ */
+#define ATOMIC_OP(type)                                                        \
+do {                                                                           \
+    _Atomic type* ptr = (_Atomic type*)(uintptr_t)address;                     \
+    type val = reg[inst.src];                                                  \
+    type old;                                                                  \
+    switch (inst.imm) {                                                        \
+    case EBPF_ALU_OP_ADD:                                                      \
+    case EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH:                               \
+        old = atomic_fetch_add(ptr, val);                                      \
+        break;                                                                 \
+    case EBPF_ALU_OP_OR:                                                       \
+    case EBPF_ALU_OP_OR | EBPF_ATOMIC_OP_FETCH:                                \
+        old = atomic_fetch_or(ptr, val);                                       \
+        break;                                                                 \
+    case EBPF_ALU_OP_AND:                                                      \
+    case EBPF_ALU_OP_AND | EBPF_ATOMIC_OP_FETCH:                               \
+        old = atomic_fetch_and(ptr, val);                                      \
+        break;                                                                 \
+    case EBPF_ALU_OP_XOR:                                                      \
+    case EBPF_ALU_OP_XOR | EBPF_ATOMIC_OP_FETCH:                               \
+        old = atomic_fetch_xor(ptr, val);                                      \
+        break;                                                                 \
+    case EBPF_ATOMIC_OP_XCHG:                                                  \
+        old = atomic_exchange(ptr, val);                                       \
+        break;                                                                 \
+    case EBPF_ATOMIC_OP_CMPXCHG:                                               \
+        old = reg[0];                                                          \
+        atomic_compare_exchange_strong(ptr, &old, val);                        \
+        reg[0] = old;                                                          \
+        return true;                                                           \
+    default:                                                                   \
+        return false;                                                          \
+    }                                                                          \
+    if (inst.imm & EBPF_ATOMIC_OP_FETCH) {                                     \
+        reg[inst.src] = old;                                                   \
+    }                                                                          \
+} while (0)
+
+static bool
+ubpf_mem_atomic(struct ubpf_vm* vm, struct ebpf_inst inst, uint64_t* reg, size_t size, uint32_t cur_pc)
+{
+    uint64_t address = reg[inst.dst] + inst.offset;
+
+    if (!IS_ALIGNED(address, size)) {
+        vm->error_printf(stderr, "uBPF error: misaligned atomic at PC %u, addr %p\n", cur_pc, (void*)address);
+        return false;
+    }
+
+    vm->hot_address = address;
+    vm->hot_address_size = size;
+
+    if (size == 4) {
+        ATOMIC_OP(uint32_t);
+    } else {
+        ATOMIC_OP(uint64_t);
+    }
+    return true;
+}
+
+/*
+ * Shadows running on other threads share the counts; a lost update now and
+ * then is fine for a profile, so skip the locked add.
+ */
+static inline void
+count_branch(struct ubpf_vm* vm, struct ebpf_inst inst, uint32_t cur_pc)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    if ((cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) || inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_CALL) {
+        return;
+    }
+    _Atomic uint64_t* count =
+        vm->pc == cur_pc + 1 ? &vm->branch_counts[cur_pc].not_taken : &vm->branch_counts[cur_pc].taken;
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/*
+ * Tail call into slot index of program array id, for the program running on
+ * vm (which is home itself or home->tail).  home->tail becomes a copy of the
+ * target VM, to borrow its program, helpers and maps, but with home's
+ * registers, stack and context, and runs from its first instruction on the
+ * next step.  Every program that tail calls keeps a full stack (see
+ * validate()), so whatever it calls fits.  The chain holds a read section
+ * from its first tail call to its end, so a target whose program is swapped
+ * meanwhile keeps running the one it started with.
+ */
+static bool
+tail_call(struct ubpf_vm* home, const struct ubpf_vm* vm, uint64_t id, uint64_t index)
+{
+    if (home->tail_calls >= UBPF_MAX_TAIL_CALLS) {
+        return false;
+    }
+    if (home->tail_epoch == 0) {
+        home->tail_epoch = ubpf_epoch_enter();
+    }
+    struct ubpf_vm* target = ubpf_maps_prog(vm, id, index);
+    struct ubpf_image* image = target ? atomic_load_explicit(&target->image, memory_order_acquire) : NULL;
+    if (target == NULL || (image == NULL && target->insts == NULL) ||
+        (image ? image->stack_usage : target->stack_usage) > home->stack_size) {
+        return false;
+    }
+    if (home->tail == NULL && (home->tail = malloc(sizeof(*home->tail))) == NULL) {
+        return false;
+    }
+
+    /* vm may be the copy we are about to overwrite */
+    void* mem = vm->mem;
+    int mem_len = vm->mem_len;
+    void* packet = vm->packet;
+    size_t packet_len = vm->packet_len;
+
+    struct ubpf_vm* tail = home->tail;
+    *tail = *target;
+    tail->regs = home->regs;
+    tail->stack = home->stack;
+    tail->stack_size = home->stack_size;
+    tail->mem = mem;
+    tail->mem_len = mem_len;
+    tail->packet = packet;
+    tail->packet_len = packet_len;
+    tail->pc = 0;
+    tail->suspended = false;
+    tail->return_value = 0;
+    tail->tier = NULL;
+    tail->spec = NULL;
+    if (image) {
+        tail->insts = image->insts;
+        tail->num_insts = image->num_insts;
+        tail->stack_usage = image->stack_usage;
+        tail->jitted = image->jitted;
+        tail->jitted_size = image->jitted_size;
+        tail->branch_counts = image->branch_counts;
+    }
+    atomic_store_explicit(&tail->image, NULL, memory_order_relaxed);
+    tail->epoch = 0;
+    tail->tail_epoch = 0;
+    tail->tail = NULL;
+    tail->tail_calls = 0;
+    home->tail_calls++;
+    return true;
+}
+
+static int
+exec_step(struct ubpf_vm* vm, struct ubpf_vm* home)
 {
     uint64_t *reg = vm->regs;
-    const uint16_t cur_pc = vm->pc;
+    const uint32_t cur_pc = vm->pc;
     struct ebpf_inst inst = ubpf_fetch_instruction(vm, vm->pc++);
 
     switch (inst.opcode) {
@@ -325,7 +739,7 @@ ubpf_exec_step(struct ubpf_vm* vm)
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_DIV_REG:
-        reg[inst.dst] = reg[inst.src] ? u32(reg[inst.dst]) / u32(reg[inst.src]) : 0;
+        reg[inst.dst] = u32(reg[inst.src]) ? u32(reg[inst.dst]) / u32(reg[inst.src]) : 0;
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_OR_IMM:
@@ -345,19 +759,19 @@ ubpf_exec_step(struct ubpf_vm* vm)
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_LSH_IMM:
-        reg[inst.dst] <<= inst.imm;
+        reg[inst.dst] <<= inst.imm & 31;
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_LSH_REG:
-        reg[inst.dst] <<= reg[inst.src];
+        reg[inst.dst] <<= reg[inst.src] & 31;
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_RSH_IMM:
-        reg[inst.dst] = u32(reg[inst.dst]) >> inst.imm;
+        reg[inst.dst] = u32(reg[inst.dst]) >> (inst.imm & 31);
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_RSH_REG:
-        reg[inst.dst] = u32(reg[inst.dst]) >> reg[inst.src];
+        reg[inst.dst] = u32(reg[inst.dst]) >> (reg[inst.src] & 31);
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_NEG:
@@ -388,11 +802,11 @@ ubpf_exec_step(struct ubpf_vm* vm)
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_ARSH_IMM:
-        reg[inst.dst] = (int32_t)reg[inst.dst] >> inst.imm;
+        reg[inst.dst] = (int32_t)reg[inst.dst] >> (inst.imm & 31);
         reg[inst.dst] &= UINT32_MAX;
         break;
     case EBPF_OP_ARSH_REG:
-        reg[inst.dst] = (int32_t)reg[inst.dst] >> u32(reg[inst.src]);
+        reg[inst.dst] = (int32_t)reg[inst.dst] >> (reg[inst.src] & 31);
         reg[inst.dst] &= UINT32_MAX;
         break;
 
@@ -452,16 +866,16 @@ ubpf_exec_step(struct ubpf_vm* vm)
         reg[inst.dst] &= reg[inst.src];
         break;
     case EBPF_OP_LSH64_IMM:
-        reg[inst.dst] <<= inst.imm;
+        reg[inst.dst] <<= inst.imm & 63;
         break;
     case EBPF_OP_LSH64_REG:
-        reg[inst.dst] <<= reg[inst.src];
+        reg[inst.dst] <<= reg[inst.src] & 63;
         break;
     case EBPF_OP_RSH64_IMM:
-        reg[inst.dst] >>= inst.imm;
+        reg[inst.dst] >>= inst.imm & 63;
         break;
     case EBPF_OP_RSH64_REG:
-        reg[inst.dst] >>= reg[inst.src];
+        reg[inst.dst] >>= reg[inst.src] & 63;
         break;
     case EBPF_OP_NEG64:
         reg[inst.dst] = -reg[inst.dst];
@@ -485,10 +899,10 @@ ubpf_exec_step(struct ubpf_vm* vm)
         reg[inst.dst] = reg[inst.src];
         break;
     case EBPF_OP_ARSH64_IMM:
-        reg[inst.dst] = (int64_t)reg[inst.dst] >> inst.imm;
+        reg[inst.dst] = (int64_t)reg[inst.dst] >> (inst.imm & 63);
         break;
     case EBPF_OP_ARSH64_REG:
-        reg[inst.dst] = (int64_t)reg[inst.dst] >> reg[inst.src];
+        reg[inst.dst] = (int64_t)reg[inst.dst] >> (reg[inst.src] & 63);
         break;
 
         /*
@@ -560,6 +974,19 @@ do {
         ubpf_mem_store(vm, reg[inst.dst] + inst.offset, reg[inst.src], 8);
         break;
 
+    case EBPF_OP_ATOMIC32_STORE:
+        BOUNDS_CHECK_STORE(4);
+        if (!ubpf_mem_atomic(vm, inst, reg, 4, cur_pc)) {
+            return -1;
+        }
+        break;
+    case EBPF_OP_ATOMIC_STORE:
+        BOUNDS_CHECK_STORE(8);
+        if (!ubpf_mem_atomic(vm, inst, reg, 8, cur_pc)) {
+            return -1;
+        }
+        break;
+
     case EBPF_OP_LDDW:
         reg[inst.dst] = u32(inst.imm) | ((uint64_t)ubpf_fetch_instruction(vm, vm->pc++).imm << 32);
         break;
@@ -583,12 +1010,12 @@ do {
         }
         break;
     case EBPF_OP_JEQ32_REG:
-        if (u32(reg[inst.dst]) == reg[inst.src]) {
+        if (u32(reg[inst.dst]) == u32(reg[inst.src])) {
             vm->pc += inst.offset;
         }
         break;
     case EBPF_OP_JGT_IMM:
-        if (reg[inst.dst] > u32(inst.imm)) {
+        if (reg[inst.dst] > (uint64_t)(int64_t)inst.imm) {
             vm->pc += inst.offset;
         }
         break;
@@ -608,7 +1035,7 @@ do {
         }
         break;
     case EBPF_OP_JGE_IMM:
-        if (reg[inst.dst] >= u32(inst.imm)) {
+        if (reg[inst.dst] >= (uint64_t)(int64_t)inst.imm) {
             vm->pc += inst.offset;
         }
         break;
@@ -628,7 +1055,7 @@ do {
         }
         break;
     case EBPF_OP_JLT_IMM:
-        if (reg[inst.dst] < u32(inst.imm)) {
+        if (reg[inst.dst] < (uint64_t)(int64_t)inst.imm) {
             vm->pc += inst.offset;
         }
         break;
@@ -648,7 +1075,7 @@ do {
         }
         break;
     case EBPF_OP_JLE_IMM:
-        if (reg[inst.dst] <= u32(inst.imm)) {
+        if (reg[inst.dst] <= (uint64_t)(int64_t)inst.imm) {
             vm->pc += inst.offset;
         }
         break;
@@ -791,7 +1218,14 @@ do {
         vm->return_value = reg[0];
         return 0;
     case EBPF_OP_CALL:
+        if (ubpf_maps_is_tail_call(vm, inst.imm)) {
+            /* On success, the next step is the target's first instruction */
+            reg[0] = tail_call(home, vm, reg[2], reg[3]) ? 0 : (uint64_t)-1;
+            return 1;
+        }
+        vm->checked_call = true;
         reg[0] = vm->ext_funcs[inst.imm](vm, inst.imm, reg[1], reg[2], reg[3], reg[4], reg[5]);
+        vm->checked_call = false;
         // Unwind the stack if unwind extension returns success.
         if (inst.imm == vm->unwind_stack_extension_index && reg[0] == 0) {
             vm->return_value = reg[0];
@@ -800,14 +1234,39 @@ do {
         break;
     }
 
+    if (vm->branch_counts) {
+        count_branch(vm, inst, cur_pc);
+    }
     return 1;
 }
 
 int
-ubpf_exec(struct ubpf_vm* vm)
+ubpf_exec_step(struct ubpf_vm* vm)
+{
+    int rc;
+    if (vm->tail_calls == 0) {
+        rc = exec_step(vm, vm);
+    } else {
+        rc = exec_step(vm->tail, vm);
+        if (rc <= 0) {
+            /* The end of the chain is the end of the run */
+            vm->return_value = vm->tail->return_value;
+            vm->tail_calls = 0;
+        }
+    }
+    /* Also after a first tail call that failed */
+    if (vm->tail_calls == 0 && vm->tail_epoch) {
+        ubpf_epoch_exit(vm->tail_epoch);
+        vm->tail_epoch = 0;
+    }
+    return rc;
+}
+
+int
+ubpf_exec_budget(struct ubpf_vm* vm, uint64_t budget)
 {
-    if (vm->pc != 0) {
-        /* Not at the beginning of program */
+    if (vm->pc != 0 && !vm->suspended) {
+        /* Not at the beginning of program, nor paused by a budget */
         return -1;
     }
     if (!vm->insts) {
@@ -815,17 +1274,60 @@ ubpf_exec(struct ubpf_vm* vm)
         return -1;
     }
 
-    while(1) {
+    if (!vm->suspended) {
+        ubpf_spec_refresh(vm);
+    }
+    vm->suspended = false;
+    for (uint64_t steps = 0; budget == 0 || steps < budget; steps++) {
         int rc = ubpf_exec_step(vm);
         if (rc <= 0) {
-            // VM terminated (maybe with error)
+            // VM terminated (maybe with error); the next call starts over
+            vm->pc = 0;
             return rc;
         }
     }
+    vm->suspended = true;
+    return 1;
+}
+
+int
+ubpf_exec(struct ubpf_vm* vm)
+{
+    return ubpf_exec_budget(vm, 0);
+}
+
+/*
+ * Deepest stack access made directly through r10, or UBPF_STACK_SIZE if r10
+ * is copied anywhere, since accesses through the copies can't be seen here.
+ */
+static uint32_t
+stack_depth(const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    uint32_t depth = 0;
+
+    for (uint32_t i = 0; i < num_insts; i++) {
+        struct ebpf_inst inst = insts[i];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        bool access = (cls == EBPF_CLS_LDX && inst.src == 10) ||
+                      ((cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) && inst.dst == 10);
+
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+            continue;
+        }
+        if (inst.src == 10 && cls != EBPF_CLS_LDX && cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) {
+            return UBPF_STACK_SIZE; /* copied to another register, or stored */
+        }
+        if (access && inst.offset < 0 && -inst.offset > depth) {
+            depth = -inst.offset;
+        }
+    }
+    /* Anything deeper is out of bounds, and fails when run */
+    return depth < UBPF_STACK_SIZE ? depth : UBPF_STACK_SIZE;
 }
 
 bool
-validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+validate(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
 {
     if (num_insts >= UBPF_MAX_INSTS) {
         *errmsg = ubpf_error("too many instructions (max %u)", UBPF_MAX_INSTS);
@@ -913,6 +1415,23 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
             store = true;
             break;
 
+        case EBPF_OP_ATOMIC32_STORE:
+        case EBPF_OP_ATOMIC_STORE:
+            switch (inst.imm & ~EBPF_ATOMIC_OP_FETCH) {
+            case EBPF_ALU_OP_ADD:
+            case EBPF_ALU_OP_OR:
+            case EBPF_ALU_OP_AND:
+            case EBPF_ALU_OP_XOR:
+                break;
+            default:
+                if (inst.imm != EBPF_ATOMIC_OP_XCHG && inst.imm != EBPF_ATOMIC_OP_CMPXCHG) {
+                    *errmsg = ubpf_error("invalid atomic operation 0x%x at PC %d", inst.imm, i);
+                    return false;
+                }
+            }
+            store = true;
+            break;
+
         case EBPF_OP_LDDW:
             if (inst.src != 0) {
                 *errmsg = ubpf_error("invalid source register for LDDW at PC %d", i);
@@ -1020,28 +1539,66 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
         }
     }
 
+    if (vm->loop_check_enabled && !ubpf_check_loops(insts, num_insts, errmsg)) {
+        return false;
+    }
+
+    if (vm->verifier_enabled && !ubpf_verify(vm, insts, num_insts, errmsg)) {
+        return false;
+    }
+    /*
+     * The verifier's depth only covers the paths it followed, so it could
+     * leave a store it pruned as unreachable without stack; size the stack
+     * from every access instead.
+     */
+    uint32_t depth = stack_depth(insts, num_insts);
+    /* Programs this one tail calls run on its stack */
+    for (i = 0; i < num_insts; i++) {
+        if (insts[i].opcode == EBPF_OP_CALL && ubpf_maps_is_tail_call(vm, insts[i].imm)) {
+            depth = UBPF_STACK_SIZE;
+        }
+    }
+    /* Keep frames 16-byte aligned for the JIT, and never empty */
+    vm->stack_usage = depth ? (depth + 15) & ~15 : 16;
+
     return true;
 }
 
+/* Bytes from addr to the end of the region [start, start + len), or 0 if addr is outside it */
+static size_t
+region_avail(const void* addr, const void* start, size_t len)
+{
+    if (!start || (const char*)addr < (const char*)start || (const char*)addr >= (const char*)start + len) {
+        return 0;
+    }
+    return (const char*)start + len - (const char*)addr;
+}
+
 static bool
 bounds_check(
     const struct ubpf_vm* vm,
     void* addr,
     int size,
     const char* type,
-    uint16_t cur_pc,
+    uint32_t cur_pc,
     void* mem,
     size_t mem_len,
     void* stack)
 {
     if (!vm->bounds_check_enabled)
         return true;
-    if (mem && (addr >= mem && ((char*)addr + size) <= ((char*)mem + mem_len))) {
+    if (region_avail(addr, mem, mem_len) >= (size_t)size) {
         /* Context access */
         return true;
-    } else if (addr >= stack && ((char*)addr + size) <= ((char*)stack + UBPF_STACK_SIZE)) {
+    } else if (region_avail(addr, stack, vm->stack_size) >= (size_t)size) {
         /* Stack access */
         return true;
+    } else if (region_avail(addr, vm->packet, vm->packet_len) >= (size_t)size) {
+        /* Packet access, see ubpf_exec_xdp() */
+        return true;
+    } else if (vm->maps && ubpf_maps_contain(vm, addr, size)) {
+        /* Map value access */
+        return true;
     } else {
         vm->error_printf(
             stderr,
@@ -1053,11 +1610,27 @@ bounds_check(
             mem,
             mem_len,
             stack,
-            UBPF_STACK_SIZE);
+            vm->stack_size);
         return false;
     }
 }
 
+size_t
+ubpf_accessible(const struct ubpf_vm* vm, const void* addr)
+{
+    if (!vm->bounds_check_enabled || !vm->checked_call) {
+        /* Unchecked, or not called by the interpreter (compiled code isn't checked either) */
+        return SIZE_MAX;
+    }
+    size_t avail;
+    if ((avail = region_avail(addr, vm->mem, vm->mem_len)) ||
+        (avail = region_avail(addr, vm->stack, vm->stack_size)) ||
+        (avail = region_avail(addr, vm->packet, vm->packet_len))) {
+        return avail;
+    }
+    return vm->maps ? ubpf_maps_avail(vm, addr) : 0;
+}
+
 char*
 ubpf_error(const char* fmt, ...)
 {
@@ -1081,7 +1654,7 @@ typedef struct _ebpf_encoded_inst
 } ebpf_encoded_inst;
 
 struct ebpf_inst
-ubpf_fetch_instruction(const struct ubpf_vm* vm, uint16_t pc)
+ubpf_fetch_instruction(const struct ubpf_vm* vm, uint32_t pc)
 {
     // XOR instruction with base address of vm.
     // This makes ROP attack more difficult.
@@ -1093,7 +1666,7 @@ ubpf_fetch_instruction(const struct ubpf_vm* vm, uint16_t pc)
 }
 
 void
-ubpf_store_instruction(const struct ubpf_vm* vm, uint16_t pc, struct ebpf_inst inst)
+ubpf_store_instruction(const struct ubpf_vm* vm, uint32_t pc, struct ebpf_inst inst)
 {
     // XOR instruction with base address of vm.
     // This makes ROP attack more difficult.
@@ -1113,3 +1686,16 @@ ubpf_set_pointer_secret(struct ubpf_vm* vm, uint64_t secret)
     vm->pointer_secret = secret;
     return 0;
 }
+
+int
+ubpf_set_jit_profiling(struct ubpf_vm* vm, unsigned int flags, const char* name)
+{
+    char* copy = strdup(name ? name : "anon");
+    if (copy == NULL) {
+        return -1;
+    }
+    free(vm->jit_name);
+    vm->jit_name = copy;
+    vm->jit_profiling = flags;
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2023 Andrew Jenkins <andrewjjenkins@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * XDP-style packet mode: run a program over packets with an xdp_md context,
+ * and stream pcap/pcapng captures through it.
+ *
+ * Captures are mapped copy-on-write and each frame is handed to the program
+ * where it lies in the mapping, so a program that only reads its packets
+ * never copies them, and one that rewrites them doesn't touch the file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ubpf_int.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_PB 0x00000002
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+
+int
+ubpf_exec_xdp(struct ubpf_vm* vm, struct ubpf_xdp_md* ctx, uint64_t* action)
+{
+    if (!vm->insts || vm->pc != 0) {
+        /* No code, or a run paused by ubpf_exec_budget() */
+        return -1;
+    }
+    ubpf_spec_refresh(vm);
+    if (vm->jitted) {
+        /* Tail calls may land in programs that are being swapped */
+        unsigned int epoch = ubpf_epoch_enter();
+        *action = vm->jitted(ctx, sizeof(*ctx));
+        ubpf_epoch_exit(epoch);
+        return 0;
+    }
+
+    /* The context is the run's memory, and the packet is allowed alongside it */
+    void* mem = vm->mem;
+    int mem_len = vm->mem_len;
+    vm->mem = ctx;
+    vm->mem_len = sizeof(*ctx);
+    /* Including any head- and tailroom that xdp_adjust_head()/tail() may grow into */
+    uint64_t start = ctx->data_hard_start ? ctx->data_hard_start : ctx->data_meta;
+    uint64_t end = ctx->data_hard_end ? ctx->data_hard_end : ctx->data_end;
+    vm->packet = (void*)(uintptr_t)start;
+    vm->packet_len = end - start;
+    vm->regs[1] = (uintptr_t)ctx;
+    vm->regs[2] = sizeof(*ctx);
+    vm->regs[10] = (uintptr_t)((char*)vm->stack + vm->stack_size);
+
+    int rc = ubpf_exec(vm);
+
+    vm->mem = mem;
+    vm->mem_len = mem_len;
+    vm->packet = NULL;
+    vm->packet_len = 0;
+    if (rc == 0) {
+        *action = vm->return_value;
+    }
+    return rc;
+}
+
+struct capture
+{
+    const unsigned char* data;
+    size_t size;
+    bool swapped;
+};
+
+static uint32_t
+read32(const struct capture* cap, size_t offset)
+{
+    uint32_t v;
+    memcpy(&v, cap->data + offset, sizeof(v));
+    return cap->swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t
+read16(const struct capture* cap, size_t offset)
+{
+    uint16_t v;
+    memcpy(&v, cap->data + offset, sizeof(v));
+    return cap->swapped ? __builtin_bswap16(v) : v;
+}
+
+static void
+run_frame(struct ubpf_vm* vm, unsigned char* frame, uint32_t len, uint32_t ifindex, struct ubpf_xdp_stats* stats)
+{
+    struct ubpf_xdp_md ctx = {
+        .data = (uintptr_t)frame,
+        .data_end = (uintptr_t)frame + len,
+        .data_meta = (uintptr_t)frame,
+        .ingress_ifindex = ifindex,
+    };
+    uint64_t action;
+
+    stats->packets++;
+    stats->bytes += len;
+    if (ubpf_exec_xdp(vm, &ctx, &action) < 0) {
+        stats->errors++;
+        action = UBPF_XDP_ABORTED;
+    }
+    /* Like Linux, anything that isn't a verdict counts as aborted */
+    stats->actions[action < UBPF_XDP_ACTIONS ? action : UBPF_XDP_ABORTED]++;
+}
+
+static int
+run_pcap(struct ubpf_vm* vm, struct capture* cap, struct ubpf_xdp_stats* stats, char** errmsg)
+{
+    size_t offset = PCAP_HEADER_SIZE;
+    while (offset < cap->size) {
+        if (cap->size - offset < PCAP_RECORD_SIZE) {
+            *errmsg = ubpf_error("truncated pcap record header at offset %zu", offset);
+            return -1;
+        }
+        uint32_t caplen = read32(cap, offset + 8);
+        offset += PCAP_RECORD_SIZE;
+        if (cap->size - offset < caplen) {
+            *errmsg = ubpf_error("truncated pcap record at offset %zu", offset);
+            return -1;
+        }
+        run_frame(vm, (unsigned char*)cap->data + offset, caplen, 0, stats);
+        offset += caplen;
+    }
+    return 0;
+}
+
+static int
+run_pcapng(struct ubpf_vm* vm, struct capture* cap, struct ubpf_xdp_stats* stats, char** errmsg)
+{
+    size_t offset = 0;
+    while (offset < cap->size) {
+        if (cap->size - offset < 12) {
+            *errmsg = ubpf_error("truncated pcapng block at offset %zu", offset);
+            return -1;
+        }
+        uint32_t type;
+        memcpy(&type, cap->data + offset, sizeof(type));
+        if (type == PCAPNG_SHB) {
+            /* Each section has its own byte order */
+            uint32_t magic;
+            memcpy(&magic, cap->data + offset + 8, sizeof(magic));
+            if (magic != PCAPNG_BYTE_ORDER_MAGIC && magic != __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC)) {
+                *errmsg = ubpf_error("bad pcapng byte order magic at offset %zu", offset);
+                return -1;
+            }
+            cap->swapped = magic != PCAPNG_BYTE_ORDER_MAGIC;
+        }
+        type = read32(cap, offset);
+        uint32_t block_len = read32(cap, offset + 4);
+        if (block_len < 12 || block_len % 4 || block_len > cap->size - offset) {
+            *errmsg = ubpf_error("bad pcapng block length %u at offset %zu", block_len, offset);
+            return -1;
+        }
+
+        /* Captured length, and where the frame starts in the block */
+        uint32_t caplen = 0, start = 0, ifindex = 0;
+        if ((type == PCAPNG_EPB || type == PCAPNG_PB) && block_len >= 32) {
+            ifindex = type == PCAPNG_EPB ? read32(cap, offset + 8) : read16(cap, offset + 8);
+            caplen = read32(cap, offset + 20);
+            start = 28;
+        } else if (type == PCAPNG_SPB && block_len >= 16) {
+            /* Only the original length is recorded; the block holds what was captured */
+            caplen = read32(cap, offset + 8);
+            if (caplen > block_len - 16) {
+                caplen = block_len - 16;
+            }
+            start = 12;
+        }
+        if (start) {
+            if (caplen > block_len - start - 4) {
+                *errmsg = ubpf_error("pcapng packet overruns its block at offset %zu", offset);
+                return -1;
+            }
+            run_frame(vm, (unsigned char*)cap->data + offset + start, caplen, ifindex, stats);
+        }
+        offset += block_len;
+    }
+    return 0;
+}
+
+int
+ubpf_xdp_run_pcap(struct ubpf_vm* vm, const char* path, struct ubpf_xdp_stats* stats, char** errmsg)
+{
+    *errmsg = NULL;
+    memset(stats, 0, sizeof(*stats));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = ubpf_error("cannot open %s", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < PCAP_HEADER_SIZE) {
+        close(fd);
+        *errmsg = ubpf_error("%s is not a capture file", path);
+        return -1;
+    }
+
+    /* Private and writable: programs may rewrite packets, the file stays as it is */
+    struct capture cap = {.size = st.st_size};
+    void* data = mmap(NULL, cap.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *errmsg = ubpf_error("cannot map %s", path);
+        return -1;
+    }
+    cap.data = data;
+
+    uint32_t magic;
+    memcpy(&magic, cap.data, sizeof(magic));
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int rc;
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+        rc = run_pcap(vm, &cap, stats, errmsg);
+    } else if (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+        cap.swapped = true;
+        rc = run_pcap(vm, &cap, stats, errmsg);
+    } else if (magic == PCAPNG_SHB) {
+        rc = run_pcapng(vm, &cap, stats, errmsg);
+    } else {
+        *errmsg = ubpf_error("%s is not a pcap or pcapng file", path);
+        rc = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    munmap(data, cap.size);
+    stats->elapsed_ns = (end.tv_sec - begin.tv_sec) * 1000000000ull + end.tv_nsec - begin.tv_nsec;
+    if (stats->elapsed_ns) {
+        stats->packets_per_second = stats->packets * 1e9 / stats->elapsed_ns;
+    }
+    return rc;
+}